@@ -0,0 +1,208 @@
+/**
+ * @file        ALPC-Tools/Alpc-SymbolService/Source.cpp
+ *
+ * @brief       The symbol service. It polls the driver for the pdbs whose symbols
+ *              are needed, resolves them and sends the symbols back.
+ *
+ * @note        It must run as SYSTEM - the driver refuses the messages otherwise.
+ *              While it is not running, the driver parses the pdbs itself.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "SymbolService.hpp"
+
+#include <stdio.h>
+
+
+/**
+ * @brief   The default symbol server. Like for the driver, it can be overwritten with the
+ *          SymbolServer registry value - and, for the service only, from the command line.
+ */
+#define SYMBOL_SERVICE_DEFAULT_SERVER       L"http://msdl.microsoft.com/download/symbols"
+
+/**
+ * @brief   The local pdb cache. The driver keeps its pdbs here too.
+ */
+#define SYMBOL_SERVICE_CACHE_DIRECTORY      L"C:\\Symbols\\"
+
+/**
+ * @brief   How long to wait before asking again, when the driver could not be reached.
+ */
+#define SYMBOL_SERVICE_RETRY_DELAY_MS       1000
+
+
+/**
+ * @brief       Sends a message to the driver over the firmware table channel.
+ *              The driver may fill the message in place.
+ *
+ * @param[in,out]   Message - The message to be sent.
+ *
+ * @return      A proper NTSTATUS error code.
+ */
+_Must_inspect_result_
+static NTSTATUS XPF_API
+SymbolServiceNotifyKernel(
+    _Inout_ UM_KM_MESSAGE_HEADER* Message
+) noexcept(true)
+{
+    uint32_t messageSize = 0;
+    ULONG retLength = 0;
+
+    //
+    // Compute the full message size.
+    //
+    bool isSuccess = xpf::ApiNumbersSafeAdd(uint32_t{ sizeof(UM_KM_MESSAGE_HEADER) },
+                                            Message->BufferLength,
+                                            &messageSize);
+    if (!isSuccess)
+    {
+        return STATUS_INTEGER_OVERFLOW;
+    }
+
+    //
+    // SystemFirmwareTableInformation - 0x4c
+    // https://www.geoffchappell.com/studies/windows/km/ntoskrnl/api/ex/sysinfo/query.htm
+    //
+    return ::NtQuerySystemInformation(static_cast<SYSTEM_INFORMATION_CLASS>(0x4C),
+                                      Message,
+                                      messageSize,
+                                      &retLength);
+}
+
+/**
+ * @brief       Resolves one request and sends the reply to the driver.
+ *              If anything fails, the driver is told so - it does not wait for nothing.
+ *
+ * @param[in]   SymbolServer    - The symbol server.
+ * @param[in]   Request         - The request filled by the driver.
+ *
+ * @return      A proper NTSTATUS error code.
+ */
+_Must_inspect_result_
+static NTSTATUS XPF_API
+SymbolServiceHandleRequest(
+    _In_ _Const_ const xpf::StringView<wchar_t>& SymbolServer,
+    _In_ _Const_ const UM_KM_SYMBOLS_GET_REQUEST& Request
+) noexcept(true)
+{
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    xpf::Buffer pdb;
+    xpf::Buffer reply;
+    xpf::Vector<xpf::pdb::SymbolInformation> symbols;
+
+    /* The driver always terminates the strings - but don't rely on it. */
+    const xpf::StringView<wchar_t> pdbName{ Request.PdbName,
+                                            ::wcsnlen(Request.PdbName, XPF_ARRAYSIZE(Request.PdbName)) };
+    const xpf::StringView<wchar_t> pdbGuidAndAge{ Request.PdbGuidAndAge,
+                                                  ::wcsnlen(Request.PdbGuidAndAge, XPF_ARRAYSIZE(Request.PdbGuidAndAge)) };
+
+    status = SymbolServiceResolvePdb(SymbolServer,
+                                     SYMBOL_SERVICE_CACHE_DIRECTORY,
+                                     pdbName,
+                                     pdbGuidAndAge,
+                                     &pdb);
+    if (NT_SUCCESS(status))
+    {
+        status = SymbolServiceExtractSymbols(pdb,
+                                             &symbols);
+    }
+    if (NT_SUCCESS(status))
+    {
+        status = SymbolServiceBuildReply(Request.RequestId,
+                                         symbols,
+                                         &reply);
+    }
+    printf("[*] Request %llu - %ls/%ls resolved %zu symbols with status 0x%08x \r\n",
+           Request.RequestId,
+           pdbName.Buffer(),
+           pdbGuidAndAge.Buffer(),
+           symbols.Size(),
+           static_cast<unsigned int>(status));
+
+    if (!NT_SUCCESS(status))
+    {
+        status = SymbolServiceBuildFailedReply(Request.RequestId,
+                                               &reply);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+    }
+    return SymbolServiceNotifyKernel(static_cast<UM_KM_MESSAGE_HEADER*>(reply.GetBuffer()));
+}
+
+int main(int argc, char** argv)
+{
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    xpf::String<wchar_t> symbolServer;
+
+    if (argc > 1 && nullptr != argv[1])
+    {
+        status = xpf::StringConversion::UTF8ToWide(xpf::StringView<char>{ argv[1] },
+                                                   symbolServer);
+    }
+    else
+    {
+        status = SymbolServiceQuerySymbolServer(&symbolServer);
+    }
+    if (!NT_SUCCESS(status))
+    {
+        symbolServer.Reset();
+        status = symbolServer.Append(SYMBOL_SERVICE_DEFAULT_SERVER);
+        if (!NT_SUCCESS(status))
+        {
+            return -1;
+        }
+    }
+    printf("[*] Using symbol server %ls \r\n", symbolServer.View().Buffer());
+
+    /* It may already exist - the driver keeps its module cache there too. */
+    ::CreateDirectoryW(SYMBOL_SERVICE_CACHE_DIRECTORY,
+                       NULL);
+
+    while (true)
+    {
+        UM_KM_SYMBOLS_GET_REQUEST request;
+        xpf::ApiZeroMemory(&request, sizeof(request));
+
+        request.Header.ProviderSignature = UM_KM_CALLBACK_SIGNATURE;
+        request.Header.RequestType = UM_KM_REQUEST_TYPE;
+        request.Header.Reserved = 0;
+        request.Header.BufferLength = sizeof(request) - sizeof(request.Header);
+        request.MessageType = UM_KM_MESSAGE_TYPE_SYMBOLS_GET_REQUEST;
+
+        /* The driver holds the request for a little while when there is nothing to do. */
+        status = SymbolServiceNotifyKernel(&request.Header);
+        if (STATUS_PRIVILEGE_NOT_HELD == status)
+        {
+            printf("[!] The service must run as SYSTEM! \r\n");
+            return -1;
+        }
+        if (!NT_SUCCESS(status))
+        {
+            /* The driver is not loaded yet. */
+            xpf::ApiSleep(SYMBOL_SERVICE_RETRY_DELAY_MS);
+            continue;
+        }
+        if (0 == request.RequestId)
+        {
+            continue;
+        }
+
+        status = SymbolServiceHandleRequest(symbolServer.View(),
+                                            request);
+        if (!NT_SUCCESS(status))
+        {
+            printf("[!] Failed to reply to request %llu with status 0x%08x \r\n",
+                   request.RequestId,
+                   static_cast<unsigned int>(status));
+        }
+    }
+}
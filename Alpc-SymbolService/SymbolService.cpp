@@ -0,0 +1,1114 @@
+/**
+ * @file        ALPC-Tools/Alpc-SymbolService/SymbolService.cpp
+ *
+ * @brief       This is responsible for resolving the symbols requested by the
+ *              driver. The pdbs are downloaded and parsed here, in user mode,
+ *              and only the rva and the name of each symbol are sent back.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "SymbolService.hpp"
+
+#include <string.h>
+
+/**
+ * @brief   Pdbs larger than this are not downloaded. The driver would not keep
+ *          their symbols anyway, as they go over its memory budget.
+ */
+#define SYMBOL_SERVICE_MAX_PDB_SIZE                 (512 * 1024 * 1024)
+
+/**
+ * @brief   The pdb parser expects the buffer aligned to this.
+ */
+#define SYMBOL_SERVICE_PDB_ALIGNMENT                0x1000
+
+/**
+ * @brief   The service key of the driver. The symbol server is configured here, for both.
+ */
+#define SYMBOL_SERVICE_DRIVER_REGISTRY_KEY          L"System\\CurrentControlSet\\Services\\AlpcMon_Sys"
+
+/**
+ * @brief   The structures below are read as they are from the pdb.
+ *          See https://llvm.org/docs/PDB/MsfFile.html and https://llvm.org/docs/PDB/DbiStream.html
+ */
+#pragma pack(push, 1)
+
+/**
+ * @brief   The first block of the pdb. It describes where the stream directory is.
+ */
+typedef struct _SYMBOL_SERVICE_MSF_SUPER_BLOCK
+{
+    char        FileMagic[32];
+    uint32_t    BlockSize;
+    uint32_t    FreeBlockMapBlock;
+    uint32_t    NumBlocks;
+    uint32_t    NumDirectoryBytes;
+    uint32_t    Unknown;
+    uint32_t    BlockMapAddr;
+} SYMBOL_SERVICE_MSF_SUPER_BLOCK;
+
+/**
+ * @brief   The header of the debug information stream. We only need it to find the section headers stream.
+ */
+typedef struct _SYMBOL_SERVICE_DBI_STREAM_HEADER
+{
+    int32_t     VersionSignature;
+    uint32_t    VersionHeader;
+    uint32_t    Age;
+    uint16_t    GlobalStreamIndex;
+    uint16_t    BuildNumber;
+    uint16_t    PublicStreamIndex;
+    uint16_t    PdbDllVersion;
+    uint16_t    SymRecordStream;
+    uint16_t    PdbDllRbld;
+    int32_t     ModInfoSize;
+    int32_t     SectionContributionSize;
+    int32_t     SectionMapSize;
+    int32_t     SourceInfoSize;
+    int32_t     TypeServerMapSize;
+    uint32_t    MFCTypeServerIndex;
+    int32_t     OptionalDbgHeaderSize;
+    int32_t     ECSubstreamSize;
+    uint16_t    Flags;
+    uint16_t    Machine;
+    uint32_t    Padding;
+} SYMBOL_SERVICE_DBI_STREAM_HEADER;
+
+#pragma pack(pop)
+
+/**
+ * @brief   The magic with which every msf 7.0 file starts.
+ */
+static const char SYMBOL_SERVICE_MSF_MAGIC[32] = { 'M', 'i', 'c', 'r', 'o', 's', 'o', 'f', 't', ' ', 'C', '/',
+                                                   'C', '+', '+', ' ', 'M', 'S', 'F', ' ', '7', '.', '0', '0',
+                                                   '\r', '\n', '\x1a', 'D', 'S', '\0', '\0', '\0' };
+
+/**
+ * @brief   A stream with this size does not exist. It has no blocks.
+ */
+#define SYMBOL_SERVICE_MSF_NIL_STREAM_SIZE          0xFFFFFFFF
+
+/**
+ * @brief   The msf stream which holds the debug information.
+ */
+#define SYMBOL_SERVICE_DBI_STREAM_INDEX             3
+
+/**
+ * @brief   The index of the section headers stream in the optional debug header.
+ */
+#define SYMBOL_SERVICE_DBG_HEADER_SECTION_HDR_INDEX 5
+
+/**
+ * @brief   Marks a stream which is not present.
+ */
+#define SYMBOL_SERVICE_INVALID_STREAM_INDEX         0xFFFF
+
+
+//
+// -------------------------------------------------------------------------------------------------------------------
+// | ****************************************************************************************************************|
+// |                                       SymbolServiceBuildPdbUrl                                                  |
+// | ****************************************************************************************************************|
+// -------------------------------------------------------------------------------------------------------------------
+//
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SymbolServiceBuildPdbUrl(
+    _In_ _Const_ const xpf::StringView<char>& SymbolServer,
+    _In_ _Const_ const xpf::StringView<wchar_t>& PdbName,
+    _In_ _Const_ const xpf::StringView<wchar_t>& PdbGuidAndAge,
+    _Out_ xpf::String<char>* Url
+) noexcept(true)
+{
+    XPF_DEATH_ON_FAILURE(nullptr != Url);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    xpf::String<char> ansiName;
+    xpf::String<char> ansiGuidAndAge;
+
+    /* Preinit output. */
+    Url->Reset();
+
+    status = xpf::StringConversion::WideToUTF8(PdbName, ansiName);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    status = xpf::StringConversion::WideToUTF8(PdbGuidAndAge, ansiGuidAndAge);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    /* Helper macro to help build the url */
+    #ifndef DOXYGEN_SHOULD_SKIP_THIS
+        #define HELPER_APPEND_DATA_TO_STRING(string, data)          \
+        {                                                           \
+            status = string->Append(data);                          \
+            if (!NT_SUCCESS(status))                                \
+            {                                                       \
+                return status;                                      \
+            }                                                       \
+        }
+    #endif  // DOXYGEN_SHOULD_SKIP_THIS
+
+    HELPER_APPEND_DATA_TO_STRING(Url, SymbolServer);
+    if (!SymbolServer.EndsWith("/", false))
+    {
+        HELPER_APPEND_DATA_TO_STRING(Url, "/");
+    }
+    HELPER_APPEND_DATA_TO_STRING(Url, ansiName.View());
+    HELPER_APPEND_DATA_TO_STRING(Url, "/");
+    HELPER_APPEND_DATA_TO_STRING(Url, ansiGuidAndAge.View());
+    HELPER_APPEND_DATA_TO_STRING(Url, "/");
+    HELPER_APPEND_DATA_TO_STRING(Url, ansiName.View());
+
+    /* Macro no longer needed */
+    #undef HELPER_APPEND_DATA_TO_STRING
+
+    /* All good. */
+    return STATUS_SUCCESS;
+}
+
+//
+// -------------------------------------------------------------------------------------------------------------------
+// | ****************************************************************************************************************|
+// |                                       SymbolServiceDownloadPdb                                                  |
+// | ****************************************************************************************************************|
+// -------------------------------------------------------------------------------------------------------------------
+//
+
+/**
+ * @brief       Appends a downloaded chunk to the pdb. The buffer grows geometrically,
+ *              so a large pdb is not copied over and over again.
+ *
+ * @param[in,out]   Pdb     - The pdb buffer.
+ * @param[in,out]   PdbSize - How much of the buffer is used.
+ * @param[in]       Chunk   - The downloaded chunk.
+ *
+ * @return      A proper NTSTATUS error code.
+ */
+_Must_inspect_result_
+static NTSTATUS XPF_API
+SymbolServiceAppendChunk(
+    _Inout_ xpf::Buffer* Pdb,
+    _Inout_ size_t* PdbSize,
+    _In_ _Const_ const xpf::StringView<char>& Chunk
+) noexcept(true)
+{
+    size_t newSize = 0;
+
+    if (Chunk.IsEmpty())
+    {
+        return STATUS_SUCCESS;
+    }
+    if (!xpf::ApiNumbersSafeAdd(*PdbSize, Chunk.BufferSize(), &newSize) || newSize > SYMBOL_SERVICE_MAX_PDB_SIZE)
+    {
+        return STATUS_FILE_TOO_LARGE;
+    }
+
+    if (newSize > Pdb->GetSize())
+    {
+        size_t newCapacity = (Pdb->GetSize() < SYMBOL_SERVICE_PDB_ALIGNMENT) ? SYMBOL_SERVICE_PDB_ALIGNMENT
+                                                                             : Pdb->GetSize() * 2;
+        if (newCapacity < newSize)
+        {
+            newCapacity = newSize;
+        }
+        if (newCapacity > SYMBOL_SERVICE_MAX_PDB_SIZE)
+        {
+            newCapacity = SYMBOL_SERVICE_MAX_PDB_SIZE;
+        }
+
+        NTSTATUS status = Pdb->Resize(newCapacity);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+    }
+
+    xpf::ApiCopyMemory(xpf::AlgoAddToPointer(Pdb->GetBuffer(), *PdbSize),
+                       Chunk.Buffer(),
+                       Chunk.BufferSize());
+    *PdbSize = newSize;
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @brief       Pads the pdb with zeros up to a page multiple, as the pdb parser expects.
+ *
+ * @param[in,out]   Pdb     - The pdb buffer.
+ * @param[in]       PdbSize - How much of the buffer is used.
+ *
+ * @return      A proper NTSTATUS error code.
+ */
+_Must_inspect_result_
+static NTSTATUS XPF_API
+SymbolServicePadPdb(
+    _Inout_ xpf::Buffer* Pdb,
+    _In_ size_t PdbSize
+) noexcept(true)
+{
+    const size_t alignedSize = xpf::AlgoAlignValueUp(PdbSize,
+                                                     size_t{ SYMBOL_SERVICE_PDB_ALIGNMENT });
+    if (alignedSize < PdbSize)
+    {
+        return STATUS_FILE_TOO_LARGE;
+    }
+    NTSTATUS status = Pdb->Resize(alignedSize);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    xpf::ApiZeroMemory(xpf::AlgoAddToPointer(Pdb->GetBuffer(), PdbSize),
+                       alignedSize - PdbSize);
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SymbolServiceDownloadPdb(
+    _In_ _Const_ const xpf::StringView<char>& Url,
+    _Out_ xpf::Buffer* Pdb
+) noexcept(true)
+{
+    XPF_DEATH_ON_FAILURE(nullptr != Pdb);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    bool hasMoreData = true;
+    size_t pdbSize = 0;
+
+    xpf::SharedPointer<xpf::IClient> client;
+    xpf::http::HttpResponse response;
+
+    /* Header items to be used. */
+    const xpf::http::HeaderItem headerItems[] =
+    {
+        { "Accept",             "application/octet-stream" },
+        { "Accept-Encoding",    "gzip, deflate, br" },
+        { "User-Agent",         "Microsoft-Symbol-Server/10.0.10036.206" },
+        { "Connection",         "close" },
+    };
+
+    /* The buffer grows as the chunks come - it must start empty. */
+    XPF_DEATH_ON_FAILURE(0 == Pdb->GetSize());
+
+    /* Grab the .pdb file. This will also grab the first chunk. */
+    status = xpf::http::InitiateHttpDownload(Url,
+                                             headerItems,
+                                             XPF_ARRAYSIZE(headerItems),
+                                             &response,
+                                             client);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    status = SymbolServiceAppendChunk(Pdb,
+                                      &pdbSize,
+                                      response.Body);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    /* Now grab the rest of .pdb */
+    while (hasMoreData)
+    {
+        status = xpf::http::HttpContinueDownload(client,
+                                                 &response,
+                                                 &hasMoreData);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+        status = SymbolServiceAppendChunk(Pdb,
+                                          &pdbSize,
+                                          response.Body);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+    }
+    if (0 == pdbSize)
+    {
+        return STATUS_NOT_FOUND;
+    }
+
+    /* The parser assumes an aligned size - so fill with 0. */
+    return SymbolServicePadPdb(Pdb,
+                               pdbSize);
+}
+
+//
+// -------------------------------------------------------------------------------------------------------------------
+// | ****************************************************************************************************************|
+// |                                       SymbolServiceResolvePdb                                                   |
+// | ****************************************************************************************************************|
+// -------------------------------------------------------------------------------------------------------------------
+//
+
+/**
+ * @brief       Reads a pdb file in memory.
+ *
+ * @param[in]   Path    - The full path of the pdb.
+ * @param[out]  Pdb     - The content of the pdb, zero padded to a page multiple. Must be empty on input.
+ *
+ * @return      STATUS_NOT_FOUND if the file does not exist,
+ *              or a proper NTSTATUS error code.
+ */
+_Must_inspect_result_
+static NTSTATUS XPF_API
+SymbolServiceReadPdbFile(
+    _In_ _Const_ const xpf::String<wchar_t>& Path,
+    _Out_ xpf::Buffer* Pdb
+) noexcept(true)
+{
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    LARGE_INTEGER fileSize = { 0 };
+    size_t readBytes = 0;
+
+    HANDLE file = ::CreateFileW(Path.View().Buffer(),
+                                GENERIC_READ,
+                                FILE_SHARE_READ,
+                                NULL,
+                                OPEN_EXISTING,
+                                FILE_ATTRIBUTE_NORMAL,
+                                NULL);
+    if (INVALID_HANDLE_VALUE == file)
+    {
+        return STATUS_NOT_FOUND;
+    }
+
+    if (FALSE == ::GetFileSizeEx(file, &fileSize))
+    {
+        status = STATUS_UNSUCCESSFUL;
+        goto CleanUp;
+    }
+    if (fileSize.QuadPart <= 0 || fileSize.QuadPart > SYMBOL_SERVICE_MAX_PDB_SIZE)
+    {
+        status = STATUS_FILE_TOO_LARGE;
+        goto CleanUp;
+    }
+    status = Pdb->Resize(static_cast<size_t>(fileSize.QuadPart));
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+
+    while (readBytes < Pdb->GetSize())
+    {
+        DWORD chunkSize = 0;
+        if (FALSE == ::ReadFile(file,
+                                xpf::AlgoAddToPointer(Pdb->GetBuffer(), readBytes),
+                                static_cast<DWORD>(Pdb->GetSize() - readBytes),
+                                &chunkSize,
+                                NULL) || 0 == chunkSize)
+        {
+            status = STATUS_UNSUCCESSFUL;
+            goto CleanUp;
+        }
+        readBytes += chunkSize;
+    }
+
+    status = SymbolServicePadPdb(Pdb,
+                                 readBytes);
+
+CleanUp:
+    ::CloseHandle(file);
+    if (!NT_SUCCESS(status))
+    {
+        Pdb->Clear();
+    }
+    return status;
+}
+
+/**
+ * @brief       Saves a pdb in the local cache. It is written to a temporary file first
+ *              and renamed over the final one, so a reader never sees a partial pdb.
+ *
+ * @param[in]   Path    - The full path of the pdb.
+ * @param[in]   Pdb     - The content of the pdb.
+ *
+ * @return      A proper NTSTATUS error code.
+ */
+_Must_inspect_result_
+static NTSTATUS XPF_API
+SymbolServiceWritePdbFile(
+    _In_ _Const_ const xpf::String<wchar_t>& Path,
+    _In_ _Const_ const xpf::Buffer& Pdb
+) noexcept(true)
+{
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    xpf::String<wchar_t> temporaryPath;
+    size_t writtenBytes = 0;
+
+    status = temporaryPath.Append(Path.View());
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    status = temporaryPath.Append(L".tmp");
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    HANDLE file = ::CreateFileW(temporaryPath.View().Buffer(),
+                                GENERIC_WRITE,
+                                0,
+                                NULL,
+                                CREATE_ALWAYS,
+                                FILE_ATTRIBUTE_NORMAL,
+                                NULL);
+    if (INVALID_HANDLE_VALUE == file)
+    {
+        return STATUS_UNSUCCESSFUL;
+    }
+    while (writtenBytes < Pdb.GetSize())
+    {
+        DWORD chunkSize = 0;
+        if (FALSE == ::WriteFile(file,
+                                 xpf::AlgoAddToPointer(Pdb.GetBuffer(), writtenBytes),
+                                 static_cast<DWORD>(Pdb.GetSize() - writtenBytes),
+                                 &chunkSize,
+                                 NULL) || 0 == chunkSize)
+        {
+            break;
+        }
+        writtenBytes += chunkSize;
+    }
+    ::CloseHandle(file);
+
+    if (writtenBytes != Pdb.GetSize() ||
+        FALSE == ::MoveFileExW(temporaryPath.View().Buffer(),
+                               Path.View().Buffer(),
+                               MOVEFILE_REPLACE_EXISTING))
+    {
+        ::DeleteFileW(temporaryPath.View().Buffer());
+        return STATUS_UNSUCCESSFUL;
+    }
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SymbolServiceResolvePdb(
+    _In_ _Const_ const xpf::StringView<wchar_t>& SymbolServer,
+    _In_ _Const_ const xpf::StringView<wchar_t>& CacheDirectory,
+    _In_ _Const_ const xpf::StringView<wchar_t>& PdbName,
+    _In_ _Const_ const xpf::StringView<wchar_t>& PdbGuidAndAge,
+    _Out_ xpf::Buffer* Pdb
+) noexcept(true)
+{
+    XPF_DEATH_ON_FAILURE(nullptr != Pdb);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    xpf::String<wchar_t> cachePath;
+    xpf::String<wchar_t> serverPath;
+    xpf::String<char> ansiServer;
+    xpf::String<char> url;
+
+    /* Preinit output. */
+    Pdb->Clear();
+
+    /* The pdb name comes from the image - it must not walk out of the cache directory. */
+    for (size_t i = 0; i < PdbName.BufferSize(); ++i)
+    {
+        if (L'\\' == PdbName.Buffer()[i] || L'/' == PdbName.Buffer()[i] || L':' == PdbName.Buffer()[i])
+        {
+            return STATUS_OBJECT_NAME_INVALID;
+        }
+    }
+
+    /* Helper macro to help build the paths */
+    #ifndef DOXYGEN_SHOULD_SKIP_THIS
+        #define HELPER_APPEND_DATA_TO_STRING(string, data)          \
+        {                                                           \
+            status = string.Append(data);                           \
+            if (!NT_SUCCESS(status))                                \
+            {                                                       \
+                return status;                                      \
+            }                                                       \
+        }
+    #endif  // DOXYGEN_SHOULD_SKIP_THIS
+
+    /* Same layout as the driver uses - so both share the downloaded pdbs. */
+    HELPER_APPEND_DATA_TO_STRING(cachePath, CacheDirectory);
+    if (!CacheDirectory.EndsWith(L"\\", false))
+    {
+        HELPER_APPEND_DATA_TO_STRING(cachePath, L"\\");
+    }
+    HELPER_APPEND_DATA_TO_STRING(cachePath, PdbGuidAndAge);
+    HELPER_APPEND_DATA_TO_STRING(cachePath, L"_");
+    HELPER_APPEND_DATA_TO_STRING(cachePath, PdbName);
+
+    status = SymbolServiceReadPdbFile(cachePath,
+                                      Pdb);
+    if (NT_SUCCESS(status))
+    {
+        return STATUS_SUCCESS;
+    }
+
+    /* Like in the driver, the symbol server can also be a local directory or a share. */
+    if (!SymbolServer.StartsWith(L"http://", false) && !SymbolServer.StartsWith(L"https://", false))
+    {
+        HELPER_APPEND_DATA_TO_STRING(serverPath, SymbolServer);
+        if (!SymbolServer.EndsWith(L"\\", false))
+        {
+            HELPER_APPEND_DATA_TO_STRING(serverPath, L"\\");
+        }
+        HELPER_APPEND_DATA_TO_STRING(serverPath, PdbName);
+        HELPER_APPEND_DATA_TO_STRING(serverPath, L"\\");
+        HELPER_APPEND_DATA_TO_STRING(serverPath, PdbGuidAndAge);
+        HELPER_APPEND_DATA_TO_STRING(serverPath, L"\\");
+        HELPER_APPEND_DATA_TO_STRING(serverPath, PdbName);
+
+        return SymbolServiceReadPdbFile(serverPath,
+                                        Pdb);
+    }
+
+    /* Macro no longer needed */
+    #undef HELPER_APPEND_DATA_TO_STRING
+
+    status = xpf::StringConversion::WideToUTF8(SymbolServer,
+                                               ansiServer);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    status = SymbolServiceBuildPdbUrl(ansiServer.View(),
+                                      PdbName,
+                                      PdbGuidAndAge,
+                                      &url);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    status = SymbolServiceDownloadPdb(url.View(),
+                                      Pdb);
+    if (!NT_SUCCESS(status))
+    {
+        Pdb->Clear();
+        return status;
+    }
+
+    /* The cache is best effort - the pdb is downloaded again next time. */
+    status = SymbolServiceWritePdbFile(cachePath,
+                                       *Pdb);
+    XPF_UNREFERENCED_PARAMETER(status);
+
+    return STATUS_SUCCESS;
+}
+
+//
+// -------------------------------------------------------------------------------------------------------------------
+// | ****************************************************************************************************************|
+// |                                       SymbolServiceQuerySymbolServer                                            |
+// | ****************************************************************************************************************|
+// -------------------------------------------------------------------------------------------------------------------
+//
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SymbolServiceQuerySymbolServer(
+    _Out_ xpf::String<wchar_t>* SymbolServer
+) noexcept(true)
+{
+    XPF_DEATH_ON_FAILURE(nullptr != SymbolServer);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    xpf::Buffer value;
+    DWORD valueSize = 0;
+
+    /* Preinit output. */
+    SymbolServer->Reset();
+
+    LSTATUS error = ::RegGetValueW(HKEY_LOCAL_MACHINE,
+                                   SYMBOL_SERVICE_DRIVER_REGISTRY_KEY,
+                                   L"SymbolServer",
+                                   RRF_RT_REG_SZ,
+                                   NULL,
+                                   NULL,
+                                   &valueSize);
+    if (ERROR_SUCCESS != error || valueSize < sizeof(wchar_t))
+    {
+        return STATUS_NOT_FOUND;
+    }
+    status = value.Resize(valueSize);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    error = ::RegGetValueW(HKEY_LOCAL_MACHINE,
+                           SYMBOL_SERVICE_DRIVER_REGISTRY_KEY,
+                           L"SymbolServer",
+                           RRF_RT_REG_SZ,
+                           NULL,
+                           value.GetBuffer(),
+                           &valueSize);
+    if (ERROR_SUCCESS != error)
+    {
+        return STATUS_NOT_FOUND;
+    }
+
+    /* RegGetValueW always terminates the string. */
+    const wchar_t* server = static_cast<const wchar_t*>(value.GetBuffer());
+    const xpf::StringView<wchar_t> serverView{ server,
+                                               ::wcsnlen(server, valueSize / sizeof(wchar_t)) };
+    if (serverView.IsEmpty())
+    {
+        return STATUS_NOT_FOUND;
+    }
+    return SymbolServer->Append(serverView);
+}
+
+//
+// -------------------------------------------------------------------------------------------------------------------
+// | ****************************************************************************************************************|
+// |                                       SymbolServiceExtractSymbols                                               |
+// | ****************************************************************************************************************|
+// -------------------------------------------------------------------------------------------------------------------
+//
+
+/**
+ * @brief       Copies a range of the pdb. The whole range must be inside the pdb.
+ *
+ * @param[in]   Pdb         - The content of the pdb.
+ * @param[in]   Offset      - Where to start copying from.
+ * @param[in]   Size        - How many bytes to copy.
+ * @param[out]  Destination - Receives the bytes.
+ *
+ * @return      STATUS_FILE_CORRUPT_ERROR if the range is outside the pdb,
+ *              or a proper NTSTATUS error code.
+ */
+_Must_inspect_result_
+static NTSTATUS XPF_API
+SymbolServiceReadPdbRange(
+    _In_ _Const_ const xpf::Buffer& Pdb,
+    _In_ uint64_t Offset,
+    _In_ size_t Size,
+    _Out_writes_bytes_(Size) void* Destination
+) noexcept(true)
+{
+    if (Offset > Pdb.GetSize() || Size > Pdb.GetSize() - Offset)
+    {
+        return STATUS_FILE_CORRUPT_ERROR;
+    }
+    xpf::ApiCopyMemory(Destination,
+                       xpf::AlgoAddToPointer(Pdb.GetBuffer(), static_cast<size_t>(Offset)),
+                       Size);
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @brief       Reads a whole msf stream of a pdb which is in memory.
+ *              Same validations as the driver's MsfReader.
+ *
+ * @param[in]   Pdb     - The content of the pdb.
+ * @param[in]   Stream  - The index of the stream.
+ * @param[out]  Data    - The content of the stream.
+ *
+ * @return      STATUS_FILE_CORRUPT_ERROR if the pdb is not valid,
+ *              or a proper NTSTATUS error code.
+ */
+_Must_inspect_result_
+static NTSTATUS XPF_API
+SymbolServiceReadPdbStream(
+    _In_ _Const_ const xpf::Buffer& Pdb,
+    _In_ uint32_t Stream,
+    _Out_ xpf::Buffer* Data
+) noexcept(true)
+{
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    SYMBOL_SERVICE_MSF_SUPER_BLOCK superBlock = { 0 };
+
+    xpf::Buffer directoryBlocks;
+    xpf::Buffer directory;
+
+    status = SymbolServiceReadPdbRange(Pdb,
+                                       0,
+                                       sizeof(superBlock),
+                                       &superBlock);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    if (0 != ::memcmp(superBlock.FileMagic, SYMBOL_SERVICE_MSF_MAGIC, sizeof(SYMBOL_SERVICE_MSF_MAGIC)))
+    {
+        return STATUS_FILE_CORRUPT_ERROR;
+    }
+    if (superBlock.BlockSize < 512 || superBlock.BlockSize > 32768 ||
+        (superBlock.BlockSize & (superBlock.BlockSize - 1)) != 0)
+    {
+        return STATUS_FILE_CORRUPT_ERROR;
+    }
+    if (superBlock.BlockMapAddr >= superBlock.NumBlocks || 0 == superBlock.NumDirectoryBytes)
+    {
+        return STATUS_FILE_CORRUPT_ERROR;
+    }
+
+    /* The indexes of the directory blocks must fit in the block map block. */
+    const uint32_t directoryBlocksCount = (superBlock.NumDirectoryBytes / superBlock.BlockSize) +
+                                          ((superBlock.NumDirectoryBytes % superBlock.BlockSize) != 0 ? 1 : 0);
+    if (directoryBlocksCount > superBlock.BlockSize / sizeof(uint32_t))
+    {
+        return STATUS_FILE_CORRUPT_ERROR;
+    }
+    status = directoryBlocks.Resize(directoryBlocksCount * sizeof(uint32_t));
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    status = SymbolServiceReadPdbRange(Pdb,
+                                       uint64_t{ superBlock.BlockMapAddr } * superBlock.BlockSize,
+                                       directoryBlocks.GetSize(),
+                                       directoryBlocks.GetBuffer());
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    /* Gather the directory. */
+    status = directory.Resize(superBlock.NumDirectoryBytes);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    for (uint32_t i = 0; i < directoryBlocksCount; ++i)
+    {
+        const uint32_t block = static_cast<const uint32_t*>(directoryBlocks.GetBuffer())[i];
+        const uint32_t directoryOffset = i * superBlock.BlockSize;
+        const uint32_t bytesLeft = superBlock.NumDirectoryBytes - directoryOffset;
+        const uint32_t bytesInBlock = (bytesLeft < superBlock.BlockSize) ? bytesLeft
+                                                                         : superBlock.BlockSize;
+        status = SymbolServiceReadPdbRange(Pdb,
+                                           uint64_t{ block } * superBlock.BlockSize,
+                                           bytesInBlock,
+                                           xpf::AlgoAddToPointer(directory.GetBuffer(), directoryOffset));
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+    }
+
+    /* The directory starts with the number of streams, followed by their sizes and then by their blocks. */
+    const uint32_t* entries = static_cast<const uint32_t*>(directory.GetBuffer());
+    const size_t entriesCount = directory.GetSize() / sizeof(uint32_t);
+    if (entriesCount < 1 || entries[0] > entriesCount - 1 || Stream >= entries[0])
+    {
+        return STATUS_FILE_CORRUPT_ERROR;
+    }
+
+    size_t blocksIndex = 1 + size_t{ entries[0] };
+    uint32_t streamSize = 0;
+    uint32_t streamBlocks = 0;
+    for (uint32_t i = 0; i <= Stream; ++i)
+    {
+        blocksIndex += streamBlocks;
+
+        streamSize = (entries[1 + i] == SYMBOL_SERVICE_MSF_NIL_STREAM_SIZE) ? 0
+                                                                             : entries[1 + i];
+        streamBlocks = (streamSize / superBlock.BlockSize) +
+                       ((streamSize % superBlock.BlockSize) != 0 ? 1 : 0);
+        if (blocksIndex > entriesCount || streamBlocks > entriesCount - blocksIndex)
+        {
+            return STATUS_FILE_CORRUPT_ERROR;
+        }
+    }
+
+    /* Copy block by block - the blocks of a stream are not necessarily contiguous. */
+    status = Data->Resize(streamSize);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    for (uint32_t i = 0; i < streamBlocks; ++i)
+    {
+        const uint32_t streamOffset = i * superBlock.BlockSize;
+        const uint32_t bytesLeft = streamSize - streamOffset;
+        const uint32_t bytesInBlock = (bytesLeft < superBlock.BlockSize) ? bytesLeft
+                                                                         : superBlock.BlockSize;
+        status = SymbolServiceReadPdbRange(Pdb,
+                                           uint64_t{ entries[blocksIndex + i] } * superBlock.BlockSize,
+                                           bytesInBlock,
+                                           xpf::AlgoAddToPointer(Data->GetBuffer(), streamOffset));
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+    }
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @brief       Reads the section headers of the image, as they are saved in the pdb.
+ *
+ * @param[in]   Pdb             - The content of the pdb.
+ * @param[out]  SectionHeaders  - The section headers.
+ *
+ * @return      STATUS_FILE_CORRUPT_ERROR if the pdb is not valid,
+ *              or a proper NTSTATUS error code.
+ */
+_Must_inspect_result_
+static NTSTATUS XPF_API
+SymbolServiceReadSectionHeaders(
+    _In_ _Const_ const xpf::Buffer& Pdb,
+    _Out_ xpf::Buffer* SectionHeaders
+) noexcept(true)
+{
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    SYMBOL_SERVICE_DBI_STREAM_HEADER dbiHeader = { 0 };
+    xpf::Buffer dbiStream;
+
+    uint64_t dbgHeaderOffset = sizeof(dbiHeader);
+    uint16_t sectionHeadersStream = SYMBOL_SERVICE_INVALID_STREAM_INDEX;
+
+    status = SymbolServiceReadPdbStream(Pdb,
+                                        SYMBOL_SERVICE_DBI_STREAM_INDEX,
+                                        &dbiStream);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    status = SymbolServiceReadPdbRange(dbiStream,
+                                       0,
+                                       sizeof(dbiHeader),
+                                       &dbiHeader);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    /* The optional debug header follows all other substreams. */
+    const int32_t substreamSizes[] = { dbiHeader.ModInfoSize,
+                                       dbiHeader.SectionContributionSize,
+                                       dbiHeader.SectionMapSize,
+                                       dbiHeader.SourceInfoSize,
+                                       dbiHeader.TypeServerMapSize,
+                                       dbiHeader.ECSubstreamSize };
+    for (size_t i = 0; i < XPF_ARRAYSIZE(substreamSizes); ++i)
+    {
+        if (substreamSizes[i] < 0)
+        {
+            return STATUS_FILE_CORRUPT_ERROR;
+        }
+        dbgHeaderOffset += static_cast<uint64_t>(substreamSizes[i]);
+    }
+    if (dbiHeader.OptionalDbgHeaderSize < static_cast<int32_t>((SYMBOL_SERVICE_DBG_HEADER_SECTION_HDR_INDEX + 1) * sizeof(uint16_t)))
+    {
+        return STATUS_FILE_CORRUPT_ERROR;
+    }
+    status = SymbolServiceReadPdbRange(dbiStream,
+                                       dbgHeaderOffset + SYMBOL_SERVICE_DBG_HEADER_SECTION_HDR_INDEX * sizeof(uint16_t),
+                                       sizeof(sectionHeadersStream),
+                                       &sectionHeadersStream);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    if (SYMBOL_SERVICE_INVALID_STREAM_INDEX == sectionHeadersStream)
+    {
+        return STATUS_FILE_CORRUPT_ERROR;
+    }
+
+    return SymbolServiceReadPdbStream(Pdb,
+                                      sectionHeadersStream,
+                                      SectionHeaders);
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SymbolServiceExtractSymbols(
+    _In_ _Const_ const xpf::Buffer& Pdb,
+    _Out_ xpf::Vector<xpf::pdb::SymbolInformation>* Symbols
+) noexcept(true)
+{
+    XPF_DEATH_ON_FAILURE(nullptr != Symbols);
+
+    xpf::Buffer sectionHeaders;
+    xpf::Vector<xpf::pdb::SymbolInformation> allSymbols;
+
+    /* Preinit output. */
+    Symbols->Clear();
+
+    NTSTATUS status = SymbolServiceReadSectionHeaders(Pdb,
+                                                      &sectionHeaders);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    status = xpf::pdb::ExtractSymbols(Pdb.GetBuffer(),
+                                      Pdb.GetSize(),
+                                      &allSymbols);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    /* Same as the driver - data symbols would only confuse the stack decoration. */
+    const IMAGE_SECTION_HEADER* sections = static_cast<const IMAGE_SECTION_HEADER*>(sectionHeaders.GetBuffer());
+    const size_t sectionsCount = sectionHeaders.GetSize() / sizeof(IMAGE_SECTION_HEADER);
+    for (size_t i = 0; i < allSymbols.Size(); ++i)
+    {
+        const uint64_t rva = allSymbols[i].SymbolRVA;
+        for (size_t j = 0; j < sectionsCount; ++j)
+        {
+            const uint64_t sectionSize = (0 != sections[j].Misc.VirtualSize) ? sections[j].Misc.VirtualSize
+                                                                             : sections[j].SizeOfRawData;
+            if ((sections[j].Characteristics & IMAGE_SCN_MEM_EXECUTE) == 0 ||
+                rva < sections[j].VirtualAddress || rva - sections[j].VirtualAddress >= sectionSize)
+            {
+                continue;
+            }
+
+            status = Symbols->Emplace(xpf::Move(allSymbols[i]));
+            if (!NT_SUCCESS(status))
+            {
+                Symbols->Clear();
+                return status;
+            }
+            break;
+        }
+    }
+
+    /* The driver looks the symbols up with a binary search - it rejects unsorted replies. */
+    Symbols->Sort([&](const xpf::pdb::SymbolInformation& Left,
+                      const xpf::pdb::SymbolInformation& Right)
+                  {
+                      return Left.SymbolRVA < Right.SymbolRVA;
+                  });
+    return STATUS_SUCCESS;
+}
+
+//
+// -------------------------------------------------------------------------------------------------------------------
+// | ****************************************************************************************************************|
+// |                                       SymbolServiceBuildReply                                                   |
+// | ****************************************************************************************************************|
+// -------------------------------------------------------------------------------------------------------------------
+//
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SymbolServiceBuildReply(
+    _In_ uint64_t RequestId,
+    _In_ _Const_ const xpf::Vector<xpf::pdb::SymbolInformation>& Symbols,
+    _Out_ xpf::Buffer* Reply
+) noexcept(true)
+{
+    XPF_DEATH_ON_FAILURE(nullptr != Reply);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    size_t symbolsCount = 0;
+    size_t namesSize = 0;
+    size_t replySize = 0;
+
+    /* First pass - compute the size. */
+    for (size_t i = 0; i < Symbols.Size(); ++i)
+    {
+        const size_t nameLength = Symbols[i].SymbolName.View().BufferSize();
+        if (0 == nameLength)
+        {
+            continue;
+        }
+        symbolsCount++;
+        namesSize += (nameLength > UM_KM_SYMBOLS_MAX_NAME_LENGTH) ? UM_KM_SYMBOLS_MAX_NAME_LENGTH
+                                                                  : nameLength;
+    }
+    if (symbolsCount > UM_KM_SYMBOLS_MAX_COUNT)
+    {
+        return STATUS_FILE_TOO_LARGE;
+    }
+
+    /* The whole message length must fit in the header. */
+    replySize = sizeof(UM_KM_SYMBOLS_REPLY) + symbolsCount * sizeof(UM_KM_SYMBOL) + namesSize;
+    if (replySize > xpf::NumericLimits<uint32_t>::MaxValue())
+    {
+        return STATUS_FILE_TOO_LARGE;
+    }
+    status = Reply->Resize(replySize);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    xpf::ApiZeroMemory(Reply->GetBuffer(),
+                       Reply->GetSize());
+
+    UM_KM_SYMBOLS_REPLY* message = static_cast<UM_KM_SYMBOLS_REPLY*>(Reply->GetBuffer());
+    message->Header.ProviderSignature = UM_KM_CALLBACK_SIGNATURE;
+    message->Header.RequestType = UM_KM_REQUEST_TYPE;
+    message->Header.Reserved = 0;
+    message->Header.BufferLength = static_cast<uint32_t>(replySize - sizeof(UM_KM_MESSAGE_HEADER));
+    message->MessageType = UM_KM_MESSAGE_TYPE_SYMBOLS_REPLY;
+    message->RequestId = RequestId;
+    message->Status = 0;
+    message->SymbolsCount = static_cast<uint32_t>(symbolsCount);
+
+    UM_KM_SYMBOL* entries = static_cast<UM_KM_SYMBOL*>(xpf::AlgoAddToPointer(message,
+                                                                             sizeof(UM_KM_SYMBOLS_REPLY)));
+    char* names = static_cast<char*>(xpf::AlgoAddToPointer(entries,
+                                                           symbolsCount * sizeof(UM_KM_SYMBOL)));
+
+    /* Second pass - fill the entries and the names. */
+    size_t entry = 0;
+    size_t nameOffset = 0;
+    for (size_t i = 0; i < Symbols.Size(); ++i)
+    {
+        const xpf::StringView<char> name = Symbols[i].SymbolName.View();
+        if (name.IsEmpty())
+        {
+            continue;
+        }
+        const size_t nameLength = (name.BufferSize() > UM_KM_SYMBOLS_MAX_NAME_LENGTH) ? UM_KM_SYMBOLS_MAX_NAME_LENGTH
+                                                                                       : name.BufferSize();
+
+        entries[entry].Rva = Symbols[i].SymbolRVA;
+        entries[entry].NameOffset = static_cast<uint32_t>(nameOffset);
+        entries[entry].NameLength = static_cast<uint32_t>(nameLength);
+        xpf::ApiCopyMemory(&names[nameOffset],
+                           name.Buffer(),
+                           nameLength);
+
+        nameOffset += nameLength;
+        entry++;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SymbolServiceBuildFailedReply(
+    _In_ uint64_t RequestId,
+    _Out_ xpf::Buffer* Reply
+) noexcept(true)
+{
+    XPF_DEATH_ON_FAILURE(nullptr != Reply);
+
+    NTSTATUS status = Reply->Resize(sizeof(UM_KM_SYMBOLS_REPLY));
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    xpf::ApiZeroMemory(Reply->GetBuffer(),
+                       Reply->GetSize());
+
+    UM_KM_SYMBOLS_REPLY* message = static_cast<UM_KM_SYMBOLS_REPLY*>(Reply->GetBuffer());
+    message->Header.ProviderSignature = UM_KM_CALLBACK_SIGNATURE;
+    message->Header.RequestType = UM_KM_REQUEST_TYPE;
+    message->Header.Reserved = 0;
+    message->Header.BufferLength = static_cast<uint32_t>(sizeof(UM_KM_SYMBOLS_REPLY) - sizeof(UM_KM_MESSAGE_HEADER));
+    message->MessageType = UM_KM_MESSAGE_TYPE_SYMBOLS_REPLY;
+    message->RequestId = RequestId;
+    message->Status = 1;
+    message->SymbolsCount = 0;
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,146 @@
+/**
+ * @file        ALPC-Tools/Alpc-SymbolService/SymbolService.hpp
+ *
+ * @brief       This is responsible for resolving the symbols requested by the
+ *              driver. The pdbs are downloaded and parsed here, in user mode,
+ *              and only the rva and the name of each symbol are sent back.
+ *
+ * @note        Everything here relies only on xpf, so it does not depend
+ *              on the channel used to talk with the driver.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#pragma once
+
+#include <xpf_lib/xpf.hpp>
+#include "UmKmComms.hpp"
+
+
+/**
+ * @brief       Builds the url of a pdb on a symbol server.
+ *              SymbolServer/PdbName/PdbGuidAndAge/PdbName
+ *
+ * @param[in]   SymbolServer    - The symbol server. For example http://msdl.microsoft.com/download/symbols
+ * @param[in]   PdbName         - The name of the pdb. For example "ntdll.pdb".
+ * @param[in]   PdbGuidAndAge   - The guid and age of the pdb, as used by the symbol server.
+ * @param[out]  Url             - The url of the pdb.
+ *
+ * @return      A proper NTSTATUS error code.
+ */
+_Must_inspect_result_
+NTSTATUS XPF_API
+SymbolServiceBuildPdbUrl(
+    _In_ _Const_ const xpf::StringView<char>& SymbolServer,
+    _In_ _Const_ const xpf::StringView<wchar_t>& PdbName,
+    _In_ _Const_ const xpf::StringView<wchar_t>& PdbGuidAndAge,
+    _Out_ xpf::String<char>* Url
+) noexcept(true);
+
+/**
+ * @brief       Downloads a pdb in memory.
+ *
+ * @param[in]   Url     - The url of the pdb.
+ * @param[out]  Pdb     - The content of the pdb. It is zero padded to a page multiple,
+ *                        as the pdb parser expects. Must be empty on input.
+ *
+ * @return      A proper NTSTATUS error code.
+ */
+_Must_inspect_result_
+NTSTATUS XPF_API
+SymbolServiceDownloadPdb(
+    _In_ _Const_ const xpf::StringView<char>& Url,
+    _Out_ xpf::Buffer* Pdb
+) noexcept(true);
+
+/**
+ * @brief       Brings a pdb in memory. The local cache is checked first, then the symbol
+ *              server. A pdb downloaded over http is saved in the cache for next time.
+ *
+ * @param[in]   SymbolServer    - The symbol server. An url, a local directory or a share.
+ * @param[in]   CacheDirectory  - The local pdb cache. The same one the driver uses.
+ * @param[in]   PdbName         - The name of the pdb. For example "ntdll.pdb".
+ * @param[in]   PdbGuidAndAge   - The guid and age of the pdb, as used by the symbol server.
+ * @param[out]  Pdb             - The content of the pdb, zero padded to a page multiple.
+ *
+ * @return      A proper NTSTATUS error code.
+ */
+_Must_inspect_result_
+NTSTATUS XPF_API
+SymbolServiceResolvePdb(
+    _In_ _Const_ const xpf::StringView<wchar_t>& SymbolServer,
+    _In_ _Const_ const xpf::StringView<wchar_t>& CacheDirectory,
+    _In_ _Const_ const xpf::StringView<wchar_t>& PdbName,
+    _In_ _Const_ const xpf::StringView<wchar_t>& PdbGuidAndAge,
+    _Out_ xpf::Buffer* Pdb
+) noexcept(true);
+
+/**
+ * @brief       Reads the symbol server configured for the driver - the SymbolServer
+ *              value under its service key.
+ *
+ * @param[out]  SymbolServer    - The configured symbol server.
+ *
+ * @return      STATUS_NOT_FOUND if nothing is configured,
+ *              or a proper NTSTATUS error code.
+ */
+_Must_inspect_result_
+NTSTATUS XPF_API
+SymbolServiceQuerySymbolServer(
+    _Out_ xpf::String<wchar_t>* SymbolServer
+) noexcept(true);
+
+/**
+ * @brief       Extracts the symbols from a pdb which is in memory.
+ *              Like the driver, only the symbols in executable sections are kept.
+ *
+ * @param[in]   Pdb     - The content of the pdb, zero padded to a page multiple.
+ * @param[out]  Symbols - The symbols, sorted by their rva.
+ *
+ * @return      A proper NTSTATUS error code.
+ */
+_Must_inspect_result_
+NTSTATUS XPF_API
+SymbolServiceExtractSymbols(
+    _In_ _Const_ const xpf::Buffer& Pdb,
+    _Out_ xpf::Vector<xpf::pdb::SymbolInformation>* Symbols
+) noexcept(true);
+
+/**
+ * @brief       Serializes the symbols in a UM_KM_SYMBOLS_REPLY message.
+ *              Names longer than UM_KM_SYMBOLS_MAX_NAME_LENGTH are truncated
+ *              and the symbols without a name are skipped.
+ *
+ * @param[in]   RequestId   - The request this reply is for.
+ * @param[in]   Symbols     - The symbols, sorted by their rva.
+ * @param[out]  Reply       - The message, ready to be sent to the driver.
+ *
+ * @return      A proper NTSTATUS error code.
+ */
+_Must_inspect_result_
+NTSTATUS XPF_API
+SymbolServiceBuildReply(
+    _In_ uint64_t RequestId,
+    _In_ _Const_ const xpf::Vector<xpf::pdb::SymbolInformation>& Symbols,
+    _Out_ xpf::Buffer* Reply
+) noexcept(true);
+
+/**
+ * @brief       Builds a UM_KM_SYMBOLS_REPLY message for a request which could not be resolved.
+ *
+ * @param[in]   RequestId   - The request this reply is for.
+ * @param[out]  Reply       - The message, ready to be sent to the driver.
+ *
+ * @return      A proper NTSTATUS error code.
+ */
+_Must_inspect_result_
+NTSTATUS XPF_API
+SymbolServiceBuildFailedReply(
+    _In_ uint64_t RequestId,
+    _Out_ xpf::Buffer* Reply
+) noexcept(true);
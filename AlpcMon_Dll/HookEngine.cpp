@@ -17,6 +17,13 @@
 #include "AlpcMon.hpp"
 
 
+/**
+ * @brief   The hooks installed in this process - UM_KM_HOOK_SET_* flags.
+ *          Chosen by the driver on initialize, the same ones are removed on deinitialize.
+ */
+static uint32_t gHookEngineHookSet = UM_KM_HOOK_SET_ALL;
+
+
 //
 // -------------------------------------------------------------------------------------------------------------------
 // | ****************************************************************************************************************|
@@ -169,11 +176,12 @@ HookEnginePrepareHooks(
 ) noexcept(true)
 {
     //
-    // What this API does is installing or uninstalling all hooks in the current transaction.
+    // What this API does is installing or uninstalling the hooks from gHookEngineHookSet in the current transaction.
     //
 
     #ifndef DOXYGEN_SHOULD_SKIP_THIS
-    #define HOOK_ENGINE_EDIT_HOOK(hook)                                                                          /* NOLINT(*) */  \
+    #define HOOK_ENGINE_EDIT_HOOK(hook, flag)                                                                    /* NOLINT(*) */  \
+    if (0 != (gHookEngineHookSet & (flag)))                                                                      /* NOLINT(*) */  \
     {                                                                                                            /* NOLINT(*) */  \
         if (Install)                                                                                             /* NOLINT(*) */  \
         {                                                                                                        /* NOLINT(*) */  \
@@ -198,9 +206,9 @@ HookEnginePrepareHooks(
     };
     #endif  // DOXYGEN_SHOULD_SKIP_THIS
 
-    HOOK_ENGINE_EDIT_HOOK(gNtAlpcConnectPortHook);
-    HOOK_ENGINE_EDIT_HOOK(gNtAlpcSendWaitReceivePortHook);
-    HOOK_ENGINE_EDIT_HOOK(gNtAlpcDisconnectPortHook);
+    HOOK_ENGINE_EDIT_HOOK(gNtAlpcConnectPortHook, UM_KM_HOOK_SET_ALPC_CONNECT_PORT);
+    HOOK_ENGINE_EDIT_HOOK(gNtAlpcSendWaitReceivePortHook, UM_KM_HOOK_SET_ALPC_SEND_WAIT_RECEIVE_PORT);
+    HOOK_ENGINE_EDIT_HOOK(gNtAlpcDisconnectPortHook, UM_KM_HOOK_SET_ALPC_DISCONNECT_PORT);
 
     #undef HOOK_ENGINE_EDIT_HOOK
 
@@ -292,6 +300,43 @@ CleanUp:
     return status;
 }
 
+//
+// -------------------------------------------------------------------------------------------------------------------
+// | ****************************************************************************************************************|
+// |                                       HookEngineQueryHookSet                                                    |
+// | ****************************************************************************************************************|
+// -------------------------------------------------------------------------------------------------------------------
+//
+
+static uint32_t XPF_API
+HookEngineQueryHookSet(
+    void
+) noexcept(true)
+{
+    //
+    // The driver decides which hooks are installed, based on its injection policy.
+    // If it can not be asked, all hooks are installed - as before the policy existed.
+    //
+    UM_KM_HOOK_SET_REQUEST message = { 0 };
+
+    message.Header.ProviderSignature = UM_KM_CALLBACK_SIGNATURE;
+    message.Header.RequestType = UM_KM_REQUEST_TYPE;
+    message.Header.Reserved = 0;
+    message.Header.BufferLength = sizeof(UM_KM_HOOK_SET_REQUEST) - sizeof(UM_KM_MESSAGE_HEADER);
+
+    message.MessageType = UM_KM_MESSAGE_TYPE_HOOK_SET_REQUEST;
+    message.HookSet = UM_KM_HOOK_SET_ALL;
+
+    NTSTATUS status = HookEngineNotifyKernel(&message.Header);
+    if (!NT_SUCCESS(status))
+    {
+        return UM_KM_HOOK_SET_ALL;
+    }
+
+    /* Ignore the hooks we do not know about. */
+    return message.HookSet & UM_KM_HOOK_SET_ALL;
+}
+
 //
 // -------------------------------------------------------------------------------------------------------------------
 // | ****************************************************************************************************************|
@@ -306,6 +351,7 @@ HookEngineInitialize(
     void
 ) noexcept(true)
 {
+    gHookEngineHookSet = HookEngineQueryHookSet();
     return HookEngineChangeState(true);
 }
 
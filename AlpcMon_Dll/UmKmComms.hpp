@@ -77,6 +77,20 @@ static_assert(sizeof(UM_KM_MESSAGE_HEADER) == 16,
  *          monitored RPC interfaces.
  */
 #define UM_KM_MESSAGE_TYPE_INTERESTING_RPC_MESSAGE          1
+/**
+ * @brief   The symbol service asks for the next pdb whose symbols are needed.
+ *          The driver fills the request in place.
+ */
+#define UM_KM_MESSAGE_TYPE_SYMBOLS_GET_REQUEST              2
+/**
+ * @brief   The symbol service sends the symbols it extracted from a pdb.
+ */
+#define UM_KM_MESSAGE_TYPE_SYMBOLS_REPLY                    3
+/**
+ * @brief   The injected dll asks which hooks it should install in the process.
+ *          The driver fills the request in place.
+ */
+#define UM_KM_MESSAGE_TYPE_HOOK_SET_REQUEST                 4
 
 /**
  * @brief       Getter for message type starting from the UM_KM_MESSAGE_HEADER.
@@ -174,3 +188,184 @@ typedef struct _UM_KM_INTERESTING_RPC_MESSAGE
      */
     uint8_t     Buffer[0x1000];
 } UM_KM_INTERESTING_RPC_MESSAGE;
+
+/**
+ * @brief   The maximum length of a pdb name, in characters, including the terminator.
+ */
+#define UM_KM_SYMBOLS_MAX_PDB_NAME                          260
+
+/**
+ * @brief   The maximum length of the guid and age string, in characters.
+ *          Including the null terminator.
+ */
+#define UM_KM_SYMBOLS_MAX_GUID_AND_AGE                      64
+
+/**
+ * @brief   The maximum number of symbols in a reply.
+ */
+#define UM_KM_SYMBOLS_MAX_COUNT                             0x100000
+
+/**
+ * @brief   The maximum length of a symbol name in a reply.
+ */
+#define UM_KM_SYMBOLS_MAX_NAME_LENGTH                       0x400
+
+/**
+ * @brief   Sent by the symbol service to pick up the next pdb whose symbols
+ *          are needed. The driver fills everything after MessageType.
+ */
+typedef struct _UM_KM_SYMBOLS_GET_REQUEST
+{
+    /**
+     * @brief   The header of the message. Contains metadata
+     *          to properly distinguish between notifications.
+     */
+    UM_KM_MESSAGE_HEADER Header;
+
+    /**
+     * @brief   A header to identify the message type.
+     *          For this particular message, this is always
+     *          UM_KM_MESSAGE_TYPE_SYMBOLS_GET_REQUEST.
+     */
+    uint64_t    MessageType;
+
+    /**
+     * @brief   Identifies the request in the reply.
+     *          Zero if there is nothing to do right now.
+     */
+    uint64_t    RequestId;
+
+    /**
+     * @brief   The guid of the program database.
+     */
+    uuid_t      PdbGuid;
+
+    /**
+     * @brief   The age of the program database.
+     */
+    uint32_t    PdbAge;
+
+    /**
+     * @brief   Reserved - must be zero.
+     */
+    uint32_t    Reserved;
+
+    /**
+     * @brief   The name of the pdb - as it is in the codeview entry.
+     *          Always null terminated.
+     */
+    wchar_t     PdbName[UM_KM_SYMBOLS_MAX_PDB_NAME];
+
+    /**
+     * @brief   The guid and age as used by the symbol server.
+     *          Always null terminated.
+     */
+    wchar_t     PdbGuidAndAge[UM_KM_SYMBOLS_MAX_GUID_AND_AGE];
+} UM_KM_SYMBOLS_GET_REQUEST;
+
+/**
+ * @brief   Describes a symbol in UM_KM_SYMBOLS_REPLY.
+ */
+typedef struct _UM_KM_SYMBOL
+{
+    /**
+     * @brief   The rva of the symbol.
+     */
+    uint32_t    Rva;
+
+    /**
+     * @brief   Where the name starts, relative to the end of the symbols array.
+     */
+    uint32_t    NameOffset;
+
+    /**
+     * @brief   The length of the name, in bytes. Not null terminated.
+     */
+    uint32_t    NameLength;
+} UM_KM_SYMBOL;
+
+/**
+ * @brief   Sent by the symbol service with the symbols of a requested pdb.
+ *          The symbols must be sorted by their rva.
+ */
+typedef struct _UM_KM_SYMBOLS_REPLY
+{
+    /**
+     * @brief   The header of the message. Contains metadata
+     *          to properly distinguish between notifications.
+     */
+    UM_KM_MESSAGE_HEADER Header;
+
+    /**
+     * @brief   A header to identify the message type.
+     *          For this particular message, this is always
+     *          UM_KM_MESSAGE_TYPE_SYMBOLS_REPLY.
+     */
+    uint64_t    MessageType;
+
+    /**
+     * @brief   The RequestId from UM_KM_SYMBOLS_GET_REQUEST.
+     */
+    uint64_t    RequestId;
+
+    /**
+     * @brief   Zero on success. Otherwise the pdb could not be retrieved
+     *          or parsed, and there are no symbols.
+     */
+    uint32_t    Status;
+
+    /**
+     * @brief   How many symbols follow.
+     */
+    uint32_t    SymbolsCount;
+
+    /* Comes after the message */
+    /* UM_KM_SYMBOL Symbols[SymbolsCount] */
+    /* char         Names[] */
+} UM_KM_SYMBOLS_REPLY;
+
+/**
+ * @brief   The hooks which can be installed by the injected dll.
+ */
+#define UM_KM_HOOK_SET_ALPC_CONNECT_PORT                    0x00000001
+#define UM_KM_HOOK_SET_ALPC_SEND_WAIT_RECEIVE_PORT          0x00000002
+#define UM_KM_HOOK_SET_ALPC_DISCONNECT_PORT                 0x00000004
+
+/**
+ * @brief   All the hooks - installed when the driver does not say otherwise.
+ */
+#define UM_KM_HOOK_SET_ALL                                  (UM_KM_HOOK_SET_ALPC_CONNECT_PORT           | \
+                                                             UM_KM_HOOK_SET_ALPC_SEND_WAIT_RECEIVE_PORT | \
+                                                             UM_KM_HOOK_SET_ALPC_DISCONNECT_PORT)
+
+/**
+ * @brief   Sent by the injected dll before installing its hooks.
+ *          The driver fills the HookSet chosen by the injection policy.
+ */
+typedef struct _UM_KM_HOOK_SET_REQUEST
+{
+    /**
+     * @brief   The header of the message. Contains metadata
+     *          to properly distinguish between notifications.
+     */
+    UM_KM_MESSAGE_HEADER Header;
+
+    /**
+     * @brief   A header to identify the message type.
+     *          For this particular message, this is always
+     *          UM_KM_MESSAGE_TYPE_HOOK_SET_REQUEST.
+     */
+    uint64_t    MessageType;
+
+    /**
+     * @brief   The hooks to be installed - UM_KM_HOOK_SET_* flags.
+     *          Must be set to UM_KM_HOOK_SET_ALL by the dll, so it is left
+     *          as it is if the driver does not answer.
+     */
+    uint32_t    HookSet;
+
+    /**
+     * @brief   Reserved - must be zero.
+     */
+    uint32_t    Reserved;
+} UM_KM_HOOK_SET_REQUEST;
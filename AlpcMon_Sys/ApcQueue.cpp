@@ -24,48 +24,44 @@
   */
 XPF_SECTION_PAGED;
 
+KmHelper::ApcQueue::ApcQueue(void) noexcept(true) : m_ApcAllocator{sizeof(KmHelper::Apc), true}
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    for (size_t i = 0; i < KmHelper::ApcQueue::PROCESS_BUCKETS_COUNT; ++i)
+    {
+        ::InitializeListHead(&this->m_ProcessBuckets[i]);
+    }
+}
+
 KmHelper::ApcQueue::~ApcQueue(void) noexcept(true)
 {
     XPF_MAX_APC_LEVEL();
 
+    LIST_ENTRY cancelled = { 0 };
+    ::InitializeListHead(&cancelled);
+
     /* Cancel all pending apcs. */
-    PFUNC_KeRemoveQueueApc keRemoveApcApi = GlobalDataGetDynamicData()->ApiKeRemoveQueueApc;
-    if (keRemoveApcApi != nullptr)
     {
         xpf::ExclusiveLockGuard guard{ this->m_ApcListLock };
-        for (size_t i = 0; i < this->m_ApcList.Size();)
+        for (size_t i = 0; i < KmHelper::ApcQueue::PROCESS_BUCKETS_COUNT; ++i)
         {
-            KmHelper::Apc* apc = this->m_ApcList[i].Get();
-
-            const BOOLEAN removed = keRemoveApcApi(xpf::AddressOf(apc->OriginalApc));
-            if (FALSE != removed)
+            PLIST_ENTRY bucket = &this->m_ProcessBuckets[i];
+            PLIST_ENTRY entry = bucket->Flink;
+            while (entry != bucket)
             {
-                if (apc->OriginalCleanupRoutine)
-                {
-                    apc->OriginalCleanupRoutine(apc->OriginalNormalConext,
-                                                apc->OriginalSystemArgument1,
-                                                apc->OriginalSystemArgument2);
-                }
-                this->ApcRemove(xpf::AddressOf(apc->OriginalApc));
-            }
-            else
-            {
-                i++;
+                /* The entry may be moved to the cancelled list. */
+                KmHelper::Apc* apc = XPF_CONTAINING_RECORD(entry, KmHelper::Apc, ListEntry);
+                entry = entry->Flink;
+
+                this->CancelApcLocked(apc, &cancelled);
             }
         }
     }
+    this->CompleteCancelledApcs(&cancelled);
 
     /* Rundown until all apcs are executed. */
-    while (true)
-    {
-        xpf::ApiSleep(300);
-
-        xpf::SharedLockGuard guard{ this->m_ApcListLock };
-        if (this->m_ApcList.IsEmpty())
-        {
-            break;
-        }
-    }
+    this->m_Rundown.WaitForRelease();
 }
 
 void NTAPI
@@ -187,7 +183,7 @@ KmHelper::ApcQueue::ScheduleApc(
     XPF_MAX_PASSIVE_LEVEL();
 
     NTSTATUS status = STATUS_UNSUCCESSFUL;
-    xpf::SharedPointer<KmHelper::Apc> apc{ this->m_ApcList.GetAllocator() };
+    KmHelper::Apc* apc = nullptr;
 
     PFUNC_KeInitializeApc keInitializeApcApi = GlobalDataGetDynamicData()->ApiKeInitializeApc;
     PFUNC_KeInsertQueueApc keInsertQueueApcApi = GlobalDataGetDynamicData()->ApiKeInsertQueueApc;
@@ -225,15 +221,17 @@ KmHelper::ApcQueue::ScheduleApc(
     }
 
     /* Create a new apc. */
-    apc = xpf::MakeSharedWithAllocator<KmHelper::Apc>(this->m_ApcList.GetAllocator());
-    if (apc.IsEmpty())
+    apc = static_cast<KmHelper::Apc*>(this->m_ApcAllocator.AllocateMemory(sizeof(KmHelper::Apc)));
+    if (nullptr == apc)
     {
         return STATUS_INSUFFICIENT_RESOURCES;
     }
+    xpf::MemoryAllocator::Construct(apc);
 
     /* Now let's properly initialize the apc object. */
     KmHelper::Apc& apcRef = (*apc);
 
+    apcRef.ProcessId = HandleToUlong(::PsGetCurrentProcessId());
     apcRef.Mode = Mode;
     apcRef.ApcQueueObject = this;
     apcRef.OriginalNormalRoutine = NormalRoutine;
@@ -254,13 +252,28 @@ KmHelper::ApcQueue::ScheduleApc(
     /* Enqueue it. */
     {
         xpf::ExclusiveLockGuard guard{ this->m_ApcListLock };
-        status = this->m_ApcList.Emplace(apc);
-        if (!NT_SUCCESS(status))
+
+        /* Released when the apc is removed from the list. */
+        if (!this->m_Rundown.Acquire())
+        {
+            status = STATUS_TOO_LATE;
+        }
+        else
         {
-            return status;
+            ::InsertTailList(this->ProcessBucket(apcRef.ProcessId),
+                             &apcRef.ListEntry);
+            status = STATUS_SUCCESS;
         }
     }
 
+    /* The queue is running down - the apc was never queued, so there is no reference to drop. */
+    if (!NT_SUCCESS(status))
+    {
+        xpf::MemoryAllocator::Destruct(apc);
+        this->m_ApcAllocator.FreeMemory(apc);
+        return status;
+    }
+
     /* Now we need to insert it. */
     const BOOLEAN result = keInsertQueueApcApi(xpf::AddressOf(apcRef.OriginalApc),
                                                SystemArgument1,
@@ -291,19 +304,114 @@ KmHelper::ApcQueue::ApcRemove(
     }
 
     /* Prevent races. */
-    xpf::ExclusiveLockGuard guard{ this->m_ApcListLock };
+    {
+        xpf::ExclusiveLockGuard guard{ this->m_ApcListLock };
+        ::RemoveEntryList(&apc->ListEntry);
+    }
 
-    /* Find the apc and remove it. */
-    for (size_t i = 0; i < this->m_ApcList.Size();)
+    this->ApcFree(apc);
+}
+
+void XPF_API
+KmHelper::ApcQueue::PurgeProcessApcs(
+    _In_ uint32_t ProcessId
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    LIST_ENTRY cancelled = { 0 };
+    ::InitializeListHead(&cancelled);
+
+    /* Only the bucket of the process - the others are not touched. */
     {
-        if (this->m_ApcList[i].Get() == apc)
+        xpf::ExclusiveLockGuard guard{ this->m_ApcListLock };
+
+        PLIST_ENTRY bucket = this->ProcessBucket(ProcessId);
+        PLIST_ENTRY entry = bucket->Flink;
+        while (entry != bucket)
         {
-            const NTSTATUS status = this->m_ApcList.Erase(i);
-            XPF_DEATH_ON_FAILURE(NT_SUCCESS(status));
+            /* The entry may be moved to the cancelled list. */
+            KmHelper::Apc* apc = XPF_CONTAINING_RECORD(entry, KmHelper::Apc, ListEntry);
+            entry = entry->Flink;
+
+            if (apc->ProcessId == ProcessId)
+            {
+                this->CancelApcLocked(apc, &cancelled);
+            }
         }
-        else
+    }
+    this->CompleteCancelledApcs(&cancelled);
+}
+
+void XPF_API
+KmHelper::ApcQueue::CancelApcLocked(
+    _Inout_ KmHelper::Apc* Apc,
+    _Inout_ PLIST_ENTRY Cancelled
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    PFUNC_KeRemoveQueueApc keRemoveApcApi = GlobalDataGetDynamicData()->ApiKeRemoveQueueApc;
+    if (nullptr == keRemoveApcApi)
+    {
+        return;
+    }
+
+    /* Already delivered - its routines will remove it. */
+    const BOOLEAN removed = keRemoveApcApi(xpf::AddressOf(Apc->OriginalApc));
+    if (FALSE == removed)
+    {
+        return;
+    }
+
+    ::RemoveEntryList(&Apc->ListEntry);
+    ::InsertTailList(Cancelled,
+                     &Apc->ListEntry);
+}
+
+void XPF_API
+KmHelper::ApcQueue::CompleteCancelledApcs(
+    _Inout_ PLIST_ENTRY Cancelled
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    while (FALSE == ::IsListEmpty(Cancelled))
+    {
+        PLIST_ENTRY entry = ::RemoveHeadList(Cancelled);
+        KmHelper::Apc* apc = XPF_CONTAINING_RECORD(entry, KmHelper::Apc, ListEntry);
+
+        if (apc->OriginalCleanupRoutine)
         {
-            i++;
+            apc->OriginalCleanupRoutine(apc->OriginalNormalConext,
+                                        apc->OriginalSystemArgument1,
+                                        apc->OriginalSystemArgument2);
         }
+        this->ApcFree(apc);
     }
 }
+
+void XPF_API
+KmHelper::ApcQueue::ApcFree(
+    _Inout_ KmHelper::Apc* Apc
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    xpf::MemoryAllocator::Destruct(Apc);
+    this->m_ApcAllocator.FreeMemory(Apc);
+
+    /* This may let the queue go away - don't touch it anymore. */
+    this->m_Rundown.Release();
+}
+
+PLIST_ENTRY XPF_API
+KmHelper::ApcQueue::ProcessBucket(
+    _In_ uint32_t ProcessId
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    /* Process ids are multiples of 4 - drop the low bits which are always zero. */
+    return &this->m_ProcessBuckets[(ProcessId >> 2) % KmHelper::ApcQueue::PROCESS_BUCKETS_COUNT];
+}
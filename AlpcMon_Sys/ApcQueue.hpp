@@ -15,6 +15,7 @@
 
 #include "precomp.hpp"
 #include "globals.hpp"
+#include "RundownProtection.hpp"
 
 namespace KmHelper
 {
@@ -34,6 +35,14 @@ struct Apc
      *          Using this we'll get to the bigger Apc structure.
      */
     KAPC OriginalApc = { 0 };
+    /**
+     * @brief   Links the apc in the bucket of its process.
+     */
+    LIST_ENTRY ListEntry = { 0 };
+    /**
+     * @brief   The process on which the apc was scheduled.
+     */
+    uint32_t ProcessId = 0;
     /**
      * @brief   Specifies whether the apc is a kernel or a user one.
      */
@@ -78,6 +87,10 @@ struct Apc
  * @brief   In Windows KM we have a possibility to enqueue APCs to be executed at a later date.
  *          This is a convenience wrapper to enqueue APCs and avoid the driver from being ran down
  *          while they are executed.
+ *
+ *          The in-flight apcs are linked in buckets indexed by their process id, and they are
+ *          allocated from a lookaside list - so inserting and removing one does not depend on
+ *          how many are in flight, and purging a process only walks its own bucket.
  */
 class ApcQueue final
 {
@@ -85,7 +98,7 @@ class ApcQueue final
      /**
       * @brief  Default constructor.
       */
-     ApcQueue(void) noexcept(true) = default;
+     ApcQueue(void) noexcept(true);
 
      /**
       * @brief  Default destructor.
@@ -108,7 +121,8 @@ class ApcQueue final
       * @param[in]  SystemArgument1 - argument 1 to be passed to the routine.
       * @param[in]  SystemArgument2 - argument 2 to be passed to the routine.
       *
-      * @return     A proper NTSTATUS error code.
+      * @return     STATUS_TOO_LATE if the thread is terminating or the queue is running down,
+      *             or a proper NTSTATUS error code.
       */
      NTSTATUS XPF_API
      ScheduleApc(
@@ -120,6 +134,20 @@ class ApcQueue final
          _In_opt_ PVOID SystemArgument2
      ) noexcept(true);
 
+     /**
+      * @brief      Cancels the apcs which were not yet delivered in a process.
+      *             Their cleanup routine is invoked instead.
+      *
+      * @param[in]  ProcessId - The process which terminated.
+      *
+      * @return     Nothing.
+      */
+     _IRQL_requires_max_(APC_LEVEL)
+     void XPF_API
+     PurgeProcessApcs(
+         _In_ uint32_t ProcessId
+     ) noexcept(true);
+
  private:
     /**
      * @brief           This routine is executed before executing the actual APC.
@@ -192,8 +220,66 @@ class ApcQueue final
         _Inout_ PKAPC Apc
     ) noexcept(true);
 
+    /**
+     * @brief           Cancels an apc if it was not yet delivered. The list lock must be held.
+     *
+     * @param[in,out]   Apc         - An enqueued apc.
+     * @param[in,out]   Cancelled   - If the apc is cancelled, it is moved to this list.
+     *
+     * @return          Nothing.
+     */
+    void XPF_API
+    CancelApcLocked(
+        _Inout_ KmHelper::Apc* Apc,
+        _Inout_ PLIST_ENTRY Cancelled
+    ) noexcept(true);
+
+    /**
+     * @brief           Invokes the cleanup routine of the cancelled apcs and frees them.
+     *                  Must be called without the list lock held.
+     *
+     * @param[in,out]   Cancelled - The list filled by CancelApcLocked.
+     *
+     * @return          Nothing.
+     */
+    void XPF_API
+    CompleteCancelledApcs(
+        _Inout_ PLIST_ENTRY Cancelled
+    ) noexcept(true);
+
+    /**
+     * @brief           Frees an apc which is no longer linked.
+     *
+     * @param[in,out]   Apc - The apc, on output, this should not be used.
+     *
+     * @return          Nothing.
+     */
+    void XPF_API
+    ApcFree(
+        _Inout_ KmHelper::Apc* Apc
+    ) noexcept(true);
+
+    /**
+     * @brief       Maps a process id to its bucket.
+     *
+     * @param[in]   ProcessId - The process id.
+     *
+     * @return      The bucket of the process.
+     */
+    PLIST_ENTRY XPF_API
+    ProcessBucket(
+        _In_ uint32_t ProcessId
+    ) noexcept(true);
+
  private:
+    /**
+     * @brief   How many buckets index the in-flight apcs. Process ids are multiples of 4.
+     */
+    static constexpr size_t PROCESS_BUCKETS_COUNT = 64;
+
      xpf::BusyLock m_ApcListLock;
-     xpf::Vector<xpf::SharedPointer<KmHelper::Apc>> m_ApcList{ SYSMON_NPAGED_ALLOCATOR };
+     LIST_ENTRY m_ProcessBuckets[PROCESS_BUCKETS_COUNT] = { 0 };
+     xpf::LookasideListAllocator m_ApcAllocator;
+     KmHelper::RundownProtection m_Rundown;
 };  // class WorkQueue
 };  // namespace KmHelper
@@ -0,0 +1,210 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/DllTriggerMatcher.cpp
+ *
+ * @brief       In this file we define the matcher of the dlls which trigger
+ *              the injection. It is consulted for every image loaded in every
+ *              process, so a path is hashed once instead of compared with each dll.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "precomp.hpp"
+
+#include "KmHelper.hpp"
+
+#include "DllTriggerMatcher.hpp"
+#include "trace.hpp"
+
+/**
+ * @brief   The matcher is paged. It is only used at PASSIVE_LEVEL.
+ */
+XPF_SECTION_PAGED;
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::DllTriggerMatcher::Create(
+    _Out_ xpf::Optional<SysMon::DllTriggerMatcher>* Matcher
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != Matcher);
+
+    /* Preinit output. */
+    Matcher->Reset();
+    Matcher->Emplace();
+
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::DllTriggerMatcher::AddTrigger(
+    _In_ _Const_ const xpf::StringView<wchar_t>& PathSuffix,
+    _In_ uint32_t Flag
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    SysMon::DllTrigger trigger;
+
+    /* The table is already built. */
+    if (!this->m_Slots.IsEmpty())
+    {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    const xpf::StringView<wchar_t> name = SysMon::DllTriggerMatcher::FinalComponent(PathSuffix);
+    if (0 == Flag || name.IsEmpty())
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    status = KmHelper::HelperHashUnicodeString(name,
+                                               &trigger.NameHash);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    status = trigger.PathSuffix.Append(PathSuffix);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    trigger.Flag = Flag;
+
+    return this->m_Triggers.Emplace(xpf::Move(trigger));
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::DllTriggerMatcher::Build(
+    void
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    /* Start with twice as many slots as triggers, then double until the names do not collide. */
+    size_t tableSize = 4;
+    while (tableSize < 2 * this->m_Triggers.Size())
+    {
+        tableSize *= 2;
+    }
+    while (tableSize <= SysMon::DllTriggerMatcher::MAX_TABLE_SIZE)
+    {
+        status = this->LinkTriggers(tableSize,
+                                    false);
+        if (STATUS_HASH_NOT_PRESENT != status)
+        {
+            return status;
+        }
+        tableSize *= 2;
+    }
+
+    /* No perfect table within the limit - share the slots, the full compare tells them apart. */
+    SysMonLogWarning("Trigger dll names collide - sharing slots in a table of %llu slots",
+                     static_cast<uint64_t>(SysMon::DllTriggerMatcher::MAX_TABLE_SIZE));
+    return this->LinkTriggers(SysMon::DllTriggerMatcher::MAX_TABLE_SIZE,
+                              true);
+}
+
+_Use_decl_annotations_
+uint32_t XPF_API
+SysMon::DllTriggerMatcher::Match(
+    _In_ _Const_ const xpf::StringView<wchar_t>& ImagePath
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    uint32_t nameHash = 0;
+    uint32_t flags = 0;
+
+    if (this->m_Slots.IsEmpty())
+    {
+        return 0;
+    }
+
+    /* Hash only the file name - the directories are checked on hit. */
+    const NTSTATUS status = KmHelper::HelperHashUnicodeString(SysMon::DllTriggerMatcher::FinalComponent(ImagePath),
+                                                              &nameHash);
+    if (!NT_SUCCESS(status))
+    {
+        return 0;
+    }
+
+    /* Walk the whole chain - a configured suffix may overlap a built-in one ("\user32.dll"). */
+    size_t next = this->m_Slots[nameHash % this->m_Slots.Size()];
+    while (0 != next)
+    {
+        const SysMon::DllTrigger& trigger = this->m_Triggers[next - 1];
+        if (trigger.NameHash == nameHash && ImagePath.EndsWith(trigger.PathSuffix.View(), false))
+        {
+            flags |= trigger.Flag;
+        }
+        next = trigger.NextInSlot;
+    }
+    return flags;
+}
+
+_Use_decl_annotations_
+xpf::StringView<wchar_t> XPF_API
+SysMon::DllTriggerMatcher::FinalComponent(
+    _In_ _Const_ const xpf::StringView<wchar_t>& Path
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    size_t start = Path.BufferSize();
+    while (start > 0 && Path.Buffer()[start - 1] != L'\\')
+    {
+        start--;
+    }
+    return xpf::StringView<wchar_t>(Path.Buffer() + start,
+                                    Path.BufferSize() - start);
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::DllTriggerMatcher::LinkTriggers(
+    _In_ size_t TableSize,
+    _In_ bool AllowSharing
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    this->m_Slots.Clear();
+    for (size_t i = 0; i < TableSize; ++i)
+    {
+        status = this->m_Slots.Emplace(size_t{ 0 });
+        if (!NT_SUCCESS(status))
+        {
+            this->m_Slots.Clear();
+            return status;
+        }
+    }
+
+    /* Link in reverse, so each chain keeps the order in which the triggers were added. */
+    for (size_t i = this->m_Triggers.Size(); i > 0; --i)
+    {
+        SysMon::DllTrigger& trigger = this->m_Triggers[i - 1];
+        size_t& slot = this->m_Slots[trigger.NameHash % TableSize];
+
+        if (0 != slot && !AllowSharing && this->m_Triggers[slot - 1].NameHash != trigger.NameHash)
+        {
+            this->m_Slots.Clear();
+            return STATUS_HASH_NOT_PRESENT;
+        }
+        trigger.NextInSlot = slot;
+        slot = i;
+    }
+    return STATUS_SUCCESS;
+}
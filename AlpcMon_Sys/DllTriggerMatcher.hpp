@@ -0,0 +1,187 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/DllTriggerMatcher.hpp
+ *
+ * @brief       In this file we define the matcher of the dlls which trigger
+ *              the injection. It is consulted for every image loaded in every
+ *              process, so a path is hashed once instead of compared with each dll.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#pragma once
+
+#include "precomp.hpp"
+
+
+namespace SysMon
+{
+/**
+ * @brief   A dll which is waited for - identified by a suffix of its path.
+ */
+struct DllTrigger
+{
+    /**
+     * @brief   The end of the dll path - for example "\System32\ntdll.dll".
+     */
+    xpf::String<wchar_t> PathSuffix{ SYSMON_PAGED_ALLOCATOR };
+
+    /**
+     * @brief   The flag returned when the dll is matched.
+     */
+    uint32_t Flag = 0;
+
+    /**
+     * @brief   The case insensitive hash of the final component of the path ("ntdll.dll").
+     */
+    uint32_t NameHash = 0;
+
+    /**
+     * @brief   The next trigger in the same slot, plus one. 0 ends the chain.
+     *          Triggers with the same file name ("\System32\ntdll.dll" and
+     *          "\SysWow64\ntdll.dll") always share the slot.
+     */
+    size_t NextInSlot = 0;
+};
+
+/**
+ * @brief   This class matches an image path against a set of trigger dlls.
+ *
+ *          The final component of the path is hashed (case insensitive) and looked up
+ *          in a table built once, after all triggers are added. The table is grown until
+ *          every slot holds a single file name - so a lookup costs one hash and, only
+ *          on a hit, the full compare of the path suffix.
+ */
+class DllTriggerMatcher final
+{
+ private:
+    /**
+     * @brief  Default constructor - private as Create
+     *         method must be used to instantiate an object.
+     */
+    DllTriggerMatcher(void) noexcept(true) = default;
+
+ public:
+    /**
+     * @brief   Default destructor.
+     */
+    ~DllTriggerMatcher(void) noexcept(true) = default;
+
+    /**
+     * @brief   Copy and move are deleted for this class.
+     *          They can be implemented when required.
+     */
+    XPF_CLASS_COPY_MOVE_BEHAVIOR(SysMon::DllTriggerMatcher, delete);
+
+    /**
+     * @brief       Creates an empty matcher.
+     *
+     * @param[out]  Matcher - On success, it will contain a properly initialized object.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    static NTSTATUS XPF_API
+    Create(
+        _Out_ xpf::Optional<SysMon::DllTriggerMatcher>* Matcher
+    ) noexcept(true);
+
+    /**
+     * @brief       Adds a trigger. Must be called before Build.
+     *
+     * @param[in]   PathSuffix  - The end of the dll path. It must contain the file name.
+     * @param[in]   Flag        - The non zero flag returned when the dll is matched.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    AddTrigger(
+        _In_ _Const_ const xpf::StringView<wchar_t>& PathSuffix,
+        _In_ uint32_t Flag
+    ) noexcept(true);
+
+    /**
+     * @brief       Builds the lookup table. After this, no triggers can be added.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    Build(
+        void
+    ) noexcept(true);
+
+    /**
+     * @brief       Matches an image path against the triggers.
+     *
+     * @param[in]   ImagePath - The full path of the loaded image.
+     *
+     * @return      The flags of all the matched triggers, or 0 if none matches.
+     *              Overlapping suffixes all match - "\user32.dll" and "\System32\user32.dll".
+     */
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    uint32_t XPF_API
+    Match(
+        _In_ _Const_ const xpf::StringView<wchar_t>& ImagePath
+    ) noexcept(true);
+
+ private:
+    /**
+     * @brief       Gets the final component of a path - everything after the last backslash.
+     *
+     * @param[in]   Path - The path.
+     *
+     * @return      A view over the final component.
+     */
+    static xpf::StringView<wchar_t> XPF_API
+    FinalComponent(
+        _In_ _Const_ const xpf::StringView<wchar_t>& Path
+    ) noexcept(true);
+
+    /**
+     * @brief       Links the triggers in a table of the given size.
+     *
+     * @param[in]   TableSize       - How many slots the table has.
+     * @param[in]   AllowSharing    - Whether different file names may share a slot.
+     *
+     * @return      STATUS_HASH_NOT_PRESENT if two file names share a slot and this is not
+     *              allowed, or a proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    NTSTATUS XPF_API
+    LinkTriggers(
+        _In_ size_t TableSize,
+        _In_ bool AllowSharing
+    ) noexcept(true);
+
+ private:
+    /**
+     * @brief   The largest table tried. Beyond it, file names share slots - a 32 bit
+     *          hash collision between two trigger names would never go away.
+     */
+    static constexpr size_t MAX_TABLE_SIZE = 1024;
+
+    xpf::Vector<SysMon::DllTrigger> m_Triggers{ SYSMON_PAGED_ALLOCATOR };
+
+    /**
+     * @brief   The first trigger of each slot, plus one. 0 means the slot is empty.
+     */
+    xpf::Vector<size_t> m_Slots{ SYSMON_PAGED_ALLOCATOR };
+
+    /**
+     * @brief   Default MemoryAllocator is our friend as it requires access to the private
+     *          default constructor. It is used in the Create() method to ensure that
+     *          no partially constructed objects are created but instead they will be
+     *          all fully initialized.
+     */
+    friend class xpf::MemoryAllocator;
+};  // class DllTriggerMatcher
+};  // namespace SysMon
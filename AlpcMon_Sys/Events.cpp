@@ -44,6 +44,7 @@ NTSTATUS XPF_API
 SysMon::ProcessCreateEvent::Create(
     _Inout_ xpf::UniquePointer<xpf::IEvent>& Event,
     _In_ uint32_t ProcessPid,
+    _In_ uint32_t ParentPid,
     _In_ const SysMon::ProcessArchitecture& ProcessArchitecture,
     _In_ _Const_ const xpf::StringView<wchar_t> ProcessPath
 ) noexcept(true)
@@ -51,6 +52,7 @@ SysMon::ProcessCreateEvent::Create(
     XPF_MAX_PASSIVE_LEVEL();
 
     xpf::UniquePointer<SysMon::ProcessCreateEvent> eventInstance;
+    xpf::UniquePointer<SysMon::StackTrace> stackTrace;
     NTSTATUS status = STATUS_UNSUCCESSFUL;
 
     //
@@ -72,39 +74,43 @@ SysMon::ProcessCreateEvent::Create(
         return status;
     }
     eventInstanceReference.m_ProcessPid = ProcessPid;
+    eventInstanceReference.m_ParentPid = ParentPid;
     eventInstanceReference.m_ProcessArchitecture = ProcessArchitecture;
 
     //
-    // And finally capture the stack trace.
+    // And finally capture the stack trace. Only the modules are resolved now,
+    // the symbols are looked up when someone asks for the decorated stack.
+    // The trace is big - keep it off the kernel stack.
     //
-    status = SysMon::StackTraceCapture(&eventInstanceReference.m_StackTrace);
+    stackTrace = xpf::MakeUniqueWithAllocator<SysMon::StackTrace>(SYSMON_PAGED_ALLOCATOR);
+    if (stackTrace.IsEmpty())
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    status = SysMon::StackTraceCapture(&(*stackTrace));
     if (!NT_SUCCESS(status))
     {
         return status;
     }
-    DbgPrintEx(DPFLTR_IHVDRIVER_ID,
-                   DPFLTR_ERROR_LEVEL,
-                   "Starting to decorate at 0x%llx\r\n",
-                   xpf::ApiCurrentTime());
-    status = SysMon::StackTraceDecorate(&eventInstanceReference.m_StackTrace);
+    status = SysMon::StackTraceResolveModules(&(*stackTrace));
     if (!NT_SUCCESS(status))
     {
         return status;
     }
-    DbgPrintEx(DPFLTR_IHVDRIVER_ID,
-                   DPFLTR_ERROR_LEVEL,
-                   "Finisehd to decorate at 0x%llx\r\n",
-                   xpf::ApiCurrentTime());
-    for (size_t i = 0; i < eventInstanceReference.m_StackTrace.DecoratedFrames.Size(); ++i)
+
+    //
+    // The event only carries the id. If the stack can't be stored,
+    // the event is still reported - just without a stack.
+    //
+    status = StackStoreIntern(*stackTrace,
+                              &eventInstanceReference.m_StackId);
+    if (!NT_SUCCESS(status))
     {
-        DbgPrintEx(DPFLTR_IHVDRIVER_ID,
-                   DPFLTR_ERROR_LEVEL,
-                   "%S\r\n",
-                   eventInstanceReference.m_StackTrace.DecoratedFrames[i].View().Buffer());
+        SysMonLogWarning("Failed to intern the stack of process %u with status %!STATUS!",
+                         ProcessPid,
+                         status);
+        eventInstanceReference.m_StackId = 0;
     }
-    DbgPrintEx(DPFLTR_IHVDRIVER_ID,
-               DPFLTR_ERROR_LEVEL,
-               "=================================\r\n");
 
     //
     // And finally cast to generic event.
@@ -114,6 +120,18 @@ SysMon::ProcessCreateEvent::Create(
                              : STATUS_SUCCESS;
 }
 
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::ProcessCreateEvent::DecorateStackTrace(
+    _Out_ xpf::Vector<xpf::String<wchar_t>>* DecoratedFrames
+) const noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    return StackStoreDecorate(this->m_StackId,
+                              DecoratedFrames);
+}
+
 //
 // -------------------------------------------------------------------------------------------------------------------
 // | ****************************************************************************************************************|
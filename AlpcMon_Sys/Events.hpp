@@ -14,7 +14,7 @@
 #pragma once
 
 #include "precomp.hpp"
-#include "StackDecorator.hpp"
+#include "StackStore.hpp"
 
 namespace SysMon
 {
@@ -137,6 +137,8 @@ class ProcessCreateEvent final : public xpf::IEvent
      *
      * @param[in]      ProcessPid           - The process Id.
      *
+     * @param[in]      ParentPid            - The id of the parent process.
+     *
      * @param[in]      ProcessArchitecture  - The architecture of the process.
      *
      * @param[in]      ProcessPath          - The path of the process.
@@ -152,6 +154,7 @@ class ProcessCreateEvent final : public xpf::IEvent
     Create(
         _Inout_ xpf::UniquePointer<xpf::IEvent>& Event,
         _In_ uint32_t ProcessPid,
+        _In_ uint32_t ParentPid,
         _In_ const SysMon::ProcessArchitecture& ProcessArchitecture,
         _In_ _Const_ const xpf::StringView<wchar_t> ProcessPath
     ) noexcept(true);
@@ -169,6 +172,19 @@ class ProcessCreateEvent final : public xpf::IEvent
         return this->m_ProcessPid;
     }
 
+    /**
+     * @brief   Getter for the parent process id.
+     *
+     * @return  The id of the process which created this one.
+     */
+    inline uint32_t XPF_API
+    ParentPid(
+        void
+    ) const noexcept(true)
+    {
+        return this->m_ParentPid;
+    }
+
     /**
      * @brief   Getter for the process path.
      *
@@ -195,11 +211,41 @@ class ProcessCreateEvent final : public xpf::IEvent
         return this->m_ProcessArchitecture;
     }
 
+    /**
+     * @brief   Getter for the id of the stack trace captured when the process was created.
+     *
+     * @return  The id of the stack in the stack store, or 0 if it could not be stored.
+     */
+    inline uint64_t XPF_API
+    StackId(
+        void
+    ) const noexcept(true)
+    {
+        return this->m_StackId;
+    }
+
+    /**
+     * @brief          Decorates the stack trace captured when the process was created.
+     *                 The symbols are looked up now - not when the event is created -
+     *                 so only the consumers which need the text form pay for it.
+     *
+     * @param[out]     DecoratedFrames  - The frames containing module!symbol information.
+     *
+     * @return         A proper NTSTATUS error code.
+     */
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    _Must_inspect_result_
+    NTSTATUS XPF_API
+    DecorateStackTrace(
+        _Out_ xpf::Vector<xpf::String<wchar_t>>* DecoratedFrames
+    ) const noexcept(true);
+
  private:
      uint32_t m_ProcessPid = 0;
+     uint32_t m_ParentPid = 0;
      xpf::String<wchar_t> m_ProcessPath{ SYSMON_PAGED_ALLOCATOR };
      SysMon::ProcessArchitecture m_ProcessArchitecture = SysMon::ProcessArchitecture::MAX;
-     SysMon::StackTrace m_StackTrace;
+     uint64_t m_StackId = 0;
 
      /**
       * @brief   Default MemoryAllocator is our friend as it requires access to the private
@@ -0,0 +1,314 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/ExportCache.cpp
+ *
+ * @brief       In this file we define a small cache of the exports resolved in the
+ *              user mode modules. The same kernel32 is loaded in most processes,
+ *              so its export directory is walked once instead of once per process.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "precomp.hpp"
+
+#include "KmHelper.hpp"
+#include "FileObject.hpp"
+#include "PeExportReader.hpp"
+
+#include "ExportCache.hpp"
+#include "trace.hpp"
+
+/**
+ * @brief   The cache is paged. It is only used at PASSIVE_LEVEL.
+ */
+XPF_SECTION_PAGED;
+
+SysMon::ExportCache::~ExportCache(
+    void
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    this->ReportStatistics();
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::ExportCache::Create(
+    _Out_ xpf::Optional<SysMon::ExportCache>* Cache
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != Cache);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    /* Preinit output. */
+    Cache->Reset();
+    Cache->Emplace();
+
+    SysMon::ExportCache& cache = (*(*Cache));
+
+    status = xpf::ReadWriteLock::Create(&cache.m_EntriesLock);
+    if (!NT_SUCCESS(status))
+    {
+        Cache->Reset();
+        return status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+void* XPF_API
+SysMon::ExportCache::FindExport(
+    _In_ _Const_ const xpf::StringView<wchar_t>& ImagePath,
+    _In_ void* ModuleBase,
+    _In_ size_t ModuleSize,
+    _In_ _Const_ const char* ExportName
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    XPF_DEATH_ON_FAILURE(nullptr != ModuleBase);
+    XPF_DEATH_ON_FAILURE(0 != ModuleSize);
+    XPF_DEATH_ON_FAILURE(nullptr != ExportName);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    SysMon::ExportCacheEntry identity;
+    uint32_t exportRva = 0;
+
+    const xpf::StringView<char> exportName{ ExportName };
+
+    /* Without an identity we can not tell which file the mapping matches. */
+    status = SysMon::ExportCache::ReadIdentity(ModuleBase,
+                                               ModuleSize,
+                                               &identity);
+    if (!NT_SUCCESS(status))
+    {
+        return nullptr;
+    }
+
+    /* The same image was seen before - add the rva to where it is mapped now. */
+    {
+        xpf::SharedLockGuard guard{ *this->m_EntriesLock };
+
+        for (size_t i = 0; i < this->m_Entries.Size(); ++i)
+        {
+            const SysMon::ExportCacheEntry* entry = this->m_Entries[i].Get();
+            if (entry->TimeDateStamp != identity.TimeDateStamp ||
+                entry->SizeOfImage != identity.SizeOfImage ||
+                entry->Machine != identity.Machine ||
+                !entry->ExportName.View().Equals(exportName, false))
+            {
+                continue;
+            }
+
+            xpf::ApiAtomicIncrement(&this->m_Hits);
+            return (entry->ExportRva < ModuleSize) ? xpf::AlgoAddToPointer(ModuleBase, entry->ExportRva)
+                                                   : nullptr;
+        }
+    }
+    xpf::ApiAtomicIncrement(&this->m_Misses);
+
+    /* A miss - the rva is taken from the file, as the mapping may have been tampered with by the process. */
+    /* The exports which are not found are not remembered.                                                 */
+    status = SysMon::ExportCache::ReadExportFromFile(ImagePath,
+                                                     ExportName,
+                                                     identity,
+                                                     &exportRva);
+    if (!NT_SUCCESS(status))
+    {
+        SysMonLogWarning("Could not resolve export %s from %S. status = %!STATUS!",
+                         ExportName,
+                         ImagePath.Buffer(),
+                         status);
+        return nullptr;
+    }
+    if (exportRva >= ModuleSize)
+    {
+        return nullptr;
+    }
+    void* exportAddress = xpf::AlgoAddToPointer(ModuleBase, exportRva);
+
+    /* Prepare the entry outside of the lock. If anything fails, we just do not remember it. */
+    xpf::SharedPointer<SysMon::ExportCacheEntry> newEntry = xpf::MakeSharedWithAllocator<SysMon::ExportCacheEntry>(SYSMON_PAGED_ALLOCATOR);
+    if (newEntry.IsEmpty())
+    {
+        return exportAddress;
+    }
+    newEntry.Get()->TimeDateStamp = identity.TimeDateStamp;
+    newEntry.Get()->SizeOfImage = identity.SizeOfImage;
+    newEntry.Get()->Machine = identity.Machine;
+    newEntry.Get()->ExportRva = exportRva;
+
+    status = newEntry.Get()->ExportName.Append(exportName);
+    if (!NT_SUCCESS(status))
+    {
+        return exportAddress;
+    }
+
+    {
+        xpf::ExclusiveLockGuard guard{ *this->m_EntriesLock };
+
+        for (size_t i = 0; i < this->m_Entries.Size(); ++i)
+        {
+            const SysMon::ExportCacheEntry* entry = this->m_Entries[i].Get();
+
+            /* Someone else resolved it meanwhile. */
+            if (entry->TimeDateStamp == identity.TimeDateStamp &&
+                entry->SizeOfImage == identity.SizeOfImage &&
+                entry->Machine == identity.Machine &&
+                entry->ExportName.View().Equals(exportName, false))
+            {
+                return exportAddress;
+            }
+        }
+        if (this->m_Entries.Size() < SysMon::ExportCache::MAX_ENTRIES)
+        {
+            status = this->m_Entries.Emplace(newEntry);
+            if (!NT_SUCCESS(status))
+            {
+                SysMonLogWarning("Failed to cache export %s. status = %!STATUS!",
+                                 ExportName,
+                                 status);
+            }
+        }
+    }
+
+    return exportAddress;
+}
+
+_Use_decl_annotations_
+void XPF_API
+SysMon::ExportCache::ReportStatistics(
+    void
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    const uint64_t hits = this->m_Hits;
+    const uint64_t misses = this->m_Misses;
+    const uint64_t lookups = hits + misses;
+
+    SysMonLogInfo("Export cache: %llu lookups, %llu hits (%llu%%), %llu entries",
+                  lookups,
+                  hits,
+                  (0 == lookups) ? 0 : (hits * 100) / lookups,
+                  static_cast<uint64_t>(this->m_Entries.Size()));
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::ExportCache::ReadExportFromFile(
+    _In_ _Const_ const xpf::StringView<wchar_t>& ImagePath,
+    _In_ _Const_ const char* ExportName,
+    _In_ _Const_ const SysMon::ExportCacheEntry& MappedIdentity,
+    _Out_ uint32_t* ExportRva
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != ExportRva);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    xpf::Optional<SysMon::File::FileObject> imageFile;
+    xpf::Buffer readBuffer{ SYSMON_PAGED_ALLOCATOR };
+    SysMon::PeExportReader::ImageIdentity fileIdentity;
+
+    *ExportRva = 0;
+
+    status = SysMon::File::FileObject::Create(ImagePath,
+                                              XPF_FILE_ACCESS_READ,
+                                              &imageFile);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    /* Only the headers, the export directory and a few names are read. */
+    auto readFile = [&](uint64_t Offset, void* Destination, size_t Size) -> bool
+                    {
+                        uint64_t endOffset = 0;
+                        if (!xpf::ApiNumbersSafeAdd(Offset, static_cast<uint64_t>(Size), &endOffset) ||
+                            endOffset > (*imageFile).FileSize())
+                        {
+                            return false;
+                        }
+                        if (!NT_SUCCESS(readBuffer.Resize(Size)) ||
+                            !NT_SUCCESS((*imageFile).Read(Offset, &readBuffer)) ||
+                            readBuffer.GetSize() != Size)
+                        {
+                            return false;
+                        }
+                        xpf::ApiCopyMemory(Destination,
+                                           readBuffer.GetBuffer(),
+                                           Size);
+                        return true;
+                    };
+    if (!SysMon::PeExportReader::FindExport(readFile,
+                                            ExportName,
+                                            &fileIdentity,
+                                            ExportRva))
+    {
+        return STATUS_NOT_FOUND;
+    }
+
+    /* The file must be the one which is mapped - otherwise the rva means nothing there. */
+    if (fileIdentity.TimeDateStamp != MappedIdentity.TimeDateStamp ||
+        fileIdentity.SizeOfImage != MappedIdentity.SizeOfImage ||
+        fileIdentity.Machine != MappedIdentity.Machine)
+    {
+        *ExportRva = 0;
+        return STATUS_IMAGE_CHECKSUM_MISMATCH;
+    }
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::ExportCache::ReadIdentity(
+    _In_ void* ModuleBase,
+    _In_ size_t ModuleSize,
+    _Out_ SysMon::ExportCacheEntry* Identity
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != Identity);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    PIMAGE_NT_HEADERS headers = nullptr;
+
+    __try
+    {
+        /* If this is a user address, we need to probe it. */
+        if (KmHelper::HelperIsUserAddress(ModuleBase))
+        {
+            ::ProbeForRead(ModuleBase, ModuleSize, 1);
+        }
+
+        status = KmHelper::WrapperRtlImageNtHeaderEx(0,
+                                                     ModuleBase,
+                                                     ModuleSize,
+                                                     &headers);
+        if (!NT_SUCCESS(status))
+        {
+            __leave;
+        }
+
+        /* SizeOfImage is at the same offset in both the 32 and 64 bit optional headers. */
+        Identity->TimeDateStamp = headers->FileHeader.TimeDateStamp;
+        Identity->Machine = headers->FileHeader.Machine;
+        Identity->SizeOfImage = headers->OptionalHeader.SizeOfImage;
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        /* The image is unmapped under our feet. */
+        status = STATUS_UNHANDLED_EXCEPTION;
+    }
+
+    return status;
+}
@@ -0,0 +1,193 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/ExportCache.hpp
+ *
+ * @brief       In this file we define a small cache of the exports resolved in the
+ *              user mode modules. The same kernel32 is loaded in most processes,
+ *              so its export directory is walked once instead of once per process.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#pragma once
+
+#include "precomp.hpp"
+
+
+namespace SysMon
+{
+/**
+ * @brief   A resolved export - the rva of a name inside an image with a given identity.
+ */
+struct ExportCacheEntry
+{
+    /**
+     * @brief   The TimeDateStamp from the image file header.
+     */
+    uint32_t TimeDateStamp = 0;
+
+    /**
+     * @brief   The SizeOfImage from the image optional header.
+     */
+    uint32_t SizeOfImage = 0;
+
+    /**
+     * @brief   The Machine from the image file header - native and wow images
+     *          with the same name differ by it.
+     */
+    uint16_t Machine = 0;
+
+    /**
+     * @brief   The name of the export.
+     */
+    xpf::String<char> ExportName{ SYSMON_PAGED_ALLOCATOR };
+
+    /**
+     * @brief   The rva of the export. Added to the base where the image is mapped.
+     */
+    uint32_t ExportRva = 0;
+};
+
+/**
+ * @brief   This class caches the exports of the user mode modules, keyed by the identity of
+ *          the image (timestamp, size and machine) and the export name.
+ *
+ *          Only the pe headers of the module are read on a hit. On a miss, the rva is read from
+ *          the file the image was loaded from - never from the mapping, which the process can
+ *          write to (copy on write) and which would poison the entry for all other processes.
+ *          The cache is bounded - once it is full, the misses are not remembered.
+ */
+class ExportCache final
+{
+ private:
+    /**
+     * @brief  Default constructor - private as Create
+     *         method must be used to instantiate an object.
+     */
+    ExportCache(void) noexcept(true) = default;
+
+ public:
+    /**
+     * @brief   Destructor. Reports the hit ratio.
+     */
+    ~ExportCache(void) noexcept(true);
+
+    /**
+     * @brief   Copy and move are deleted for this class.
+     *          They can be implemented when required.
+     */
+    XPF_CLASS_COPY_MOVE_BEHAVIOR(SysMon::ExportCache, delete);
+
+    /**
+     * @brief       Creates an export cache.
+     *
+     * @param[out]  Cache - On success, it will contain a properly initialized object.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    static NTSTATUS XPF_API
+    Create(
+        _Out_ xpf::Optional<SysMon::ExportCache>* Cache
+    ) noexcept(true);
+
+    /**
+     * @brief       Finds an export in a module mapped as image. The export directory of the
+     *              file is read only the first time an image is seen.
+     *
+     * @param[in]   ImagePath   - The path of the file the module was loaded from.
+     * @param[in]   ModuleBase  - The base of the module. Can be a user mode address,
+     *                            in which case the caller must be in the process context.
+     * @param[in]   ModuleSize  - The size of the module.
+     * @param[in]   ExportName  - A null terminated string containing the export name.
+     *
+     * @return      NULL if the export could not be retrieved or was not found,
+     *              the address of the export otherwise.
+     */
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    void* XPF_API
+    FindExport(
+        _In_ _Const_ const xpf::StringView<wchar_t>& ImagePath,
+        _In_ void* ModuleBase,
+        _In_ size_t ModuleSize,
+        _In_ _Const_ const char* ExportName
+    ) noexcept(true);
+
+    /**
+     * @brief       Logs how many lookups were served from the cache.
+     *
+     * @return      Nothing.
+     */
+    void XPF_API
+    ReportStatistics(
+        void
+    ) noexcept(true);
+
+ private:
+    /**
+     * @brief       Finds an export in the file an image was loaded from.
+     *
+     * @param[in]   ImagePath       - The path of the file.
+     * @param[in]   ExportName      - A null terminated string containing the export name.
+     * @param[in]   MappedIdentity  - The identity of the mapped image. The file must match it.
+     * @param[out]  ExportRva       - The rva of the export.
+     *
+     * @return      STATUS_NOT_FOUND if the export is not found or is forwarded,
+     *              STATUS_IMAGE_CHECKSUM_MISMATCH if the file is not the mapped image,
+     *              or a proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    static NTSTATUS XPF_API
+    ReadExportFromFile(
+        _In_ _Const_ const xpf::StringView<wchar_t>& ImagePath,
+        _In_ _Const_ const char* ExportName,
+        _In_ _Const_ const SysMon::ExportCacheEntry& MappedIdentity,
+        _Out_ uint32_t* ExportRva
+    ) noexcept(true);
+
+    /**
+     * @brief       Reads the identity of a module from its pe headers.
+     *
+     * @param[in]   ModuleBase  - The base of the module.
+     * @param[in]   ModuleSize  - The size of the module.
+     * @param[out]  Identity    - The TimeDateStamp, SizeOfImage and Machine are filled.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    static NTSTATUS XPF_API
+    ReadIdentity(
+        _In_ void* ModuleBase,
+        _In_ size_t ModuleSize,
+        _Out_ SysMon::ExportCacheEntry* Identity
+    ) noexcept(true);
+
+ private:
+    /**
+     * @brief   How many exports are remembered. A few routines in a few
+     *          system dlls, for each architecture.
+     */
+    static constexpr size_t MAX_ENTRIES = 64;
+
+    xpf::Optional<xpf::ReadWriteLock> m_EntriesLock;
+    xpf::Vector<xpf::SharedPointer<SysMon::ExportCacheEntry>> m_Entries{ SYSMON_PAGED_ALLOCATOR };
+
+    volatile uint64_t m_Hits = 0;
+    volatile uint64_t m_Misses = 0;
+
+    /**
+     * @brief   Default MemoryAllocator is our friend as it requires access to the private
+     *          default constructor. It is used in the Create() method to ensure that
+     *          no partially constructed objects are created but instead they will be
+     *          all fully initialized.
+     */
+    friend class xpf::MemoryAllocator;
+};  // class ExportCache
+};  // namespace SysMon
@@ -121,6 +121,10 @@ SysmonFileOpen(
         desiredAccess = desiredAccess | FILE_GENERIC_WRITE;
         createDisposition = FILE_OPEN_IF;
     }
+    if (DesiredAccess & XPF_FILE_ACCESS_DELETE)
+    {
+        desiredAccess = desiredAccess | DELETE;
+    }
 
     /* Get an unicode string to open the file. */
     status = KmHelper::HelperViewToUnicodeString(FilePath,
@@ -506,6 +510,217 @@ SysMon::File::FileObject::Write(
     return status;
 }
 
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::File::FileObject::Delete(
+    void
+) noexcept(true)
+{
+    /* Can not do I/O at higher IRQLs */
+    XPF_MAX_PASSIVE_LEVEL();
+
+    IO_STATUS_BLOCK ioStatusBlock = { 0 };
+    FILE_DISPOSITION_INFORMATION dispositionInformation = { 0 };
+
+    dispositionInformation.DeleteFile = TRUE;
+
+    NTSTATUS status = ::ZwSetInformationFile(this->m_FileHandle,
+                                             &ioStatusBlock,
+                                             &dispositionInformation,
+                                             sizeof(dispositionInformation),
+                                             FILE_INFORMATION_CLASS::FileDispositionInformation);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    return ioStatusBlock.Status;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::File::FileObject::Truncate(
+    _In_ const uint64_t& Size
+) noexcept(true)
+{
+    /* Can not do I/O at higher IRQLs */
+    XPF_MAX_PASSIVE_LEVEL();
+
+    IO_STATUS_BLOCK ioStatusBlock = { 0 };
+    FILE_END_OF_FILE_INFORMATION endOfFileInformation = { 0 };
+
+    if (Size > static_cast<uint64_t>(xpf::NumericLimits<int64_t>::MaxValue()))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+    endOfFileInformation.EndOfFile.QuadPart = static_cast<LONGLONG>(Size);
+
+    NTSTATUS status = ::ZwSetInformationFile(this->m_FileHandle,
+                                             &ioStatusBlock,
+                                             &endOfFileInformation,
+                                             sizeof(endOfFileInformation),
+                                             FILE_INFORMATION_CLASS::FileEndOfFileInformation);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    if (!NT_SUCCESS(ioStatusBlock.Status))
+    {
+        return ioStatusBlock.Status;
+    }
+
+    this->m_FileSize = Size;
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::File::FileObject::Rename(
+    _In_ _Const_ const xpf::StringView<wchar_t>& NewFilePath
+) noexcept(true)
+{
+    /* Can not do I/O at higher IRQLs */
+    XPF_MAX_PASSIVE_LEVEL();
+
+    IO_STATUS_BLOCK ioStatusBlock = { 0 };
+    xpf::Buffer renameInformation{ SYSMON_PAGED_ALLOCATOR };
+    size_t renameInformationSize = 0;
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    /* The name is stored inline, right after the fixed part of the structure. */
+    if (NewFilePath.IsEmpty() ||
+        NewFilePath.BufferSize() > xpf::NumericLimits<ULONG>::MaxValue() / sizeof(wchar_t))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+    const size_t nameSize = NewFilePath.BufferSize() * sizeof(wchar_t);
+    if (!xpf::ApiNumbersSafeAdd(size_t{ FIELD_OFFSET(FILE_RENAME_INFORMATION, FileName) }, nameSize, &renameInformationSize))
+    {
+        return STATUS_INTEGER_OVERFLOW;
+    }
+    if (renameInformationSize < sizeof(FILE_RENAME_INFORMATION))
+    {
+        renameInformationSize = sizeof(FILE_RENAME_INFORMATION);
+    }
+    if (renameInformationSize > xpf::NumericLimits<ULONG>::MaxValue())
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+    status = renameInformation.Resize(renameInformationSize);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    xpf::ApiZeroMemory(renameInformation.GetBuffer(), renameInformation.GetSize());
+
+    FILE_RENAME_INFORMATION* information = static_cast<FILE_RENAME_INFORMATION*>(renameInformation.GetBuffer());
+    information->ReplaceIfExists = TRUE;
+    information->RootDirectory = NULL;
+    information->FileNameLength = static_cast<ULONG>(nameSize);
+    xpf::ApiCopyMemory(information->FileName,
+                       NewFilePath.Buffer(),
+                       nameSize);
+
+    status = ::ZwSetInformationFile(this->m_FileHandle,
+                                    &ioStatusBlock,
+                                    information,
+                                    static_cast<ULONG>(renameInformationSize),
+                                    FILE_INFORMATION_CLASS::FileRenameInformation);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    return ioStatusBlock.Status;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::File::FileObject::QueryIdentity(
+    _Out_ SysMon::File::FileIdentity* Identity
+) noexcept(true)
+{
+    /* Can not do I/O at higher IRQLs */
+    XPF_MAX_PASSIVE_LEVEL();
+
+    XPF_DEATH_ON_FAILURE(nullptr != Identity);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    IO_STATUS_BLOCK ioStatusBlock = { 0 };
+
+    FILE_INTERNAL_INFORMATION internalInformation = { 0 };
+    FILE_BASIC_INFORMATION basicInformation = { 0 };
+    xpf::Buffer volumeInformation{ SYSMON_PAGED_ALLOCATOR };
+    xpf::Buffer usnInformation{ SYSMON_PAGED_ALLOCATOR };
+
+    /* Preinit output. */
+    xpf::ApiZeroMemory(Identity, sizeof(*Identity));
+
+    /* The file id is unique per volume. */
+    status = ::ZwQueryInformationFile(this->m_FileHandle,
+                                      &ioStatusBlock,
+                                      &internalInformation,
+                                      sizeof(internalInformation),
+                                      FILE_INFORMATION_CLASS::FileInternalInformation);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    Identity->FileId = static_cast<uint64_t>(internalInformation.IndexNumber.QuadPart);
+
+    /* The last write time is used when there is no change journal. */
+    status = ::ZwQueryInformationFile(this->m_FileHandle,
+                                      &ioStatusBlock,
+                                      &basicInformation,
+                                      sizeof(basicInformation),
+                                      FILE_INFORMATION_CLASS::FileBasicInformation);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    Identity->LastWriteTime = basicInformation.LastWriteTime.QuadPart;
+
+    /* The volume information has a variable label at the end - we only care about the serial. */
+    status = volumeInformation.Resize(sizeof(FILE_FS_VOLUME_INFORMATION) + MAX_PATH * sizeof(wchar_t));
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    status = ::ZwQueryVolumeInformationFile(this->m_FileHandle,
+                                            &ioStatusBlock,
+                                            volumeInformation.GetBuffer(),
+                                            static_cast<ULONG>(volumeInformation.GetSize()),
+                                            FS_INFORMATION_CLASS::FileFsVolumeInformation);
+    if (!NT_SUCCESS(status) && (STATUS_BUFFER_OVERFLOW != status))
+    {
+        return status;
+    }
+    Identity->VolumeSerialNumber = static_cast<const FILE_FS_VOLUME_INFORMATION*>(volumeInformation.GetBuffer())->VolumeSerialNumber;
+
+    /* The usn is best effort. The change journal might not be active. */
+    status = usnInformation.Resize(sizeof(USN_RECORD) + MAX_PATH * sizeof(wchar_t));
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    status = ::ZwFsControlFile(this->m_FileHandle,
+                               NULL,
+                               NULL,
+                               NULL,
+                               &ioStatusBlock,
+                               FSCTL_READ_FILE_USN_DATA,
+                               NULL,
+                               0,
+                               usnInformation.GetBuffer(),
+                               static_cast<ULONG>(usnInformation.GetSize()));
+    if (NT_SUCCESS(status))
+    {
+        Identity->Usn = static_cast<const USN_RECORD*>(usnInformation.GetBuffer())->Usn;
+    }
+
+    /* All good. */
+    return STATUS_SUCCESS;
+}
+
 _Use_decl_annotations_
 NTSTATUS XPF_API
 SysMon::File::QueryFileNameFromRawFileObject(
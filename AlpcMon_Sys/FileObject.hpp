@@ -33,6 +33,44 @@ namespace File
  */
 #define XPF_FILE_ACCESS_WRITE       0x00000002
 
+/**
+ * @brief   The requested access to the file must include delete rights.
+ */
+#define XPF_FILE_ACCESS_DELETE      0x00000004
+
+/**
+ * @brief   Describes the identity of a file on disk. It is used to validate
+ *          whether information cached about a file is still up to date.
+ */
+struct FileIdentity
+{
+    /**
+     * @brief   The serial number of the volume on which the file resides.
+     */
+    uint32_t VolumeSerialNumber = 0;
+
+    /**
+     * @brief   Padding - keeps the layout the same on all architectures.
+     */
+    uint32_t Reserved = 0;
+
+    /**
+     * @brief   The file reference number. Unique per volume.
+     */
+    uint64_t FileId = 0;
+
+    /**
+     * @brief   The update sequence number of the last change to the file.
+     *          It is 0 when the volume has no change journal.
+     */
+    int64_t Usn = 0;
+
+    /**
+     * @brief   The last time the file was written to.
+     */
+    int64_t LastWriteTime = 0;
+};
+
 /**
  * @brief   This class is a wrapper to interact with files.
  */
@@ -112,6 +150,67 @@ class FileObject
         _In_ const size_t& BufferSize
     ) noexcept(true);
 
+    /**
+     * @brief           Marks the file for deletion. It is deleted when the file is closed.
+     *                  The file must be opened with XPF_FILE_ACCESS_DELETE.
+     *
+     * @return          A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    Delete(
+        void
+    ) noexcept(true);
+
+    /**
+     * @brief           Sets the size of the file. The bytes past the new size are discarded.
+     *                  The file must be opened with XPF_FILE_ACCESS_WRITE.
+     *
+     * @param[in]       Size - The new size of the file, in bytes.
+     *
+     * @return          A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    Truncate(
+        _In_ const uint64_t& Size
+    ) noexcept(true);
+
+    /**
+     * @brief           Renames the file, replacing the destination if it exists.
+     *                  The file must be opened with XPF_FILE_ACCESS_DELETE.
+     *
+     * @param[in]       NewFilePath - The full path of the destination, on the same volume.
+     *
+     * @return          A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    Rename(
+        _In_ _Const_ const xpf::StringView<wchar_t>& NewFilePath
+    ) noexcept(true);
+
+    /**
+     * @brief           Queries the identity of the file - volume serial number, file id,
+     *                  the last update sequence number and the last write time.
+     *
+     * @param[out]      Identity - On success, it will contain the file identity.
+     *
+     * @return          A proper NTSTATUS error code.
+     *
+     * @note            The change journal might not be active on the volume.
+     *                  In this case the Usn is 0 and only the write time is relevant.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    QueryIdentity(
+        _Out_ SysMon::File::FileIdentity* Identity
+    ) noexcept(true);
+
     /**
      * @brief   Getter for the file size.
      *
@@ -28,6 +28,7 @@
 #include "globals.hpp"
 #include "Events.hpp"
 #include "UmKmComms.hpp"
+#include "ModuleCollector.hpp"
 
 #include "FirmwareTableHandlerFilter.hpp"
 #include "trace.hpp"
@@ -76,6 +77,23 @@ FirmwareTableHandlerCallback(
         return STATUS_NOT_SUPPORTED;
     }
 
+    //
+    // The symbol service talks only with the module collector.
+    // These messages are not broadcasted to the plugins.
+    //
+    if (TableInfo->TableBufferLength >= sizeof(uint64_t))
+    {
+        UM_KM_MESSAGE_HEADER* message = reinterpret_cast<UM_KM_MESSAGE_HEADER*>(TableInfo);
+        const uint64_t messageType = UmKmMessageGetType(message);
+
+        if (UM_KM_MESSAGE_TYPE_SYMBOLS_GET_REQUEST == messageType ||
+            UM_KM_MESSAGE_TYPE_SYMBOLS_REPLY == messageType)
+        {
+            return ModuleCollectorHandleSymbolsMessage(message,
+                                                       sizeof(UM_KM_MESSAGE_HEADER) + TableInfo->TableBufferLength);
+        }
+    }
+
     //
     // Ensure we have enough stack. Do not handle messages
     // if we do not have at least half a page available.
@@ -30,103 +30,254 @@ XPF_SECTION_PAGED;
 //
 
 _Use_decl_annotations_
-NTSTATUS
-KmHelper::File::HashFile(
-    _Inout_ SysMon::File::FileObject& MappedFile,
-    _In_ _Const_ const HashType& HashType,
-    _Inout_ xpf::Buffer& Hash
+NTSTATUS XPF_API
+KmHelper::File::FileHasher::Create(
+    _Out_ xpf::Optional<KmHelper::File::FileHasher>* Hasher
 ) noexcept(true)
 {
     XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != Hasher);
 
-    BCRYPT_ALG_HANDLE algorithmHandle = { 0 };
-    BOOLEAN isAlgorithmProviderOpened = FALSE;
-    LPCWSTR algorithmId = NULL;
+    /* Must be in the same order as HashTypeToIndex. */
+    const LPCWSTR algorithmIds[FileHasher::ALGORITHMS_COUNT] = { BCRYPT_MD5_ALGORITHM,
+                                                                 BCRYPT_SHA1_ALGORITHM,
+                                                                 BCRYPT_SHA256_ALGORITHM };
+    const bool allAlgorithms[FileHasher::ALGORITHMS_COUNT] = { true, true, true };
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
 
-    BCRYPT_HASH_HANDLE hashHandle = { 0 };
-    BOOLEAN isHashHandleCreated = FALSE;
+    /* Preinit output. */
+    Hasher->Reset();
 
-    uint32_t hashLength = 0;
-    ULONG cbResultPropertyLength = 0;
+    Hasher->Emplace();
+    KmHelper::File::FileHasher& hasher = (*(*Hasher));
 
-    NTSTATUS status = STATUS_UNSUCCESSFUL;
-    xpf::Buffer chunkBuffer{ SYSMON_PAGED_ALLOCATOR };
+    status = xpf::ReadWriteLock::Create(&hasher.m_SlotsLock);
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
 
-    /* First map the hash type to the bcrypt algorithm type. */
-    switch (HashType)
+    /* Try reusable hashes first - they are reset when they are finished. */
+    hasher.m_AreHashesReusable = true;
+    for (size_t i = 0; i < FileHasher::ALGORITHMS_COUNT; ++i)
     {
-        case KmHelper::File::HashType::kMd5:
+        status = ::BCryptOpenAlgorithmProvider(&hasher.m_Algorithms[i],
+                                               algorithmIds[i],
+                                               MS_PRIMITIVE_PROVIDER,
+                                               hasher.m_AreHashesReusable ? BCRYPT_HASH_REUSABLE_FLAG : 0);
+        if (!NT_SUCCESS(status) && hasher.m_AreHashesReusable)
         {
-            algorithmId = BCRYPT_MD5_ALGORITHM;
-            break;
+            /* Not supported before Windows 8 - the hash objects will be created for every file. */
+            SysMonLogInfo("Reusable hashes are not supported %!STATUS!",
+                          status);
+            hasher.m_AreHashesReusable = false;
+            status = ::BCryptOpenAlgorithmProvider(&hasher.m_Algorithms[i],
+                                                   algorithmIds[i],
+                                                   MS_PRIMITIVE_PROVIDER,
+                                                   0);
         }
-        default:
+        if (!NT_SUCCESS(status))
         {
-            XPF_ASSERT(false);
-            return STATUS_INVALID_PARAMETER;
+            hasher.m_Algorithms[i] = NULL;
+            goto CleanUp;
         }
     }
 
-    /* Now open the algorithm provider. */
-    status = ::BCryptOpenAlgorithmProvider(&algorithmHandle,
-                                           algorithmId,
-                                           MS_PRIMITIVE_PROVIDER,
-                                           0);
-    if (!NT_SUCCESS(status))
+    /* Prepare the pooled slots. */
+    for (size_t i = 0; i < FileHasher::SLOTS_COUNT; ++i)
     {
-        goto CleanUp;
+        status = hasher.m_Slots[i].Chunk.Resize(FileHasher::CHUNK_SIZE);
+        if (!NT_SUCCESS(status))
+        {
+            goto CleanUp;
+        }
+        if (hasher.m_AreHashesReusable)
+        {
+            status = hasher.CreateHashes(hasher.m_Slots[i],
+                                         allAlgorithms,
+                                         BCRYPT_HASH_REUSABLE_FLAG);
+            if (!NT_SUCCESS(status))
+            {
+                goto CleanUp;
+            }
+        }
     }
-    isAlgorithmProviderOpened = TRUE;
 
-    /* Now create the hashing object. */
-    status = ::BCryptCreateHash(algorithmHandle,
-                                &hashHandle,
-                                NULL,
-                                0,
-                                NULL,
-                                0,
-                                0);
+CleanUp:
     if (!NT_SUCCESS(status))
     {
-        goto CleanUp;
+        Hasher->Reset();
     }
-    isHashHandleCreated = TRUE;
+    return status;
+}
 
-    /* We'll read the file in PAGE_SIZE chunks. */
-    status = chunkBuffer.Resize(PAGE_SIZE);
-    if (!NT_SUCCESS(status))
+KmHelper::File::FileHasher::~FileHasher(
+    void
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    /* Cleanup the hash objects. */
+    for (size_t i = 0; i < FileHasher::SLOTS_COUNT; ++i)
     {
-        goto CleanUp;
+        XPF_DEATH_ON_FAILURE(!this->m_Slots[i].IsInUse);
+        FileHasher::DestroyHashes(this->m_Slots[i]);
     }
 
-    /* And now start hashing. */
-    for (size_t i = 0; i < MappedFile.FileSize(); i += chunkBuffer.GetSize())
+    /* Cleanup the algorithm providers. */
+    for (size_t i = 0; i < FileHasher::ALGORITHMS_COUNT; ++i)
     {
-        /* Read next chunk. */
-        status = MappedFile.Read(i, &chunkBuffer);
-        if (!NT_SUCCESS(status))
+        if (NULL != this->m_Algorithms[i])
         {
-            goto CleanUp;
+            NTSTATUS cleanupStatus = ::BCryptCloseAlgorithmProvider(this->m_Algorithms[i],
+                                                                    0);
+            XPF_DEATH_ON_FAILURE(NT_SUCCESS(cleanupStatus));
+
+            this->m_Algorithms[i] = NULL;
         }
-        if (chunkBuffer.GetSize() == 0)
+    }
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+KmHelper::File::FileHasher::HashTypeToIndex(
+    _In_ HashType Type,
+    _Out_ size_t* Index
+) noexcept(true)
+{
+    switch (Type)
+    {
+        case KmHelper::File::HashType::kMd5:
         {
-            status = STATUS_INVALID_BUFFER_SIZE;
-            goto CleanUp;
+            *Index = 0;
+            return STATUS_SUCCESS;
+        }
+        case KmHelper::File::HashType::kSha1:
+        {
+            *Index = 1;
+            return STATUS_SUCCESS;
         }
+        case KmHelper::File::HashType::kSha256:
+        {
+            *Index = 2;
+            return STATUS_SUCCESS;
+        }
+        default:
+        {
+            XPF_ASSERT(false);
+            *Index = 0;
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+}
 
-        /* Update the hash. */
-        status = ::BCryptHashData(hashHandle,
-                                  static_cast<PUCHAR>(chunkBuffer.GetBuffer()),
-                                  static_cast<uint32_t>(chunkBuffer.GetSize()),
-                                  0);
+_Use_decl_annotations_
+NTSTATUS XPF_API
+KmHelper::File::FileHasher::CreateHashes(
+    _Inout_ HashingSlot& Slot,
+    _In_reads_(ALGORITHMS_COUNT) const bool* IsRequested,
+    _In_ ULONG Flags
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    NTSTATUS status = STATUS_SUCCESS;
+
+    for (size_t i = 0; i < FileHasher::ALGORITHMS_COUNT; ++i)
+    {
+        if (!IsRequested[i])
+        {
+            continue;
+        }
+
+        /* The hash object memory is managed by bcrypt. */
+        status = ::BCryptCreateHash(this->m_Algorithms[i],
+                                    &Slot.Hashes[i],
+                                    NULL,
+                                    0,
+                                    NULL,
+                                    0,
+                                    Flags);
         if (!NT_SUCCESS(status))
         {
-            goto CleanUp;
+            Slot.Hashes[i] = NULL;
+            FileHasher::DestroyHashes(Slot);
+            return status;
         }
     }
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+void XPF_API
+KmHelper::File::FileHasher::DestroyHashes(
+    _Inout_ HashingSlot& Slot
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    for (size_t i = 0; i < FileHasher::ALGORITHMS_COUNT; ++i)
+    {
+        if (NULL != Slot.Hashes[i])
+        {
+            NTSTATUS cleanupStatus = ::BCryptDestroyHash(Slot.Hashes[i]);
+            XPF_DEATH_ON_FAILURE(NT_SUCCESS(cleanupStatus));
+
+            Slot.Hashes[i] = NULL;
+        }
+    }
+}
+
+_Use_decl_annotations_
+KmHelper::File::FileHasher::HashingSlot* XPF_API
+KmHelper::File::FileHasher::AcquireSlot(
+    void
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    xpf::ExclusiveLockGuard guard{ *this->m_SlotsLock };
+
+    for (size_t i = 0; i < FileHasher::SLOTS_COUNT; ++i)
+    {
+        if (!this->m_Slots[i].IsInUse)
+        {
+            this->m_Slots[i].IsInUse = true;
+            return &this->m_Slots[i];
+        }
+    }
+    return nullptr;
+}
+
+_Use_decl_annotations_
+void XPF_API
+KmHelper::File::FileHasher::ReleaseSlot(
+    _Inout_ HashingSlot* Slot
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
 
-    /* Now find how many bytes we need for the hash result. */
-    status = ::BCryptGetProperty(hashHandle,
+    xpf::ExclusiveLockGuard guard{ *this->m_SlotsLock };
+
+    XPF_DEATH_ON_FAILURE(Slot->IsInUse);
+    Slot->IsInUse = false;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+KmHelper::File::FileHasher::FinishHash(
+    _In_ BCRYPT_HASH_HANDLE HashHandle,
+    _Out_ xpf::Buffer* Hash
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    uint32_t hashLength = 0;
+    ULONG cbResultPropertyLength = 0;
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    /* Find how many bytes we need for the hash result. */
+    status = ::BCryptGetProperty(HashHandle,
                                  BCRYPT_HASH_LENGTH,
                                  reinterpret_cast<PUCHAR>(&hashLength),
                                  sizeof(hashLength),
@@ -134,50 +285,230 @@ KmHelper::File::HashFile(
                                  0);
     if (!NT_SUCCESS(status))
     {
-        goto CleanUp;
+        return status;
     }
     if (cbResultPropertyLength != sizeof(hashLength))
     {
-        status = STATUS_INFO_LENGTH_MISMATCH;
-        goto CleanUp;
+        return STATUS_INFO_LENGTH_MISMATCH;
     }
 
     /* Allocate buffer. */
-    status = Hash.Resize(hashLength);
+    status = Hash->Resize(hashLength);
     if (!NT_SUCCESS(status))
     {
-        goto CleanUp;
+        return status;
     }
 
-    /* And finalize the hashing. */
-    status = ::BCryptFinishHash(hashHandle,
-                                reinterpret_cast<PUCHAR>(Hash.GetBuffer()),
+    /* And finalize the hashing - this also resets a reusable hash object. */
+    return ::BCryptFinishHash(HashHandle,
+                              reinterpret_cast<PUCHAR>(Hash->GetBuffer()),
+                              hashLength,
+                              0);
+}
+
+_Use_decl_annotations_
+void XPF_API
+KmHelper::File::FileHasher::ResetHash(
+    _In_ BCRYPT_HASH_HANDLE HashHandle
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    /* Large enough for all supported digests. Finishing does not allocate, so it won't fail. */
+    UCHAR discardedHash[64] = { 0 };
+    uint32_t hashLength = 0;
+    ULONG cbResultPropertyLength = 0;
+
+    NTSTATUS status = ::BCryptGetProperty(HashHandle,
+                                          BCRYPT_HASH_LENGTH,
+                                          reinterpret_cast<PUCHAR>(&hashLength),
+                                          sizeof(hashLength),
+                                          &cbResultPropertyLength,
+                                          0);
+    XPF_DEATH_ON_FAILURE(NT_SUCCESS(status));
+    XPF_DEATH_ON_FAILURE(hashLength <= sizeof(discardedHash));
+
+    status = ::BCryptFinishHash(HashHandle,
+                                discardedHash,
                                 hashLength,
                                 0);
-    if (!NT_SUCCESS(status))
+    XPF_DEATH_ON_FAILURE(NT_SUCCESS(status));
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+KmHelper::File::FileHasher::HashFile(
+    _Inout_ SysMon::File::FileObject& File,
+    _In_reads_(HashTypesCount) const HashType* HashTypes,
+    _Out_writes_(HashTypesCount) xpf::Buffer* Hashes,
+    _In_ size_t HashTypesCount
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    bool isRequested[FileHasher::ALGORITHMS_COUNT] = { false };
+    bool isDirty = false;
+
+    HashingSlot ownSlot;
+    HashingSlot* slot = nullptr;
+    bool isPerFileSlot = false;
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    auto indexAt = [&](size_t Request, size_t* Index) -> bool
     {
-        goto CleanUp;
+        status = FileHasher::HashTypeToIndex(HashTypes[Request],
+                                             Index);
+        return NT_SUCCESS(status);
+    };
+    auto readChunk = [&](uint64_t Offset, const uint8_t** Data, size_t* Size) -> bool
+    {
+        /* The previous read might have shrunk the chunk. */
+        status = slot->Chunk.Resize(FileHasher::CHUNK_SIZE);
+        if (!NT_SUCCESS(status))
+        {
+            return false;
+        }
+        status = File.Read(Offset, &slot->Chunk);
+        if (!NT_SUCCESS(status))
+        {
+            return false;
+        }
+
+        *Data = static_cast<const uint8_t*>(slot->Chunk.GetBuffer());
+        *Size = slot->Chunk.GetSize();
+        return true;
+    };
+    auto feedChunk = [&](size_t Index, const uint8_t* Data, size_t Size) -> bool
+    {
+        status = ::BCryptHashData(slot->Hashes[Index],
+                                  const_cast<PUCHAR>(Data),
+                                  static_cast<uint32_t>(Size),
+                                  0);
+        return NT_SUCCESS(status);
+    };
+
+    /* Sanity check. */
+    if ((nullptr == HashTypes) || (nullptr == Hashes))
+    {
+        return STATUS_INVALID_PARAMETER;
     }
 
-CleanUp:
-    /* Cleanup the hash object. */
-    if (FALSE != isHashHandleCreated)
+    /* Find which algorithms we need to feed. */
+    status = STATUS_SUCCESS;
+    if (!KmHelper::MultiDigest::SelectAlgorithms(HashTypesCount,
+                                                 indexAt,
+                                                 isRequested))
+    {
+        return NT_SUCCESS(status) ? STATUS_INVALID_PARAMETER
+                                  : status;
+    }
+
+    /* All pooled slots are busy - don't wait, use one of our own for this file. */
+    slot = this->AcquireSlot();
+    if (nullptr == slot)
     {
-        NTSTATUS cleanupStatus = ::BCryptDestroyHash(hashHandle);
-        XPF_DEATH_ON_FAILURE(NT_SUCCESS(cleanupStatus));
+        status = ownSlot.Chunk.Resize(FileHasher::CHUNK_SIZE);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+        slot = &ownSlot;
+    }
+
+    /* Without reusable hashes, the hash objects live only as long as this file. */
+    isPerFileSlot = (slot == &ownSlot) || !this->m_AreHashesReusable;
+    if (isPerFileSlot)
+    {
+        status = this->CreateHashes(*slot,
+                                    isRequested,
+                                    0);
+        if (!NT_SUCCESS(status))
+        {
+            goto CleanUp;
+        }
+    }
 
-        isHashHandleCreated = FALSE;
+    /* And now start hashing - the file is read once, for all requested algorithms. */
+    status = STATUS_SUCCESS;
+    if (!KmHelper::MultiDigest::HashChunks(File.FileSize(),
+                                           isRequested,
+                                           readChunk,
+                                           feedChunk,
+                                           &isDirty))
+    {
+        /* A read which returned no data. */
+        status = NT_SUCCESS(status) ? STATUS_INVALID_BUFFER_SIZE
+                                    : status;
+        goto CleanUp;
     }
 
-    /* Cleanup the algorithm provider. */
-    if (FALSE != isAlgorithmProviderOpened)
+    /* Retrieve the results. */
+    for (size_t i = 0; i < HashTypesCount; ++i)
     {
-        NTSTATUS cleanupStatus = ::BCryptCloseAlgorithmProvider(algorithmHandle,
-                                                                0);
-        XPF_DEATH_ON_FAILURE(NT_SUCCESS(cleanupStatus));
+        size_t index = 0;
+        status = FileHasher::HashTypeToIndex(HashTypes[i],
+                                             &index);
+        if (!NT_SUCCESS(status))
+        {
+            goto CleanUp;
+        }
 
-        isAlgorithmProviderOpened = FALSE;
+        status = FileHasher::FinishHash(slot->Hashes[index],
+                                        &Hashes[i]);
+        isRequested[index] = false;
+        if (!NT_SUCCESS(status))
+        {
+            goto CleanUp;
+        }
     }
 
+CleanUp:
+    if (nullptr != slot)
+    {
+        if (isPerFileSlot)
+        {
+            FileHasher::DestroyHashes(*slot);
+        }
+        else if (!NT_SUCCESS(status) && isDirty)
+        {
+            /* The pooled objects must be reset, so the next file starts from a clean state. */
+            for (size_t i = 0; i < FileHasher::ALGORITHMS_COUNT; ++i)
+            {
+                if (isRequested[i])
+                {
+                    FileHasher::ResetHash(slot->Hashes[i]);
+                }
+            }
+        }
+
+        if (slot != &ownSlot)
+        {
+            this->ReleaseSlot(slot);
+        }
+    }
     return status;
 }
+
+_Use_decl_annotations_
+NTSTATUS
+KmHelper::File::HashFile(
+    _Inout_ SysMon::File::FileObject& MappedFile,
+    _In_ _Const_ const HashType& HashType,
+    _Inout_ xpf::Buffer& Hash
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    xpf::Optional<KmHelper::File::FileHasher> hasher;
+
+    NTSTATUS status = KmHelper::File::FileHasher::Create(&hasher);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    return (*hasher).HashFile(MappedFile,
+                              &HashType,
+                              &Hash,
+                              1);
+}
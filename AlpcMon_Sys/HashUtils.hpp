@@ -16,6 +16,7 @@
 
 #include "precomp.hpp"
 #include "FileObject.hpp"
+#include "MultiDigest.hpp"
 
 namespace KmHelper
 {
@@ -39,12 +40,256 @@ enum class HashType
      *          Historically it was widely used as a cryptographic hash function; however it has been
      *          found to suffer from extensive vulnerabilities. It remains suitable for other non-cryptographic purposes.
      */
-    kMd5 = 1
+    kMd5 = 1,
+
+    /**
+     * @brief   SHA-1 produces a 160-bit digest. It is no longer considered secure against
+     *          well funded attackers, but it is still widely used to identify files.
+     */
+    kSha1 = 2,
+
+    /**
+     * @brief   SHA-256 produces a 256-bit digest. This is what threat intelligence feeds
+     *          commonly use to identify files.
+     */
+    kSha256 = 3
 };  // enum class HashType
 
+/**
+ * @brief   This class hashes files with several algorithms at once. The file is read
+ *          only once, in large chunks, and each chunk is fed to all requested digests.
+ *
+ *          The single pass itself is driven by MultiDigest.hpp.
+ *
+ *          The algorithm providers are opened once, as opening them is expensive.
+ *          A small pool of slots - each one with its own hash objects and read chunk -
+ *          lets a few worker threads hash at the same time. When all slots are busy,
+ *          the caller gets a slot of its own for that file instead of waiting.
+ *
+ *          Reusable hash objects are only supported starting with Windows 8. On older
+ *          systems the hash objects are created for every file.
+ */
+class FileHasher final
+{
+ private:
+    /**
+     * @brief  Default constructor - private as Create
+     *         method must be used to instantiate an object.
+     */
+    FileHasher(void) noexcept(true) = default;
+
+ public:
+    /**
+     * @brief   Default destructor. Releases the bcrypt objects.
+     */
+    ~FileHasher(void) noexcept(true);
+
+    /**
+     * @brief   Copy and move are deleted for this class.
+     *          They can be implemented when required.
+     */
+    XPF_CLASS_COPY_MOVE_BEHAVIOR(KmHelper::File::FileHasher, delete);
+
+    /**
+     * @brief       Creates a file hasher object. All supported algorithms are opened here.
+     *
+     * @param[out]  Hasher - On success, it will contain a properly initialized object.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    static NTSTATUS XPF_API
+    Create(
+        _Out_ xpf::Optional<KmHelper::File::FileHasher>* Hasher
+    ) noexcept(true);
+
+    /**
+     * @brief          Computes several hashes of a file in a single pass.
+     *
+     * @param[in,out]  File            - The file to be hashed.
+     * @param[in]      HashTypes       - The hashes to be computed.
+     * @param[out]     Hashes          - Will contain the resulted hashes, in the same
+     *                                   order as HashTypes.
+     * @param[in]      HashTypesCount  - The number of elements in HashTypes and Hashes.
+     *
+     * @return         A proper NTSTATUS error code.
+     *
+     * @note           It is recommended to open files from a separated system thread to avoid potential deadlocks.
+     *                 Leverage Work-Queue mechanism. Use this routine with care!
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    HashFile(
+        _Inout_ SysMon::File::FileObject& File,
+        _In_reads_(HashTypesCount) const HashType* HashTypes,
+        _Out_writes_(HashTypesCount) xpf::Buffer* Hashes,
+        _In_ size_t HashTypesCount
+    ) noexcept(true);
+
+ private:
+    /**
+     * @brief   How many algorithms are supported - md5, sha1 and sha256.
+     */
+    static constexpr size_t ALGORITHMS_COUNT = KmHelper::MultiDigest::ALGORITHMS_COUNT;
+
+    /**
+     * @brief   The state needed to hash one file.
+     */
+    struct HashingSlot
+    {
+        /**
+         * @brief   The hash objects, one per algorithm. For a pooled slot they are
+         *          reusable and kept; otherwise they are created for each file.
+         */
+        BCRYPT_HASH_HANDLE Hashes[ALGORITHMS_COUNT] = { 0 };
+
+        /**
+         * @brief   The buffer where the file is read, one chunk at a time.
+         */
+        xpf::Buffer Chunk{ SYSMON_PAGED_ALLOCATOR };
+
+        /**
+         * @brief   Whether a caller is hashing with this slot. Guarded by m_SlotsLock.
+         */
+        bool IsInUse = false;
+    };
+
+    /**
+     * @brief       Maps a hash type to the index of its bcrypt objects.
+     *
+     * @param[in]   Type   - One of the HashType values.
+     * @param[out]  Index  - The index in m_Algorithms and HashingSlot::Hashes.
+     *
+     * @return      STATUS_INVALID_PARAMETER if the hash type is not supported,
+     *              STATUS_SUCCESS otherwise.
+     */
+    _Must_inspect_result_
+    static NTSTATUS XPF_API
+    HashTypeToIndex(
+        _In_ HashType Type,
+        _Out_ size_t* Index
+    ) noexcept(true);
+
+    /**
+     * @brief       Creates the hash objects of a slot, for the requested algorithms.
+     *
+     * @param[in,out] Slot          - The slot which receives the hash objects.
+     * @param[in]     IsRequested   - Which algorithms need a hash object.
+     * @param[in]     Flags         - Either 0 or BCRYPT_HASH_REUSABLE_FLAG.
+     *
+     * @return      A proper NTSTATUS error code. On failure, the slot has no hash objects.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    CreateHashes(
+        _Inout_ HashingSlot& Slot,
+        _In_reads_(ALGORITHMS_COUNT) const bool* IsRequested,
+        _In_ ULONG Flags
+    ) noexcept(true);
+
+    /**
+     * @brief       Destroys the hash objects of a slot.
+     *
+     * @param[in,out] Slot - The slot which owns the hash objects.
+     *
+     * @return      Nothing.
+     */
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    static void XPF_API
+    DestroyHashes(
+        _Inout_ HashingSlot& Slot
+    ) noexcept(true);
+
+    /**
+     * @brief       Takes a free slot from the pool.
+     *
+     * @return      The slot, or nullptr if all slots are busy.
+     */
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    HashingSlot* XPF_API
+    AcquireSlot(
+        void
+    ) noexcept(true);
+
+    /**
+     * @brief       Gives a slot back to the pool.
+     *
+     * @param[in,out] Slot - The slot returned by AcquireSlot.
+     *
+     * @return      Nothing.
+     */
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    void XPF_API
+    ReleaseSlot(
+        _Inout_ HashingSlot* Slot
+    ) noexcept(true);
+
+    /**
+     * @brief       Finishes a hash. A reusable hash object is also reset,
+     *              so it can be used for the next file.
+     *
+     * @param[in]   HashHandle - The hash object.
+     * @param[out]  Hash       - Will contain the resulted hash.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    static NTSTATUS XPF_API
+    FinishHash(
+        _In_ BCRYPT_HASH_HANDLE HashHandle,
+        _Out_ xpf::Buffer* Hash
+    ) noexcept(true);
+
+    /**
+     * @brief       Discards the data fed to a reusable hash object,
+     *              so the next file starts from a clean state.
+     *
+     * @param[in]   HashHandle - The hash object.
+     *
+     * @return      Nothing.
+     */
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    static void XPF_API
+    ResetHash(
+        _In_ BCRYPT_HASH_HANDLE HashHandle
+    ) noexcept(true);
+
+ private:
+    /**
+     * @brief   The file is read in chunks of this size - large enough to keep
+     *          the number of read requests low even for big binaries.
+     */
+    static constexpr size_t CHUNK_SIZE = KmHelper::MultiDigest::CHUNK_SIZE;
+
+    /**
+     * @brief   How many files can be hashed at once with pooled slots.
+     *          It matches how many module jobs run at once.
+     */
+    static constexpr size_t SLOTS_COUNT = 2;
+
+    BCRYPT_ALG_HANDLE m_Algorithms[ALGORITHMS_COUNT] = { 0 };
+    bool m_AreHashesReusable = false;
+
+    xpf::Optional<xpf::ReadWriteLock> m_SlotsLock;
+    HashingSlot m_Slots[SLOTS_COUNT];
+
+    /**
+     * @brief   Default MemoryAllocator is our friend as it requires access to the private
+     *          default constructor. It is used in the Create() method to ensure that
+     *          no partially constructed objects are created but instead they will be
+     *          all fully initialized.
+     */
+    friend class xpf::MemoryAllocator;
+};  // class FileHasher
+
 /**
  * @brief          This will hash a file in the system process context.
- *                 It will first map the file in the system process.
+ *                 It creates a FileHasher for a single use. Prefer to keep
+ *                 a FileHasher around when hashing many files.
  *
  * @param[in]      MappedFile  - The file mapped in memory.
  * @param[in]      HashType    - One of the HashType values.
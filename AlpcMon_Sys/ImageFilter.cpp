@@ -200,7 +200,9 @@ ImageFilterImageLoadNotifyRoutineCallback(
     // Q - should process collector and module collector register to image load event instead?
     //     this way we'll decouple the filter from the collector.
     //
-    ModuleCollectorHandleNewModule(fullImagePath.View());
+    ModuleCollectorHandleNewModule(fullImagePath.View(),
+                                   ImageInfo->ImageBase,
+                                   ImageInfo->ImageSize);
     ProcessCollectorHandleLoadModule(HandleToUlong(ProcessId),
                                      fullImagePath.View(),
                                      ImageInfo->ImageBase,
@@ -401,7 +403,9 @@ ImageFilterGatherSystemModules(
                                                    wideModulePath);
         if (NT_SUCCESS(status))
         {
-            ModuleCollectorHandleNewModule(wideModulePath.View());
+            ModuleCollectorHandleNewModule(wideModulePath.View(),
+                                           processModules->Modules[i].ImageBase,
+                                           processModules->Modules[i].ImageSize);
             ProcessCollectorHandleLoadModule(HandleToUlong(::PsGetProcessId(PsInitialSystemProcess)),
                                              wideModulePath.View(),
                                              processModules->Modules[i].ImageBase,
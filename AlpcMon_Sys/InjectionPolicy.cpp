@@ -0,0 +1,92 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/InjectionPolicy.cpp
+ *
+ * @brief       In this file we define the policy which decides, when a process
+ *              is created, whether our dll is injected and which hooks it installs.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "precomp.hpp"
+
+#include "InjectionPolicy.hpp"
+#include "trace.hpp"
+
+/**
+ * @brief   The policy is paged. It is only used at max APC_LEVEL.
+ */
+XPF_SECTION_PAGED;
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::InjectionPolicy::Create(
+    _Out_ xpf::Optional<SysMon::InjectionPolicy>* Policy
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != Policy);
+
+    /* Preinit output. */
+    Policy->Reset();
+    Policy->Emplace();
+
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::InjectionPolicy::AddRule(
+    _In_ _Const_ const xpf::StringView<wchar_t>& Rule
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    if (this->m_Rules.Size() >= SysMon::InjectionPolicy::MAX_RULES_COUNT)
+    {
+        return STATUS_QUOTA_EXCEEDED;
+    }
+
+    /* A rule holds its suffixes inline, so it is parsed in place rather than on the stack. */
+    status = this->m_Rules.Emplace();
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    const size_t ruleIndex = this->m_Rules.Size() - 1;
+    const SysMon::InjectionPolicyRules::TextView text{ Rule.Buffer(), Rule.BufferSize() };
+    if (!SysMon::InjectionPolicyRules::ParseRule(text,
+                                                 uint32_t{ UM_KM_HOOK_SET_ALL },
+                                                 &this->m_Rules[ruleIndex]))
+    {
+        status = this->m_Rules.Erase(ruleIndex);
+        XPF_DEATH_ON_FAILURE(NT_SUCCESS(status));
+
+        return STATUS_INVALID_PARAMETER;
+    }
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+void XPF_API
+SysMon::InjectionPolicy::Evaluate(
+    _In_ _Const_ const SysMon::InjectionPolicyContext& Context,
+    _Out_ SysMon::InjectionPolicyDecision* Decision
+) const noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != Decision);
+
+    SysMon::InjectionPolicyRules::Evaluate(this->m_Rules,
+                                           this->m_Rules.Size(),
+                                           uint32_t{ UM_KM_HOOK_SET_ALL },
+                                           Context,
+                                           Decision);
+}
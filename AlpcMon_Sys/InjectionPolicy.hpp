@@ -0,0 +1,129 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/InjectionPolicy.hpp
+ *
+ * @brief       In this file we define the policy which decides, when a process
+ *              is created, whether our dll is injected and which hooks it installs.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#pragma once
+
+#include "precomp.hpp"
+
+#include "UmKmComms.hpp"
+#include "InjectionPolicyRules.hpp"
+
+
+namespace SysMon
+{
+/**
+ * @brief   The policy types are portable - see InjectionPolicyRules.hpp.
+ */
+using InjectionPolicyAction = SysMon::InjectionPolicyRules::Action;
+using InjectionPolicyContext = SysMon::InjectionPolicyRules::Context;
+using InjectionPolicyDecision = SysMon::InjectionPolicyRules::Decision;
+using InjectionPolicyRule = SysMon::InjectionPolicyRules::Rule;
+
+/**
+ * @brief   This class holds the injection policy - an ordered list of rules, read from registry.
+ *
+ *          A rule is a string of ';' separated fields. The first one is the action - "inject",
+ *          optionally followed by ":" and the hook set, or "skip". The others are conditions:
+ *              path=<suffix>, parent=<suffix>, session=<n>, minil=<rid>, maxil=<rid>, minsigning=<level>
+ *          For example "skip;session=0" or "inject:0x2;path=\svchost.exe;maxil=0x2000".
+ *
+ *          The first rule whose conditions all hold decides. Protected and minimal processes
+ *          are never injected, regardless of the rules. When no rule matches, the process
+ *          is injected with all hooks - as it was before the policy existed.
+ *
+ *          Parsing and matching live in InjectionPolicyRules.hpp, this only keeps the rules.
+ */
+class InjectionPolicy final
+{
+ private:
+    /**
+     * @brief  Default constructor - private as Create
+     *         method must be used to instantiate an object.
+     */
+    InjectionPolicy(void) noexcept(true) = default;
+
+ public:
+    /**
+     * @brief   Default destructor.
+     */
+    ~InjectionPolicy(void) noexcept(true) = default;
+
+    /**
+     * @brief   Copy and move are deleted for this class.
+     *          They can be implemented when required.
+     */
+    XPF_CLASS_COPY_MOVE_BEHAVIOR(SysMon::InjectionPolicy, delete);
+
+    /**
+     * @brief       Creates an empty policy - every process which can be injected, is injected.
+     *
+     * @param[out]  Policy - On success, it will contain a properly initialized object.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    static NTSTATUS XPF_API
+    Create(
+        _Out_ xpf::Optional<SysMon::InjectionPolicy>* Policy
+    ) noexcept(true);
+
+    /**
+     * @brief       Parses a rule and appends it to the policy.
+     *
+     * @param[in]   Rule - The rule, in the format described above.
+     *
+     * @return      STATUS_INVALID_PARAMETER if the rule is malformed,
+     *              or a proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    AddRule(
+        _In_ _Const_ const xpf::StringView<wchar_t>& Rule
+    ) noexcept(true);
+
+    /**
+     * @brief       Decides what is done with a process. It only looks at the context,
+     *              so it never blocks.
+     *
+     * @param[in]   Context     - What is known about the process.
+     * @param[out]  Decision    - What is done with it.
+     *
+     * @return      Nothing.
+     */
+    _IRQL_requires_max_(APC_LEVEL)
+    void XPF_API
+    Evaluate(
+        _In_ _Const_ const SysMon::InjectionPolicyContext& Context,
+        _Out_ SysMon::InjectionPolicyDecision* Decision
+    ) const noexcept(true);
+
+    /**
+     * @brief   The maximum number of rules.
+     */
+    static constexpr size_t MAX_RULES_COUNT = 64;
+
+ private:
+    xpf::Vector<SysMon::InjectionPolicyRule> m_Rules{ SYSMON_PAGED_ALLOCATOR };
+
+    /**
+     * @brief   Default MemoryAllocator is our friend as it requires access to the private
+     *          default constructor. It is used in the Create() method to ensure that
+     *          no partially constructed objects are created but instead they will be
+     *          all fully initialized.
+     */
+    friend class xpf::MemoryAllocator;
+};  // class InjectionPolicy
+};  // namespace SysMon
@@ -0,0 +1,647 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/InjectionPolicyRules.hpp
+ *
+ * @brief       In this file we define how the injection policy rules are parsed
+ *              and evaluated. SysMon::InjectionPolicy keeps the rules, this decides.
+ *
+ * @note        This header is portable on purpose - it does not depend on the kernel
+ *              or on xpf, so it is also built and tested on linux. See the Tests folder.
+ *              Nothing here allocates - a rule has fixed size buffers for its suffixes.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+namespace SysMon
+{
+namespace InjectionPolicyRules
+{
+/**
+ * @brief   What is done with a newly created process.
+ */
+enum class Action : uint32_t
+{
+    /**
+     * @brief   Our dll is injected and installs the hooks from the decision.
+     */
+    kInject = 0,
+
+    /**
+     * @brief   The process is left alone.
+     */
+    kSkip = 1,
+};
+
+/**
+ * @brief   A non owning view over a string which is not necessarily null terminated.
+ */
+struct TextView
+{
+    const wchar_t* Buffer = nullptr;
+    size_t Length = 0;
+};
+
+/**
+ * @brief   What is known about a process when it is created. It is gathered by the caller,
+ *          so evaluating the policy does not touch the process or any kernel object.
+ */
+struct Context
+{
+    /**
+     * @brief   The path of the process image. Empty for minimal processes.
+     */
+    SysMon::InjectionPolicyRules::TextView ImagePath;
+
+    /**
+     * @brief   The path of the parent image. Empty if the parent is not known.
+     */
+    SysMon::InjectionPolicyRules::TextView ParentImagePath;
+
+    /**
+     * @brief   The session in which the process runs.
+     */
+    uint32_t SessionId = 0;
+
+    /**
+     * @brief   The rid of the integrity level of the process token (SECURITY_MANDATORY_*_RID).
+     *          0 (untrusted) if it could not be retrieved.
+     */
+    uint32_t IntegrityLevel = 0;
+
+    /**
+     * @brief   The signature level of the process image (SE_SIGNING_LEVEL_*).
+     *          0 (unchecked) if it could not be retrieved.
+     */
+    uint32_t SigningLevel = 0;
+
+    /**
+     * @brief   True if the process is protected or protected light.
+     */
+    bool IsProtected = false;
+
+    /**
+     * @brief   True if the process has no image - nothing can be loaded in it.
+     */
+    bool IsMinimal = false;
+};
+
+/**
+ * @brief   The outcome of evaluating the policy for a process.
+ */
+struct Decision
+{
+    /**
+     * @brief   Whether the process is injected or not.
+     */
+    SysMon::InjectionPolicyRules::Action Action = SysMon::InjectionPolicyRules::Action::kInject;
+
+    /**
+     * @brief   The hooks installed by our dll - UM_KM_HOOK_SET_* flags.
+     *          Meaningful only when the process is injected.
+     */
+    uint32_t HookSet = 0;
+
+    /**
+     * @brief   The index of the rule which matched, plus one. 0 if no rule matched.
+     */
+    size_t RuleNumber = 0;
+};
+
+/**
+ * @brief   The conditions a rule can check - see Rule.
+ */
+static constexpr uint32_t CONDITION_PATH = 0x00000001;
+static constexpr uint32_t CONDITION_PARENT = 0x00000002;
+static constexpr uint32_t CONDITION_SESSION = 0x00000004;
+static constexpr uint32_t CONDITION_MIN_INTEGRITY = 0x00000008;
+static constexpr uint32_t CONDITION_MAX_INTEGRITY = 0x00000010;
+static constexpr uint32_t CONDITION_MIN_SIGNING = 0x00000020;
+
+/**
+ * @brief   The longest path suffix a rule can hold, in characters.
+ */
+static constexpr size_t MAX_SUFFIX_LENGTH = 260;
+
+/**
+ * @brief   A rule of the policy. A condition is checked only if its flag is set in Conditions.
+ */
+struct Rule
+{
+    /**
+     * @brief   The decision taken when all conditions hold.
+     */
+    SysMon::InjectionPolicyRules::Decision Decision;
+
+    /**
+     * @brief   Which of the conditions below are checked - CONDITION_* flags.
+     */
+    uint32_t Conditions = 0;
+
+    /**
+     * @brief   The end of the image path - for example "\svchost.exe".
+     */
+    wchar_t ImagePathSuffix[MAX_SUFFIX_LENGTH] = { 0 };
+    size_t ImagePathSuffixLength = 0;
+
+    /**
+     * @brief   The end of the parent image path.
+     */
+    wchar_t ParentPathSuffix[MAX_SUFFIX_LENGTH] = { 0 };
+    size_t ParentPathSuffixLength = 0;
+
+    /**
+     * @brief   The session of the process.
+     */
+    uint32_t SessionId = 0;
+
+    /**
+     * @brief   The integrity level of the process must be at least this one.
+     */
+    uint32_t MinIntegrityLevel = 0;
+
+    /**
+     * @brief   The integrity level of the process must be at most this one.
+     */
+    uint32_t MaxIntegrityLevel = 0;
+
+    /**
+     * @brief   The signature level of the process image must be at least this one.
+     */
+    uint32_t MinSigningLevel = 0;
+};
+
+/**
+ * @brief       Lower cases a character. Only ascii letters are folded - it is enough
+ *              for the keywords, and paths differ in case mostly in ascii letters.
+ *
+ * @param[in]   Character - The character.
+ *
+ * @return      The lower case character.
+ */
+inline wchar_t
+FoldCase(
+    wchar_t Character
+) noexcept(true)
+{
+    return (Character >= L'A' && Character <= L'Z') ? static_cast<wchar_t>(Character - L'A' + L'a')
+                                                    : Character;
+}
+
+/**
+ * @brief       Compares two strings of the same length, case insensitive.
+ *
+ * @param[in]   Left    - The first string.
+ * @param[in]   Right   - The second string.
+ * @param[in]   Length  - The number of characters to compare.
+ *
+ * @return      true if the strings are equal, false otherwise.
+ */
+inline bool
+EqualsNoCase(
+    const wchar_t* Left,
+    const wchar_t* Right,
+    size_t Length
+) noexcept(true)
+{
+    for (size_t i = 0; i < Length; ++i)
+    {
+        if (FoldCase(Left[i]) != FoldCase(Right[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief       Gets the length of a null terminated string.
+ *
+ * @param[in]   Text - The string.
+ *
+ * @return      The number of characters, without the terminator.
+ */
+inline size_t
+TextLength(
+    const wchar_t* Text
+) noexcept(true)
+{
+    size_t length = 0;
+    while (L'\0' != Text[length])
+    {
+        length++;
+    }
+    return length;
+}
+
+/**
+ * @brief       Checks whether a text is a keyword, case insensitive.
+ *
+ * @param[in]   Text    - The text.
+ * @param[in]   Keyword - A null terminated keyword.
+ *
+ * @return      true if the text is the keyword, false otherwise.
+ */
+inline bool
+IsKeyword(
+    const SysMon::InjectionPolicyRules::TextView& Text,
+    const wchar_t* Keyword
+) noexcept(true)
+{
+    const size_t keywordLength = TextLength(Keyword);
+    return (Text.Length == keywordLength) && EqualsNoCase(Text.Buffer, Keyword, keywordLength);
+}
+
+/**
+ * @brief       Checks whether a text ends with a suffix, case insensitive.
+ *
+ * @param[in]   Text            - The text.
+ * @param[in]   Suffix          - The suffix.
+ * @param[in]   SuffixLength    - The number of characters in the suffix.
+ *
+ * @return      true if the text ends with the suffix, false otherwise.
+ */
+inline bool
+EndsWithNoCase(
+    const SysMon::InjectionPolicyRules::TextView& Text,
+    const wchar_t* Suffix,
+    size_t SuffixLength
+) noexcept(true)
+{
+    if (SuffixLength > Text.Length)
+    {
+        return false;
+    }
+    return EqualsNoCase(&Text.Buffer[Text.Length - SuffixLength], Suffix, SuffixLength);
+}
+
+/**
+ * @brief       Parses a decimal or "0x" prefixed hexadecimal number.
+ *
+ * @param[in]   Text    - The number.
+ * @param[out]  Number  - The parsed value.
+ *
+ * @return      false if the text is not a number which fits in 32 bits, true otherwise.
+ */
+inline bool
+ParseNumber(
+    const SysMon::InjectionPolicyRules::TextView& Text,
+    uint32_t* Number
+) noexcept(true)
+{
+    const wchar_t* text = Text.Buffer;
+    size_t textLength = Text.Length;
+    uint64_t base = 10;
+    uint64_t value = 0;
+
+    /* Preinit output. */
+    *Number = 0;
+
+    if (textLength >= 2 && L'0' == text[0] && L'x' == FoldCase(text[1]))
+    {
+        base = 16;
+        text += 2;
+        textLength -= 2;
+    }
+    if (0 == textLength)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < textLength; ++i)
+    {
+        const wchar_t character = FoldCase(text[i]);
+        uint64_t digit = base;
+
+        if (character >= L'0' && character <= L'9')
+        {
+            digit = static_cast<uint64_t>(character - L'0');
+        }
+        else if (character >= L'a' && character <= L'f')
+        {
+            digit = static_cast<uint64_t>(character - L'a') + 10;
+        }
+        if (digit >= base)
+        {
+            return false;
+        }
+
+        value = value * base + digit;
+        if (value > 0xFFFFFFFF)
+        {
+            return false;
+        }
+    }
+
+    *Number = static_cast<uint32_t>(value);
+    return true;
+}
+
+/**
+ * @brief       Copies a path suffix in a rule.
+ *
+ * @param[in]   Value           - The suffix.
+ * @param[out]  Suffix          - The buffer of the rule, MAX_SUFFIX_LENGTH characters.
+ * @param[out]  SuffixLength    - The number of characters copied.
+ *
+ * @return      false if the suffix is too long, true otherwise.
+ */
+inline bool
+CopySuffix(
+    const SysMon::InjectionPolicyRules::TextView& Value,
+    wchar_t* Suffix,
+    size_t* SuffixLength
+) noexcept(true)
+{
+    if (Value.Length > MAX_SUFFIX_LENGTH)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < Value.Length; ++i)
+    {
+        Suffix[i] = Value.Buffer[i];
+    }
+    *SuffixLength = Value.Length;
+    return true;
+}
+
+/**
+ * @brief       Parses a field of a rule - the action or one of the conditions.
+ *
+ * @param[in]   Field       - The field, without the ';' separator.
+ * @param[in]   IsAction    - True for the first field of the rule.
+ * @param[in]   AllHookSets - All the hooks our dll knows about.
+ * @param[in,out] Rule      - The rule being parsed.
+ *
+ * @return      false if the field is malformed, true otherwise.
+ */
+inline bool
+ParseField(
+    const SysMon::InjectionPolicyRules::TextView& Field,
+    bool IsAction,
+    uint32_t AllHookSets,
+    SysMon::InjectionPolicyRules::Rule* Rule
+) noexcept(true)
+{
+    //
+    // The action - "skip", "inject" or "inject:<hook set>".
+    //
+    if (IsAction)
+    {
+        static constexpr wchar_t INJECT_PREFIX[] = L"inject:";
+        const size_t prefixLength = TextLength(INJECT_PREFIX);
+
+        if (IsKeyword(Field, L"skip"))
+        {
+            Rule->Decision.Action = SysMon::InjectionPolicyRules::Action::kSkip;
+            return true;
+        }
+        if (IsKeyword(Field, L"inject"))
+        {
+            Rule->Decision.Action = SysMon::InjectionPolicyRules::Action::kInject;
+            Rule->Decision.HookSet = AllHookSets;
+            return true;
+        }
+        if (Field.Length < prefixLength || !EqualsNoCase(Field.Buffer, INJECT_PREFIX, prefixLength))
+        {
+            return false;
+        }
+
+        uint32_t hookSet = 0;
+        const SysMon::InjectionPolicyRules::TextView hookSetText{ &Field.Buffer[prefixLength], Field.Length - prefixLength };
+        if (!ParseNumber(hookSetText, &hookSet))
+        {
+            return false;
+        }
+
+        /* Only the hooks our dll knows about. */
+        if (0 == hookSet || 0 != (hookSet & ~AllHookSets))
+        {
+            return false;
+        }
+
+        Rule->Decision.Action = SysMon::InjectionPolicyRules::Action::kInject;
+        Rule->Decision.HookSet = hookSet;
+        return true;
+    }
+
+    //
+    // A condition - "key=value".
+    //
+    size_t separator = 0;
+    while (separator < Field.Length && L'=' != Field.Buffer[separator])
+    {
+        separator++;
+    }
+    if (separator == 0 || separator + 1 >= Field.Length)
+    {
+        return false;
+    }
+
+    const SysMon::InjectionPolicyRules::TextView key{ Field.Buffer, separator };
+    const SysMon::InjectionPolicyRules::TextView value{ &Field.Buffer[separator + 1], Field.Length - separator - 1 };
+
+    if (IsKeyword(key, L"path"))
+    {
+        Rule->Conditions |= CONDITION_PATH;
+        return CopySuffix(value, Rule->ImagePathSuffix, &Rule->ImagePathSuffixLength);
+    }
+    if (IsKeyword(key, L"parent"))
+    {
+        Rule->Conditions |= CONDITION_PARENT;
+        return CopySuffix(value, Rule->ParentPathSuffix, &Rule->ParentPathSuffixLength);
+    }
+    if (IsKeyword(key, L"session"))
+    {
+        Rule->Conditions |= CONDITION_SESSION;
+        return ParseNumber(value, &Rule->SessionId);
+    }
+    if (IsKeyword(key, L"minil"))
+    {
+        Rule->Conditions |= CONDITION_MIN_INTEGRITY;
+        return ParseNumber(value, &Rule->MinIntegrityLevel);
+    }
+    if (IsKeyword(key, L"maxil"))
+    {
+        Rule->Conditions |= CONDITION_MAX_INTEGRITY;
+        return ParseNumber(value, &Rule->MaxIntegrityLevel);
+    }
+    if (IsKeyword(key, L"minsigning"))
+    {
+        Rule->Conditions |= CONDITION_MIN_SIGNING;
+        return ParseNumber(value, &Rule->MinSigningLevel);
+    }
+
+    /* An unknown condition - better to refuse the rule than to apply it partially. */
+    return false;
+}
+
+/**
+ * @brief       Parses a rule. It is a string of ';' separated fields. The first one is the
+ *              action - "inject", optionally followed by ":" and the hook set, or "skip".
+ *              The others are conditions:
+ *                  path=<suffix>, parent=<suffix>, session=<n>, minil=<rid>, maxil=<rid>, minsigning=<level>
+ *              For example "skip;session=0" or "inject:0x2;path=\svchost.exe;maxil=0x2000".
+ *
+ * @param[in]   Text        - The rule.
+ * @param[in]   AllHookSets - All the hooks our dll knows about.
+ * @param[out]  Rule        - The parsed rule.
+ *
+ * @return      false if the rule is malformed, true otherwise.
+ */
+inline bool
+ParseRule(
+    const SysMon::InjectionPolicyRules::TextView& Text,
+    uint32_t AllHookSets,
+    SysMon::InjectionPolicyRules::Rule* Rule
+) noexcept(true)
+{
+    size_t fieldIndex = 0;
+    size_t start = 0;
+
+    /* Preinit output. */
+    *Rule = SysMon::InjectionPolicyRules::Rule{};
+    Rule->Decision.HookSet = AllHookSets;
+
+    /* Walk the ';' separated fields - the first one is the action. */
+    while (start <= Text.Length)
+    {
+        size_t end = start;
+        while (end < Text.Length && L';' != Text.Buffer[end])
+        {
+            end++;
+        }
+
+        /* Empty conditions are tolerated - a trailing ';' for example. The action is not. */
+        if (end > start || 0 == fieldIndex)
+        {
+            const SysMon::InjectionPolicyRules::TextView field{ &Text.Buffer[start], end - start };
+            if (!ParseField(field, 0 == fieldIndex, AllHookSets, Rule))
+            {
+                return false;
+            }
+        }
+
+        fieldIndex++;
+        start = end + 1;
+    }
+    return true;
+}
+
+/**
+ * @brief       Checks whether all the conditions of a rule hold.
+ *
+ * @param[in]   Rule    - The rule.
+ * @param[in]   Context - What is known about the process.
+ *
+ * @return      true if the rule matches the process, false otherwise.
+ */
+inline bool
+RuleMatches(
+    const SysMon::InjectionPolicyRules::Rule& Rule,
+    const SysMon::InjectionPolicyRules::Context& Context
+) noexcept(true)
+{
+    if (0 != (Rule.Conditions & CONDITION_PATH))
+    {
+        if (!EndsWithNoCase(Context.ImagePath, Rule.ImagePathSuffix, Rule.ImagePathSuffixLength))
+        {
+            return false;
+        }
+    }
+    if (0 != (Rule.Conditions & CONDITION_PARENT))
+    {
+        /* An unknown parent does not match any suffix. */
+        if (0 == Context.ParentImagePath.Length ||
+            !EndsWithNoCase(Context.ParentImagePath, Rule.ParentPathSuffix, Rule.ParentPathSuffixLength))
+        {
+            return false;
+        }
+    }
+    if (0 != (Rule.Conditions & CONDITION_SESSION))
+    {
+        if (Context.SessionId != Rule.SessionId)
+        {
+            return false;
+        }
+    }
+    if (0 != (Rule.Conditions & CONDITION_MIN_INTEGRITY))
+    {
+        if (Context.IntegrityLevel < Rule.MinIntegrityLevel)
+        {
+            return false;
+        }
+    }
+    if (0 != (Rule.Conditions & CONDITION_MAX_INTEGRITY))
+    {
+        if (Context.IntegrityLevel > Rule.MaxIntegrityLevel)
+        {
+            return false;
+        }
+    }
+    if (0 != (Rule.Conditions & CONDITION_MIN_SIGNING))
+    {
+        if (Context.SigningLevel < Rule.MinSigningLevel)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief       Decides what is done with a process. The first rule whose conditions all hold
+ *              decides. Protected and minimal processes are never injected, regardless of the
+ *              rules. When no rule matches, the process is injected with all hooks.
+ *
+ * @param[in]   Rules       - The rules, in order - anything indexable with [].
+ * @param[in]   RulesCount  - The number of rules.
+ * @param[in]   AllHookSets - All the hooks our dll knows about.
+ * @param[in]   Context     - What is known about the process.
+ * @param[out]  Decision    - What is done with it.
+ *
+ * @return      Nothing.
+ */
+template <class RuleList>
+inline void
+Evaluate(
+    const RuleList& Rules,
+    size_t RulesCount,
+    uint32_t AllHookSets,
+    const SysMon::InjectionPolicyRules::Context& Context,
+    SysMon::InjectionPolicyRules::Decision* Decision
+) noexcept(true)
+{
+    /* Preinit output - inject with all hooks. */
+    *Decision = SysMon::InjectionPolicyRules::Decision{};
+    Decision->HookSet = AllHookSets;
+
+    /* Our dll can not be loaded in these - no rule can change that. */
+    if (Context.IsProtected || Context.IsMinimal)
+    {
+        Decision->Action = SysMon::InjectionPolicyRules::Action::kSkip;
+        return;
+    }
+
+    /* The first rule which matches decides. */
+    for (size_t i = 0; i < RulesCount; ++i)
+    {
+        if (RuleMatches(Rules[i], Context))
+        {
+            *Decision = Rules[i].Decision;
+            Decision->RuleNumber = i + 1;
+            return;
+        }
+    }
+}
+};  // namespace InjectionPolicyRules
+};  // namespace SysMon
@@ -0,0 +1,177 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/InjectionSection.cpp
+ *
+ * @brief       In this file we define the section holding the path of the
+ *              injected dll. It is created once and mapped read-only in
+ *              every process we inject in.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "precomp.hpp"
+
+#include "KmHelper.hpp"
+
+#include "InjectionSection.hpp"
+#include "trace.hpp"
+
+#ifndef SEC_NO_CHANGE
+    /**
+     * @brief   The protection of a view mapped with this flag can not be changed,
+     *          nor can the view be unmapped, from user mode.
+     */
+    #define SEC_NO_CHANGE   0x00400000
+#endif  // SEC_NO_CHANGE
+
+/**
+ * @brief   The section is paged. It is only used at PASSIVE_LEVEL.
+ */
+XPF_SECTION_PAGED;
+
+SysMon::InjectionSection::~InjectionSection(
+    void
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    if (NULL != this->m_SectionHandle)
+    {
+        NTSTATUS closeStatus = ::ZwClose(this->m_SectionHandle);
+        XPF_DEATH_ON_FAILURE(NT_SUCCESS(closeStatus));
+
+        this->m_SectionHandle = NULL;
+    }
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::InjectionSection::Create(
+    _In_ _Const_ const xpf::StringView<wchar_t>& DllPath,
+    _Out_ xpf::Optional<SysMon::InjectionSection>* Section
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != Section);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    OBJECT_ATTRIBUTES objectAttributes = { 0 };
+    LARGE_INTEGER maximumSize = { 0 };
+    UNICODE_STRING dllPath = { 0 };
+    PVOID baseAddress = nullptr;
+    SIZE_T viewSize = 0;
+    const wchar_t nullTerminator = L'\0';
+
+    /* Preinit output. */
+    Section->Reset();
+    Section->Emplace();
+
+    SysMon::InjectionSection& section = (*(*Section));
+
+    status = KmHelper::HelperViewToUnicodeString(DllPath,
+                                                 dllPath);
+    if (!NT_SUCCESS(status))
+    {
+        Section->Reset();
+        return status;
+    }
+
+    /* We only want to write the path. */
+    section.m_SectionSize = static_cast<size_t>(dllPath.Length) + sizeof(nullTerminator);
+    maximumSize.QuadPart = section.m_SectionSize;
+
+    /* The handle is a kernel one, so it can be used from the context of any process. */
+    InitializeObjectAttributes(&objectAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+    status = ::ZwCreateSection(&section.m_SectionHandle,
+                               SECTION_MAP_READ | SECTION_MAP_WRITE | SECTION_QUERY,
+                               &objectAttributes,
+                               &maximumSize,
+                               PAGE_READWRITE,
+                               SEC_COMMIT,
+                               NULL);
+    if (!NT_SUCCESS(status))
+    {
+        section.m_SectionHandle = NULL;
+        Section->Reset();
+        return status;
+    }
+
+    /* Write the path through a temporary writable view. */
+    viewSize = section.m_SectionSize;
+    status = ::ZwMapViewOfSection(section.m_SectionHandle,
+                                  ZwCurrentProcess(),
+                                  &baseAddress,
+                                  0,
+                                  viewSize,
+                                  NULL,
+                                  &viewSize,
+                                  SECTION_INHERIT::ViewUnmap,
+                                  0,
+                                  PAGE_READWRITE);
+    if (!NT_SUCCESS(status))
+    {
+        Section->Reset();
+        return status;
+    }
+
+    status = KmHelper::HelperSafeWriteBuffer(static_cast<uint8_t*>(baseAddress),
+                                             dllPath.Buffer,
+                                             dllPath.Length);
+    if (NT_SUCCESS(status))
+    {
+        status = KmHelper::HelperSafeWriteBuffer(static_cast<uint8_t*>(baseAddress) + dllPath.Length,
+                                                 &nullTerminator,
+                                                 sizeof(nullTerminator));
+    }
+
+    NTSTATUS unmapStatus = ::ZwUnmapViewOfSection(ZwCurrentProcess(),
+                                                  baseAddress);
+    XPF_DEATH_ON_FAILURE(NT_SUCCESS(unmapStatus));
+
+    if (!NT_SUCCESS(status))
+    {
+        Section->Reset();
+        return status;
+    }
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::InjectionSection::MapInCurrentProcess(
+    _Out_ void** BaseAddress
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != BaseAddress);
+
+    PVOID baseAddress = nullptr;
+    SIZE_T viewSize = this->m_SectionSize;
+
+    /* Preinit output. */
+    *BaseAddress = nullptr;
+
+    /* The section is writable - a plain read-only view could be reprotected as read-write */
+    /* from user mode, and the path seen by all the other processes rewritten. */
+    const NTSTATUS status = ::ZwMapViewOfSection(this->m_SectionHandle,
+                                                 ZwCurrentProcess(),
+                                                 &baseAddress,
+                                                 0,
+                                                 viewSize,
+                                                 NULL,
+                                                 &viewSize,
+                                                 SECTION_INHERIT::ViewUnmap,
+                                                 SEC_NO_CHANGE,
+                                                 PAGE_READONLY);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    *BaseAddress = baseAddress;
+    return STATUS_SUCCESS;
+}
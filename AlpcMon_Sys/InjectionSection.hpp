@@ -0,0 +1,98 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/InjectionSection.hpp
+ *
+ * @brief       In this file we define the section holding the path of the
+ *              injected dll. It is created once and mapped read-only in
+ *              every process we inject in.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#pragma once
+
+#include "precomp.hpp"
+
+
+namespace SysMon
+{
+/**
+ * @brief   The payload of the injection is only the path of the dll, which depends only on
+ *          the architecture of the process. So instead of a new section for every process,
+ *          one section per architecture is created and filled when the plugin starts.
+ *          The processes get read-only views of it - the only per-process cost is the view.
+ *
+ *          The section itself is writable, so the views are mapped with SEC_NO_CHANGE.
+ *          Otherwise a process could raise the protection of its view back to the one of
+ *          the section, and change the dll path loaded in all the processes injected after it.
+ */
+class InjectionSection final
+{
+ private:
+    /**
+     * @brief  Default constructor - private as Create
+     *         method must be used to instantiate an object.
+     */
+    InjectionSection(void) noexcept(true) = default;
+
+ public:
+    /**
+     * @brief   Destructor. Closes the section - the views already mapped stay valid.
+     */
+    ~InjectionSection(void) noexcept(true);
+
+    /**
+     * @brief   Copy and move are deleted for this class.
+     *          They can be implemented when required.
+     */
+    XPF_CLASS_COPY_MOVE_BEHAVIOR(SysMon::InjectionSection, delete);
+
+    /**
+     * @brief       Creates the section and writes the null terminated dll path in it.
+     *
+     * @param[in]   DllPath - The full DOS path of the dll to be injected.
+     * @param[out]  Section - On success, it will contain a properly initialized object.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    static NTSTATUS XPF_API
+    Create(
+        _In_ _Const_ const xpf::StringView<wchar_t>& DllPath,
+        _Out_ xpf::Optional<SysMon::InjectionSection>* Section
+    ) noexcept(true);
+
+    /**
+     * @brief       Maps a read-only view of the section in the current process.
+     *              The protection of the view can not be changed from user mode.
+     *
+     * @param[out]  BaseAddress - The address of the view. It must be unmapped
+     *                            with ZwUnmapViewOfSection - from kernel mode.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    MapInCurrentProcess(
+        _Out_ void** BaseAddress
+    ) noexcept(true);
+
+ private:
+    HANDLE m_SectionHandle = NULL;
+    size_t m_SectionSize = 0;
+
+    /**
+     * @brief   Default MemoryAllocator is our friend as it requires access to the private
+     *          default constructor. It is used in the Create() method to ensure that
+     *          no partially constructed objects are created but instead they will be
+     *          all fully initialized.
+     */
+    friend class xpf::MemoryAllocator;
+};  // class InjectionSection
+};  // namespace SysMon
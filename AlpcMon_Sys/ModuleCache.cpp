@@ -0,0 +1,800 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/ModuleCache.cpp
+ *
+ * @brief       A persistent cache of module hashes and symbols.
+ *              It survives reboots, so the expensive work of hashing
+ *              and extracting symbols is not repeated on every boot.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "precomp.hpp"
+
+#include "FileObject.hpp"
+#include "HashUtils.hpp"
+#include "ModuleCacheFormat.hpp"
+#include "PdbHelper.hpp"
+
+#include "ModuleCache.hpp"
+#include "trace.hpp"
+
+
+/**
+ * @brief   The cache is only accessed from worker threads.
+ *          All code is paged.
+ */
+XPF_SECTION_PAGED;
+
+/**
+ * @brief   The on-disk structures are packed, so the layout does not depend on the compiler.
+ *          The file header and the symbols are described in ModuleCacheFormat.hpp - only the
+ *          entry header is here, as it holds kernel types.
+ */
+#pragma pack(push, 1)
+
+/**
+ * @brief   This is found at the beginning of each entry.
+ *          It is followed by HashSize bytes of hash and by SymbolsCount
+ *          symbols, each one being a SysMon::ModuleCacheFormat::SymbolHeader
+ *          followed by the name of the symbol (not null terminated).
+ */
+typedef struct _MODULE_CACHE_ENTRY_HEADER
+{
+    /**
+     * @brief   The key of this module.
+     */
+    SysMon::ModuleCacheKey          Key;
+
+    /**
+     * @brief   The identity of the file for which the hash was computed.
+     */
+    SysMon::File::FileIdentity      File;
+
+    /**
+     * @brief   One of the KmHelper::File::HashType values.
+     */
+    uint32_t                        HashType;
+
+    /**
+     * @brief   The size of the hash, in bytes. Zero if no hash was computed.
+     */
+    uint32_t                        HashSize;
+
+    /**
+     * @brief   The number of symbols.
+     */
+    uint32_t                        SymbolsCount;
+
+    /**
+     * @brief   The number of bytes following this header which belong to this entry.
+     */
+    uint32_t                        DataSize;
+} MODULE_CACHE_ENTRY_HEADER;
+
+#pragma pack(pop)
+
+/**
+ * @brief       Parses a cache entry. The entry was validated when it was stored,
+ *              but it is checked again - it is cheap compared to the copies.
+ *
+ * @param[in]   Entry           - The serialized entry.
+ * @param[out]  ModuleHash      - Receives the hash.
+ * @param[out]  ModuleSymbols   - Receives the symbols.
+ *
+ * @return      STATUS_FILE_CORRUPT_ERROR if the entry is not valid,
+ *              or a proper NTSTATUS error code.
+ */
+_Must_inspect_result_
+static NTSTATUS XPF_API
+ModuleCacheParseEntry(
+    _In_ _Const_ const xpf::Buffer& Entry,
+    _Out_ xpf::Buffer* ModuleHash,
+    _Out_ xpf::Vector<xpf::pdb::SymbolInformation>* ModuleSymbols
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    /* Set only when a callback fails - otherwise a failed parse means a corrupted entry. */
+    NTSTATUS status = STATUS_SUCCESS;
+
+    auto onHash = [&](const void* Hash, size_t HashSize) -> bool
+                  {
+                      status = ModuleHash->Resize(HashSize);
+                      if (!NT_SUCCESS(status))
+                      {
+                          return false;
+                      }
+                      xpf::ApiCopyMemory(ModuleHash->GetBuffer(),
+                                         Hash,
+                                         HashSize);
+                      return true;
+                  };
+    auto onSymbol = [&](const SysMon::ModuleCacheFormat::SymbolView& Symbol) -> bool
+                    {
+                        xpf::pdb::SymbolInformation symbol;
+                        xpf::StringView<char> name{ Symbol.Name,
+                                                    Symbol.NameLength };
+
+                        symbol.SymbolRVA = Symbol.Rva;
+                        status = symbol.SymbolName.Append(name);
+                        if (!NT_SUCCESS(status))
+                        {
+                            return false;
+                        }
+                        status = ModuleSymbols->Emplace(xpf::Move(symbol));
+                        return NT_SUCCESS(status);
+                    };
+
+    if (!SysMon::ModuleCacheFormat::ParseEntry<MODULE_CACHE_ENTRY_HEADER>(Entry.GetBuffer(),
+                                                                          Entry.GetSize(),
+                                                                          onHash,
+                                                                          onSymbol))
+    {
+        return NT_SUCCESS(status) ? STATUS_FILE_CORRUPT_ERROR
+                                  : status;
+    }
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @brief       Serializes a cache entry.
+ *
+ * @param[in]   Key             - The key of the module.
+ * @param[in]   File            - The identity of the file on disk.
+ * @param[in]   ModuleHash      - The hash of the module. May be empty.
+ * @param[in]   ModuleHashType  - The type of the hash.
+ * @param[in]   ModuleSymbols   - The symbols of the module. May be empty.
+ * @param[out]  Entry           - The serialized entry.
+ *
+ * @return      A proper NTSTATUS error code.
+ */
+_Must_inspect_result_
+static NTSTATUS XPF_API
+ModuleCacheSerializeEntry(
+    _In_ _Const_ const SysMon::ModuleCacheKey& Key,
+    _In_ _Const_ const SysMon::File::FileIdentity& File,
+    _In_ _Const_ const xpf::Buffer& ModuleHash,
+    _In_ KmHelper::File::HashType ModuleHashType,
+    _In_ _Const_ const xpf::Vector<xpf::pdb::SymbolInformation>& ModuleSymbols,
+    _Out_ xpf::Buffer* Entry
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    MODULE_CACHE_ENTRY_HEADER header = { 0 };
+    size_t entrySize = 0;
+
+    auto symbolAt = [&](size_t Index) -> SysMon::ModuleCacheFormat::SymbolView
+                    {
+                        const xpf::StringView<char> name = ModuleSymbols[Index].SymbolName.View();
+                        SysMon::ModuleCacheFormat::SymbolView symbol;
+
+                        symbol.Rva = static_cast<uint32_t>(ModuleSymbols[Index].SymbolRVA);
+                        symbol.Name = name.Buffer();
+                        symbol.NameLength = name.BufferSize();
+                        return symbol;
+                    };
+
+    /* First compute the size, so we allocate only once. */
+    if (!SysMon::ModuleCacheFormat::ComputeEntrySize<MODULE_CACHE_ENTRY_HEADER>(ModuleHash.GetSize(),
+                                                                                ModuleSymbols.Size(),
+                                                                                symbolAt,
+                                                                                &entrySize))
+    {
+        return STATUS_FILE_TOO_LARGE;
+    }
+    status = Entry->Resize(entrySize);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    /* The sizes and counts are filled by the writer. */
+    header.Key = Key;
+    header.File = File;
+    header.HashType = static_cast<uint32_t>(ModuleHashType);
+
+    if (!SysMon::ModuleCacheFormat::WriteEntry(header,
+                                               ModuleHash.GetBuffer(),
+                                               ModuleHash.GetSize(),
+                                               ModuleSymbols.Size(),
+                                               symbolAt,
+                                               Entry->GetBuffer(),
+                                               Entry->GetSize()))
+    {
+        return STATUS_INVALID_BUFFER_SIZE;
+    }
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @brief       Checks whether two keys are equal.
+ *
+ * @param[in]   Left  - The first key.
+ * @param[in]   Right - The second key.
+ *
+ * @return      true if the keys are equal, false otherwise.
+ */
+static bool XPF_API
+ModuleCacheKeyEquals(
+    _In_ _Const_ const SysMon::ModuleCacheKey& Left,
+    _In_ _Const_ const SysMon::ModuleCacheKey& Right
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    return (Left.TimeDateStamp == Right.TimeDateStamp) &&
+           (Left.SizeOfImage == Right.SizeOfImage) &&
+           (Left.PdbAge == Right.PdbAge) &&
+           (sizeof(Left.PdbGuid) == ::RtlCompareMemory(&Left.PdbGuid, &Right.PdbGuid, sizeof(Left.PdbGuid)));
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::ModuleCache::Create(
+    _In_ _Const_ const xpf::StringView<wchar_t>& CacheFilePath,
+    _Out_ xpf::Optional<SysMon::ModuleCache>* Cache
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != Cache);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    /* Preinit output. */
+    Cache->Reset();
+
+    Cache->Emplace();
+    SysMon::ModuleCache& cache = (*(*Cache));
+
+    status = cache.m_CacheFilePath.Append(CacheFilePath);
+    if (!NT_SUCCESS(status))
+    {
+        Cache->Reset();
+        return status;
+    }
+
+    /* The cache is written next to the file and renamed over it, so a torn write never corrupts it. */
+    status = cache.m_TemporaryFilePath.Append(CacheFilePath);
+    if (!NT_SUCCESS(status))
+    {
+        Cache->Reset();
+        return status;
+    }
+    status = cache.m_TemporaryFilePath.Append(L".tmp");
+    if (!NT_SUCCESS(status))
+    {
+        Cache->Reset();
+        return status;
+    }
+
+    status = xpf::ReadWriteLock::Create(&cache.m_CacheLock);
+    if (!NT_SUCCESS(status))
+    {
+        Cache->Reset();
+        return status;
+    }
+    status = xpf::ReadWriteLock::Create(&cache.m_FlushLock);
+    if (!NT_SUCCESS(status))
+    {
+        Cache->Reset();
+        return status;
+    }
+
+    for (size_t i = 0; i < SysMon::ModuleCache::CACHE_BUCKETS_COUNT; ++i)
+    {
+        status = cache.m_Buckets.Emplace(xpf::Vector<SysMon::ModuleCacheEntry>{ SYSMON_PAGED_ALLOCATOR });
+        if (!NT_SUCCESS(status))
+        {
+            Cache->Reset();
+            return status;
+        }
+    }
+
+    /* The file is read on first use - we don't want to do I/O this early. */
+    return STATUS_SUCCESS;
+}
+
+SysMon::ModuleCache::~ModuleCache(
+    void
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    /* Best effort - persist what we gathered. */
+    if (this->m_CacheLock.HasValue() && this->m_FlushLock.HasValue() && !this->m_Buckets.IsEmpty())
+    {
+        const NTSTATUS status = this->Flush();
+        if (!NT_SUCCESS(status))
+        {
+            SysMonLogWarning("Could not persist the module cache %!STATUS!",
+                             status);
+        }
+    }
+}
+
+_Use_decl_annotations_
+SysMon::ModuleCacheKey XPF_API
+SysMon::ModuleCache::KeyFromIdentity(
+    _In_ _Const_ const PdbHelper::ImageIdentity& Identity
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    SysMon::ModuleCacheKey key;
+
+    key.TimeDateStamp = Identity.TimeDateStamp;
+    key.SizeOfImage = Identity.SizeOfImage;
+    key.PdbGuid = Identity.PdbGuid;
+    key.PdbAge = Identity.PdbAge;
+
+    return key;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::ModuleCache::Find(
+    _In_ _Const_ const ModuleCacheKey& Key,
+    _In_ _Const_ const SysMon::File::FileIdentity& File,
+    _Out_ xpf::Buffer* ModuleHash,
+    _Out_ KmHelper::File::HashType* ModuleHashType,
+    _Out_ xpf::Vector<xpf::pdb::SymbolInformation>* ModuleSymbols
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    /* Preinit output. */
+    ModuleHash->Clear();
+    *ModuleHashType = KmHelper::File::HashType::kMd5;
+    ModuleSymbols->Clear();
+
+    this->EnsureLoaded();
+
+    xpf::SharedLockGuard guard{ *this->m_CacheLock };
+
+    xpf::Vector<SysMon::ModuleCacheEntry>& bucket = this->Bucket(Key);
+    const xpf::Optional<size_t> index = SysMon::ModuleCache::FindEntryIndex(bucket,
+                                                                           Key);
+    if (!index.HasValue())
+    {
+        return STATUS_NOT_FOUND;
+    }
+
+    /* Other lookups may race on this - an approximate order is enough for eviction. */
+    SysMon::ModuleCacheEntry& entry = bucket[*index];
+    entry.LastUse = xpf::ApiAtomicIncrement(&this->m_UseCounter);
+
+    const MODULE_CACHE_ENTRY_HEADER* header = static_cast<const MODULE_CACHE_ENTRY_HEADER*>(entry.Data.GetBuffer());
+
+    status = ModuleCacheParseEntry(entry.Data,
+                                   ModuleHash,
+                                   ModuleSymbols);
+    if (!NT_SUCCESS(status))
+    {
+        ModuleHash->Clear();
+        ModuleSymbols->Clear();
+        return status;
+    }
+    *ModuleHashType = static_cast<KmHelper::File::HashType>(header->HashType);
+
+    /* The hash is trusted only if the file was not modified in the meantime. */
+    if ((header->File.VolumeSerialNumber != File.VolumeSerialNumber) ||
+        (header->File.FileId != File.FileId) ||
+        (header->File.Usn != File.Usn) ||
+        (header->File.LastWriteTime != File.LastWriteTime))
+    {
+        ModuleHash->Clear();
+    }
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::ModuleCache::Insert(
+    _In_ _Const_ const ModuleCacheKey& Key,
+    _In_ _Const_ const SysMon::File::FileIdentity& File,
+    _In_ _Const_ const xpf::Buffer& ModuleHash,
+    _In_ KmHelper::File::HashType ModuleHashType,
+    _In_ _Const_ const xpf::Vector<xpf::pdb::SymbolInformation>& ModuleSymbols
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    SysMon::ModuleCacheEntry entry;
+    bool shouldFlush = false;
+
+    /* Serialize outside the lock. */
+    status = ModuleCacheSerializeEntry(Key,
+                                       File,
+                                       ModuleHash,
+                                       ModuleHashType,
+                                       ModuleSymbols,
+                                       &entry.Data);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    this->EnsureLoaded();
+
+    /* Scope the guard as flushing will acquire it again. */
+    {
+        xpf::ExclusiveLockGuard guard{ *this->m_CacheLock };
+
+        status = this->StoreEntry(xpf::Move(entry));
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        this->m_DirtyEntries++;
+        shouldFlush = (this->m_DirtyEntries >= ModuleCache::FLUSH_THRESHOLD);
+    }
+
+    /* Don't wait for unload to persist the work - the machine might be powered off. */
+    if (shouldFlush)
+    {
+        status = this->Flush();
+        if (!NT_SUCCESS(status))
+        {
+            SysMonLogWarning("Could not persist the module cache %!STATUS!",
+                             status);
+        }
+    }
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::ModuleCache::Flush(
+    void
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    SysMon::ModuleCacheFormat::FileHeader header = { 0 };
+    size_t payloadSize = 0;
+    uint32_t flushedEntries = 0;
+
+    xpf::Buffer content{ SYSMON_PAGED_ALLOCATOR };
+    xpf::StreamWriter writer{ content };
+    xpf::Optional<SysMon::File::FileObject> cacheFile;
+
+    /* Two flushes would race on the temporary file. */
+    xpf::ExclusiveLockGuard flushGuard{ *this->m_FlushLock };
+
+    /* Take a snapshot - the lookups can go on while it is copied and written. */
+    {
+        xpf::SharedLockGuard guard{ *this->m_CacheLock };
+        if (0 == this->m_DirtyEntries)
+        {
+            return STATUS_SUCCESS;
+        }
+        flushedEntries = this->m_DirtyEntries;
+
+        /* The cache is bounded, so this is bounded as well. */
+        payloadSize = this->m_CacheSize;
+        status = content.Resize(sizeof(header) + payloadSize);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        /* The header is filled once the entries are written. */
+        header.EntriesCount = static_cast<uint32_t>(this->m_EntriesCount);
+
+        if (!writer.WriteBytes(sizeof(header), reinterpret_cast<const uint8_t*>(&header)))
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        for (size_t i = 0; i < this->m_Buckets.Size(); ++i)
+        {
+            const xpf::Vector<SysMon::ModuleCacheEntry>& bucket = this->m_Buckets[i];
+            for (size_t j = 0; j < bucket.Size(); ++j)
+            {
+                if (!writer.WriteBytes(bucket[j].Data.GetSize(), static_cast<const uint8_t*>(bucket[j].Data.GetBuffer())))
+                {
+                    return STATUS_INSUFFICIENT_RESOURCES;
+                }
+            }
+        }
+    }
+
+    header = SysMon::ModuleCacheFormat::SealFile(content.GetBuffer(),
+                                                 content.GetSize(),
+                                                 header.EntriesCount);
+
+    /* Write a temporary file and rename it over the cache - a crash midway leaves the previous cache intact. */
+    status = SysMon::File::FileObject::Create(this->m_TemporaryFilePath.View(),
+                                              XPF_FILE_ACCESS_WRITE | XPF_FILE_ACCESS_DELETE,
+                                              &cacheFile);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    status = (*cacheFile).Write(content.GetBuffer(),
+                                content.GetSize());
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    /* The temporary file might be left over by a previous flush - drop its trailing bytes. */
+    status = (*cacheFile).Truncate(content.GetSize());
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    status = (*cacheFile).Rename(this->m_CacheFilePath.View());
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    SysMonLogInfo("Persisted %d module cache entries (%I64u bytes)",
+                  header.EntriesCount,
+                  header.PayloadSize);
+
+    /* The entries inserted while we were writing stay dirty. */
+    {
+        xpf::ExclusiveLockGuard guard{ *this->m_CacheLock };
+        this->m_DirtyEntries = (this->m_DirtyEntries > flushedEntries) ? this->m_DirtyEntries - flushedEntries
+                                                                       : 0;
+    }
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+void XPF_API
+SysMon::ModuleCache::EnsureLoaded(
+    void
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    xpf::Optional<SysMon::File::FileObject> cacheFile;
+    xpf::Buffer content{ SYSMON_PAGED_ALLOCATOR };
+
+    /* Fast path - already loaded. */
+    {
+        xpf::SharedLockGuard guard{ *this->m_CacheLock };
+        if (this->m_IsLoaded)
+        {
+            return;
+        }
+    }
+
+    xpf::ExclusiveLockGuard guard{ *this->m_CacheLock };
+    if (this->m_IsLoaded)
+    {
+        return;
+    }
+
+    /* Whatever happens, we try only once. */
+    this->m_IsLoaded = true;
+
+    status = SysMon::File::FileObject::Create(this->m_CacheFilePath.View(),
+                                              XPF_FILE_ACCESS_READ,
+                                              &cacheFile);
+    if (!NT_SUCCESS(status))
+    {
+        /* First run - nothing to load. */
+        return;
+    }
+    if ((*cacheFile).FileSize() > xpf::NumericLimits<uint32_t>::MaxValue())
+    {
+        status = STATUS_FILE_TOO_LARGE;
+        goto CleanUp;
+    }
+    status = content.Resize(static_cast<size_t>((*cacheFile).FileSize()));
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+    status = (*cacheFile).Read(0, &content);
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+    status = this->Deserialize(content);
+
+CleanUp:
+    if (!NT_SUCCESS(status))
+    {
+        /* Start from scratch - the file will be rewritten on the next flush. */
+        SysMonLogWarning("Discarding the module cache %!STATUS!",
+                         status);
+        this->ClearEntries();
+    }
+    else
+    {
+        SysMonLogInfo("Loaded %d module cache entries",
+                      static_cast<uint32_t>(this->m_EntriesCount));
+    }
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::ModuleCache::StoreEntry(
+    _Inout_ SysMon::ModuleCacheEntry&& Entry
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    const MODULE_CACHE_ENTRY_HEADER* header = static_cast<const MODULE_CACHE_ENTRY_HEADER*>(Entry.Data.GetBuffer());
+    const ModuleCacheKey key = header->Key;
+    const size_t entrySize = Entry.Data.GetSize();
+
+    /* A single entry over the limit would evict everything else and still not fit. */
+    if (entrySize > SysMon::ModuleCache::MAX_CACHE_SIZE)
+    {
+        return STATUS_FILE_TOO_LARGE;
+    }
+
+    xpf::Vector<SysMon::ModuleCacheEntry>& bucket = this->Bucket(key);
+    const xpf::Optional<size_t> index = SysMon::ModuleCache::FindEntryIndex(bucket,
+                                                                           key);
+    if (index.HasValue())
+    {
+        const size_t previousSize = bucket[*index].Data.GetSize();
+        status = bucket.Erase(*index);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+        this->m_CacheSize -= previousSize;
+        this->m_EntriesCount--;
+    }
+
+    Entry.LastUse = xpf::ApiAtomicIncrement(&this->m_UseCounter);
+    status = bucket.Emplace(xpf::Move(Entry));
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    this->m_CacheSize += entrySize;
+    this->m_EntriesCount++;
+
+    /* Evict the least recently used entries until we are back within the limits. */
+    while ((this->m_EntriesCount > SysMon::ModuleCache::MAX_ENTRIES_COUNT) ||
+           (this->m_CacheSize > SysMon::ModuleCache::MAX_CACHE_SIZE))
+    {
+        size_t oldestBucket = 0;
+        size_t oldestIndex = 0;
+        uint64_t oldestUse = xpf::NumericLimits<uint64_t>::MaxValue();
+
+        for (size_t i = 0; i < this->m_Buckets.Size(); ++i)
+        {
+            for (size_t j = 0; j < this->m_Buckets[i].Size(); ++j)
+            {
+                if (this->m_Buckets[i][j].LastUse < oldestUse)
+                {
+                    oldestUse = this->m_Buckets[i][j].LastUse;
+                    oldestBucket = i;
+                    oldestIndex = j;
+                }
+            }
+        }
+
+        const size_t oldestSize = this->m_Buckets[oldestBucket][oldestIndex].Data.GetSize();
+        status = this->m_Buckets[oldestBucket].Erase(oldestIndex);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+        this->m_CacheSize -= oldestSize;
+        this->m_EntriesCount--;
+    }
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+void XPF_API
+SysMon::ModuleCache::ClearEntries(
+    void
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    for (size_t i = 0; i < this->m_Buckets.Size(); ++i)
+    {
+        this->m_Buckets[i].Clear();
+    }
+    this->m_EntriesCount = 0;
+    this->m_CacheSize = 0;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::ModuleCache::Deserialize(
+    _In_ _Const_ const xpf::Buffer& Content
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    /* Set only when storing fails - otherwise a failed parse means a corrupted file. */
+    NTSTATUS status = STATUS_SUCCESS;
+
+    auto onEntry = [&](const void* Data, size_t DataSize) -> bool
+                   {
+                       SysMon::ModuleCacheEntry entry;
+
+                       /* Each entry is kept serialized - it is parsed only when it is looked up. */
+                       status = entry.Data.Resize(DataSize);
+                       if (!NT_SUCCESS(status))
+                       {
+                           return false;
+                       }
+                       xpf::ApiCopyMemory(entry.Data.GetBuffer(),
+                                          Data,
+                                          DataSize);
+
+                       /* The limits apply to the file as well - it might come from an older build. */
+                       status = this->StoreEntry(xpf::Move(entry));
+                       return NT_SUCCESS(status);
+                   };
+
+    /* The whole entries are validated now, so lookups can trust them. */
+    if (!SysMon::ModuleCacheFormat::ParseFile<MODULE_CACHE_ENTRY_HEADER>(Content.GetBuffer(),
+                                                                         Content.GetSize(),
+                                                                         onEntry))
+    {
+        return NT_SUCCESS(status) ? STATUS_FILE_CORRUPT_ERROR
+                                  : status;
+    }
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+xpf::Vector<SysMon::ModuleCacheEntry>& XPF_API
+SysMon::ModuleCache::Bucket(
+    _In_ _Const_ const ModuleCacheKey& Key
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    /* The guid is already random - mix in the image fields for modules without a pdb. */
+    uint32_t hash = static_cast<uint32_t>(Key.PdbGuid.Data1);
+    hash = (hash * 31) ^ ((static_cast<uint32_t>(Key.PdbGuid.Data2) << 16) | Key.PdbGuid.Data3);
+    hash = (hash * 31) ^ Key.PdbAge;
+    hash = (hash * 31) ^ Key.TimeDateStamp;
+    hash = (hash * 31) ^ Key.SizeOfImage;
+
+    return this->m_Buckets[hash % SysMon::ModuleCache::CACHE_BUCKETS_COUNT];
+}
+
+_Use_decl_annotations_
+xpf::Optional<size_t> XPF_API
+SysMon::ModuleCache::FindEntryIndex(
+    _In_ _Const_ const xpf::Vector<SysMon::ModuleCacheEntry>& Bucket,
+    _In_ _Const_ const ModuleCacheKey& Key
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    xpf::Optional<size_t> index;
+
+    for (size_t i = 0; i < Bucket.Size(); ++i)
+    {
+        const MODULE_CACHE_ENTRY_HEADER* header = static_cast<const MODULE_CACHE_ENTRY_HEADER*>(Bucket[i].Data.GetBuffer());
+        if (ModuleCacheKeyEquals(header->Key, Key))
+        {
+            index.Emplace(i);
+            break;
+        }
+    }
+    return index;
+}
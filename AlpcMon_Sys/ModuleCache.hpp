@@ -0,0 +1,321 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/ModuleCache.hpp
+ *
+ * @brief       A persistent cache of module hashes and symbols.
+ *              It survives reboots, so the expensive work of hashing
+ *              and extracting symbols is not repeated on every boot.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#pragma once
+
+#include "precomp.hpp"
+
+#include "FileObject.hpp"
+#include "HashUtils.hpp"
+#include "PdbHelper.hpp"
+
+
+namespace SysMon
+{
+/**
+ * @brief   Identifies a specific build of a module. The symbols
+ *          are the same for all files having the same key.
+ */
+struct ModuleCacheKey
+{
+    /**
+     * @brief   The TimeDateStamp from the image file header.
+     */
+    uint32_t TimeDateStamp = 0;
+
+    /**
+     * @brief   The SizeOfImage from the image optional header.
+     */
+    uint32_t SizeOfImage = 0;
+
+    /**
+     * @brief   The guid of the program database.
+     */
+    uuid_t PdbGuid = { 0 };
+
+    /**
+     * @brief   The age of the program database.
+     */
+    uint32_t PdbAge = 0;
+};
+
+/**
+ * @brief   A cached module. It is kept serialized - it is parsed only when it is looked up.
+ */
+struct ModuleCacheEntry
+{
+    /**
+     * @brief   The serialized entry, exactly as it is stored in the cache file.
+     */
+    xpf::Buffer Data{ SYSMON_PAGED_ALLOCATOR };
+
+    /**
+     * @brief   The value of the use counter when the entry was last inserted or found.
+     *          The least recently used entries are evicted first.
+     */
+    volatile uint64_t LastUse = 0;
+};
+
+/**
+ * @brief   This class keeps the hashes and symbols of the modules in a file on disk.
+ *          The file is loaded on the first lookup and it is written back
+ *          from time to time and when the cache is destroyed.
+ *
+ *          The symbols are valid for every file with the same ModuleCacheKey.
+ *          The hash is valid only as long as the file was not changed, so it
+ *          is validated against the file identity (file id and usn).
+ *
+ *          The cache is bounded both in entries and in bytes - when it grows past
+ *          either limit, the least recently used entries are evicted.
+ */
+class ModuleCache final
+{
+ private:
+    /**
+     * @brief  Default constructor - private as Create
+     *         method must be used to instantiate an object.
+     */
+    ModuleCache(void) noexcept(true) = default;
+
+ public:
+    /**
+     * @brief   Default destructor. Writes the cache back to disk if needed.
+     */
+    ~ModuleCache(void) noexcept(true);
+
+    /**
+     * @brief   Copy and move are deleted for this class.
+     *          They can be implemented when required.
+     */
+    XPF_CLASS_COPY_MOVE_BEHAVIOR(SysMon::ModuleCache, delete);
+
+    /**
+     * @brief       Creates a module cache object. The backing file is not read here.
+     *
+     * @param[in]   CacheFilePath - The file where the cache is persisted.
+     * @param[out]  Cache         - On success, it will contain a properly initialized object.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    static NTSTATUS XPF_API
+    Create(
+        _In_ _Const_ const xpf::StringView<wchar_t>& CacheFilePath,
+        _Out_ xpf::Optional<SysMon::ModuleCache>* Cache
+    ) noexcept(true);
+
+    /**
+     * @brief       Builds the cache key for an image.
+     *
+     * @param[in]   Identity - The image identity.
+     *
+     * @return      The cache key.
+     */
+    static ModuleCacheKey XPF_API
+    KeyFromIdentity(
+        _In_ _Const_ const PdbHelper::ImageIdentity& Identity
+    ) noexcept(true);
+
+    /**
+     * @brief       Looks up a module in the cache.
+     *
+     * @param[in]   Key            - The key of the module.
+     * @param[in]   File           - The identity of the file on disk.
+     * @param[out]  ModuleHash     - The cached hash. Empty if it was not computed,
+     *                               or if the file changed since it was computed.
+     * @param[out]  ModuleHashType - The type of the cached hash.
+     * @param[out]  ModuleSymbols  - The cached symbols. May be empty.
+     *
+     * @return      STATUS_NOT_FOUND if the module is not cached,
+     *              or a proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    Find(
+        _In_ _Const_ const ModuleCacheKey& Key,
+        _In_ _Const_ const SysMon::File::FileIdentity& File,
+        _Out_ xpf::Buffer* ModuleHash,
+        _Out_ KmHelper::File::HashType* ModuleHashType,
+        _Out_ xpf::Vector<xpf::pdb::SymbolInformation>* ModuleSymbols
+    ) noexcept(true);
+
+    /**
+     * @brief       Inserts or replaces a module in the cache.
+     *
+     * @param[in]   Key            - The key of the module.
+     * @param[in]   File           - The identity of the file on disk.
+     * @param[in]   ModuleHash     - The hash of the module. May be empty.
+     * @param[in]   ModuleHashType - The type of the hash.
+     * @param[in]   ModuleSymbols  - The symbols of the module. May be empty.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    Insert(
+        _In_ _Const_ const ModuleCacheKey& Key,
+        _In_ _Const_ const SysMon::File::FileIdentity& File,
+        _In_ _Const_ const xpf::Buffer& ModuleHash,
+        _In_ KmHelper::File::HashType ModuleHashType,
+        _In_ _Const_ const xpf::Vector<xpf::pdb::SymbolInformation>& ModuleSymbols
+    ) noexcept(true);
+
+    /**
+     * @brief       Writes the cache to disk if it was changed since the last flush.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    Flush(
+        void
+    ) noexcept(true);
+
+ private:
+    /**
+     * @brief       Reads the cache from disk on first use.
+     *              A missing or corrupted file results in an empty cache.
+     *
+     * @return      Nothing.
+     */
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    void XPF_API
+    EnsureLoaded(
+        void
+    ) noexcept(true);
+
+    /**
+     * @brief       Stores an entry, replacing the one with the same key, and evicts
+     *              the least recently used entries while the cache is over its limits.
+     *              The m_CacheLock must be held exclusively by the caller.
+     *
+     * @param[in,out] Entry - The entry to be stored. It is moved into the cache.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    StoreEntry(
+        _Inout_ SysMon::ModuleCacheEntry&& Entry
+    ) noexcept(true);
+
+    /**
+     * @brief       Drops all entries. The m_CacheLock must be held exclusively by the caller.
+     *
+     * @return      Nothing.
+     */
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    void XPF_API
+    ClearEntries(
+        void
+    ) noexcept(true);
+
+    /**
+     * @brief       Parses the content of the cache file. The m_CacheLock must be
+     *              held exclusively by the caller.
+     *
+     * @param[in]   Content - The content of the cache file.
+     *
+     * @return      STATUS_FILE_CORRUPT_ERROR if the content is not valid,
+     *              or a proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    Deserialize(
+        _In_ _Const_ const xpf::Buffer& Content
+    ) noexcept(true);
+
+    /**
+     * @brief       Selects the bucket of a module.
+     *
+     * @param[in]   Key - The key of the module.
+     *
+     * @return      The bucket where the module belongs.
+     */
+    xpf::Vector<SysMon::ModuleCacheEntry>& XPF_API
+    Bucket(
+        _In_ _Const_ const ModuleCacheKey& Key
+    ) noexcept(true);
+
+    /**
+     * @brief       Looks up the index of the entry having the given key in its bucket.
+     *              The m_CacheLock must be held by the caller.
+     *
+     * @param[in]   Bucket - The bucket returned by Bucket() for this key.
+     * @param[in]   Key    - The key of the module.
+     *
+     * @return      Empty if the key is not found, the index in the bucket otherwise.
+     */
+    static xpf::Optional<size_t> XPF_API
+    FindEntryIndex(
+        _In_ _Const_ const xpf::Vector<SysMon::ModuleCacheEntry>& Bucket,
+        _In_ _Const_ const ModuleCacheKey& Key
+    ) noexcept(true);
+
+ private:
+    /**
+     * @brief   After this many inserts the cache is written to disk.
+     */
+    static constexpr uint32_t FLUSH_THRESHOLD = 64;
+
+    /**
+     * @brief   The number of buckets. The keys are spread by their pdb guid.
+     */
+    static constexpr size_t CACHE_BUCKETS_COUNT = 127;
+
+    /**
+     * @brief   At most this many modules are cached.
+     */
+    static constexpr size_t MAX_ENTRIES_COUNT = 4096;
+
+    /**
+     * @brief   At most this many bytes of serialized entries are kept in memory.
+     *          It is also the bound of the file on disk.
+     */
+    static constexpr size_t MAX_CACHE_SIZE = 16 * 1024 * 1024;
+
+    xpf::String<wchar_t> m_CacheFilePath{ SYSMON_PAGED_ALLOCATOR };
+    xpf::String<wchar_t> m_TemporaryFilePath{ SYSMON_PAGED_ALLOCATOR };
+
+    xpf::Optional<xpf::ReadWriteLock> m_CacheLock;
+    xpf::Vector<xpf::Vector<SysMon::ModuleCacheEntry>> m_Buckets{ SYSMON_PAGED_ALLOCATOR };
+    size_t m_EntriesCount = 0;
+    size_t m_CacheSize = 0;
+    volatile uint64_t m_UseCounter = 0;
+
+    /**
+     * @brief   Serializes the flushes, as they share the temporary file.
+     *          It is never acquired while m_CacheLock is held.
+     */
+    xpf::Optional<xpf::ReadWriteLock> m_FlushLock;
+
+    bool m_IsLoaded = false;
+    uint32_t m_DirtyEntries = 0;
+
+    /**
+     * @brief   Default MemoryAllocator is our friend as it requires access to the private
+     *          default constructor. It is used in the Create() method to ensure that
+     *          no partially constructed objects are created but instead they will be
+     *          all fully initialized.
+     */
+    friend class xpf::MemoryAllocator;
+};  // class ModuleCache
+};  // namespace SysMon
@@ -0,0 +1,452 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/ModuleCacheFormat.hpp
+ *
+ * @brief       In this file we define the on-disk format of the module cache -
+ *              how the file and its entries are written and validated.
+ *              SysMon::ModuleCache keeps the entries, this decides whether they can be trusted.
+ *
+ * @note        This header is portable on purpose - it does not depend on the kernel
+ *              or on xpf, so it is also built and tested on linux. See the Tests folder.
+ *              Nothing here allocates - the caller owns the buffers.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+
+namespace SysMon
+{
+namespace ModuleCacheFormat
+{
+/**
+ * @brief   The on-disk structures are packed, so the layout does not depend on the compiler.
+ */
+#pragma pack(push, 1)
+
+/**
+ * @brief   This is found at the beginning of the cache file.
+ *          It is followed by EntriesCount entries.
+ */
+struct FileHeader
+{
+    /**
+     * @brief   Must be FILE_MAGIC.
+     */
+    uint32_t    Magic;
+
+    /**
+     * @brief   Must be FILE_VERSION.
+     */
+    uint32_t    Version;
+
+    /**
+     * @brief   The number of entries following this header.
+     */
+    uint32_t    EntriesCount;
+
+    /**
+     * @brief   FNV-1a checksum of the payload.
+     */
+    uint32_t    Checksum;
+
+    /**
+     * @brief   The number of bytes following this header.
+     *          The file might be larger - the extra bytes are ignored.
+     */
+    uint64_t    PayloadSize;
+};
+
+/**
+ * @brief   Describes a symbol. It is followed by NameLength characters (not null terminated).
+ */
+struct SymbolHeader
+{
+    /**
+     * @brief   The RVA of the symbol.
+     */
+    uint32_t    Rva;
+
+    /**
+     * @brief   The length of the name, in characters.
+     */
+    uint32_t    NameLength;
+};
+
+#pragma pack(pop)
+
+/**
+ * @brief   Identifies the file format - 'CMMS'.
+ */
+static constexpr uint32_t FILE_MAGIC = 0x434D4D53;
+
+/**
+ * @brief   Must be bumped whenever the layout changes.
+ */
+static constexpr uint32_t FILE_VERSION = 1;
+
+/**
+ * @brief   A non owning view over a symbol - what is written for it in an entry.
+ */
+struct SymbolView
+{
+    uint32_t Rva = 0;
+    const char* Name = nullptr;
+    size_t NameLength = 0;
+};
+
+/**
+ * @brief       Computes the FNV-1a checksum over a buffer.
+ *              It is not meant to be secure, only to detect a corrupted file.
+ *
+ * @param[in]   Buffer      - The buffer to be checksummed.
+ * @param[in]   BufferSize  - The size of the buffer, in bytes.
+ *
+ * @return      The checksum.
+ */
+inline uint32_t
+Checksum(
+    const void* Buffer,
+    size_t BufferSize
+) noexcept(true)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(Buffer);
+    uint32_t checksum = 0x811C9DC5;
+
+    for (size_t i = 0; i < BufferSize; ++i)
+    {
+        checksum = checksum ^ bytes[i];
+        checksum = checksum * 0x01000193;
+    }
+    return checksum;
+}
+
+/**
+ * @brief       Computes the size of a serialized entry.
+ *
+ * @param[in]   HashSize        - The size of the hash, in bytes. May be 0.
+ * @param[in]   SymbolsCount    - The number of symbols.
+ * @param[in]   SymbolAt        - Returns the symbol at an index: SymbolView SymbolAt(size_t Index).
+ * @param[out]  EntrySize       - The size of the entry, header included.
+ *
+ * @return      false if the entry would not fit the 32 bit sizes of the format, true otherwise.
+ *
+ * @note        EntryHeader is the packed header of an entry. It must have the
+ *              HashType, HashSize, SymbolsCount and DataSize fields.
+ */
+template <class EntryHeader, class SymbolAccessor>
+inline bool
+ComputeEntrySize(
+    size_t HashSize,
+    size_t SymbolsCount,
+    const SymbolAccessor& SymbolAt,
+    size_t* EntrySize
+) noexcept(true)
+{
+    /* Everything after the header must fit DataSize. */
+    const uint64_t maxDataSize = uint64_t{ UINT32_MAX } - sizeof(EntryHeader);
+    uint64_t dataSize = HashSize;
+
+    *EntrySize = 0;
+
+    if (dataSize > maxDataSize || SymbolsCount > UINT32_MAX)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < SymbolsCount; ++i)
+    {
+        const SysMon::ModuleCacheFormat::SymbolView symbol = SymbolAt(i);
+        if (symbol.NameLength > maxDataSize)
+        {
+            return false;
+        }
+
+        /* Both terms are bounded by maxDataSize, so this does not overflow. */
+        dataSize += sizeof(SysMon::ModuleCacheFormat::SymbolHeader) + uint64_t{ symbol.NameLength };
+        if (dataSize > maxDataSize)
+        {
+            return false;
+        }
+    }
+
+    *EntrySize = sizeof(EntryHeader) + static_cast<size_t>(dataSize);
+    return true;
+}
+
+/**
+ * @brief       Serializes an entry in a buffer sized with ComputeEntrySize.
+ *
+ * @param[in]   Header          - The header of the entry, with the fields identifying the module
+ *                                already filled. The sizes and counts are filled here.
+ * @param[in]   Hash            - The hash of the module. May be null if HashSize is 0.
+ * @param[in]   HashSize        - The size of the hash, in bytes.
+ * @param[in]   SymbolsCount    - The number of symbols.
+ * @param[in]   SymbolAt        - Returns the symbol at an index: SymbolView SymbolAt(size_t Index).
+ * @param[out]  Entry           - Receives the entry.
+ * @param[in]   EntrySize       - The size of the Entry buffer, in bytes.
+ *
+ * @return      false if the entry does not fit the buffer exactly, true otherwise.
+ */
+template <class EntryHeader, class SymbolAccessor>
+inline bool
+WriteEntry(
+    EntryHeader Header,
+    const void* Hash,
+    size_t HashSize,
+    size_t SymbolsCount,
+    const SymbolAccessor& SymbolAt,
+    void* Entry,
+    size_t EntrySize
+) noexcept(true)
+{
+    size_t expectedSize = 0;
+    uint8_t* bytes = static_cast<uint8_t*>(Entry);
+
+    if (!SysMon::ModuleCacheFormat::ComputeEntrySize<EntryHeader>(HashSize, SymbolsCount, SymbolAt, &expectedSize) ||
+        expectedSize != EntrySize)
+    {
+        return false;
+    }
+
+    Header.HashSize = static_cast<uint32_t>(HashSize);
+    Header.SymbolsCount = static_cast<uint32_t>(SymbolsCount);
+    Header.DataSize = static_cast<uint32_t>(EntrySize - sizeof(Header));
+
+    ::memcpy(bytes, &Header, sizeof(Header));
+    size_t offset = sizeof(Header);
+
+    if (0 != HashSize)
+    {
+        ::memcpy(bytes + offset, Hash, HashSize);
+        offset += HashSize;
+    }
+    for (size_t i = 0; i < SymbolsCount; ++i)
+    {
+        const SysMon::ModuleCacheFormat::SymbolView symbol = SymbolAt(i);
+        SysMon::ModuleCacheFormat::SymbolHeader symbolHeader = { 0 };
+
+        symbolHeader.Rva = symbol.Rva;
+        symbolHeader.NameLength = static_cast<uint32_t>(symbol.NameLength);
+
+        ::memcpy(bytes + offset, &symbolHeader, sizeof(symbolHeader));
+        offset += sizeof(symbolHeader);
+
+        if (0 != symbol.NameLength)
+        {
+            ::memcpy(bytes + offset, symbol.Name, symbol.NameLength);
+            offset += symbol.NameLength;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief       Parses an entry. Every size is checked against the entry before it is used.
+ *
+ * @param[in]   Entry       - The serialized entry.
+ * @param[in]   EntrySize   - The size of the entry, in bytes.
+ * @param[in]   OnHash      - Called with the hash, if any: bool OnHash(const void* Hash, size_t HashSize).
+ * @param[in]   OnSymbol    - Called for each symbol, in order: bool OnSymbol(const SymbolView& Symbol).
+ *                            The name points inside the entry.
+ *
+ * @return      false if the entry is not valid or if a callback returned false, true otherwise.
+ *
+ * @note        To only validate an entry, pass callbacks which return true.
+ */
+template <class EntryHeader, class HashCallback, class SymbolCallback>
+inline bool
+ParseEntry(
+    const void* Entry,
+    size_t EntrySize,
+    HashCallback& OnHash,
+    SymbolCallback& OnSymbol
+) noexcept(true)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(Entry);
+    EntryHeader header;
+    size_t offset = sizeof(header);
+
+    if (EntrySize < sizeof(header))
+    {
+        return false;
+    }
+    ::memcpy(&header, bytes, sizeof(header));
+    if (EntrySize - sizeof(header) != header.DataSize)
+    {
+        return false;
+    }
+
+    /* The hash comes first. */
+    if (header.HashSize > EntrySize - offset)
+    {
+        return false;
+    }
+    if (0 != header.HashSize && !OnHash(bytes + offset, size_t{ header.HashSize }))
+    {
+        return false;
+    }
+    offset += header.HashSize;
+
+    /* Then the symbols - they are stored sorted by rva. */
+    for (uint32_t i = 0; i < header.SymbolsCount; ++i)
+    {
+        SysMon::ModuleCacheFormat::SymbolHeader symbolHeader = { 0 };
+        SysMon::ModuleCacheFormat::SymbolView symbol;
+
+        if (sizeof(symbolHeader) > EntrySize - offset)
+        {
+            return false;
+        }
+        ::memcpy(&symbolHeader, bytes + offset, sizeof(symbolHeader));
+        offset += sizeof(symbolHeader);
+
+        if (symbolHeader.NameLength > EntrySize - offset)
+        {
+            return false;
+        }
+        symbol.Rva = symbolHeader.Rva;
+        symbol.Name = reinterpret_cast<const char*>(bytes + offset);
+        symbol.NameLength = symbolHeader.NameLength;
+        if (!OnSymbol(symbol))
+        {
+            return false;
+        }
+        offset += symbolHeader.NameLength;
+    }
+
+    /* Every byte must be accounted for. */
+    return offset == EntrySize;
+}
+
+/**
+ * @brief       Validates an entry without extracting anything.
+ *
+ * @param[in]   Entry       - The serialized entry.
+ * @param[in]   EntrySize   - The size of the entry, in bytes.
+ *
+ * @return      true if the entry is valid, false otherwise.
+ */
+template <class EntryHeader>
+inline bool
+IsValidEntry(
+    const void* Entry,
+    size_t EntrySize
+) noexcept(true)
+{
+    auto onHash = [](const void*, size_t) -> bool { return true; };
+    auto onSymbol = [](const SysMon::ModuleCacheFormat::SymbolView&) -> bool { return true; };
+
+    return SysMon::ModuleCacheFormat::ParseEntry<EntryHeader>(Entry, EntrySize, onHash, onSymbol);
+}
+
+/**
+ * @brief       Fills the header of a cache file. The entries must already follow it.
+ *
+ * @param[in,out]   Content         - The file content: room for the header, followed by the entries.
+ * @param[in]       ContentSize     - The size of the content, in bytes. At least the size of the header.
+ * @param[in]       EntriesCount    - The number of entries following the header.
+ *
+ * @return      The header, as it was written.
+ */
+inline SysMon::ModuleCacheFormat::FileHeader
+SealFile(
+    void* Content,
+    size_t ContentSize,
+    uint32_t EntriesCount
+) noexcept(true)
+{
+    SysMon::ModuleCacheFormat::FileHeader header = { 0 };
+    uint8_t* bytes = static_cast<uint8_t*>(Content);
+
+    header.Magic = SysMon::ModuleCacheFormat::FILE_MAGIC;
+    header.Version = SysMon::ModuleCacheFormat::FILE_VERSION;
+    header.EntriesCount = EntriesCount;
+    header.PayloadSize = ContentSize - sizeof(header);
+
+    /* The checksum covers everything after the header. */
+    header.Checksum = SysMon::ModuleCacheFormat::Checksum(bytes + sizeof(header),
+                                                          ContentSize - sizeof(header));
+
+    ::memcpy(bytes, &header, sizeof(header));
+    return header;
+}
+
+/**
+ * @brief       Parses a cache file. Every entry is validated before it is handed out.
+ *
+ * @param[in]   Content     - The file content.
+ * @param[in]   ContentSize - The size of the content, in bytes.
+ * @param[in]   OnEntry     - Called for each valid entry, in order: bool OnEntry(const void* Entry, size_t EntrySize).
+ *                            The entry points inside the content.
+ *
+ * @return      false if the file is not valid or if the callback returned false, true otherwise.
+ */
+template <class EntryHeader, class EntryCallback>
+inline bool
+ParseFile(
+    const void* Content,
+    size_t ContentSize,
+    EntryCallback& OnEntry
+) noexcept(true)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(Content);
+    SysMon::ModuleCacheFormat::FileHeader header = { 0 };
+    size_t offset = sizeof(header);
+
+    if (ContentSize < sizeof(header))
+    {
+        return false;
+    }
+    ::memcpy(&header, bytes, sizeof(header));
+
+    if ((header.Magic != SysMon::ModuleCacheFormat::FILE_MAGIC) ||
+        (header.Version != SysMon::ModuleCacheFormat::FILE_VERSION) ||
+        (header.PayloadSize > ContentSize - sizeof(header)))
+    {
+        return false;
+    }
+    if (header.Checksum != SysMon::ModuleCacheFormat::Checksum(bytes + sizeof(header),
+                                                               static_cast<size_t>(header.PayloadSize)))
+    {
+        return false;
+    }
+
+    /* The trailing bytes, if any, are not part of the cache. */
+    const size_t end = sizeof(header) + static_cast<size_t>(header.PayloadSize);
+    for (uint32_t i = 0; i < header.EntriesCount; ++i)
+    {
+        EntryHeader entryHeader;
+
+        if (sizeof(entryHeader) > end - offset)
+        {
+            return false;
+        }
+        ::memcpy(&entryHeader, bytes + offset, sizeof(entryHeader));
+        if (entryHeader.DataSize > end - offset - sizeof(entryHeader))
+        {
+            return false;
+        }
+
+        const size_t entrySize = sizeof(entryHeader) + entryHeader.DataSize;
+        if (!SysMon::ModuleCacheFormat::IsValidEntry<EntryHeader>(bytes + offset, entrySize) ||
+            !OnEntry(static_cast<const void*>(bytes + offset), entrySize))
+        {
+            return false;
+        }
+        offset += entrySize;
+    }
+
+    /* Every byte of the payload must be accounted for. */
+    return offset == end;
+}
+};  // namespace ModuleCacheFormat
+};  // namespace SysMon
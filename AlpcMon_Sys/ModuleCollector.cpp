@@ -16,8 +16,12 @@
 
 #include "HashUtils.hpp"
 #include "KmHelper.hpp"
-#include "WorkQueue.hpp"
+#include "RegistryUtils.hpp"
+#include "globals.hpp"
+#include "ModuleJobQueue.hpp"
 #include "PdbHelper.hpp"
+#include "ModuleCache.hpp"
+#include "SymbolStore.hpp"
 
 #include "ModuleCollector.hpp"
 #include "trace.hpp"
@@ -31,6 +35,37 @@
 
 XPF_SECTION_PAGED
 
+/**
+ * @brief           Lowers a counter updated from multiple threads, without going below zero.
+ *
+ * @param[in,out]   Counter - The counter.
+ * @param[in]       Value   - What to subtract.
+ *
+ * @return          Nothing.
+ */
+static void XPF_API
+ModuleCollectorAtomicSubtract(
+    _Inout_ volatile uint64_t* Counter,
+    _In_ uint64_t Value
+) noexcept(true)
+{
+    /* Code is paged. */
+    XPF_MAX_PASSIVE_LEVEL();
+
+    uint64_t current = *Counter;
+    while (true)
+    {
+        const uint64_t next = (current > Value) ? (current - Value)
+                                                : 0;
+        const uint64_t previous = xpf::ApiAtomicCompareExchange(Counter, next, current);
+        if (previous == current)
+        {
+            return;
+        }
+        current = previous;
+    }
+}
+
 SysMon::ModuleCollector* XPF_API
 SysMon::ModuleCollector::Create(
     void
@@ -42,6 +77,10 @@ SysMon::ModuleCollector::Create(
     ModuleCollector* instance = nullptr;
     NTSTATUS status = STATUS_UNSUCCESSFUL;
 
+    xpf::Buffer symbolServerBuffer{ SYSMON_PAGED_ALLOCATOR };
+    xpf::StringView<wchar_t> symbolServer = L"http://msdl.microsoft.com/download/symbols";
+    xpf::Buffer symbolsBudgetBuffer{ SYSMON_PAGED_ALLOCATOR };
+
     /* Create a new module collector. */
     instance = static_cast<ModuleCollector*>(xpf::MemoryAllocator::AllocateMemory(sizeof(SysMon::ModuleCollector)));
     if (nullptr == instance)
@@ -57,7 +96,95 @@ SysMon::ModuleCollector::Create(
     {
         goto CleanUp;
     }
-    instance->m_ModulesWorkQueue.Emplace();
+    for (size_t i = 0; i < ModuleCollector::MODULE_BUCKETS_COUNT; ++i)
+    {
+        status = instance->m_ModuleBuckets.Emplace(xpf::Vector<xpf::SharedPointer<SysMon::ModuleData>>{ SYSMON_PAGED_ALLOCATOR });
+        if (!NT_SUCCESS(status))
+        {
+            goto CleanUp;
+        }
+        status = instance->m_PathBuckets.Emplace(xpf::Vector<xpf::SharedPointer<SysMon::ModulePathEntry>>{ SYSMON_PAGED_ALLOCATOR });
+        if (!NT_SUCCESS(status))
+        {
+            goto CleanUp;
+        }
+    }
+    status = SysMon::ModuleCache::Create(L"\\??\\C:\\Symbols\\ModuleCache.bin",
+                                         &instance->m_ModuleCache);
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+    status = KmHelper::File::FileHasher::Create(&instance->m_FileHasher);
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+    status = SysMon::SymbolStore::Create(&instance->m_SymbolStore);
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+    status = SysMon::SymbolCache::Create(&instance->m_SymbolCache);
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+
+    /* The symbol server can be overwritten from registry - an url or a local directory or share. */
+    status = KmHelper::WrapperRegistryQueryValueKey(GlobalDataGetRegistryKey(),
+                                                    L"SymbolServer",
+                                                    REG_SZ,
+                                                    &symbolServerBuffer);
+    if (NT_SUCCESS(status))
+    {
+        /* Registry data is not guaranteed to be terminated - stop at the buffer end or the first terminator. */
+        const wchar_t* server = static_cast<const wchar_t*>(symbolServerBuffer.GetBuffer());
+        const size_t serverBufferLength = symbolServerBuffer.GetSize() / sizeof(wchar_t);
+
+        size_t serverLength = 0;
+        while (serverLength < serverBufferLength && L'\0' != server[serverLength])
+        {
+            serverLength++;
+        }
+
+        /* An empty value keeps the default server. */
+        if (0 != serverLength)
+        {
+            symbolServer = xpf::StringView<wchar_t>(server, serverLength);
+        }
+    }
+    status = PdbHelper::PdbDownloader::Create(symbolServer,
+                                              L"\\??\\C:\\Symbols\\",
+                                              &instance->m_PdbDownloader);
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+    status = SysMon::ModuleJobQueue::Create(&instance->m_ModuleJobQueue);
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+    status = SysMon::SymbolBroker::Create(&instance->m_SymbolBroker);
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+
+    /* The memory budget of the symbols can be overwritten from registry - in megabytes. */
+    status = KmHelper::WrapperRegistryQueryValueKey(GlobalDataGetRegistryKey(),
+                                                    L"SymbolsMemoryBudgetMb",
+                                                    REG_DWORD,
+                                                    &symbolsBudgetBuffer);
+    if (NT_SUCCESS(status) && symbolsBudgetBuffer.GetSize() >= sizeof(uint32_t))
+    {
+        const uint32_t budgetMb = *static_cast<const uint32_t*>(symbolsBudgetBuffer.GetBuffer());
+        if (0 != budgetMb)
+        {
+            instance->m_SymbolsMemoryBudget = size_t{ budgetMb } * 1024 * 1024;
+        }
+    }
 
     /* All good. */
     status = STATUS_SUCCESS;
@@ -92,24 +219,30 @@ NTSTATUS XPF_API
 SysMon::ModuleCollector::Insert(
     _Inout_ xpf::String<wchar_t>&& ModulePath,
     _In_ uint32_t PathHash,
+    _In_ _Const_ const SysMon::ModuleIdentity& Identity,
     _Inout_ xpf::Buffer&& ModuleHash,
     _In_ KmHelper::File::HashType ModuleHashType,
-    _Inout_ xpf::Vector<xpf::pdb::SymbolInformation>&& ModulesSymbols
+    _In_ _Const_ const xpf::SharedPointer<SysMon::SymbolTable>& ModulesSymbols,
+    _In_ SysMon::ModuleSymbolsState SymbolsState
 ) noexcept(true)
 {
     /* Code is paged. */
     XPF_MAX_APC_LEVEL();
 
     xpf::SharedPointer<SysMon::ModuleData> newmodule{ SYSMON_PAGED_ALLOCATOR };
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
 
-    /* Check if the module was already added in list. */
+    /* Check if the module was already added in its bucket. */
     xpf::ExclusiveLockGuard guard{ *this->m_ModulesLock };
-    for (size_t i = 0; i < this->m_Modules.Size(); ++i)
+    xpf::Vector<xpf::SharedPointer<SysMon::ModuleData>>& bucket = this->ModuleBucket(Identity);
+    for (size_t i = 0; i < bucket.Size(); ++i)
     {
-        /* Module was already added.*/
-        if (this->m_Modules[i].Get()->Equals(ModulePath.View(), PathHash))
+        /* Module was already added - possibly through another path. */
+        if (bucket[i].Get()->Equals(Identity))
         {
-            return STATUS_ALREADY_REGISTERED;
+            return this->BindPathLocked(ModulePath.View(),
+                                        PathHash,
+                                        bucket[i]);
         }
     }
 
@@ -117,28 +250,137 @@ SysMon::ModuleCollector::Insert(
     newmodule = xpf::MakeSharedWithAllocator<SysMon::ModuleData>(SYSMON_PAGED_ALLOCATOR,
                                                                     xpf::Move(ModulePath),
                                                                     PathHash,
+                                                                    Identity,
                                                                     xpf::Move(ModuleHash),
                                                                     ModuleHashType,
-                                                                    xpf::Move(ModulesSymbols));
+                                                                    ModulesSymbols,
+                                                                    SymbolsState);
     if (newmodule.IsEmpty())
     {
         return STATUS_INSUFFICIENT_RESOURCES;
     }
+    status = xpf::ReadWriteLock::Create(xpf::AddressOf(newmodule.Get()->m_SymbolsLock));
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
 
     /* Emplace the new module. */
-    return this->m_Modules.Emplace(newmodule);
+    status = bucket.Emplace(newmodule);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    /* And make its path resolve to it. */
+    return this->BindPathLocked(newmodule.Get()->ModulePath(),
+                                PathHash,
+                                newmodule);
+}
+
+NTSTATUS XPF_API
+SysMon::ModuleCollector::BindPath(
+    _In_ _Const_ const xpf::StringView<wchar_t>& ModulePath,
+    _In_ uint32_t PathHash,
+    _In_ _Const_ const xpf::SharedPointer<SysMon::ModuleData>& Module
+) noexcept(true)
+{
+    /* Code is paged. */
+    XPF_MAX_APC_LEVEL();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    bool isModuleStored = false;
+
+    xpf::ExclusiveLockGuard guard{ *this->m_ModulesLock };
+
+    /* The module may have been forgotten as stale meanwhile - it is reachable again. */
+    xpf::Vector<xpf::SharedPointer<SysMon::ModuleData>>& bucket = this->ModuleBucket(Module.Get()->Identity());
+    for (size_t i = 0; i < bucket.Size(); ++i)
+    {
+        if (bucket[i].Get() == Module.Get())
+        {
+            isModuleStored = true;
+            break;
+        }
+    }
+    if (!isModuleStored)
+    {
+        status = bucket.Emplace(Module);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+    }
+
+    return this->BindPathLocked(ModulePath,
+                                PathHash,
+                                Module);
+}
+
+NTSTATUS XPF_API
+SysMon::ModuleCollector::BindPathLocked(
+    _In_ _Const_ const xpf::StringView<wchar_t>& ModulePath,
+    _In_ uint32_t PathHash,
+    _In_ _Const_ const xpf::SharedPointer<SysMon::ModuleData>& Module
+) noexcept(true)
+{
+    /* Code is paged. */
+    XPF_MAX_APC_LEVEL();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    xpf::SharedPointer<SysMon::ModulePathEntry> pathEntry{ SYSMON_PAGED_ALLOCATOR };
+
+    /* If the path is already known, it now resolves to the new module. */
+    xpf::Vector<xpf::SharedPointer<SysMon::ModulePathEntry>>& bucket = this->PathBucket(PathHash);
+    for (size_t i = 0; i < bucket.Size(); ++i)
+    {
+        SysMon::ModulePathEntry* existingEntry = bucket[i].Get();
+        if (existingEntry->PathHash == PathHash && existingEntry->Path.View().Equals(ModulePath, true))
+        {
+            if (existingEntry->Module.Get() != Module.Get())
+            {
+                /* The previous module loses a path - with none left, it is stale. */
+                existingEntry->Module.Get()->m_BoundPaths--;
+                Module.Get()->m_BoundPaths++;
+                existingEntry->Module = Module;
+            }
+            return STATUS_SUCCESS;
+        }
+    }
+
+    /* Otherwise create a new entry. */
+    pathEntry = xpf::MakeSharedWithAllocator<SysMon::ModulePathEntry>(SYSMON_PAGED_ALLOCATOR);
+    if (pathEntry.IsEmpty())
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    status = pathEntry.Get()->Path.Append(ModulePath);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    pathEntry.Get()->PathHash = PathHash;
+    pathEntry.Get()->Module = Module;
+
+    status = bucket.Emplace(pathEntry);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    Module.Get()->m_BoundPaths++;
+    return STATUS_SUCCESS;
 }
 
 xpf::SharedPointer<SysMon::ModuleData> XPF_API
 SysMon::ModuleCollector::Find(
-    _In_ _Const_ const xpf::StringView<wchar_t>& ModulePath
+    _In_ _Const_ const xpf::StringView<wchar_t>& ModulePath,
+    _In_ uint32_t PathHash
 ) noexcept(true)
 {
     /* Code is paged. */
-    XPF_MAX_PASSIVE_LEVEL();
+    XPF_MAX_APC_LEVEL();
 
     xpf::SharedPointer<SysMon::ModuleData> foundModule{ SYSMON_PAGED_ALLOCATOR };
-    uint32_t modulePathHash = 0;
 
     /* Path can not be empty. */
     if (ModulePath.IsEmpty())
@@ -146,22 +388,66 @@ SysMon::ModuleCollector::Find(
         return foundModule;
     }
 
-    /* First we need to hash the string for lookup. */
-    NTSTATUS status = KmHelper::HelperHashUnicodeString(ModulePath,
-                                                        &modulePathHash);
-    if (!NT_SUCCESS(status))
+    /* Only the bucket for this hash needs to be walked. */
+    xpf::SharedLockGuard guard{ *this->m_ModulesLock };
+    const xpf::Vector<xpf::SharedPointer<SysMon::ModulePathEntry>>& bucket = this->PathBucket(PathHash);
+    for (size_t i = 0; i < bucket.Size(); ++i)
     {
-        SysMonLogError("HelperHashUnicodeString failed with status %!STATUS!",
-                       status);
-        return foundModule;
+        const SysMon::ModulePathEntry* pathEntry = bucket[i].Get();
+        if (pathEntry->PathHash == PathHash && pathEntry->Path.View().Equals(ModulePath, true))
+        {
+            foundModule = pathEntry->Module;
+            break;
+        }
+    }
+
+    /* Empty if no module was found. */
+    return foundModule;
+}
+
+xpf::SharedPointer<SysMon::ModuleData> XPF_API
+SysMon::ModuleCollector::FindByPathHash(
+    _In_ uint32_t PathHash
+) noexcept(true)
+{
+    /* Code is paged. */
+    XPF_MAX_APC_LEVEL();
+
+    xpf::SharedPointer<SysMon::ModuleData> foundModule{ SYSMON_PAGED_ALLOCATOR };
+
+    /* Only the bucket for this hash needs to be walked. */
+    xpf::SharedLockGuard guard{ *this->m_ModulesLock };
+    const xpf::Vector<xpf::SharedPointer<SysMon::ModulePathEntry>>& bucket = this->PathBucket(PathHash);
+    for (size_t i = 0; i < bucket.Size(); ++i)
+    {
+        if (bucket[i].Get()->PathHash == PathHash)
+        {
+            foundModule = bucket[i].Get()->Module;
+            break;
+        }
     }
 
+    /* Empty if no module was found. */
+    return foundModule;
+}
+
+xpf::SharedPointer<SysMon::ModuleData> XPF_API
+SysMon::ModuleCollector::FindByIdentity(
+    _In_ _Const_ const SysMon::ModuleIdentity& Identity
+) noexcept(true)
+{
+    /* Code is paged. */
+    XPF_MAX_APC_LEVEL();
+
+    xpf::SharedPointer<SysMon::ModuleData> foundModule{ SYSMON_PAGED_ALLOCATOR };
+
     xpf::SharedLockGuard guard{ *this->m_ModulesLock };
-    for (size_t i = 0; i < this->m_Modules.Size(); ++i)
+    const xpf::Vector<xpf::SharedPointer<SysMon::ModuleData>>& bucket = this->ModuleBucket(Identity);
+    for (size_t i = 0; i < bucket.Size(); ++i)
     {
-        if (this->m_Modules[i].Get()->Equals(ModulePath, modulePathHash))
+        if (bucket[i].Get()->Equals(Identity))
         {
-            foundModule = this->m_Modules[i];
+            foundModule = bucket[i];
             break;
         }
     }
@@ -170,9 +456,249 @@ SysMon::ModuleCollector::Find(
     return foundModule;
 }
 
+NTSTATUS XPF_API
+SysMon::ModuleCollector::CollectSymbolsUsage(
+    _Out_ xpf::Vector<xpf::SharedPointer<SysMon::ModuleData>>* LoadedModules,
+    _Out_ xpf::Vector<SysMon::ModuleSymbolsUsage>* Usage,
+    _Out_ size_t* TotalSize
+) noexcept(true)
+{
+    /* Code is paged. */
+    XPF_MAX_PASSIVE_LEVEL();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    xpf::Vector<xpf::SharedPointer<SysMon::ModuleData>> modules{ SYSMON_PAGED_ALLOCATOR };
+    xpf::Vector<xpf::SharedPointer<SysMon::SymbolTable>> staleTables{ SYSMON_PAGED_ALLOCATOR };
+    bool hasStaleModules = false;
+
+    /* Preinit output. */
+    LoadedModules->Clear();
+    Usage->Clear();
+    *TotalSize = 0;
+
+    /* Snapshot the modules - the loads can go on while the usage is computed. */
+    {
+        xpf::SharedLockGuard guard{ *this->m_ModulesLock };
+        for (size_t i = 0; i < this->m_ModuleBuckets.Size(); ++i)
+        {
+            const xpf::Vector<xpf::SharedPointer<SysMon::ModuleData>>& bucket = this->m_ModuleBuckets[i];
+            for (size_t j = 0; j < bucket.Size(); ++j)
+            {
+                if (0 == bucket[j].Get()->m_BoundPaths)
+                {
+                    hasStaleModules = true;
+                    continue;
+                }
+                status = modules.Emplace(bucket[j]);
+                if (!NT_SUCCESS(status))
+                {
+                    return status;
+                }
+            }
+        }
+    }
+
+    /* No path resolves to them anymore - whoever still holds them keeps them alive. Files are rarely replaced. */
+    if (hasStaleModules)
+    {
+        xpf::ExclusiveLockGuard guard{ *this->m_ModulesLock };
+        for (size_t i = 0; i < this->m_ModuleBuckets.Size(); ++i)
+        {
+            xpf::Vector<xpf::SharedPointer<SysMon::ModuleData>>& bucket = this->m_ModuleBuckets[i];
+
+            size_t j = 0;
+            while (j < bucket.Size())
+            {
+                SysMon::ModuleData* module = bucket[j].Get();
+                if (0 != module->m_BoundPaths)
+                {
+                    j++;
+                    continue;
+                }
+                {
+                    xpf::SharedLockGuard symbolsGuard{ *module->m_SymbolsLock };
+                    if (!module->m_ModuleSymbols.IsEmpty())
+                    {
+                        /* Best effort - if we can't remember it, the cached lookups simply age out. */
+                        (void) staleTables.Emplace(module->m_ModuleSymbols);
+                    }
+                }
+                status = bucket.Erase(j);
+                XPF_DEATH_ON_FAILURE(NT_SUCCESS(status));
+            }
+        }
+    }
+
+    /* Don't let the cached lookups keep the stale symbols alive. The locks are released by now. */
+    for (size_t i = 0; i < staleTables.Size(); ++i)
+    {
+        this->SymbolCache().InvalidateTable(staleTables[i]);
+    }
+
+    for (size_t i = 0; i < modules.Size(); ++i)
+    {
+        SysMon::ModuleData* module = modules[i].Get();
+
+        xpf::SharedPointer<SysMon::SymbolTable> table{ SYSMON_PAGED_ALLOCATOR };
+        {
+            xpf::SharedLockGuard symbolsGuard{ *module->m_SymbolsLock };
+            table = module->m_ModuleSymbols;
+        }
+        if (table.IsEmpty())
+        {
+            continue;
+        }
+
+        status = LoadedModules->Emplace(modules[i]);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        /* Modules with the same pdb share the table - account it once, as recent as its most recent user. */
+        bool isTableKnown = false;
+        for (size_t k = 0; k < Usage->Size(); ++k)
+        {
+            SysMon::ModuleSymbolsUsage& usage = (*Usage)[k];
+            if (usage.Table.Get() == table.Get())
+            {
+                usage.LastUsedTime = (module->m_LastUsedTime > usage.LastUsedTime) ? module->m_LastUsedTime
+                                                                                   : usage.LastUsedTime;
+                isTableKnown = true;
+                break;
+            }
+        }
+        if (!isTableKnown)
+        {
+            SysMon::ModuleSymbolsUsage usage;
+            usage.Table = table;
+            usage.MemorySize = table.Get()->MemorySize();
+            usage.LastUsedTime = module->m_LastUsedTime;
+
+            status = Usage->Emplace(usage);
+            if (!NT_SUCCESS(status))
+            {
+                return status;
+            }
+            *TotalSize += usage.MemorySize;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+void XPF_API
+SysMon::ModuleCollector::TrimSymbols(
+    void
+) noexcept(true)
+{
+    /* Code is paged. */
+    XPF_MAX_PASSIVE_LEVEL();
+
+    xpf::Vector<xpf::SharedPointer<SysMon::ModuleData>> loadedModules{ SYSMON_PAGED_ALLOCATOR };
+    xpf::Vector<SysMon::ModuleSymbolsUsage> usage{ SYSMON_PAGED_ALLOCATOR };
+    size_t totalSize = 0;
+    size_t evictedTables = 0;
+
+    /* An allocation failed since the last trim - make room for more than a few tables. */
+    const bool isUnderMemoryPressure = this->m_IsUnderMemoryPressure;
+    this->m_IsUnderMemoryPressure = false;
+
+    const size_t budget = isUnderMemoryPressure ? this->m_SymbolsMemoryBudget / ModuleCollector::MEMORY_PRESSURE_BUDGET_DIVISOR
+                                                : this->m_SymbolsMemoryBudget;
+
+    /* Loads which finish while we trim are accounted on top of this - they are not lost below. */
+    const uint64_t accountedSize = this->m_AccountedSymbolsSize;
+
+    NTSTATUS status = this->CollectSymbolsUsage(&loadedModules,
+                                                &usage,
+                                                &totalSize);
+    if (!NT_SUCCESS(status))
+    {
+        /* Try again on the next trim. */
+        this->m_IsUnderMemoryPressure = true;
+        return;
+    }
+
+    while (totalSize > budget && !usage.IsEmpty())
+    {
+        /* The least recently used table goes first. Trims run only over the budget, a linear scan is enough. */
+        size_t oldest = 0;
+        for (size_t i = 1; i < usage.Size(); ++i)
+        {
+            if (usage[i].LastUsedTime < usage[oldest].LastUsedTime)
+            {
+                oldest = i;
+            }
+        }
+
+        /* Drop it from all the modules sharing it and from the store, so the memory is freed. */
+        bool isEvicted = false;
+        for (size_t i = 0; i < loadedModules.Size(); ++i)
+        {
+            if (loadedModules[i].Get()->EvictModuleSymbols(usage[oldest].Table))
+            {
+                isEvicted = true;
+            }
+        }
+
+        /* The modules moved on in the meantime - the memory is not released by us, so it is not accounted. */
+        if (isEvicted)
+        {
+            this->SymbolStore().Evict(usage[oldest].Table);
+            this->SymbolCache().InvalidateTable(usage[oldest].Table);
+
+            totalSize -= usage[oldest].MemorySize;
+            evictedTables++;
+        }
+
+        status = usage.Erase(oldest);
+        XPF_DEATH_ON_FAILURE(NT_SUCCESS(status));
+    }
+
+    /* Reconcile with what is really loaded - the evicted tables and the ones freed with stale modules. */
+    if (accountedSize > uint64_t{ totalSize })
+    {
+        ModuleCollectorAtomicSubtract(&this->m_AccountedSymbolsSize,
+                                      accountedSize - uint64_t{ totalSize });
+    }
+
+    if (evictedTables > 0)
+    {
+        SysMonLogInfo("Evicted %llu symbol tables, %llu bytes of symbols left loaded (memory pressure %d)",
+                      static_cast<uint64_t>(evictedTables),
+                      static_cast<uint64_t>(totalSize),
+                      isUnderMemoryPressure ? 1 : 0);
+        this->SymbolCache().ReportStatistics();
+    }
+}
+
+void XPF_API
+SysMon::ModuleCollector::AccountSymbols(
+    _In_ size_t MemorySize
+) noexcept(true)
+{
+    /* Code is paged. */
+    XPF_MAX_PASSIVE_LEVEL();
+
+    uint64_t current = this->m_AccountedSymbolsSize;
+    while (true)
+    {
+        const uint64_t previous = xpf::ApiAtomicCompareExchange(&this->m_AccountedSymbolsSize,
+                                                                current + uint64_t{ MemorySize },
+                                                                current);
+        if (previous == current)
+        {
+            return;
+        }
+        current = previous;
+    }
+}
+
 SysMon::ModuleContext* XPF_API
 SysMon::ModuleCollector::CreateModuleContext(
-    _In_ _Const_ const xpf::StringView<wchar_t>& ModulePath
+    _In_ _Const_ const xpf::StringView<wchar_t>& ModulePath,
+    _In_ uint32_t PathHash
 ) noexcept(true)
 {
     /* Code is paged. */
@@ -190,6 +716,7 @@ SysMon::ModuleCollector::CreateModuleContext(
 
     /* Construct the context. */
     xpf::MemoryAllocator::Construct(context);
+    context->PathHash = PathHash;
 
     /* Duplicate the module path. */
     status = context->Path.Append(ModulePath);
@@ -233,6 +760,138 @@ SysMon::ModuleCollector::DestroyModuleContext(
  */
 static SysMon::ModuleCollector* gModuleCollector = nullptr;
 
+/**
+ * @brief   The symbols of these modules are loaded as soon as the module is seen.
+ *          They are almost always on the stack of an rpc call. The symbols of
+ *          all other modules are loaded only when a stack needs them.
+ *          Leave this empty to defer all modules.
+ */
+static const wchar_t* gModuleCollectorEagerSymbolsModules[] = { L"\\ntdll.dll",
+                                                                L"\\rpcrt4.dll",
+                                                                L"\\combase.dll" };
+
+/**
+ * @brief       Checks whether the symbols of a module can be retrieved from the symbol server.
+ *
+ * @param[in]   ModulePath  - The path of the module.
+ *
+ * @return      true for windows modules, false otherwise.
+ */
+static bool XPF_API
+ModuleCollectorHasPublicSymbols(
+    _In_ _Const_ const xpf::StringView<wchar_t>& ModulePath
+) noexcept(true)
+{
+    /* Code is paged. */
+    XPF_MAX_APC_LEVEL();
+
+    return ModulePath.Substring(L"\\Windows\\", false, nullptr) ||
+           ModulePath.Substring(L"\\SystemRoot\\", false, nullptr) ||
+           ModulePath.Substring(L"\\Microsoft\\", false, nullptr);
+}
+
+/**
+ * @brief       Checks whether the symbols of a module are loaded eagerly.
+ *
+ * @param[in]   ModulePath  - The path of the module.
+ *
+ * @return      true if the module is in gModuleCollectorEagerSymbolsModules, false otherwise.
+ */
+static bool XPF_API
+ModuleCollectorIsEagerSymbolsModule(
+    _In_ _Const_ const xpf::StringView<wchar_t>& ModulePath
+) noexcept(true)
+{
+    /* Code is paged. */
+    XPF_MAX_APC_LEVEL();
+
+    for (size_t i = 0; i < XPF_ARRAYSIZE(gModuleCollectorEagerSymbolsModules); ++i)
+    {
+        if (ModulePath.EndsWith(gModuleCollectorEagerSymbolsModules[i], false))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * @brief           Loads the symbols of an image through the symbol store. If another
+ *                  module with the same pdb already loaded them, or is loading them right
+ *                  now, its table is shared instead of extracting the symbols again.
+ *
+ * @param[in]       ImageIdentity   - The identity of the image.
+ * @param[in,out]   Symbols         - On input, the cached symbols of the image. May be empty.
+ *                                    On output, if they were empty and this call extracted
+ *                                    the symbols, they are returned here to be persisted.
+ * @param[out]      Table           - The loaded symbols.
+ *
+ * @return          A proper NTSTATUS error code.
+ */
+static NTSTATUS XPF_API
+ModuleCollectorLoadSymbols(
+    _In_ _Const_ const PdbHelper::ImageIdentity& ImageIdentity,
+    _Inout_ xpf::Vector<xpf::pdb::SymbolInformation>* Symbols,
+    _Out_ xpf::SharedPointer<SysMon::SymbolTable>* Table
+) noexcept(true)
+{
+    /* The routine can be called only at max PASSIVE_LEVEL from worker thread. */
+    XPF_MAX_PASSIVE_LEVEL();
+
+    xpf::SharedPointer<SysMon::SymbolStoreEntry> entry{ SYSMON_NPAGED_ALLOCATOR };
+    bool isOwner = false;
+
+    Table->Reset();
+
+    NTSTATUS status = gModuleCollector->SymbolStore().Acquire(ImageIdentity,
+                                                              &entry,
+                                                              &isOwner);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    /* Someone else is responsible for this pdb - wait for it. */
+    if (!isOwner)
+    {
+        return gModuleCollector->SymbolStore().Wait(entry,
+                                                    Table);
+    }
+
+    /* We own the pdb - the waiters are woken by Publish, whatever happens here.       */
+    /* The symbol service parses it in user mode when running - otherwise we do it here. */
+    if (Symbols->IsEmpty())
+    {
+        status = gModuleCollector->SymbolBroker().Resolve(ImageIdentity,
+                                                          Symbols);
+        if (STATUS_NOT_SUPPORTED == status)
+        {
+            status = PdbHelper::ExtractPdbSymbolInformation(ImageIdentity,
+                                                            gModuleCollector->PdbDownloader(),
+                                                            Symbols);
+        }
+    }
+    if (NT_SUCCESS(status))
+    {
+        status = SysMon::SymbolTable::Create(*Symbols,
+                                             Table);
+    }
+    if (NT_SUCCESS(status))
+    {
+        /* Only the owner accounts the table - the waiters share it. */
+        gModuleCollector->AccountSymbols(Table->Get()->MemorySize());
+    }
+    if (!NT_SUCCESS(status))
+    {
+        Symbols->Clear();
+        Table->Reset();
+    }
+
+    gModuleCollector->SymbolStore().Publish(entry,
+                                            *Table);
+    return status;
+}
 
 static void XPF_API
 ModuleCollectorWorkerCallback(
@@ -242,13 +901,26 @@ ModuleCollectorWorkerCallback(
     /* The routine can be called only at max PASSIVE_LEVEL from worker thread. */
     XPF_MAX_PASSIVE_LEVEL();
 
-    uint32_t modulePathHash = 0;
     xpf::Optional<SysMon::File::FileObject> moduleFile;
     NTSTATUS status = STATUS_UNSUCCESSFUL;
 
-    KmHelper::File::HashType hashType = KmHelper::File::HashType::kMd5;
+    PdbHelper::ImageIdentity imageIdentity;
+    SysMon::File::FileIdentity fileIdentity;
+    SysMon::ModuleIdentity moduleIdentity;
+    SysMon::ModuleCacheKey cacheKey;
+    bool isCacheUpdated = false;
+
+    xpf::SharedPointer<SysMon::ModuleData> knownModule{ SYSMON_PAGED_ALLOCATOR };
+    SysMon::ModuleSymbolsState symbolsState = SysMon::ModuleSymbolsState::kLoaded;
+
+    KmHelper::File::HashType hashType = KmHelper::File::HashType::kSha256;
     xpf::Buffer hash{ SYSMON_PAGED_ALLOCATOR };
     xpf::Vector<xpf::pdb::SymbolInformation> symbolsInformation{ SYSMON_PAGED_ALLOCATOR };
+    xpf::SharedPointer<SysMon::SymbolTable> symbolTable{ SYSMON_PAGED_ALLOCATOR };
+
+    bool shouldHash = false;
+    bool shouldLoadSymbols = false;
+    bool areSymbolsCached = false;
 
     /* Don't expect this to be null. */
     SysMon::ModuleContext* data = static_cast<SysMon::ModuleContext*>(Argument);
@@ -265,37 +937,100 @@ ModuleCollectorWorkerCallback(
         goto CleanUp;
     }
 
-    /* Hash the string path. */
-    status = KmHelper::HelperHashUnicodeString(data->Path.View(),
-                                               &modulePathHash);
+    /* Open the module path. */
+    status = SysMon::File::FileObject::Create(data->Path.View(),
+                                              XPF_FILE_ACCESS_READ,
+                                              &moduleFile);
     if (!NT_SUCCESS(status))
     {
         goto CleanUp;
     }
 
-    /* Open the module path. */
-    status = SysMon::File::FileObject::Create(data->Path.View(),
-                                              XPF_FILE_ACCESS_READ,
-                                              &moduleFile);
+    /* The module is identified by the file it was loaded from and by its pe headers. */
+    status = (*moduleFile).QueryIdentity(&fileIdentity);
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+    status = PdbHelper::ExtractImageIdentity((*moduleFile),
+                                             &imageIdentity);
     if (!NT_SUCCESS(status))
     {
         goto CleanUp;
     }
+    moduleIdentity.VolumeSerialNumber = fileIdentity.VolumeSerialNumber;
+    moduleIdentity.FileId = fileIdentity.FileId;
+    moduleIdentity.TimeDateStamp = imageIdentity.TimeDateStamp;
+    moduleIdentity.SizeOfImage = imageIdentity.SizeOfImage;
+
+    /* Same file seen through another path (hardlink, short name, device path). Nothing to compute. */
+    knownModule = gModuleCollector->FindByIdentity(moduleIdentity);
+    if (!knownModule.IsEmpty())
+    {
+        status = gModuleCollector->BindPath(data->Path.View(),
+                                            data->PathHash,
+                                            knownModule);
+        goto CleanUp;
+    }
+
+    /* Executables are hashed, windows modules get their symbols from .pdb */
+    shouldHash = data->Path.View().EndsWith(L".exe", false);
+    shouldLoadSymbols = ModuleCollectorHasPublicSymbols(data->Path.View());
+
+    /* Look in the persistent cache first. */
+    if (shouldHash || shouldLoadSymbols)
+    {
+        cacheKey = SysMon::ModuleCache::KeyFromIdentity(imageIdentity);
+        status = gModuleCollector->ModuleCache().Find(cacheKey,
+                                                      fileIdentity,
+                                                      &hash,
+                                                      &hashType,
+                                                      &symbolsInformation);
+        if (NT_SUCCESS(status))
+        {
+            /* Only redo the work which was not cached. A failed pdb download is retried. */
+            shouldHash = shouldHash && (hash.IsEmpty() || hashType != KmHelper::File::HashType::kSha256);
+            areSymbolsCached = !symbolsInformation.IsEmpty();
+        }
+    }
+
+    /* Most modules never show up on a stack - their symbols are loaded on first use. */
+    if (shouldLoadSymbols && !areSymbolsCached && !ModuleCollectorIsEagerSymbolsModule(data->Path.View()))
+    {
+        shouldLoadSymbols = false;
+        symbolsState = SysMon::ModuleSymbolsState::kDeferred;
+    }
 
-    /* Hash the file. */
-    if (data->Path.View().EndsWith(L".exe", false))
+    /* Hash the file. Sha256 is kept, md5 is computed in the same pass only for tracing. */
+    if (shouldHash)
     {
-        status = KmHelper::File::HashFile((*moduleFile),
-                                          hashType,
-                                          hash);
+        const KmHelper::File::HashType hashTypes[] = { KmHelper::File::HashType::kSha256,
+                                                       KmHelper::File::HashType::kMd5 };
+        xpf::Buffer hashes[] = { xpf::Buffer{ SYSMON_PAGED_ALLOCATOR },
+                                 xpf::Buffer{ SYSMON_PAGED_ALLOCATOR } };
+
+        status = gModuleCollector->FileHasher().HashFile((*moduleFile),
+                                                         hashTypes,
+                                                         hashes,
+                                                         XPF_ARRAYSIZE(hashTypes));
+        if (!NT_SUCCESS(status))
+        {
+            goto CleanUp;
+        }
+        hashType = KmHelper::File::HashType::kSha256;
+        status = hash.Resize(hashes[0].GetSize());
         if (!NT_SUCCESS(status))
         {
             goto CleanUp;
         }
+        xpf::ApiCopyMemory(hash.GetBuffer(),
+                           hashes[0].GetBuffer(),
+                           hashes[0].GetSize());
+        isCacheUpdated = true;
 
         /* Also log for tracing. */
         {
-            const unsigned char* hashBuffer = static_cast<const unsigned char*>(hash.GetBuffer());
+            const unsigned char* hashBuffer = static_cast<const unsigned char*>(hashes[1].GetBuffer());
             SysMonLogTrace("Successfully computed md5 hash for %S : %02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",  // NOLINT(*)
                             data->Path.View().Buffer(),                                                                                 // NOLINT(*)
                             uint16_t{hashBuffer[0]},  uint16_t{hashBuffer[1]},  uint16_t{hashBuffer[2]},  uint16_t{hashBuffer[3]},      // NOLINT(*)
@@ -306,52 +1041,307 @@ ModuleCollectorWorkerCallback(
     }
 
     /* If this is a windows module we try to retrieve .pdb information */
-    if (data->Path.View().Substring(L"\\Windows\\", false, nullptr) ||
-        data->Path.View().Substring(L"\\SystemRoot\\", false, nullptr) ||
-        data->Path.View().Substring(L"\\Microsoft\\", false, nullptr))
+    if (shouldLoadSymbols)
     {
-        status = PdbHelper::ExtractPdbSymbolInformation((*moduleFile),
-                                                        L"\\??\\C:\\Symbols\\",
-                                                        &symbolsInformation);
+        status = ModuleCollectorLoadSymbols(imageIdentity,
+                                            &symbolsInformation,
+                                            &symbolTable);
         if (!NT_SUCCESS(status))
         {
-            /* Non critical - we simply won't have symbols for this module. */
-            symbolsInformation.Clear();
+            /* Non critical - the symbols are loaded again on first use. */
+            SysMonLogWarning("Could not load symbols for %S %!STATUS!",
+                             data->Path.View().Buffer(),
+                             status);
+            if (STATUS_INSUFFICIENT_RESOURCES == status)
+            {
+                gModuleCollector->ReportMemoryPressure();
+            }
+            symbolsState = SysMon::ModuleSymbolsState::kDeferred;
             status = STATUS_SUCCESS;
         }
+        else if (!areSymbolsCached && !symbolsInformation.IsEmpty())
+        {
+            isCacheUpdated = true;
+        }
+    }
+
+    /* Persist what we computed, so it won't be computed again after reboot. */
+    if (isCacheUpdated)
+    {
+        status = gModuleCollector->ModuleCache().Insert(cacheKey,
+                                                        fileIdentity,
+                                                        hash,
+                                                        hashType,
+                                                        symbolsInformation);
+        if (!NT_SUCCESS(status))
+        {
+            /* Non critical - we'll just redo the work next time. */
+            SysMonLogWarning("Could not cache module %S %!STATUS!",
+                             data->Path.View().Buffer(),
+                             status);
+        }
     }
 
+    /* The symbols are kept packed - the expanded vector is released when we're done. */
+    symbolsInformation.Clear();
+
     /* Now insert it into module collector. */
     /* We already allocated the path in module context - so we'll move that memory. */
     status = gModuleCollector->Insert(xpf::Move(data->Path),
-                                      modulePathHash,
+                                      data->PathHash,
+                                      moduleIdentity,
                                       xpf::Move(hash),
                                       hashType,
-                                      xpf::Move(symbolsInformation));
+                                      symbolTable,
+                                      symbolsState);
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+
+CleanUp:
+    if (STATUS_INSUFFICIENT_RESOURCES == status)
+    {
+        gModuleCollector->ReportMemoryPressure();
+    }
+    gModuleCollector->DestroyModuleContext(data);
+
+    /* More symbols may be loaded now - trim only when they went over the budget. */
+    if (gModuleCollector->ShouldTrimSymbols())
+    {
+        gModuleCollector->TrimSymbols();
+    }
+}
+
+static void XPF_API
+ModuleCollectorSymbolsWorkerCallback(
+    _In_opt_ xpf::thread::CallbackArgument Argument
+) noexcept(true)
+{
+    /* The routine can be called only at max PASSIVE_LEVEL from worker thread. */
+    XPF_MAX_PASSIVE_LEVEL();
+
+    xpf::Optional<SysMon::File::FileObject> moduleFile;
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    PdbHelper::ImageIdentity imageIdentity;
+    SysMon::File::FileIdentity fileIdentity;
+    SysMon::ModuleIdentity moduleIdentity;
+    SysMon::ModuleCacheKey cacheKey;
+
+    KmHelper::File::HashType hashType = KmHelper::File::HashType::kSha256;
+    xpf::Buffer hash{ SYSMON_PAGED_ALLOCATOR };
+    xpf::Vector<xpf::pdb::SymbolInformation> symbolsInformation{ SYSMON_PAGED_ALLOCATOR };
+    xpf::SharedPointer<SysMon::SymbolTable> symbolTable{ SYSMON_PAGED_ALLOCATOR };
+    bool areSymbolsCached = false;
+
+    /* Don't expect this to be null. */
+    SysMon::ModuleContext* data = static_cast<SysMon::ModuleContext*>(Argument);
+    if (nullptr == data || data->Module.IsEmpty())
+    {
+        XPF_ASSERT(false);
+        return;
+    }
+
+    /* If queue is running down, we need to bail. Fast as we are unloading. */
+    if (gModuleCollector->IsQueueRunDown())
+    {
+        goto CleanUp;
+    }
+
+    /* Reopen the module and make sure it is still the same image we saw at load. */
+    status = SysMon::File::FileObject::Create(data->Path.View(),
+                                              XPF_FILE_ACCESS_READ,
+                                              &moduleFile);
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+    status = (*moduleFile).QueryIdentity(&fileIdentity);
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+    status = PdbHelper::ExtractImageIdentity((*moduleFile),
+                                             &imageIdentity);
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+    moduleIdentity.VolumeSerialNumber = fileIdentity.VolumeSerialNumber;
+    moduleIdentity.FileId = fileIdentity.FileId;
+    moduleIdentity.TimeDateStamp = imageIdentity.TimeDateStamp;
+    moduleIdentity.SizeOfImage = imageIdentity.SizeOfImage;
+    if (!moduleIdentity.Equals(data->Module.Get()->Identity()))
+    {
+        status = STATUS_FILE_CHANGED;
+        goto CleanUp;
+    }
+
+    /* Evicted symbols are in the persistent cache - no need to parse the pdb again. */
+    cacheKey = SysMon::ModuleCache::KeyFromIdentity(imageIdentity);
+    status = gModuleCollector->ModuleCache().Find(cacheKey,
+                                                  fileIdentity,
+                                                  &hash,
+                                                  &hashType,
+                                                  &symbolsInformation);
+    if (!NT_SUCCESS(status))
+    {
+        hash.Clear();
+        hashType = KmHelper::File::HashType::kSha256;
+        symbolsInformation.Clear();
+    }
+    areSymbolsCached = !symbolsInformation.IsEmpty();
+
+    status = ModuleCollectorLoadSymbols(imageIdentity,
+                                        &symbolsInformation,
+                                        &symbolTable);
     if (!NT_SUCCESS(status))
     {
         goto CleanUp;
     }
 
+    /* Already persisted - either cached, or another module with the same pdb loaded them. */
+    if (areSymbolsCached || symbolsInformation.IsEmpty())
+    {
+        goto CleanUp;
+    }
+
+    /* Persist the symbols next to whatever was already cached for this module. */
+    status = gModuleCollector->ModuleCache().Insert(cacheKey,
+                                                    fileIdentity,
+                                                    hash,
+                                                    hashType,
+                                                    symbolsInformation);
+    if (!NT_SUCCESS(status))
+    {
+        /* Non critical - we'll just redo the work next time. */
+        SysMonLogWarning("Could not cache symbols for %S %!STATUS!",
+                         data->Path.View().Buffer(),
+                         status);
+        status = STATUS_SUCCESS;
+    }
+
 CleanUp:
+    if (STATUS_INSUFFICIENT_RESOURCES == status)
+    {
+        gModuleCollector->ReportMemoryPressure();
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        data->Module.Get()->SetModuleSymbols(symbolTable);
+    }
+    else
+    {
+        /* Non critical - the load is retried later, with a growing delay, not on every stack. */
+        SysMonLogTrace("Could not load symbols for %S %!STATUS!",
+                       data->Path.View().Buffer(),
+                       status);
+        data->Module.Get()->FailSymbolsLoad();
+    }
     gModuleCollector->DestroyModuleContext(data);
+
+    /* More symbols may be loaded now - trim only when they went over the budget. */
+    if (!gModuleCollector->IsQueueRunDown() && gModuleCollector->ShouldTrimSymbols())
+    {
+        gModuleCollector->TrimSymbols();
+    }
+}
+
+static bool XPF_API
+ModuleCollectorIsSameImage(
+    _In_ _Const_ const SysMon::ModuleIdentity& Identity,
+    _In_ const void* ModuleBase,
+    _In_ const size_t& ModuleSize
+) noexcept(true)
+{
+    /* The routine can be called only at max PASSIVE_LEVEL. */
+    XPF_MAX_PASSIVE_LEVEL();
+
+    PIMAGE_NT_HEADERS ntHeaders = nullptr;
+    bool isSameImage = false;
+
+    /* Can't say - consider it the same so we don't keep recomputing it. */
+    if (nullptr == ModuleBase || 0 == ModuleSize)
+    {
+        return true;
+    }
+
+    __try
+    {
+        NTSTATUS status = KmHelper::WrapperRtlImageNtHeaderEx(0,
+                                                              const_cast<void*>(ModuleBase),
+                                                              ModuleSize,
+                                                              &ntHeaders);
+        if (!NT_SUCCESS(status) || nullptr == ntHeaders)
+        {
+            isSameImage = true;
+            __leave;
+        }
+
+        /* The file was replaced in place - the cached module is stale. */
+        isSameImage = (ntHeaders->FileHeader.TimeDateStamp == Identity.TimeDateStamp) &&
+                      (ModuleSize == Identity.SizeOfImage);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        isSameImage = true;
+    }
+
+    return isSameImage;
+}
+
+static bool XPF_API
+ModuleCollectorIsSameNewModuleJob(
+    _In_opt_ xpf::thread::CallbackArgument PendingArgument,
+    _In_opt_ xpf::thread::CallbackArgument NewArgument
+) noexcept(true)
+{
+    /* Called with the job queue lock held. */
+    XPF_MAX_APC_LEVEL();
+
+    const SysMon::ModuleContext* pendingContext = static_cast<const SysMon::ModuleContext*>(PendingArgument);
+    const SysMon::ModuleContext* newContext = static_cast<const SysMon::ModuleContext*>(NewArgument);
+
+    if (nullptr == pendingContext || nullptr == newContext)
+    {
+        return false;
+    }
+
+    /* The key is only the path hash - two paths may collide. */
+    return (pendingContext->PathHash == newContext->PathHash) &&
+           pendingContext->Path.View().Equals(newContext->Path.View(), true);
 }
 
 static void XPF_API
 ModuleCollectorCacheNewModule(
-    _In_ _Const_ const xpf::StringView<wchar_t>& ModulePath
+    _In_ _Const_ const xpf::StringView<wchar_t>& ModulePath,
+    _In_ uint32_t PathHash
 )
 {
     /* The routine can be called only at max PASSIVE_LEVEL. */
     XPF_MAX_PASSIVE_LEVEL();
 
-    SysMon::ModuleContext* moduleContext = gModuleCollector->CreateModuleContext(ModulePath);
-    if (moduleContext)
+    SysMon::ModuleContext* moduleContext = gModuleCollector->CreateModuleContext(ModulePath,
+                                                                                 PathHash);
+    if (nullptr == moduleContext)
     {
-        /* Enqueue the work item and do not wait inline to finish. */
-        gModuleCollector->WorkQueue().EnqueueWork(ModuleCollectorWorkerCallback,
-                                                  moduleContext,
-                                                  false);
+        gModuleCollector->ReportMemoryPressure();
+    }
+    else
+    {
+        /* Enqueue the job and do not wait inline to finish. */
+        /* If the module is already pending (loaded in many processes at once), it only gets a hit. */
+        NTSTATUS status = gModuleCollector->JobQueue().Enqueue(SysMon::ModuleJobKind::kNewModule,
+                                                               PathHash,
+                                                               ModuleCollectorWorkerCallback,
+                                                               moduleContext,
+                                                               ModuleCollectorIsSameNewModuleJob);
+        if (!NT_SUCCESS(status))
+        {
+            gModuleCollector->DestroyModuleContext(moduleContext);
+        }
     }
 }
 
@@ -409,31 +1399,195 @@ ModuleCollectorDestroy(
 _Use_decl_annotations_
 void XPF_API
 ModuleCollectorHandleNewModule(
-    _In_ _Const_ const xpf::StringView<wchar_t>& ModulePath
+    _In_ _Const_ const xpf::StringView<wchar_t>& ModulePath,
+    _In_ const void* ModuleBase,
+    _In_ const size_t& ModuleSize
 ) noexcept(true)
 {
     /* The routine can be called only at max PASSIVE_LEVEL. */
     XPF_MAX_PASSIVE_LEVEL();
 
     xpf::SharedPointer<SysMon::ModuleData> cachedModule{ SYSMON_PAGED_ALLOCATOR };
+    uint32_t modulePathHash = 0;
+
+    /* Hash the path once - it is used both for lookup and for the async work. */
+    NTSTATUS status = KmHelper::HelperHashUnicodeString(ModulePath,
+                                                        &modulePathHash);
+    if (!NT_SUCCESS(status))
+    {
+        SysMonLogError("HelperHashUnicodeString failed with status %!STATUS!",
+                       status);
+        return;
+    }
 
     /* Lookup the module in cache. */
-    cachedModule = gModuleCollector->Find(ModulePath);
-    if (cachedModule.IsEmpty())
+    cachedModule = gModuleCollector->Find(ModulePath,
+                                          modulePathHash);
+    if (cachedModule.IsEmpty() ||
+        !ModuleCollectorIsSameImage(cachedModule.Get()->Identity(), ModuleBase, ModuleSize))
     {
         /* Create a new module. */
-        ModuleCollectorCacheNewModule(ModulePath);
+        ModuleCollectorCacheNewModule(ModulePath,
+                                      modulePathHash);
     }
 }
 
 _IRQL_requires_max_(APC_LEVEL)
 xpf::SharedPointer<SysMon::ModuleData> XPF_API
 ModuleCollectorFindModule(
-    _In_ _Const_ const xpf::StringView<wchar_t>& ModulePath
+    _In_ _Const_ const xpf::StringView<wchar_t>& ModulePath,
+    _In_ uint32_t PathHash
+) noexcept(true)
+{
+    /* Modules are paged, so we can query them only at max apc level.*/
+    XPF_MAX_APC_LEVEL();
+
+    return gModuleCollector->Find(ModulePath,
+                                  PathHash);
+}
+
+_IRQL_requires_max_(APC_LEVEL)
+xpf::SharedPointer<SysMon::ModuleData> XPF_API
+ModuleCollectorFindModuleByPathHash(
+    _In_ uint32_t PathHash
+) noexcept(true)
+{
+    /* Modules are paged, so we can query them only at max apc level.*/
+    XPF_MAX_APC_LEVEL();
+
+    return gModuleCollector->FindByPathHash(PathHash);
+}
+
+_Use_decl_annotations_
+void XPF_API
+ModuleCollectorRequestSymbols(
+    _In_ _Const_ const xpf::SharedPointer<SysMon::ModuleData>& Module
+) noexcept(true)
+{
+    /* Modules are paged, so we can query them only at max apc level.*/
+    XPF_MAX_APC_LEVEL();
+
+    SysMon::ModuleContext* moduleContext = nullptr;
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    if (Module.IsEmpty() || gModuleCollector->IsQueueRunDown())
+    {
+        return;
+    }
+
+    /* The job key - the module is kept alive by the job context, so its address is unique. */
+    const uint64_t jobKey = xpf::AlgoPointerToValue(Module.Get());
+
+    /* Only the first caller loads the symbols - the others see them as already loading or loaded. */
+    if (!Module.Get()->TryBeginSymbolsLoad())
+    {
+        /* Still pending - the module is hot, so move it up in the queue. */
+        if (Module.Get()->AreSymbolsLoading())
+        {
+            gModuleCollector->JobQueue().Hit(SysMon::ModuleJobKind::kSymbols,
+                                             jobKey);
+        }
+        return;
+    }
+
+    moduleContext = gModuleCollector->CreateModuleContext(Module.Get()->ModulePath(),
+                                                          Module.Get()->PathHash());
+    if (nullptr == moduleContext)
+    {
+        /* Don't leave the module stuck in loading. */
+        Module.Get()->CancelSymbolsLoad();
+        gModuleCollector->ReportMemoryPressure();
+        return;
+    }
+    moduleContext->Module = Module;
+
+    /* Enqueue the job and do not wait inline to finish. */
+    status = gModuleCollector->JobQueue().Enqueue(SysMon::ModuleJobKind::kSymbols,
+                                                  jobKey,
+                                                  ModuleCollectorSymbolsWorkerCallback,
+                                                  moduleContext,
+                                                  nullptr);
+    if (!NT_SUCCESS(status))
+    {
+        /* The queue is full - a later stack will ask again. */
+        gModuleCollector->DestroyModuleContext(moduleContext);
+        Module.Get()->CancelSymbolsLoad();
+    }
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+ModuleCollectorFindSymbol(
+    _In_ _Const_ const xpf::SharedPointer<SysMon::ModuleData>& Module,
+    _In_ uint32_t Rva,
+    _Out_ uint32_t* SymbolRva,
+    _Out_ xpf::String<char>* SymbolName
 ) noexcept(true)
 {
     /* Modules are paged, so we can query them only at max apc level.*/
     XPF_MAX_APC_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != SymbolRva);
+    XPF_DEATH_ON_FAILURE(nullptr != SymbolName);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    /* Preinit output. */
+    *SymbolRva = 0;
+    SymbolName->Reset();
+
+    if (Module.IsEmpty())
+    {
+        return STATUS_NOT_FOUND;
+    }
+
+    /* Symbols are loaded on first use - until then there is nothing to find. */
+    xpf::SharedPointer<SysMon::SymbolTable> symbols = Module.Get()->ModuleSymbols();
+    if (symbols.IsEmpty())
+    {
+        ModuleCollectorRequestSymbols(Module);
+        return STATUS_NOT_FOUND;
+    }
+
+    /* Hot return addresses are served from the cache. */
+    status = gModuleCollector->SymbolCache().Find(symbols,
+                                                  Rva,
+                                                  SymbolRva,
+                                                  SymbolName);
+    if (NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    status = symbols.Get()->Find(Rva,
+                                 SymbolRva,
+                                 SymbolName);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    /* Failing to cache the lookup is not fatal - it will be resolved again next time. */
+    NTSTATUS cacheStatus = gModuleCollector->SymbolCache().Insert(symbols,
+                                                                  Rva,
+                                                                  *SymbolRva,
+                                                                  SymbolName->View());
+    if (STATUS_INSUFFICIENT_RESOURCES == cacheStatus)
+    {
+        gModuleCollector->ReportMemoryPressure();
+    }
+    return status;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+ModuleCollectorHandleSymbolsMessage(
+    _Inout_ UM_KM_MESSAGE_HEADER* Message,
+    _In_ size_t MessageSize
+) noexcept(true)
+{
+    /* The routine can be called only at max PASSIVE_LEVEL. */
+    XPF_MAX_PASSIVE_LEVEL();
 
-    return gModuleCollector->Find(ModulePath);
+    return gModuleCollector->SymbolBroker().HandleMessage(Message,
+                                                          MessageSize);
 }
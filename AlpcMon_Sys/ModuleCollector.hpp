@@ -18,11 +18,110 @@
 
 #include "KmHelper.hpp"
 #include "HashUtils.hpp"
-#include "WorkQueue.hpp"
+#include "ModuleJobQueue.hpp"
+#include "ModuleCache.hpp"
+#include "SymbolTable.hpp"
+#include "SymbolStore.hpp"
+#include "SymbolCache.hpp"
+#include "PdbDownloader.hpp"
+#include "SymbolBroker.hpp"
 
 
 namespace SysMon
 {
+/**
+ * @brief   Uniquely identifies a module on this machine. The same file reached
+ *          through different paths (hardlinks, short names, device or dos paths)
+ *          has the same identity. A file replaced in place has a different one.
+ */
+struct ModuleIdentity
+{
+    /**
+     * @brief   The serial number of the volume on which the file resides.
+     */
+    uint32_t VolumeSerialNumber = 0;
+
+    /**
+     * @brief   The file reference number. Unique per volume.
+     */
+    uint64_t FileId = 0;
+
+    /**
+     * @brief   The TimeDateStamp from the image file header.
+     */
+    uint32_t TimeDateStamp = 0;
+
+    /**
+     * @brief   The SizeOfImage from the image optional header.
+     */
+    uint32_t SizeOfImage = 0;
+
+    /**
+     * @brief       Checks whether this identity is equal to the other one.
+     *
+     * @param[in]   Other - The identity to compare against.
+     *
+     * @return      true if the identities are equal, false otherwise.
+     */
+    inline bool XPF_API
+    Equals(
+        _In_ _Const_ const ModuleIdentity& Other
+    ) const noexcept(true)
+    {
+        return (this->VolumeSerialNumber == Other.VolumeSerialNumber) &&
+               (this->FileId == Other.FileId) &&
+               (this->TimeDateStamp == Other.TimeDateStamp) &&
+               (this->SizeOfImage == Other.SizeOfImage);
+    }
+
+    /**
+     * @brief   Computes a hash of the identity - used to select the bucket.
+     *
+     * @return  A numerical value for the hash of the identity.
+     */
+    inline uint32_t XPF_API
+    Hash(
+        void
+    ) const noexcept(true)
+    {
+        uint32_t hash = this->VolumeSerialNumber;
+        hash = (hash * 31) ^ static_cast<uint32_t>(this->FileId);
+        hash = (hash * 31) ^ static_cast<uint32_t>(this->FileId >> 32);
+        hash = (hash * 31) ^ this->TimeDateStamp;
+        hash = (hash * 31) ^ this->SizeOfImage;
+        return hash;
+    }
+};
+
+/**
+ * @brief   Forward declaration. It needs to initialize the ModuleData.
+ */
+class ModuleCollector;
+
+/**
+ * @brief   The symbols of a module are loaded when they are first needed.
+ *          These are the states a module can be in.
+ */
+enum class ModuleSymbolsState : uint32_t
+{
+    /**
+     * @brief   The symbols were not requested yet, or the last load failed
+     *          and it is retried after a delay.
+     */
+    kDeferred = 0,
+
+    /**
+     * @brief   A work item is loading the symbols.
+     */
+    kLoading = 1,
+
+    /**
+     * @brief   The symbols were loaded, or there is nothing to load.
+     *          The symbols table might still be empty if loading failed.
+     */
+    kLoaded = 2
+};  // enum class ModuleSymbolsState
+
 /**
  * @brief   This class is used to store information about modules
  *          from the current machine. The data in these modules is
@@ -41,26 +140,35 @@ class ModuleData final
      * @param[in,out]   ModulePath     - a string which contains the path of the module.
      * @param[in]       PathHash       - an unsigned value containing the hash for the ModulePath.
      *                                   This is the hash of the string defining the path.
+     * @param[in]       Identity       - The identity of the module.
      * @param[in,out]   ModuleHash     - The hash of the content of the module.
      * @param[in]       ModuleHashType - The type of hash that was computed.
-     * @param[in,out]   ModuleSymbols  - Extracted modules symbols.
+     * @param[in]       ModuleSymbols  - The symbols of the module. May be empty.
+     * @param[in]       SymbolsState   - Whether the symbols are deferred until first use.
      */
     ModuleData(
         _Inout_ xpf::String<wchar_t>&& ModulePath,
         _In_ uint32_t PathHash,
+        _In_ _Const_ const ModuleIdentity& Identity,
         _Inout_ xpf::Buffer&& ModuleHash,
         _In_ KmHelper::File::HashType ModuleHashType,
-        _Inout_ xpf::Vector<xpf::pdb::SymbolInformation>&& ModuleSymbols
+        _In_ _Const_ const xpf::SharedPointer<SysMon::SymbolTable>& ModuleSymbols,
+        _In_ SysMon::ModuleSymbolsState SymbolsState
     ) noexcept(true) : m_ModulePath{xpf::Move(ModulePath)},
                        m_PathHash{ PathHash },
+                       m_Identity{ Identity },
                        m_ModuleHash{xpf::Move(ModuleHash)},
                        m_ModuleHashType{ModuleHashType},
-                       m_ModulesSymbols{xpf::Move(ModuleSymbols)}
+                       m_ModuleSymbols{ModuleSymbols},
+                       m_SymbolsState{static_cast<uint32_t>(SymbolsState)}
     {
         /* Path should not be empty. */
         XPF_ASSERT(!this->m_ModulePath.IsEmpty());
         /* Hash should not be zero. */
         XPF_ASSERT(0 != this->m_PathHash);
+
+        /* Freshly loaded symbols should not be the first ones evicted. */
+        this->m_LastUsedTime = xpf::ApiCurrentTime();
     }
 
     /**
@@ -102,6 +210,19 @@ class ModuleData final
         return this->m_PathHash;
     }
 
+    /**
+     * @brief   Getter for the module identity.
+     *
+     * @return  The identity of the module - this is what the module is keyed on.
+     */
+    inline const ModuleIdentity& XPF_API
+    Identity(
+        void
+    ) const noexcept(true)
+    {
+        return this->m_Identity;
+    }
+
     /**
      * @brief   Getter for the module hash.
      *
@@ -132,53 +253,260 @@ class ModuleData final
      * @brief   Getter for the modules symbols
      *
      * @return  The extracted modules symbols - might be empty if something failed,
-     *          or the pdb was not found.
+     *          the pdb was not found, the symbols were not loaded yet or they were evicted.
+     *
+     * @note    This counts as a use of the symbols - recently used symbols are evicted last.
      */
-    inline const xpf::Vector<xpf::pdb::SymbolInformation>& XPF_API
+    inline xpf::SharedPointer<SysMon::SymbolTable> XPF_API
     ModuleSymbols(
         void
-    ) const noexcept(true)
+    ) noexcept(true)
     {
-        return this->m_ModulesSymbols;
+        /* Only a hint for eviction - a torn or lost update does no harm. */
+        this->m_LastUsedTime = xpf::ApiCurrentTime();
+
+        xpf::SharedLockGuard guard{ *this->m_SymbolsLock };
+        return this->m_ModuleSymbols;
     }
 
     /**
-     * @brief       Checks whether this module is equal to the other one.
+     * @brief           Drops the loaded symbols of the module to free memory. The symbols
+     *                  go back to deferred, so they are loaded again on the next use.
      *
-     * @param[in]   ModulePath - a view over the string which contains the path of the
-     *                           module to be compared against.
-     * @param[in]   PathHash   - an unsigned value containing the hash for the ModulePath.
-     *                           This is the hash of the string defining the path.
+     * @param[in]       ModuleSymbols - The table to be dropped. Nothing happens if the
+     *                                  module has other symbols by now.
      *
-     * @return      true if this module is considered equal to the Other.
-     *              false otherwise.
+     * @return          true if the symbols were dropped, false otherwise.
      */
     inline bool XPF_API
-    Equals(
-        _In_ _Const_ const xpf::StringView<wchar_t>& ModulePath,
-        _In_ uint32_t PathHash
-    ) const noexcept(true)
+    EvictModuleSymbols(
+        _In_ _Const_ const xpf::SharedPointer<SysMon::SymbolTable>& ModuleSymbols
+    ) noexcept(true)
     {
-        /* First hashes must match. */
-        if (this->PathHash() != PathHash)
+        xpf::ExclusiveLockGuard guard{ *this->m_SymbolsLock };
+
+        if (this->m_ModuleSymbols.IsEmpty() || this->m_ModuleSymbols.Get() != ModuleSymbols.Get())
+        {
+            return false;
+        }
+        const uint32_t previousState = xpf::ApiAtomicCompareExchange(&this->m_SymbolsState,
+                                                                     static_cast<uint32_t>(SysMon::ModuleSymbolsState::kDeferred),
+                                                                     static_cast<uint32_t>(SysMon::ModuleSymbolsState::kLoaded));
+        if (previousState != static_cast<uint32_t>(SysMon::ModuleSymbolsState::kLoaded))
         {
             return false;
         }
+        this->m_ModuleSymbols.Reset();
+        return true;
+    }
+
+    /**
+     * @brief           Sets the symbols of the module, once they were loaded.
+     *
+     * @param[in]       ModuleSymbols - The loaded symbols. May be empty.
+     *
+     * @return          Nothing.
+     */
+    inline void XPF_API
+    SetModuleSymbols(
+        _In_ _Const_ const xpf::SharedPointer<SysMon::SymbolTable>& ModuleSymbols
+    ) noexcept(true)
+    {
+        {
+            xpf::ExclusiveLockGuard guard{ *this->m_SymbolsLock };
+            this->m_ModuleSymbols = ModuleSymbols;
+        }
+        this->m_LastUsedTime = xpf::ApiCurrentTime();
+        this->m_SymbolsLoadFailures = 0;
+        xpf::ApiAtomicCompareExchange(&this->m_SymbolsState,
+                                      static_cast<uint32_t>(SysMon::ModuleSymbolsState::kLoaded),
+                                      static_cast<uint32_t>(SysMon::ModuleSymbolsState::kLoading));
+    }
+
+    /**
+     * @brief   Moves the symbols from deferred to loading. Only one caller succeeds,
+     *          so the symbols are loaded only once. After a failed load, nobody
+     *          succeeds until the retry time is reached.
+     *
+     * @return  true if the caller must load the symbols, false otherwise.
+     */
+    inline bool XPF_API
+    TryBeginSymbolsLoad(
+        void
+    ) noexcept(true)
+    {
+        /* Only a hint - a torn read delays or advances the retry a bit. */
+        if (xpf::ApiCurrentTime() < this->m_SymbolsRetryTime)
+        {
+            return false;
+        }
+
+        const uint32_t previousState = xpf::ApiAtomicCompareExchange(&this->m_SymbolsState,
+                                                                     static_cast<uint32_t>(SysMon::ModuleSymbolsState::kLoading),
+                                                                     static_cast<uint32_t>(SysMon::ModuleSymbolsState::kDeferred));
+        return previousState == static_cast<uint32_t>(SysMon::ModuleSymbolsState::kDeferred);
+    }
 
-        /* In case of collision we also check the paths. */
-        return this->ModulePath().Equals(ModulePath, true);
+    /**
+     * @brief   Moves the symbols back from loading to deferred, when the load
+     *          could not even be scheduled. A later request will retry it.
+     *
+     * @return  Nothing.
+     */
+    inline void XPF_API
+    CancelSymbolsLoad(
+        void
+    ) noexcept(true)
+    {
+        xpf::ApiAtomicCompareExchange(&this->m_SymbolsState,
+                                      static_cast<uint32_t>(SysMon::ModuleSymbolsState::kDeferred),
+                                      static_cast<uint32_t>(SysMon::ModuleSymbolsState::kLoading));
+    }
+
+    /**
+     * @brief   Moves the symbols back from loading to deferred when the load failed,
+     *          so they are loaded again on a later use. Each consecutive failure doubles
+     *          the delay before the next attempt, up to SYMBOLS_MAX_RETRY_DELAY_SHIFT.
+     *
+     * @return  Nothing.
+     *
+     * @note    Only the owner of the load calls this, so the failures are not contended.
+     */
+    inline void XPF_API
+    FailSymbolsLoad(
+        void
+    ) noexcept(true)
+    {
+        const uint32_t failures = this->m_SymbolsLoadFailures;
+        const uint32_t shift = (failures < SYMBOLS_MAX_RETRY_DELAY_SHIFT) ? failures
+                                                                           : SYMBOLS_MAX_RETRY_DELAY_SHIFT;
+
+        this->m_SymbolsLoadFailures = failures + 1;
+        this->m_SymbolsRetryTime = xpf::ApiCurrentTime() + (SYMBOLS_RETRY_DELAY << shift);
+
+        xpf::ApiAtomicCompareExchange(&this->m_SymbolsState,
+                                      static_cast<uint32_t>(SysMon::ModuleSymbolsState::kDeferred),
+                                      static_cast<uint32_t>(SysMon::ModuleSymbolsState::kLoading));
+    }
+
+    /**
+     * @brief   Checks whether the symbols are being loaded right now.
+     *
+     * @return  true if the symbols are loading, false otherwise.
+     */
+    inline bool XPF_API
+    AreSymbolsLoading(
+        void
+    ) noexcept(true)
+    {
+        const uint32_t state = xpf::ApiAtomicCompareExchange(&this->m_SymbolsState,
+                                                             static_cast<uint32_t>(SysMon::ModuleSymbolsState::kLoading),
+                                                             static_cast<uint32_t>(SysMon::ModuleSymbolsState::kLoading));
+        return state == static_cast<uint32_t>(SysMon::ModuleSymbolsState::kLoading);
+    }
+
+    /**
+     * @brief       Checks whether this module has the given identity.
+     *
+     * @param[in]   Identity - the identity to be compared against.
+     *
+     * @return      true if this module is considered equal to the Other.
+     *              false otherwise.
+     */
+    inline bool XPF_API
+    Equals(
+        _In_ _Const_ const ModuleIdentity& Identity
+    ) const noexcept(true)
+    {
+        return this->m_Identity.Equals(Identity);
     }
 
  private:
     xpf::String<wchar_t> m_ModulePath{ SYSMON_PAGED_ALLOCATOR };
     uint32_t m_PathHash = 0;
+    ModuleIdentity m_Identity;
 
     xpf::Buffer m_ModuleHash{ SYSMON_PAGED_ALLOCATOR };
     KmHelper::File::HashType m_ModuleHashType = KmHelper::File::HashType::kMd5;
 
-    xpf::Vector<xpf::pdb::SymbolInformation> m_ModulesSymbols{ SYSMON_PAGED_ALLOCATOR };
+    xpf::Optional<xpf::ReadWriteLock> m_SymbolsLock;
+    xpf::SharedPointer<SysMon::SymbolTable> m_ModuleSymbols{ SYSMON_PAGED_ALLOCATOR };
+    volatile uint32_t m_SymbolsState = static_cast<uint32_t>(SysMon::ModuleSymbolsState::kLoaded);
+    volatile uint64_t m_LastUsedTime = 0;
+
+    /**
+     * @brief   After a failed load, the symbols are not requested again before this time.
+     */
+    volatile uint64_t m_SymbolsRetryTime = 0;
+    uint32_t m_SymbolsLoadFailures = 0;
+
+    /**
+     * @brief   The delay after the first failed load, in xpf::ApiCurrentTime units (100ns) - 30 seconds.
+     */
+    static constexpr uint64_t SYMBOLS_RETRY_DELAY = 30ULL * 10000000ULL;
+
+    /**
+     * @brief   The delay stops doubling after this many failures - it is capped at about an hour.
+     */
+    static constexpr uint32_t SYMBOLS_MAX_RETRY_DELAY_SHIFT = 7;
+
+    /**
+     * @brief   How many paths resolve to this module. Guarded by the modules lock.
+     *          When it drops to 0 (the file was replaced in place), the module is stale.
+     */
+    uint32_t m_BoundPaths = 0;
+
+    /**
+     * @brief   The module collector creates the symbols lock when the module is inserted
+     *          and keeps track of the paths bound to the module.
+     */
+    friend class SysMon::ModuleCollector;
 };  // class ModuleData
 
+/**
+ * @brief   Maps a path to the module it resolves to. Several paths
+ *          may resolve to the same module.
+ */
+struct ModulePathEntry
+{
+    /**
+     * @brief   The path of the module, as it was reported on image load.
+     */
+    xpf::String<wchar_t> Path{ SYSMON_PAGED_ALLOCATOR };
+
+    /**
+     * @brief   The hash of the path. See KmHelper::HelperHashUnicodeString.
+     */
+    uint32_t PathHash = 0;
+
+    /**
+     * @brief   The module this path currently resolves to.
+     */
+    xpf::SharedPointer<SysMon::ModuleData> Module{ SYSMON_PAGED_ALLOCATOR };
+};
+
+/**
+ * @brief   Describes the memory held by a symbol table, when the symbols are trimmed.
+ *          A table may be shared by several modules - it is freed only when all drop it.
+ */
+struct ModuleSymbolsUsage
+{
+    /**
+     * @brief   The symbol table.
+     */
+    xpf::SharedPointer<SysMon::SymbolTable> Table{ SYSMON_PAGED_ALLOCATOR };
+
+    /**
+     * @brief   The memory held by the table. See SysMon::SymbolTable::MemorySize.
+     */
+    size_t MemorySize = 0;
+
+    /**
+     * @brief   The last time any of the modules sharing the table used it.
+     */
+    uint64_t LastUsedTime = 0;
+};
+
 /**
  * @brief   This will be passed to a work callback to help with async initialization of modules.
  *          From a work routine we'll do all the work and then emplace the module into the
@@ -190,6 +518,17 @@ struct ModuleContext
      * @brief   The module path for which the computations have to be performed.
      */
     xpf::String<wchar_t> Path{ SYSMON_PAGED_ALLOCATOR };
+
+    /**
+     * @brief   The hash of the module path. It is computed once when the module is
+     *          first seen, so the worker routine does not need to hash it again.
+     */
+    uint32_t PathHash = 0;
+
+    /**
+     * @brief   Set only when the work item loads the deferred symbols of this module.
+     */
+    xpf::SharedPointer<SysMon::ModuleData> Module{ SYSMON_PAGED_ALLOCATOR };
 };
 
 /**
@@ -216,8 +555,21 @@ class ModuleCollector final
     ~ModuleCollector(void) noexcept(true)
     {
         /* The queue must be ran down before destroying other members. */
+        /* Fail the requests sent to the symbol service, so the jobs don't wait for it. */
         this->m_IsQueueRunDown = true;
-        this->m_ModulesWorkQueue.Reset();
+        if (this->m_SymbolBroker.HasValue())
+        {
+            (*this->m_SymbolBroker).RunDown();
+        }
+        this->m_ModuleJobQueue.Reset();
+
+        /* No more work can be done now - so persist the cache. */
+        this->m_ModuleCache.Reset();
+        this->m_FileHasher.Reset();
+        this->m_SymbolCache.Reset();
+        this->m_SymbolStore.Reset();
+        this->m_PdbDownloader.Reset();
+        this->m_SymbolBroker.Reset();
     }
 
     /**
@@ -248,14 +600,18 @@ class ModuleCollector final
     ) noexcept(true);
 
     /**
-     * @brief           Inserts a module in the list.
+     * @brief           Inserts a module in the table and makes the path resolve to it.
+     *                  If a module with the same identity already exists, the existing
+     *                  one is kept and only the path is bound to it.
      *
      * @param[in,out]   ModulePath     - a string which contains the path of the module.
      * @param[in]       PathHash       - an unsigned value containing the hash for the ModulePath.
      *                                   This is the hash of the string defining the path.
+     * @param[in]       Identity       - The identity of the module.
      * @param[in,out]   ModuleHash     - The hash of the content of the module.
      * @param[in]       ModuleHashType - The type of hash that was computed.
-     * @param[in]       ModulesSymbols - Extracted symbols information.
+     * @param[in]       ModulesSymbols - The symbols of the module. May be empty.
+     * @param[in]       SymbolsState   - Whether the symbols are deferred until first use.
      *
      * @return          A proper NTSTATUS error value.
      */
@@ -263,37 +619,147 @@ class ModuleCollector final
     Insert(
         _Inout_ xpf::String<wchar_t>&& ModulePath,
         _In_ uint32_t PathHash,
+        _In_ _Const_ const SysMon::ModuleIdentity& Identity,
         _Inout_ xpf::Buffer&& ModuleHash,
         _In_ KmHelper::File::HashType ModuleHashType,
-        _Inout_ xpf::Vector<xpf::pdb::SymbolInformation>&& ModulesSymbols
+        _In_ _Const_ const xpf::SharedPointer<SysMon::SymbolTable>& ModulesSymbols,
+        _In_ SysMon::ModuleSymbolsState SymbolsState
     ) noexcept(true);
 
     /**
-     * @brief       Searches for a given module in the list.
+     * @brief       Makes a path resolve to an already existing module.
+     *              Any previous binding of this path is replaced.
+     *
+     * @param[in]   ModulePath     - a view over the string which contains the path of the module.
+     * @param[in]   PathHash       - the precomputed hash of the ModulePath.
+     * @param[in]   Module         - the module to which the path resolves.
+     *
+     * @return      A proper NTSTATUS error value.
+     */
+    NTSTATUS XPF_API
+    BindPath(
+        _In_ _Const_ const xpf::StringView<wchar_t>& ModulePath,
+        _In_ uint32_t PathHash,
+        _In_ _Const_ const xpf::SharedPointer<SysMon::ModuleData>& Module
+    ) noexcept(true);
+
+    /**
+     * @brief       Searches for the module a given path resolves to.
      *
      * @param[in]   ModulePath     - a view over the string which contains the path of the
      *                               module
+     * @param[in]   PathHash       - the precomputed hash of the ModulePath.
+     *                               See KmHelper::HelperHashUnicodeString.
      *
      * @return      Empty shared pointer if no data is found,
      *              a reference to the stored module data otherwise.
      */
-    inline
     xpf::SharedPointer<SysMon::ModuleData> XPF_API
     Find(
-        _In_ _Const_ const xpf::StringView<wchar_t>& ModulePath
+        _In_ _Const_ const xpf::StringView<wchar_t>& ModulePath,
+        _In_ uint32_t PathHash
     ) noexcept(true);
 
+    /**
+     * @brief       Searches for the module a path resolves to, knowing only the hash of the path.
+     *              Used for the stacks, which are kept for long and only remember the hash.
+     *
+     * @param[in]   PathHash       - the hash of the path. See KmHelper::HelperHashUnicodeString.
+     *
+     * @return      Empty shared pointer if no data is found,
+     *              a reference to the stored module data otherwise.
+     *
+     * @note        Two paths with the same hash are not told apart - the first one found wins.
+     *              The stacks are already deduplicated on the path hash, so this is consistent.
+     */
+    xpf::SharedPointer<SysMon::ModuleData> XPF_API
+    FindByPathHash(
+        _In_ uint32_t PathHash
+    ) noexcept(true);
+
+    /**
+     * @brief       Searches for a module given its identity.
+     *
+     * @param[in]   Identity - the identity of the module.
+     *
+     * @return      Empty shared pointer if no data is found,
+     *              a reference to the stored module data otherwise.
+     */
+    xpf::SharedPointer<SysMon::ModuleData> XPF_API
+    FindByIdentity(
+        _In_ _Const_ const SysMon::ModuleIdentity& Identity
+    ) noexcept(true);
+
+    /**
+     * @brief       Keeps the loaded symbols within the memory budget. The symbols of the
+     *              least recently used modules are evicted first. It also forgets the modules
+     *              which are not reachable through any path anymore.
+     *
+     * @return      Nothing.
+     *
+     * @note        After ReportMemoryPressure, it trims well below the budget.
+     *              It walks all the modules - call it only when ShouldTrimSymbols says so.
+     */
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    void XPF_API
+    TrimSymbols(
+        void
+    ) noexcept(true);
+
+    /**
+     * @brief       Signals that an allocation failed. The next TrimSymbols frees more memory.
+     *
+     * @return      Nothing.
+     */
+    inline void XPF_API
+    ReportMemoryPressure(
+        void
+    ) noexcept(true)
+    {
+        this->m_IsUnderMemoryPressure = true;
+    }
+
+    /**
+     * @brief       Accounts a newly loaded symbol table against the memory budget.
+     *
+     * @param[in]   MemorySize - The memory held by the table.
+     *
+     * @return      Nothing.
+     */
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    void XPF_API
+    AccountSymbols(
+        _In_ size_t MemorySize
+    ) noexcept(true);
+
+    /**
+     * @brief       Tells whether TrimSymbols has anything to do - the accounted symbols
+     *              are over the budget, or an allocation failed since the last trim.
+     *
+     * @return      true if the symbols should be trimmed, false otherwise.
+     */
+    inline bool XPF_API
+    ShouldTrimSymbols(
+        void
+    ) const noexcept(true)
+    {
+        return this->m_IsUnderMemoryPressure ||
+               this->m_AccountedSymbolsSize > uint64_t{ this->m_SymbolsMemoryBudget };
+    }
+
     /**
      * @brief       Creates a new module context.
      *
      * @param[in]   ModulePath - the path of the module.
+     * @param[in]   PathHash   - the precomputed hash of the ModulePath.
      *
      * @return      null on failure, or a pointer to the
      *              newly created module context otherwise.
      */
     ModuleContext* XPF_API
     CreateModuleContext(
-        _In_ _Const_ const xpf::StringView<wchar_t>& ModulePath
+        _In_ _Const_ const xpf::StringView<wchar_t>& ModulePath,
+        _In_ uint32_t PathHash
     ) noexcept(true);
 
     /**
@@ -309,18 +775,102 @@ class ModuleCollector final
     ) noexcept(true);
 
     /**
-     * @brief       Grabs the modules work queue which can be used to schedule work
+     * @brief       Grabs the modules job queue which can be used to schedule work
      *              related to offline initialization of a module.
      *
-     * @return      A reference to the underlying WorkQueue.
+     * @return      A reference to the underlying ModuleJobQueue.
      */
-    inline KmHelper::WorkQueue&
+    inline SysMon::ModuleJobQueue&
     XPF_API
-    WorkQueue(
+    JobQueue(
         void
     ) noexcept(true)
     {
-        return (*this->m_ModulesWorkQueue);
+        return (*this->m_ModuleJobQueue);
+    }
+
+    /**
+     * @brief       Grabs the persistent cache of module hashes and symbols.
+     *
+     * @return      A reference to the underlying ModuleCache.
+     */
+    inline SysMon::ModuleCache&
+    XPF_API
+    ModuleCache(
+        void
+    ) noexcept(true)
+    {
+        return (*this->m_ModuleCache);
+    }
+
+    /**
+     * @brief       Grabs the file hasher shared by the module workers.
+     *
+     * @return      A reference to the underlying FileHasher.
+     */
+    inline KmHelper::File::FileHasher&
+    XPF_API
+    FileHasher(
+        void
+    ) noexcept(true)
+    {
+        return (*this->m_FileHasher);
+    }
+
+    /**
+     * @brief       Grabs the symbol tables shared by the modules with the same pdb.
+     *
+     * @return      A reference to the underlying SymbolStore.
+     */
+    inline SysMon::SymbolStore&
+    XPF_API
+    SymbolStore(
+        void
+    ) noexcept(true)
+    {
+        return (*this->m_SymbolStore);
+    }
+
+    /**
+     * @brief       Grabs the cache of the symbol lookups done while decorating stacks.
+     *
+     * @return      A reference to the underlying SymbolCache.
+     */
+    inline SysMon::SymbolCache&
+    XPF_API
+    SymbolCache(
+        void
+    ) noexcept(true)
+    {
+        return (*this->m_SymbolCache);
+    }
+
+    /**
+     * @brief       Grabs the downloader which brings the pdbs from the symbol server.
+     *
+     * @return      A reference to the underlying PdbDownloader.
+     */
+    inline PdbHelper::PdbDownloader&
+    XPF_API
+    PdbDownloader(
+        void
+    ) noexcept(true)
+    {
+        return (*this->m_PdbDownloader);
+    }
+
+    /**
+     * @brief       Grabs the broker which hands the pdb parsing to the user mode symbol service.
+     *
+     * @return      A reference to the underlying SymbolBroker.
+     */
+    inline SysMon::SymbolBroker&
+    XPF_API
+    SymbolBroker(
+        void
+    ) noexcept(true)
+    {
+        return (*this->m_SymbolBroker);
     }
 
     /**
@@ -339,12 +889,112 @@ class ModuleCollector final
     }
 
  private:
+    /**
+     * @brief       Maps an identity hash to the bucket in which the module is stored.
+     *
+     * @param[in]   Identity - the identity of the module.
+     *
+     * @return      A reference to the bucket. The lock must be acquired by the caller.
+     */
+    inline xpf::Vector<xpf::SharedPointer<SysMon::ModuleData>>& XPF_API
+    ModuleBucket(
+        _In_ _Const_ const SysMon::ModuleIdentity& Identity
+    ) noexcept(true)
+    {
+        return this->m_ModuleBuckets[Identity.Hash() % this->m_ModuleBuckets.Size()];
+    }
+
+    /**
+     * @brief       Maps a path hash to the bucket in which the path entry is stored.
+     *
+     * @param[in]   PathHash - the hash of the module path.
+     *
+     * @return      A reference to the bucket. The lock must be acquired by the caller.
+     */
+    inline xpf::Vector<xpf::SharedPointer<SysMon::ModulePathEntry>>& XPF_API
+    PathBucket(
+        _In_ uint32_t PathHash
+    ) noexcept(true)
+    {
+        return this->m_PathBuckets[PathHash % this->m_PathBuckets.Size()];
+    }
+
+    /**
+     * @brief       Binds a path to a module. The lock must be acquired exclusively by the caller.
+     *
+     * @param[in]   ModulePath     - a view over the string which contains the path of the module.
+     * @param[in]   PathHash       - the precomputed hash of the ModulePath.
+     * @param[in]   Module         - the module to which the path resolves.
+     *
+     * @return      A proper NTSTATUS error value.
+     */
+    NTSTATUS XPF_API
+    BindPathLocked(
+        _In_ _Const_ const xpf::StringView<wchar_t>& ModulePath,
+        _In_ uint32_t PathHash,
+        _In_ _Const_ const xpf::SharedPointer<SysMon::ModuleData>& Module
+    ) noexcept(true);
+
+    /**
+     * @brief       Forgets the stale modules and collects the memory held by the loaded symbols.
+     *              The modules lock is held shared only to snapshot the modules - it is held
+     *              exclusively only if there are stale modules to be forgotten.
+     *
+     * @param[out]  LoadedModules - The modules which have symbols loaded.
+     * @param[out]  Usage         - The symbol tables of the LoadedModules, each one once.
+     * @param[out]  TotalSize     - The memory held by all the tables in Usage.
+     *
+     * @return      A proper NTSTATUS error value.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    CollectSymbolsUsage(
+        _Out_ xpf::Vector<xpf::SharedPointer<SysMon::ModuleData>>* LoadedModules,
+        _Out_ xpf::Vector<SysMon::ModuleSymbolsUsage>* Usage,
+        _Out_ size_t* TotalSize
+    ) noexcept(true);
+
+ private:
+    /**
+     * @brief   The number of buckets in the modules and paths hash tables. A machine has
+     *          a few thousands distinct modules at most, so the chains are short.
+     */
+    static constexpr size_t MODULE_BUCKETS_COUNT = 509;
+
+    /**
+     * @brief   How much memory the loaded symbols may hold, if not configured in registry.
+     */
+    static constexpr size_t DEFAULT_SYMBOLS_MEMORY_BUDGET = 64 * 1024 * 1024;
+
+    /**
+     * @brief   Under memory pressure the symbols are trimmed to a fraction of the budget.
+     */
+    static constexpr size_t MEMORY_PRESSURE_BUDGET_DIVISOR = 4;
+
     xpf::Optional<xpf::ReadWriteLock> m_ModulesLock;
-    xpf::Vector<xpf::SharedPointer<SysMon::ModuleData>> m_Modules{ SYSMON_PAGED_ALLOCATOR };
+    xpf::Vector<xpf::Vector<xpf::SharedPointer<SysMon::ModuleData>>> m_ModuleBuckets{ SYSMON_PAGED_ALLOCATOR };
+    xpf::Vector<xpf::Vector<xpf::SharedPointer<SysMon::ModulePathEntry>>> m_PathBuckets{ SYSMON_PAGED_ALLOCATOR };
     xpf::LookasideListAllocator m_ModuleContextAllocator;
-    xpf::Optional<KmHelper::WorkQueue> m_ModulesWorkQueue;
+    xpf::Optional<SysMon::ModuleJobQueue> m_ModuleJobQueue;
+    xpf::Optional<SysMon::ModuleCache> m_ModuleCache;
+    xpf::Optional<KmHelper::File::FileHasher> m_FileHasher;
+    xpf::Optional<SysMon::SymbolStore> m_SymbolStore;
+    xpf::Optional<SysMon::SymbolCache> m_SymbolCache;
+    xpf::Optional<PdbHelper::PdbDownloader> m_PdbDownloader;
+    xpf::Optional<SysMon::SymbolBroker> m_SymbolBroker;
     bool m_IsQueueRunDown = false;
 
+    size_t m_SymbolsMemoryBudget = DEFAULT_SYMBOLS_MEMORY_BUDGET;
+    volatile bool m_IsUnderMemoryPressure = false;
+
+    /**
+     * @brief   The memory of the loaded symbol tables - added on load, reconciled on trim.
+     *          Tables freed along with stale modules are only noticed on the next trim,
+     *          so it may be slightly above the real usage, never far below it.
+     */
+    volatile uint64_t m_AccountedSymbolsSize = 0;
+
     /**
      * @brief   Default MemoryAllocator is our friend as it requires access to the private
      *          default constructor. It is used in the Create() method to ensure that
@@ -394,27 +1044,107 @@ ModuleCollectorDestroy(
  *              to find a specific module given its path.
  *
  * @param[in]   ModulePath      - the path of the new module.
+ * @param[in]   PathHash        - the precomputed hash of the ModulePath.
+ *                                See SysMon::ProcessModuleData::PathHash.
  *
  * @return      A shared pointer to module data.
  */
 _IRQL_requires_max_(APC_LEVEL)
 xpf::SharedPointer<SysMon::ModuleData> XPF_API
 ModuleCollectorFindModule(
-    _In_ _Const_ const xpf::StringView<wchar_t>& ModulePath
+    _In_ _Const_ const xpf::StringView<wchar_t>& ModulePath,
+    _In_ uint32_t PathHash
+) noexcept(true);
+
+/**
+ * @brief       This API handles queries to the module collector
+ *              to find a module knowing only the hash of its path.
+ *
+ * @param[in]   PathHash        - the hash of the module path.
+ *                                See SysMon::ProcessModuleData::PathHash.
+ *
+ * @return      A shared pointer to module data. Empty if no path with this hash is known.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+xpf::SharedPointer<SysMon::ModuleData> XPF_API
+ModuleCollectorFindModuleByPathHash(
+    _In_ uint32_t PathHash
+) noexcept(true);
+
+/**
+ * @brief       Symbols are loaded only for the modules which need them.
+ *              This API enqueues a work item to load the symbols of the module,
+ *              if they were deferred. It does not wait for the symbols to be loaded.
+ *
+ * @param[in]   Module  - The module whose symbols are needed.
+ *
+ * @return      Nothing.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+void XPF_API
+ModuleCollectorRequestSymbols(
+    _In_ _Const_ const xpf::SharedPointer<SysMon::ModuleData>& Module
+) noexcept(true);
+
+/**
+ * @brief       Finds the closest symbol whose rva is smaller or equal to the given one.
+ *              The lookups are cached, as the same return addresses are decorated over
+ *              and over. If the symbols of the module are not loaded yet, their load is
+ *              requested and STATUS_NOT_FOUND is returned.
+ *
+ * @param[in]   Module      - The module containing the rva.
+ * @param[in]   Rva         - The rva to be resolved.
+ * @param[out]  SymbolRva   - The rva of the found symbol.
+ * @param[out]  SymbolName  - The name of the found symbol.
+ *
+ * @return      STATUS_NOT_FOUND if there is no such symbol,
+ *              or a proper ntstatus error code.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_Must_inspect_result_
+NTSTATUS XPF_API
+ModuleCollectorFindSymbol(
+    _In_ _Const_ const xpf::SharedPointer<SysMon::ModuleData>& Module,
+    _In_ uint32_t Rva,
+    _Out_ uint32_t* SymbolRva,
+    _Out_ xpf::String<char>* SymbolName
 ) noexcept(true);
 
 /**
  * @brief       This API handles the creation of a new module.
  *              It first looks up in the module collector cache.
- *              If the module is not found, it enqueues an async
- *              work item to compute the details about this module.
+ *              If the module is not found, or if the mapped image does not
+ *              match the cached one (the file was replaced in place), it
+ *              enqueues an async work item to compute the details about this module.
  *
  * @param[in]   ModulePath      - the path of the new module.
+ * @param[in]   ModuleBase      - where the module is mapped. Must be accessible
+ *                                from the current context.
+ * @param[in]   ModuleSize      - the size of the mapped module.
  *
  * @return      Nothing.
  */
 _IRQL_requires_max_(PASSIVE_LEVEL)
 void XPF_API
 ModuleCollectorHandleNewModule(
-    _In_ _Const_ const xpf::StringView<wchar_t>& ModulePath
+    _In_ _Const_ const xpf::StringView<wchar_t>& ModulePath,
+    _In_ _Const_ const void* ModuleBase,
+    _In_ _Const_ const size_t& ModuleSize
+) noexcept(true);
+
+/**
+ * @brief       This API handles the messages sent by the user mode symbol service.
+ *              See SysMon::SymbolBroker.
+ *
+ * @param[in,out]   Message     - The message. A get request is filled in place.
+ * @param[in]       MessageSize - The size of the message, including the header.
+ *
+ * @return      A proper ntstatus error code.
+ */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Must_inspect_result_
+NTSTATUS XPF_API
+ModuleCollectorHandleSymbolsMessage(
+    _Inout_ UM_KM_MESSAGE_HEADER* Message,
+    _In_ size_t MessageSize
 ) noexcept(true);
@@ -0,0 +1,381 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/ModuleJobQueue.cpp
+ *
+ * @brief       In this file we define the queue on which the module collector
+ *              schedules its work - hashing modules and loading their symbols.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "precomp.hpp"
+
+#include "ModuleJobQueue.hpp"
+#include "trace.hpp"
+
+/**
+ * @brief   The queue is paged. It is only used at max APC_LEVEL.
+ */
+XPF_SECTION_PAGED;
+
+SysMon::ModuleJobQueue::~ModuleJobQueue(
+    void
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    /* The running jobs keep starting the pending ones - so this waits for all of them. */
+    this->m_WorkQueue.Reset();
+
+    SysMonLogInfo("Module jobs: enqueued %llu, deduplicated %llu, rejected %llu, started %llu, "
+                  "max pending %llu, total wait %llu, max wait %llu, total run %llu, max run %llu (100ns)",
+                  this->m_Metrics.EnqueuedJobs,
+                  this->m_Metrics.DeduplicatedJobs,
+                  this->m_Metrics.RejectedJobs,
+                  this->m_Metrics.StartedJobs,
+                  static_cast<uint64_t>(this->m_Metrics.MaxPendingJobs),
+                  this->m_Metrics.TotalWaitTime,
+                  this->m_Metrics.MaxWaitTime,
+                  this->m_Metrics.TotalRunTime,
+                  this->m_Metrics.MaxRunTime);
+
+    for (size_t i = 0; i < SysMon::MODULE_JOB_KINDS_COUNT; ++i)
+    {
+        const SysMon::ModuleJobKindMetrics& kindMetrics = this->m_Metrics.Kinds[i];
+        SysMonLogInfo("Module jobs of kind %llu: enqueued %llu, deduplicated %llu, rejected %llu, started %llu, "
+                      "total wait %llu, max wait %llu, total run %llu, max run %llu (100ns)",
+                      static_cast<uint64_t>(i),
+                      kindMetrics.EnqueuedJobs,
+                      kindMetrics.DeduplicatedJobs,
+                      kindMetrics.RejectedJobs,
+                      kindMetrics.StartedJobs,
+                      kindMetrics.TotalWaitTime,
+                      kindMetrics.MaxWaitTime,
+                      kindMetrics.TotalRunTime,
+                      kindMetrics.MaxRunTime);
+    }
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::ModuleJobQueue::Create(
+    _Out_ xpf::Optional<SysMon::ModuleJobQueue>* Queue
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != Queue);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    /* Preinit output. */
+    Queue->Reset();
+    Queue->Emplace();
+
+    SysMon::ModuleJobQueue& queue = (*(*Queue));
+
+    status = xpf::ReadWriteLock::Create(&queue.m_QueueLock);
+    if (!NT_SUCCESS(status))
+    {
+        Queue->Reset();
+        return status;
+    }
+    queue.m_WorkQueue.Emplace();
+
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::ModuleJobQueue::Enqueue(
+    _In_ SysMon::ModuleJobKind Kind,
+    _In_ uint64_t Key,
+    _In_ xpf::thread::Callback Callback,
+    _In_opt_ xpf::thread::CallbackArgument Argument,
+    _In_opt_ SysMon::ModuleJobMatch Match
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    SysMon::ModuleJob newJob;
+    bool shouldStartRunner = false;
+
+    newJob.Kind = Kind;
+    newJob.Key = Key;
+    newJob.Hits = 1;
+    newJob.EnqueueTime = xpf::ApiCurrentTime();
+    newJob.Callback = Callback;
+    newJob.Argument = Argument;
+    newJob.Match = Match;
+
+    {
+        xpf::ExclusiveLockGuard guard{ *this->m_QueueLock };
+
+        /* The same module loaded in many processes - one job is enough, but it is now more important. */
+        SysMon::ModuleJob* pendingJob = this->FindPendingLocked(Kind, Key, Match, Argument);
+        if (nullptr != pendingJob)
+        {
+            pendingJob->Hits++;
+            this->m_Metrics.DeduplicatedJobs++;
+            this->KindMetricsLocked(Kind).DeduplicatedJobs++;
+            return STATUS_ALREADY_REGISTERED;
+        }
+
+        if (this->m_PendingJobs.Size() >= SysMon::ModuleJobQueue::MAX_PENDING_JOBS)
+        {
+            this->m_Metrics.RejectedJobs++;
+            this->KindMetricsLocked(Kind).RejectedJobs++;
+            return STATUS_QUOTA_EXCEEDED;
+        }
+
+        newJob.Sequence = this->m_NextSequence++;
+        status = this->m_PendingJobs.Emplace(newJob);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        this->m_Metrics.EnqueuedJobs++;
+        this->KindMetricsLocked(Kind).EnqueuedJobs++;
+        if (this->m_PendingJobs.Size() > this->m_Metrics.MaxPendingJobs)
+        {
+            this->m_Metrics.MaxPendingJobs = this->m_PendingJobs.Size();
+        }
+
+        /* Only a few runners at once - the others pick their jobs from the pending list. */
+        if (this->m_RunningJobs < SysMon::ModuleJobQueue::MAX_RUNNING_JOBS)
+        {
+            this->m_RunningJobs++;
+            shouldStartRunner = true;
+        }
+    }
+
+    if (shouldStartRunner)
+    {
+        status = (*this->m_WorkQueue).EnqueueWork(SysMon::ModuleJobQueue::RunJobs,
+                                                  this,
+                                                  false);
+        if (!NT_SUCCESS(status))
+        {
+            /* The work queue is running down - take the job back, the caller still owns the argument. */
+            xpf::ExclusiveLockGuard guard{ *this->m_QueueLock };
+            this->m_RunningJobs--;
+
+            for (size_t i = 0; i < this->m_PendingJobs.Size(); ++i)
+            {
+                if (this->m_PendingJobs[i].Sequence == newJob.Sequence)
+                {
+                    NTSTATUS eraseStatus = this->m_PendingJobs.Erase(i);
+                    XPF_DEATH_ON_FAILURE(NT_SUCCESS(eraseStatus));
+
+                    this->m_Metrics.EnqueuedJobs--;
+                    this->KindMetricsLocked(Kind).EnqueuedJobs--;
+                    this->m_Metrics.RejectedJobs++;
+                    this->KindMetricsLocked(Kind).RejectedJobs++;
+                    return status;
+                }
+            }
+
+            /* A running job already picked it up - it will run. */
+        }
+    }
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+void XPF_API
+SysMon::ModuleJobQueue::Hit(
+    _In_ SysMon::ModuleJobKind Kind,
+    _In_ uint64_t Key
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    xpf::ExclusiveLockGuard guard{ *this->m_QueueLock };
+
+    SysMon::ModuleJob* pendingJob = this->FindPendingLocked(Kind, Key, nullptr, nullptr);
+    if (nullptr != pendingJob)
+    {
+        pendingJob->Hits++;
+    }
+}
+
+_Use_decl_annotations_
+void XPF_API
+SysMon::ModuleJobQueue::QueryMetrics(
+    _Out_ SysMon::ModuleJobQueueMetrics* Metrics
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != Metrics);
+
+    xpf::SharedLockGuard guard{ *this->m_QueueLock };
+
+    *Metrics = this->m_Metrics;
+    Metrics->PendingJobs = this->m_PendingJobs.Size();
+
+    if (this->m_WorkQueue.HasValue())
+    {
+        (*this->m_WorkQueue).QueryMetrics(&Metrics->WorkQueue);
+    }
+}
+
+_Use_decl_annotations_
+SysMon::ModuleJob* XPF_API
+SysMon::ModuleJobQueue::FindPendingLocked(
+    _In_ SysMon::ModuleJobKind Kind,
+    _In_ uint64_t Key,
+    _In_opt_ SysMon::ModuleJobMatch Match,
+    _In_opt_ xpf::thread::CallbackArgument Argument
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    for (size_t i = 0; i < this->m_PendingJobs.Size(); ++i)
+    {
+        if (this->m_PendingJobs[i].Kind != Kind || this->m_PendingJobs[i].Key != Key)
+        {
+            continue;
+        }
+
+        /* A colliding key is a different job - it is queued on its own. */
+        if (nullptr != Match && !Match(this->m_PendingJobs[i].Argument, Argument))
+        {
+            continue;
+        }
+        return &this->m_PendingJobs[i];
+    }
+    return nullptr;
+}
+
+_Use_decl_annotations_
+bool XPF_API
+SysMon::ModuleJobQueue::PopNextLocked(
+    _Out_ SysMon::ModuleJob* Job
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    size_t next = 0;
+
+    if (this->m_PendingJobs.IsEmpty())
+    {
+        return false;
+    }
+
+    /* The list is bounded and small - a linear scan is cheaper than keeping it ordered on every hit. */
+    for (size_t i = 1; i < this->m_PendingJobs.Size(); ++i)
+    {
+        const SysMon::ModuleJob& candidate = this->m_PendingJobs[i];
+        const SysMon::ModuleJob& best = this->m_PendingJobs[next];
+
+        if ((candidate.Hits > best.Hits) ||
+            (candidate.Hits == best.Hits && candidate.Sequence > best.Sequence))
+        {
+            next = i;
+        }
+    }
+
+    *Job = this->m_PendingJobs[next];
+    NTSTATUS status = this->m_PendingJobs.Erase(next);
+    XPF_DEATH_ON_FAILURE(NT_SUCCESS(status));
+
+    return true;
+}
+
+_Use_decl_annotations_
+SysMon::ModuleJobKindMetrics& XPF_API
+SysMon::ModuleJobQueue::KindMetricsLocked(
+    _In_ SysMon::ModuleJobKind Kind
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    const size_t index = static_cast<size_t>(Kind);
+    XPF_DEATH_ON_FAILURE(index < SysMon::MODULE_JOB_KINDS_COUNT);
+
+    return this->m_Metrics.Kinds[index];
+}
+
+_Use_decl_annotations_
+void XPF_API
+SysMon::ModuleJobQueue::RunJobs(
+    _In_opt_ xpf::thread::CallbackArgument Argument
+) noexcept(true)
+{
+    /* The routine can be called only at max PASSIVE_LEVEL from worker thread. */
+    XPF_MAX_PASSIVE_LEVEL();
+
+    SysMon::ModuleJobQueue* queue = static_cast<SysMon::ModuleJobQueue*>(Argument);
+    if (nullptr == queue)
+    {
+        XPF_ASSERT(false);
+        return;
+    }
+
+    /* The run time of a job is accounted the next time the lock is taken. */
+    bool hasFinishedJob = false;
+    SysMon::ModuleJobKind finishedKind = SysMon::ModuleJobKind::kNewModule;
+    uint64_t finishedRunTime = 0;
+
+    while (true)
+    {
+        SysMon::ModuleJob job;
+
+        {
+            xpf::ExclusiveLockGuard guard{ *queue->m_QueueLock };
+
+            if (hasFinishedJob)
+            {
+                SysMon::ModuleJobKindMetrics& kindMetrics = queue->KindMetricsLocked(finishedKind);
+
+                queue->m_Metrics.TotalRunTime += finishedRunTime;
+                if (finishedRunTime > queue->m_Metrics.MaxRunTime)
+                {
+                    queue->m_Metrics.MaxRunTime = finishedRunTime;
+                }
+                kindMetrics.TotalRunTime += finishedRunTime;
+                if (finishedRunTime > kindMetrics.MaxRunTime)
+                {
+                    kindMetrics.MaxRunTime = finishedRunTime;
+                }
+            }
+
+            /* Nothing left - this runner is done. */
+            if (!queue->PopNextLocked(&job))
+            {
+                queue->m_RunningJobs--;
+                return;
+            }
+
+            const uint64_t now = xpf::ApiCurrentTime();
+            const uint64_t waitTime = KmHelper::WorkQueueStats::Elapsed(job.EnqueueTime, now);
+            queue->m_Metrics.StartedJobs++;
+            queue->m_Metrics.TotalWaitTime += waitTime;
+            if (waitTime > queue->m_Metrics.MaxWaitTime)
+            {
+                queue->m_Metrics.MaxWaitTime = waitTime;
+            }
+
+            SysMon::ModuleJobKindMetrics& kindMetrics = queue->KindMetricsLocked(job.Kind);
+            kindMetrics.StartedJobs++;
+            kindMetrics.TotalWaitTime += waitTime;
+            if (waitTime > kindMetrics.MaxWaitTime)
+            {
+                kindMetrics.MaxWaitTime = waitTime;
+            }
+        }
+
+        const uint64_t startTime = xpf::ApiCurrentTime();
+        job.Callback(job.Argument);
+        const uint64_t endTime = xpf::ApiCurrentTime();
+
+        hasFinishedJob = true;
+        finishedKind = job.Kind;
+        finishedRunTime = KmHelper::WorkQueueStats::Elapsed(startTime, endTime);
+    }
+}
@@ -0,0 +1,386 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/ModuleJobQueue.hpp
+ *
+ * @brief       In this file we define the queue on which the module collector
+ *              schedules its work - hashing modules and loading their symbols.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#pragma once
+
+#include "precomp.hpp"
+
+#include "WorkQueue.hpp"
+
+
+namespace SysMon
+{
+/**
+ * @brief   The kinds of jobs. Jobs of different kinds never share a key.
+ */
+enum class ModuleJobKind : uint32_t
+{
+    /**
+     * @brief   A module was seen for the first time. The key is the path hash,
+     *          colliding paths are told apart by the job match callback.
+     */
+    kNewModule = 0,
+
+    /**
+     * @brief   A stack needs the symbols of a module. The key is the module address.
+     */
+    kSymbols = 1,
+};
+
+/**
+ * @brief   How many kinds of jobs there are - used to size the per kind metrics.
+ */
+static constexpr size_t MODULE_JOB_KINDS_COUNT = 2;
+
+/**
+ * @brief       Decides whether two jobs with the same kind and key are the same job.
+ *              The keys are hashes for some kinds, so they might collide.
+ *
+ * @param[in]   PendingArgument - The argument of the pending job.
+ * @param[in]   NewArgument     - The argument of the job being enqueued.
+ *
+ * @return      true if the jobs are the same, false otherwise.
+ */
+typedef bool (XPF_API* ModuleJobMatch)(
+    _In_opt_ xpf::thread::CallbackArgument PendingArgument,
+    _In_opt_ xpf::thread::CallbackArgument NewArgument
+) noexcept(true);
+
+/**
+ * @brief   A job waiting in the queue.
+ */
+struct ModuleJob
+{
+    /**
+     * @brief   The kind of the job.
+     */
+    SysMon::ModuleJobKind Kind = SysMon::ModuleJobKind::kNewModule;
+
+    /**
+     * @brief   Identifies the job. A job with the same kind and key is not enqueued twice.
+     */
+    uint64_t Key = 0;
+
+    /**
+     * @brief   How many times the job was requested while pending.
+     *          Modules which are hit more often are processed first.
+     */
+    uint32_t Hits = 0;
+
+    /**
+     * @brief   Increases with every enqueued job. On equal hits, the most recent job goes first.
+     */
+    uint64_t Sequence = 0;
+
+    /**
+     * @brief   When the job was enqueued - used for the wait time metrics.
+     */
+    uint64_t EnqueueTime = 0;
+
+    /**
+     * @brief   The callback that runs the job.
+     */
+    xpf::thread::Callback Callback = nullptr;
+
+    /**
+     * @brief   The caller-defined context for Callback.
+     */
+    xpf::thread::CallbackArgument Argument = nullptr;
+
+    /**
+     * @brief   Optional. Confirms that a job with the same key is indeed the same job.
+     */
+    SysMon::ModuleJobMatch Match = nullptr;
+};
+
+/**
+ * @brief   The counters of a single kind of jobs.
+ *          Times are in the units returned by xpf::ApiCurrentTime (100ns).
+ */
+struct ModuleJobKindMetrics
+{
+    /**
+     * @brief   How many jobs were accepted, merged into a pending one, or refused.
+     */
+    uint64_t EnqueuedJobs = 0;
+    uint64_t DeduplicatedJobs = 0;
+    uint64_t RejectedJobs = 0;
+
+    /**
+     * @brief   How many jobs were started.
+     */
+    uint64_t StartedJobs = 0;
+
+    /**
+     * @brief   The total and the longest time a started job spent waiting in the queue.
+     */
+    uint64_t TotalWaitTime = 0;
+    uint64_t MaxWaitTime = 0;
+
+    /**
+     * @brief   The total and the longest time a job ran.
+     */
+    uint64_t TotalRunTime = 0;
+    uint64_t MaxRunTime = 0;
+};
+
+/**
+ * @brief   A snapshot of the queue counters.
+ *          Times are in the units returned by xpf::ApiCurrentTime (100ns).
+ */
+struct ModuleJobQueueMetrics
+{
+    /**
+     * @brief   How many jobs are waiting right now.
+     */
+    size_t PendingJobs = 0;
+
+    /**
+     * @brief   The largest number of jobs which were waiting at once.
+     */
+    size_t MaxPendingJobs = 0;
+
+    /**
+     * @brief   How many jobs were accepted.
+     */
+    uint64_t EnqueuedJobs = 0;
+
+    /**
+     * @brief   How many jobs were merged into an already pending one.
+     */
+    uint64_t DeduplicatedJobs = 0;
+
+    /**
+     * @brief   How many jobs were refused because the queue was full.
+     */
+    uint64_t RejectedJobs = 0;
+
+    /**
+     * @brief   How many jobs were started.
+     */
+    uint64_t StartedJobs = 0;
+
+    /**
+     * @brief   The total time the started jobs spent waiting in the queue.
+     */
+    uint64_t TotalWaitTime = 0;
+
+    /**
+     * @brief   The longest time a started job spent waiting in the queue.
+     */
+    uint64_t MaxWaitTime = 0;
+
+    /**
+     * @brief   The total time the finished jobs ran.
+     */
+    uint64_t TotalRunTime = 0;
+
+    /**
+     * @brief   The longest time a job ran.
+     */
+    uint64_t MaxRunTime = 0;
+
+    /**
+     * @brief   The same counters, split by the kind of the job.
+     */
+    SysMon::ModuleJobKindMetrics Kinds[SysMon::MODULE_JOB_KINDS_COUNT];
+
+    /**
+     * @brief   The counters of the work queue on which the jobs run -
+     *          with the wait and run time histograms.
+     */
+    KmHelper::WorkQueueMetrics WorkQueue;
+};
+
+/**
+ * @brief   This class keeps the pending module jobs and runs them by priority.
+ *
+ *          The work items of the system queue run in fifo order and are shared with
+ *          everyone else, so a burst of module loads would delay other work. Here the
+ *          jobs wait in a bounded list and at most MAX_RUNNING_JOBS of them are handed
+ *          to the work queue at once. Each time a job finishes, the pending job with the
+ *          most hits (the most recent one on ties) is started next.
+ */
+class ModuleJobQueue final
+{
+ private:
+    /**
+     * @brief  Default constructor - private as Create
+     *         method must be used to instantiate an object.
+     */
+    ModuleJobQueue(void) noexcept(true) = default;
+
+ public:
+    /**
+     * @brief   Destructor. Waits for all the pending jobs to run.
+     */
+    ~ModuleJobQueue(void) noexcept(true);
+
+    /**
+     * @brief   Copy and move are deleted for this class.
+     *          They can be implemented when required.
+     */
+    XPF_CLASS_COPY_MOVE_BEHAVIOR(SysMon::ModuleJobQueue, delete);
+
+    /**
+     * @brief       Creates a job queue.
+     *
+     * @param[out]  Queue - On success, it will contain a properly initialized object.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    static NTSTATUS XPF_API
+    Create(
+        _Out_ xpf::Optional<SysMon::ModuleJobQueue>* Queue
+    ) noexcept(true);
+
+    /**
+     * @brief       Enqueues a job. It is not waited for.
+     *
+     * @param[in]   Kind        - The kind of the job.
+     * @param[in]   Key         - Identifies the job inside its kind.
+     * @param[in]   Callback    - The callback to be executed.
+     * @param[in]   Argument    - Passed as Callback for context.
+     * @param[in]   Match       - Optional. When the Key is a hash, it is called for a pending job
+     *                            with the same key, to tell a collision from the same job.
+     *
+     * @return      STATUS_ALREADY_REGISTERED if the same job is already pending - it gets a hit instead,
+     *              STATUS_QUOTA_EXCEEDED if the queue is full,
+     *              or a proper NTSTATUS error code.
+     *
+     * @note        On failure, the callback will not run - the caller still owns the Argument.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(APC_LEVEL)
+    NTSTATUS XPF_API
+    Enqueue(
+        _In_ SysMon::ModuleJobKind Kind,
+        _In_ uint64_t Key,
+        _In_ xpf::thread::Callback Callback,
+        _In_opt_ xpf::thread::CallbackArgument Argument,
+        _In_opt_ SysMon::ModuleJobMatch Match
+    ) noexcept(true);
+
+    /**
+     * @brief       Records a hit for a pending job, so it is started sooner.
+     *
+     * @param[in]   Kind    - The kind of the job.
+     * @param[in]   Key     - Identifies the job inside its kind.
+     *
+     * @return      Nothing. If the job is not pending, nothing happens.
+     */
+    _IRQL_requires_max_(APC_LEVEL)
+    void XPF_API
+    Hit(
+        _In_ SysMon::ModuleJobKind Kind,
+        _In_ uint64_t Key
+    ) noexcept(true);
+
+    /**
+     * @brief       Takes a snapshot of the queue counters.
+     *
+     * @param[out]  Metrics - The current counters.
+     *
+     * @return      Nothing.
+     */
+    _IRQL_requires_max_(APC_LEVEL)
+    void XPF_API
+    QueryMetrics(
+        _Out_ SysMon::ModuleJobQueueMetrics* Metrics
+    ) noexcept(true);
+
+ private:
+    /**
+     * @brief       Finds a pending job. The queue lock must be held.
+     *
+     * @param[in]   Kind     - The kind of the job.
+     * @param[in]   Key      - Identifies the job inside its kind.
+     * @param[in]   Match    - Optional. Confirms a pending job with the same key is the same job.
+     * @param[in]   Argument - The argument passed to Match, along with the one of the pending job.
+     *
+     * @return      The job, or nullptr if it is not pending.
+     */
+    SysMon::ModuleJob* XPF_API
+    FindPendingLocked(
+        _In_ SysMon::ModuleJobKind Kind,
+        _In_ uint64_t Key,
+        _In_opt_ SysMon::ModuleJobMatch Match,
+        _In_opt_ xpf::thread::CallbackArgument Argument
+    ) noexcept(true);
+
+    /**
+     * @brief       Removes the job which must run next. The queue lock must be held.
+     *
+     * @param[out]  Job - The job to run.
+     *
+     * @return      false if there are no pending jobs, true otherwise.
+     */
+    bool XPF_API
+    PopNextLocked(
+        _Out_ SysMon::ModuleJob* Job
+    ) noexcept(true);
+
+    /**
+     * @brief       Gets the counters of a kind of jobs. The queue lock must be held.
+     *
+     * @param[in]   Kind - The kind of the jobs.
+     *
+     * @return      The counters of that kind.
+     */
+    SysMon::ModuleJobKindMetrics& XPF_API
+    KindMetricsLocked(
+        _In_ SysMon::ModuleJobKind Kind
+    ) noexcept(true);
+
+    /**
+     * @brief       Runs on the work queue. It keeps starting pending jobs until there are none.
+     *
+     * @param[in]   Argument - The ModuleJobQueue.
+     *
+     * @return      Nothing.
+     */
+    static void XPF_API
+    RunJobs(
+        _In_opt_ xpf::thread::CallbackArgument Argument
+    ) noexcept(true);
+
+ private:
+    /**
+     * @brief   How many jobs may wait at once. Beyond this, new jobs are refused.
+     */
+    static constexpr size_t MAX_PENDING_JOBS = 1024;
+
+    /**
+     * @brief   How many jobs may run at once. The rest of the work queue is left for others.
+     */
+    static constexpr uint32_t MAX_RUNNING_JOBS = 2;
+
+    xpf::Optional<xpf::ReadWriteLock> m_QueueLock;
+    xpf::Vector<SysMon::ModuleJob> m_PendingJobs{ SYSMON_PAGED_ALLOCATOR };
+    uint32_t m_RunningJobs = 0;
+    uint64_t m_NextSequence = 0;
+    SysMon::ModuleJobQueueMetrics m_Metrics;
+    xpf::Optional<KmHelper::WorkQueue> m_WorkQueue;
+
+    /**
+     * @brief   Default MemoryAllocator is our friend as it requires access to the private
+     *          default constructor. It is used in the Create() method to ensure that
+     *          no partially constructed objects are created but instead they will be
+     *          all fully initialized.
+     */
+    friend class xpf::MemoryAllocator;
+};  // class ModuleJobQueue
+};  // namespace SysMon
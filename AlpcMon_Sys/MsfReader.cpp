@@ -0,0 +1,376 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/MsfReader.cpp
+ *
+ * @brief       In this file we define a reader for multi-stream files (msf).
+ *              This is the container format of the program databases (.pdb).
+ *              The streams are read on demand, so the file is never
+ *              loaded in memory as a whole.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "precomp.hpp"
+
+#include "MsfReader.hpp"
+#include "trace.hpp"
+
+/**
+ * @brief   The pdb parsing is heavy and done from work items. All code is paged.
+ */
+XPF_SECTION_PAGED;
+
+/**
+ * @brief   The structures below are read as they are from the file.
+ */
+#pragma pack(push, 1)
+
+/**
+ * @brief   The first block of the file. It describes where the stream directory is.
+ */
+typedef struct _MSF_SUPER_BLOCK
+{
+    /**
+     * @brief   Must be MSF_SUPER_BLOCK_MAGIC.
+     */
+    char        FileMagic[32];
+
+    /**
+     * @brief   The size of a block. All blocks have the same size.
+     */
+    uint32_t    BlockSize;
+
+    /**
+     * @brief   The index of the active free block map. Not used by readers.
+     */
+    uint32_t    FreeBlockMapBlock;
+
+    /**
+     * @brief   The total number of blocks in the file.
+     */
+    uint32_t    NumBlocks;
+
+    /**
+     * @brief   The size of the stream directory, in bytes.
+     */
+    uint32_t    NumDirectoryBytes;
+
+    /**
+     * @brief   Unknown - not used.
+     */
+    uint32_t    Unknown;
+
+    /**
+     * @brief   The index of the block which holds the indexes of the directory blocks.
+     */
+    uint32_t    BlockMapAddr;
+} MSF_SUPER_BLOCK;
+
+#pragma pack(pop)
+
+/**
+ * @brief   The magic with which every msf 7.0 file starts.
+ */
+static const char MSF_SUPER_BLOCK_MAGIC[32] = { 'M', 'i', 'c', 'r', 'o', 's', 'o', 'f', 't', ' ', 'C', '/',
+                                                'C', '+', '+', ' ', 'M', 'S', 'F', ' ', '7', '.', '0', '0',
+                                                '\r', '\n', '\x1a', 'D', 'S', '\0', '\0', '\0' };
+
+/**
+ * @brief   A stream with this size does not exist. It has no blocks.
+ */
+#define MSF_NIL_STREAM_SIZE     0xFFFFFFFF
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+PdbHelper::MsfReader::Create(
+    _In_ SysMon::File::FileObject& File,
+    _Out_ xpf::Optional<PdbHelper::MsfReader>* Reader
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != Reader);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    MSF_SUPER_BLOCK superBlock = { 0 };
+
+    uint32_t directoryBlocksCount = 0;
+    xpf::Buffer directoryBlocks{ SYSMON_PAGED_ALLOCATOR };
+    xpf::Buffer directory{ SYSMON_PAGED_ALLOCATOR };
+
+    /* Preinit output. */
+    Reader->Reset();
+
+    Reader->Emplace();
+    PdbHelper::MsfReader& reader = (*(*Reader));
+    reader.m_File = &File;
+
+    /* The superblock is at the start of the file - read it without the window, as we don't know the block size. */
+    status = directory.Resize(sizeof(superBlock));
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+    status = File.Read(0, &directory);
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+    if (directory.GetSize() != sizeof(superBlock))
+    {
+        status = STATUS_FILE_CORRUPT_ERROR;
+        goto CleanUp;
+    }
+    xpf::ApiCopyMemory(&superBlock,
+                       directory.GetBuffer(),
+                       sizeof(superBlock));
+
+    /* Validate it. */
+    if (sizeof(MSF_SUPER_BLOCK_MAGIC) != ::RtlCompareMemory(superBlock.FileMagic,
+                                                            MSF_SUPER_BLOCK_MAGIC,
+                                                            sizeof(MSF_SUPER_BLOCK_MAGIC)))
+    {
+        status = STATUS_FILE_CORRUPT_ERROR;
+        goto CleanUp;
+    }
+    if (superBlock.BlockSize < 512 || superBlock.BlockSize > 32768 ||
+        (superBlock.BlockSize & (superBlock.BlockSize - 1)) != 0)
+    {
+        status = STATUS_FILE_CORRUPT_ERROR;
+        goto CleanUp;
+    }
+    if (superBlock.BlockMapAddr >= superBlock.NumBlocks || 0 == superBlock.NumDirectoryBytes)
+    {
+        status = STATUS_FILE_CORRUPT_ERROR;
+        goto CleanUp;
+    }
+    reader.m_BlockSize = superBlock.BlockSize;
+    reader.m_BlocksCount = superBlock.NumBlocks;
+
+    /* The indexes of the directory blocks must fit in the block map block. */
+    directoryBlocksCount = (superBlock.NumDirectoryBytes / superBlock.BlockSize) +
+                           ((superBlock.NumDirectoryBytes % superBlock.BlockSize) != 0 ? 1 : 0);
+    if (directoryBlocksCount > superBlock.BlockSize / sizeof(uint32_t))
+    {
+        status = STATUS_FILE_CORRUPT_ERROR;
+        goto CleanUp;
+    }
+    status = directoryBlocks.Resize(directoryBlocksCount * sizeof(uint32_t));
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+    status = reader.ReadFile(uint64_t{ superBlock.BlockMapAddr } * superBlock.BlockSize,
+                             directoryBlocks.GetSize(),
+                             directoryBlocks.GetBuffer());
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+
+    /* Now gather the directory. */
+    status = directory.Resize(superBlock.NumDirectoryBytes);
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+    for (uint32_t i = 0; i < directoryBlocksCount; ++i)
+    {
+        const uint32_t block = static_cast<const uint32_t*>(directoryBlocks.GetBuffer())[i];
+        const uint32_t directoryOffset = i * superBlock.BlockSize;
+        const uint32_t bytesLeft = superBlock.NumDirectoryBytes - directoryOffset;
+        const uint32_t bytesInBlock = (bytesLeft < superBlock.BlockSize) ? bytesLeft
+                                                                         : superBlock.BlockSize;
+        if (block >= superBlock.NumBlocks)
+        {
+            status = STATUS_FILE_CORRUPT_ERROR;
+            goto CleanUp;
+        }
+
+        status = reader.ReadFile(uint64_t{ block } * superBlock.BlockSize,
+                                 bytesInBlock,
+                                 xpf::AlgoAddToPointer(directory.GetBuffer(), directoryOffset));
+        if (!NT_SUCCESS(status))
+        {
+            goto CleanUp;
+        }
+    }
+
+    /* And parse it. */
+    status = reader.ParseDirectory(directory);
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+
+CleanUp:
+    if (!NT_SUCCESS(status))
+    {
+        Reader->Reset();
+    }
+    return status;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+PdbHelper::MsfReader::ParseDirectory(
+    _In_ _Const_ const xpf::Buffer& Directory
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    const uint32_t* entries = static_cast<const uint32_t*>(Directory.GetBuffer());
+    const size_t entriesCount = Directory.GetSize() / sizeof(uint32_t);
+
+    size_t blocksIndex = 0;
+    uint32_t streamsCount = 0;
+
+    /* The directory starts with the number of streams, followed by their sizes. */
+    if (entriesCount < 1)
+    {
+        return STATUS_FILE_CORRUPT_ERROR;
+    }
+    streamsCount = entries[0];
+    if (streamsCount > entriesCount - 1)
+    {
+        return STATUS_FILE_CORRUPT_ERROR;
+    }
+
+    /* Then come the blocks of each stream. */
+    blocksIndex = 1 + size_t{ streamsCount };
+    for (uint32_t i = 0; i < streamsCount; ++i)
+    {
+        const uint32_t streamSize = (entries[1 + i] == MSF_NIL_STREAM_SIZE) ? 0
+                                                                            : entries[1 + i];
+        const uint32_t streamBlocks = (streamSize / this->m_BlockSize) +
+                                      ((streamSize % this->m_BlockSize) != 0 ? 1 : 0);
+
+        if (streamBlocks > entriesCount - blocksIndex)
+        {
+            return STATUS_FILE_CORRUPT_ERROR;
+        }
+
+        status = this->m_StreamSizes.Emplace(streamSize);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+        status = this->m_StreamFirstBlock.Emplace(static_cast<uint32_t>(this->m_StreamBlocks.Size()));
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        for (uint32_t j = 0; j < streamBlocks; ++j)
+        {
+            if (entries[blocksIndex] >= this->m_BlocksCount)
+            {
+                return STATUS_FILE_CORRUPT_ERROR;
+            }
+            status = this->m_StreamBlocks.Emplace(entries[blocksIndex]);
+            if (!NT_SUCCESS(status))
+            {
+                return status;
+            }
+            ++blocksIndex;
+        }
+    }
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+PdbHelper::MsfReader::ReadStream(
+    _In_ uint32_t Stream,
+    _In_ uint32_t Offset,
+    _In_ size_t Size,
+    _Out_writes_bytes_(Size) void* Destination
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    size_t copiedBytes = 0;
+
+    /* The range must be inside the stream. */
+    if (Stream >= this->m_StreamSizes.Size())
+    {
+        return STATUS_FILE_CORRUPT_ERROR;
+    }
+    if (Offset > this->m_StreamSizes[Stream] || Size > this->m_StreamSizes[Stream] - Offset)
+    {
+        return STATUS_FILE_CORRUPT_ERROR;
+    }
+
+    /* Copy block by block - the blocks of a stream are not necessarily contiguous. */
+    while (copiedBytes < Size)
+    {
+        const uint32_t streamOffset = Offset + static_cast<uint32_t>(copiedBytes);
+        const uint32_t blockIndex = streamOffset / this->m_BlockSize;
+        const uint32_t offsetInBlock = streamOffset % this->m_BlockSize;
+        const size_t bytesLeftInBlock = this->m_BlockSize - offsetInBlock;
+        const size_t bytesToCopy = (Size - copiedBytes < bytesLeftInBlock) ? Size - copiedBytes
+                                                                           : bytesLeftInBlock;
+
+        const uint32_t block = this->m_StreamBlocks[this->m_StreamFirstBlock[Stream] + blockIndex];
+        status = this->ReadFile(uint64_t{ block } * this->m_BlockSize + offsetInBlock,
+                                bytesToCopy,
+                                xpf::AlgoAddToPointer(Destination, copiedBytes));
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+        copiedBytes += bytesToCopy;
+    }
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+PdbHelper::MsfReader::ReadFile(
+    _In_ uint64_t FileOffset,
+    _In_ size_t Size,
+    _Out_writes_bytes_(Size) void* Destination
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    /* If the range is not in the window, we move the window. */
+    if (FileOffset < this->m_WindowOffset ||
+        FileOffset + Size > this->m_WindowOffset + this->m_Window.GetSize())
+    {
+        status = this->m_Window.Resize(MsfReader::WINDOW_SIZE);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        /* The window starts at a block boundary - a block is never split between two windows. */
+        this->m_WindowOffset = FileOffset - (FileOffset % this->m_BlockSize);
+        status = this->m_File->Read(this->m_WindowOffset,
+                                    &this->m_Window);
+        if (!NT_SUCCESS(status))
+        {
+            this->m_WindowOffset = 0;
+            return status;
+        }
+
+        /* We might have hit the end of file. */
+        if (FileOffset + Size > this->m_WindowOffset + this->m_Window.GetSize())
+        {
+            return STATUS_FILE_CORRUPT_ERROR;
+        }
+    }
+
+    xpf::ApiCopyMemory(Destination,
+                       xpf::AlgoAddToPointer(this->m_Window.GetBuffer(), FileOffset - this->m_WindowOffset),
+                       Size);
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,184 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/MsfReader.hpp
+ *
+ * @brief       In this file we define a reader for multi-stream files (msf).
+ *              This is the container format of the program databases (.pdb).
+ *              The streams are read on demand, so the file is never
+ *              loaded in memory as a whole.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#pragma once
+
+#include "precomp.hpp"
+#include "FileObject.hpp"
+
+namespace PdbHelper
+{
+/**
+ * @brief   This class reads the streams of a msf file.
+ *          See https://llvm.org/docs/PDB/MsfFile.html
+ *
+ *          Only the stream directory is kept in memory. The stream data is read
+ *          through a small window, so sequential reads over a stream issue few
+ *          and large read requests, and random reads touch only the needed blocks.
+ */
+class MsfReader final
+{
+ private:
+    /**
+     * @brief  Default constructor - private as Create
+     *         method must be used to instantiate an object.
+     */
+    MsfReader(void) noexcept(true) = default;
+
+ public:
+    /**
+     * @brief   Default destructor.
+     */
+    ~MsfReader(void) noexcept(true) = default;
+
+    /**
+     * @brief   Copy and move are deleted for this class.
+     *          They can be implemented when required.
+     */
+    XPF_CLASS_COPY_MOVE_BEHAVIOR(PdbHelper::MsfReader, delete);
+
+    /**
+     * @brief       Creates a msf reader. The superblock and the stream directory are read here.
+     *
+     * @param[in]   File    - The opened msf file. It must outlive the reader.
+     * @param[out]  Reader  - On success, it will contain a properly initialized object.
+     *
+     * @return      STATUS_FILE_CORRUPT_ERROR if the file is not a valid msf,
+     *              or a proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    static NTSTATUS XPF_API
+    Create(
+        _In_ SysMon::File::FileObject& File,
+        _Out_ xpf::Optional<PdbHelper::MsfReader>* Reader
+    ) noexcept(true);
+
+    /**
+     * @brief       Gets the number of streams in the file.
+     *
+     * @return      The number of streams.
+     */
+    inline uint32_t XPF_API
+    StreamsCount(
+        void
+    ) const noexcept(true)
+    {
+        return static_cast<uint32_t>(this->m_StreamSizes.Size());
+    }
+
+    /**
+     * @brief       Gets the size of a stream.
+     *
+     * @param[in]   Stream - The index of the stream.
+     *
+     * @return      The size of the stream in bytes. 0 if the stream does not exist.
+     */
+    inline uint32_t XPF_API
+    StreamSize(
+        _In_ uint32_t Stream
+    ) const noexcept(true)
+    {
+        return (Stream < this->m_StreamSizes.Size()) ? this->m_StreamSizes[Stream]
+                                                     : 0;
+    }
+
+    /**
+     * @brief       Reads a range of bytes from a stream.
+     *
+     * @param[in]   Stream       - The index of the stream.
+     * @param[in]   Offset       - The offset inside the stream.
+     * @param[in]   Size         - How many bytes to read.
+     * @param[out]  Destination  - Where the bytes are copied. Must have at least Size bytes.
+     *
+     * @return      STATUS_FILE_CORRUPT_ERROR if the range is not inside the stream,
+     *              or a proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    ReadStream(
+        _In_ uint32_t Stream,
+        _In_ uint32_t Offset,
+        _In_ size_t Size,
+        _Out_writes_bytes_(Size) void* Destination
+    ) noexcept(true);
+
+ private:
+    /**
+     * @brief       Copies bytes from the file, through the read window.
+     *
+     * @param[in]   FileOffset   - The offset in the file.
+     * @param[in]   Size         - How many bytes to copy. Must not cross a block.
+     * @param[out]  Destination  - Where the bytes are copied.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    ReadFile(
+        _In_ uint64_t FileOffset,
+        _In_ size_t Size,
+        _Out_writes_bytes_(Size) void* Destination
+    ) noexcept(true);
+
+    /**
+     * @brief       Parses the stream directory.
+     *
+     * @param[in]   Directory - The content of the stream directory.
+     *
+     * @return      STATUS_FILE_CORRUPT_ERROR if the directory is not valid,
+     *              or a proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    ParseDirectory(
+        _In_ _Const_ const xpf::Buffer& Directory
+    ) noexcept(true);
+
+ private:
+    /**
+     * @brief   How many bytes are read at once from the file. Blocks of a stream
+     *          are usually contiguous, so this saves a lot of small reads.
+     */
+    static constexpr size_t WINDOW_SIZE = 64 * 1024;
+
+    SysMon::File::FileObject* m_File = nullptr;
+    uint32_t m_BlockSize = 0;
+    uint32_t m_BlocksCount = 0;
+
+    /**
+     * @brief   The stream directory. The blocks of stream i are found in m_StreamBlocks
+     *          starting at index m_StreamFirstBlock[i].
+     */
+    xpf::Vector<uint32_t> m_StreamSizes{ SYSMON_PAGED_ALLOCATOR };
+    xpf::Vector<uint32_t> m_StreamFirstBlock{ SYSMON_PAGED_ALLOCATOR };
+    xpf::Vector<uint32_t> m_StreamBlocks{ SYSMON_PAGED_ALLOCATOR };
+
+    xpf::Buffer m_Window{ SYSMON_PAGED_ALLOCATOR };
+    uint64_t m_WindowOffset = 0;
+
+    /**
+     * @brief   Default MemoryAllocator is our friend as it requires access to the private
+     *          default constructor. It is used in the Create() method to ensure that
+     *          no partially constructed objects are created but instead they will be
+     *          all fully initialized.
+     */
+    friend class xpf::MemoryAllocator;
+};  // class MsfReader
+};  // namespace PdbHelper
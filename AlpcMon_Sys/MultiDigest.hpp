@@ -0,0 +1,148 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/MultiDigest.hpp
+ *
+ * @brief       In this file we define how a file is hashed with several digests
+ *              in a single pass - which digests are fed, and in what chunks.
+ *              KmHelper::File::FileHasher owns the bcrypt objects, this drives them.
+ *
+ * @note        This header is portable on purpose - it does not depend on the kernel
+ *              or on xpf, so it is also built and tested on linux. See the Tests folder.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+namespace KmHelper
+{
+namespace MultiDigest
+{
+/**
+ * @brief   How many algorithms are supported - md5, sha1 and sha256.
+ */
+static constexpr size_t ALGORITHMS_COUNT = 3;
+
+/**
+ * @brief   The file is read in chunks of this size - large enough to keep
+ *          the number of read requests low even for big binaries.
+ */
+static constexpr size_t CHUNK_SIZE = 1024 * 1024;
+
+/**
+ * @brief       Finds which algorithms need to be fed.
+ *
+ * @param[in]   RequestsCount   - How many digests are requested.
+ * @param[in]   IndexAt         - Maps a request to its algorithm:
+ *                                bool IndexAt(size_t Request, size_t* Index).
+ * @param[out]  IsRequested     - ALGORITHMS_COUNT flags, set for the requested algorithms.
+ *
+ * @return      false if there is no request, if IndexAt fails, or if an algorithm
+ *              is requested more than once. true otherwise.
+ */
+template <class IndexAccessor>
+inline bool
+SelectAlgorithms(
+    size_t RequestsCount,
+    IndexAccessor& IndexAt,
+    bool* IsRequested
+) noexcept(true)
+{
+    for (size_t i = 0; i < KmHelper::MultiDigest::ALGORITHMS_COUNT; ++i)
+    {
+        IsRequested[i] = false;
+    }
+    if (0 == RequestsCount)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < RequestsCount; ++i)
+    {
+        size_t index = 0;
+        if (!IndexAt(i, &index) || index >= KmHelper::MultiDigest::ALGORITHMS_COUNT)
+        {
+            return false;
+        }
+
+        /* Each algorithm can be requested only once. */
+        if (IsRequested[index])
+        {
+            return false;
+        }
+        IsRequested[index] = true;
+    }
+    return true;
+}
+
+/**
+ * @brief       Reads the file once, chunk by chunk, and feeds each chunk
+ *              to all requested algorithms.
+ *
+ * @param[in]   FileSize    - The size of the file, in bytes.
+ * @param[in]   IsRequested - ALGORITHMS_COUNT flags, as set by SelectAlgorithms.
+ * @param[in]   ReadChunk   - Reads at most CHUNK_SIZE bytes at an offset:
+ *                            bool ReadChunk(uint64_t Offset, const uint8_t** Data, size_t* Size).
+ * @param[in]   FeedChunk   - Feeds a chunk to an algorithm:
+ *                            bool FeedChunk(size_t Index, const uint8_t* Data, size_t Size).
+ * @param[out]  IsDirty     - Set once any algorithm was fed. On failure, the caller
+ *                            must reset the fed algorithms before using them again.
+ *
+ * @return      false if a callback fails or if a read returns no data or more than
+ *              CHUNK_SIZE bytes. true once the whole file was fed.
+ */
+template <class ChunkReader, class ChunkConsumer>
+inline bool
+HashChunks(
+    uint64_t FileSize,
+    const bool* IsRequested,
+    ChunkReader& ReadChunk,
+    ChunkConsumer& FeedChunk,
+    bool* IsDirty
+) noexcept(true)
+{
+    uint64_t offset = 0;
+
+    *IsDirty = false;
+    while (offset < FileSize)
+    {
+        const uint8_t* data = nullptr;
+        size_t size = 0;
+
+        /* A read which makes no progress would loop forever. */
+        if (!ReadChunk(offset, &data, &size))
+        {
+            return false;
+        }
+        if (0 == size || size > KmHelper::MultiDigest::CHUNK_SIZE)
+        {
+            return false;
+        }
+
+        for (size_t i = 0; i < KmHelper::MultiDigest::ALGORITHMS_COUNT; ++i)
+        {
+            if (!IsRequested[i])
+            {
+                continue;
+            }
+
+            *IsDirty = true;
+            if (!FeedChunk(i, data, size))
+            {
+                return false;
+            }
+        }
+        offset += size;
+    }
+    return true;
+}
+};  // namespace MultiDigest
+};  // namespace KmHelper
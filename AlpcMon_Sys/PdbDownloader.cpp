@@ -0,0 +1,625 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/PdbDownloader.cpp
+ *
+ * @brief       In this file we define the component which brings the
+ *              program databases (.pdb) from the symbol server on disk.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "precomp.hpp"
+
+#include "FileObject.hpp"
+
+#include "PdbDownloader.hpp"
+#include "trace.hpp"
+
+/**
+ * @brief   The downloads are done from work items. All code is paged.
+ */
+XPF_SECTION_PAGED;
+
+/**
+ * @brief       Helper method to build a path or url in the symbol server layout:
+ *              Root/PdbName/PdbGuidAndAge/PdbName
+ *
+ * @param[in]   Root            - The root of the symbol server.
+ * @param[in]   Separator       - The separator to be used between components.
+ * @param[in]   PdbName         - The name of the pdb.
+ * @param[in]   PdbGuidAndAge   - The guid and age of the pdb.
+ * @param[out]  Location        - The built path or url.
+ *
+ * @return      A proper NTSTATUS error code.
+ */
+template <class CharType>
+_Must_inspect_result_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static NTSTATUS XPF_API
+PdbDownloaderBuildServerLocation(
+    _In_ _Const_ const xpf::StringView<CharType>& Root,
+    _In_ _Const_ const CharType* Separator,
+    _In_ _Const_ const xpf::StringView<CharType>& PdbName,
+    _In_ _Const_ const xpf::StringView<CharType>& PdbGuidAndAge,
+    _Out_ xpf::String<CharType>* Location
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != Location);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    /* Preinit output. */
+    Location->Reset();
+
+    /* Helper macro to help build the location */
+    #ifndef DOXYGEN_SHOULD_SKIP_THIS
+        #define HELPER_APPEND_DATA_TO_STRING(string, data)          \
+        {                                                           \
+            status = string->Append(data);                          \
+            if (!NT_SUCCESS(status))                                \
+            {                                                       \
+                return status;                                      \
+            }                                                       \
+        }
+    #endif  // DOXYGEN_SHOULD_SKIP_THIS
+
+    HELPER_APPEND_DATA_TO_STRING(Location, Root);
+    if (!Root.EndsWith(Separator, false))
+    {
+        HELPER_APPEND_DATA_TO_STRING(Location, Separator);
+    }
+    HELPER_APPEND_DATA_TO_STRING(Location, PdbName);
+    HELPER_APPEND_DATA_TO_STRING(Location, Separator);
+    HELPER_APPEND_DATA_TO_STRING(Location, PdbGuidAndAge);
+    HELPER_APPEND_DATA_TO_STRING(Location, Separator);
+    HELPER_APPEND_DATA_TO_STRING(Location, PdbName);
+
+    /* Macro no longer needed */
+    #undef HELPER_APPEND_DATA_TO_STRING
+
+    /* All good. */
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @brief       Helper method to compute the full pdb path of a file.
+ *
+ * @param[in]   PdbName          - Name of the pdb. For example "ntdll.pdb"
+ * @param[in]   PdbGuidAndAge    - As there can be multiple ntdll versions, the specific
+ *                                 version is identified by its guid and age.
+ * @param[in]   PdbDirectoryPath - The directory where to save the pdb on disk.
+ *                                 This must exist.
+ * @param[out]  PdbFullFilePath  - Will store the full pdb file path. Its form will be:
+ *                                 PdbDirectoryPath/PdbGuidAndAge_PdbName.
+ *
+ * @return      A proper NTSTATUS error code.
+ */
+_Must_inspect_result_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static NTSTATUS XPF_API
+PdbDownloaderComputePdbFullFilePath(
+    _In_ _Const_ const xpf::StringView<wchar_t>& PdbName,
+    _In_ _Const_ const xpf::StringView<wchar_t>& PdbGuidAndAge,
+    _In_ _Const_ const xpf::StringView<wchar_t>& PdbDirectoryPath,
+    _Out_ xpf::String<wchar_t>* PdbFullFilePath
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != PdbFullFilePath);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    /* Preinit output. */
+    PdbFullFilePath->Reset();
+
+    /* Helper macro to help build the full file path */
+    #ifndef DOXYGEN_SHOULD_SKIP_THIS
+        #define HELPER_APPEND_DATA_TO_STRING(string, data)          \
+        {                                                           \
+            status = string->Append(data);                          \
+            if (!NT_SUCCESS(status))                                \
+            {                                                       \
+                return status;                                      \
+            }                                                       \
+        }
+    #endif  // DOXYGEN_SHOULD_SKIP_THIS
+
+    /* Construct path. */
+    HELPER_APPEND_DATA_TO_STRING(PdbFullFilePath, PdbDirectoryPath);
+    if (!PdbDirectoryPath.EndsWith(L"\\", false))
+    {
+        HELPER_APPEND_DATA_TO_STRING(PdbFullFilePath, L"\\");
+    }
+    HELPER_APPEND_DATA_TO_STRING(PdbFullFilePath, PdbGuidAndAge);
+    HELPER_APPEND_DATA_TO_STRING(PdbFullFilePath, L"_");
+    HELPER_APPEND_DATA_TO_STRING(PdbFullFilePath, PdbName);
+
+    /* Macro no longer needed */
+    #undef HELPER_APPEND_DATA_TO_STRING
+
+    /* All good. */
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @brief       Checks whether a failed download is worth retrying.
+ *
+ * @param[in]   Status - The status of the failed download.
+ *
+ * @return      false if the pdb is not on the server - retrying won't help.
+ *              true otherwise.
+ */
+static bool XPF_API
+PdbDownloaderIsTransientError(
+    _In_ NTSTATUS Status
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    return (Status != STATUS_NOT_FOUND) &&
+           (Status != STATUS_OBJECT_NAME_NOT_FOUND) &&
+           (Status != STATUS_OBJECT_PATH_NOT_FOUND) &&
+           (Status != STATUS_NOT_SUPPORTED);
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+PdbHelper::PdbDownloader::Create(
+    _In_ _Const_ const xpf::StringView<wchar_t>& SymbolServer,
+    _In_ _Const_ const xpf::StringView<wchar_t>& PdbDirectoryPath,
+    _Out_ xpf::Optional<PdbHelper::PdbDownloader>* Downloader
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != Downloader);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    /* Preinit output. */
+    Downloader->Reset();
+    Downloader->Emplace();
+
+    PdbHelper::PdbDownloader& downloader = (*(*Downloader));
+
+    status = downloader.m_SymbolServer.Append(SymbolServer);
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+    status = downloader.m_PdbDirectoryPath.Append(PdbDirectoryPath);
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+
+    /* Anything which is not an url is a directory or a file share. */
+    downloader.m_IsHttpServer = SymbolServer.StartsWith(L"http://", false) ||
+                                SymbolServer.StartsWith(L"https://", false);
+    if (downloader.m_IsHttpServer)
+    {
+        status = xpf::StringConversion::WideToUTF8(SymbolServer,
+                                                   downloader.m_SymbolServerUrl);
+        if (!NT_SUCCESS(status))
+        {
+            goto CleanUp;
+        }
+    }
+
+    status = xpf::ReadWriteLock::Create(&downloader.m_DownloaderLock);
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+    for (size_t i = 0; i < PdbHelper::PdbDownloader::MAX_CONNECTIONS; ++i)
+    {
+        status = downloader.m_Connections.Emplace(PdbHelper::PdbConnection{});
+        if (!NT_SUCCESS(status))
+        {
+            goto CleanUp;
+        }
+    }
+
+    /* All good. */
+    status = STATUS_SUCCESS;
+
+CleanUp:
+    if (!NT_SUCCESS(status))
+    {
+        Downloader->Reset();
+    }
+    return status;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+PdbHelper::PdbDownloader::ResolvePdb(
+    _In_ _Const_ const xpf::StringView<wchar_t>& PdbName,
+    _In_ _Const_ const xpf::StringView<wchar_t>& PdbGuidAndAge,
+    _Out_ xpf::String<wchar_t>* PdbFullFilePath
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != PdbFullFilePath);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    xpf::Optional<SysMon::File::FileObject> pdbFile;
+    xpf::SharedPointer<PdbHelper::PdbDownload> download{ SYSMON_NPAGED_ALLOCATOR };
+    bool isOwner = false;
+
+    status = PdbDownloaderComputePdbFullFilePath(PdbName,
+                                                 PdbGuidAndAge,
+                                                 this->m_PdbDirectoryPath.View(),
+                                                 PdbFullFilePath);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    /* Check if the pdb is there. */
+    status = SysMon::File::FileObject::Create(PdbFullFilePath->View(),
+                                              XPF_FILE_ACCESS_READ,
+                                              &pdbFile);
+    if (NT_SUCCESS(status))
+    {
+        return STATUS_SUCCESS;
+    }
+
+    /* Join the download of this pdb if there is one, or start it. */
+    {
+        xpf::ExclusiveLockGuard guard{ *this->m_DownloaderLock };
+        for (size_t i = 0; i < this->m_InFlight.Size(); ++i)
+        {
+            if (this->m_InFlight[i].Get()->PdbFullFilePath.View().Equals(PdbFullFilePath->View(), false))
+            {
+                download = this->m_InFlight[i];
+                break;
+            }
+        }
+        if (download.IsEmpty())
+        {
+            download = xpf::MakeSharedWithAllocator<PdbHelper::PdbDownload>(SYSMON_NPAGED_ALLOCATOR);
+            if (download.IsEmpty())
+            {
+                PdbFullFilePath->Reset();
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+            status = download.Get()->PdbFullFilePath.Append(PdbFullFilePath->View());
+            if (!NT_SUCCESS(status))
+            {
+                PdbFullFilePath->Reset();
+                return status;
+            }
+            ::KeInitializeEvent(&download.Get()->Done,
+                                EVENT_TYPE::NotificationEvent,
+                                FALSE);
+            status = this->m_InFlight.Emplace(download);
+            if (!NT_SUCCESS(status))
+            {
+                PdbFullFilePath->Reset();
+                return status;
+            }
+            isOwner = true;
+        }
+    }
+
+    if (!isOwner)
+    {
+        /* The owner always signals the event - this wait is bounded by its download. */
+        status = ::KeWaitForSingleObject(&download.Get()->Done,
+                                         KWAIT_REASON::Executive,
+                                         KernelMode,
+                                         FALSE,
+                                         NULL);
+        if (NT_SUCCESS(status))
+        {
+            status = download.Get()->Status;
+        }
+    }
+    else
+    {
+        /* The previous owner may have finished while we were checking the disk. */
+        status = SysMon::File::FileObject::Create(PdbFullFilePath->View(),
+                                                  XPF_FILE_ACCESS_READ,
+                                                  &pdbFile);
+        if (!NT_SUCCESS(status))
+        {
+            status = this->Download(PdbName,
+                                    PdbGuidAndAge,
+                                    PdbFullFilePath->View());
+        }
+        download.Get()->Status = status;
+
+        {
+            xpf::ExclusiveLockGuard guard{ *this->m_DownloaderLock };
+            for (size_t i = 0; i < this->m_InFlight.Size(); ++i)
+            {
+                if (this->m_InFlight[i].Get() == download.Get())
+                {
+                    NTSTATUS eraseStatus = this->m_InFlight.Erase(i);
+                    XPF_DEATH_ON_FAILURE(NT_SUCCESS(eraseStatus));
+                    break;
+                }
+            }
+        }
+        ::KeSetEvent(&download.Get()->Done,
+                     IO_NO_INCREMENT,
+                     FALSE);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        PdbFullFilePath->Reset();
+    }
+    return status;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+PdbHelper::PdbDownloader::Download(
+    _In_ _Const_ const xpf::StringView<wchar_t>& PdbName,
+    _In_ _Const_ const xpf::StringView<wchar_t>& PdbGuidAndAge,
+    _In_ _Const_ const xpf::StringView<wchar_t>& PdbFullFilePath
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    for (uint32_t attempt = 0; attempt < PdbHelper::PdbDownloader::MAX_ATTEMPTS; ++attempt)
+    {
+        xpf::Optional<SysMon::File::FileObject> pdbFile;
+
+        /* Back off - the server or the network may need a while to recover. */
+        if (attempt > 0)
+        {
+            xpf::ApiSleep(PdbHelper::PdbDownloader::RETRY_BASE_DELAY_MS << (attempt - 1));
+        }
+
+        status = SysMon::File::FileObject::Create(PdbFullFilePath,
+                                                  XPF_FILE_ACCESS_WRITE | XPF_FILE_ACCESS_DELETE,
+                                                  &pdbFile);
+        if (!NT_SUCCESS(status))
+        {
+            break;
+        }
+
+        status = (this->m_IsHttpServer) ? this->DownloadFromHttp(PdbName, PdbGuidAndAge, (*pdbFile))
+                                        : this->CopyFromShare(PdbName, PdbGuidAndAge, (*pdbFile));
+        if (NT_SUCCESS(status))
+        {
+            break;
+        }
+
+        /* Don't leave a partial pdb behind - it would be taken as a valid one. */
+        NTSTATUS deleteStatus = (*pdbFile).Delete();
+        if (!NT_SUCCESS(deleteStatus))
+        {
+            SysMonLogWarning("Could not delete partial pdb %S %!STATUS!",
+                             PdbFullFilePath.Buffer(),
+                             deleteStatus);
+        }
+
+        SysMonLogWarning("Downloading %S failed at attempt %u with %!STATUS!",
+                         PdbFullFilePath.Buffer(),
+                         attempt + 1,
+                         status);
+        if (!PdbDownloaderIsTransientError(status))
+        {
+            break;
+        }
+    }
+    return status;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+PdbHelper::PdbDownloader::DownloadFromHttp(
+    _In_ _Const_ const xpf::StringView<wchar_t>& PdbName,
+    _In_ _Const_ const xpf::StringView<wchar_t>& PdbGuidAndAge,
+    _Inout_ SysMon::File::FileObject& PdbFile
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    size_t connection = 0;
+    bool hasMoreData = true;
+
+    xpf::String<char> url{ SYSMON_PAGED_ALLOCATOR };
+    xpf::String<char> ansiName{ SYSMON_PAGED_ALLOCATOR };
+    xpf::String<char> ansiGuidAndAge{ SYSMON_PAGED_ALLOCATOR };
+
+    xpf::http::HttpResponse response;
+
+    response.ResponseBuffer = xpf::SharedPointer<xpf::Buffer>(SYSMON_PAGED_ALLOCATOR);
+    response.Headers = xpf::Move(xpf::Vector<xpf::http::HeaderItem>(SYSMON_PAGED_ALLOCATOR));
+
+    /* Header items to be used. The connection is reused for the next pdb. */
+    const xpf::http::HeaderItem headerItems[] =
+    {
+        { "Accept",             "application/octet-stream" },
+        { "Accept-Encoding",    "gzip, deflate, br" },
+        { "User-Agent",         "Microsoft-Symbol-Server/10.0.10036.206" },
+        { "Connection",         "keep-alive" },
+    };
+
+    /* Get the ansi url for request. */
+    status = xpf::StringConversion::WideToUTF8(PdbName, ansiName);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    status = xpf::StringConversion::WideToUTF8(PdbGuidAndAge, ansiGuidAndAge);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    status = PdbDownloaderBuildServerLocation(this->m_SymbolServerUrl.View(),
+                                              "/",
+                                              ansiName.View(),
+                                              ansiGuidAndAge.View(),
+                                              &url);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    /* From here on we hold a connection - it must be given back. */
+    connection = this->AcquireConnection();
+
+    /* Grab the .pdb file. This will also grab the first chunk. */
+    status = xpf::http::InitiateHttpDownload(url.View(),
+                                             headerItems,
+                                             XPF_ARRAYSIZE(headerItems),
+                                             &response,
+                                             this->m_Connections[connection].Client);
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+    status = PdbFile.Write(response.Body.Buffer(),
+                           response.Body.BufferSize());
+    if (!NT_SUCCESS(status))
+    {
+        goto CleanUp;
+    }
+
+    /* Now grab the rest of .pdb */
+    while (hasMoreData)
+    {
+        status = xpf::http::HttpContinueDownload(this->m_Connections[connection].Client,
+                                                 &response,
+                                                 &hasMoreData);
+        if (!NT_SUCCESS(status))
+        {
+            goto CleanUp;
+        }
+        if (!response.Body.IsEmpty())
+        {
+            status = PdbFile.Write(response.Body.Buffer(),
+                                   response.Body.BufferSize());
+            if (!NT_SUCCESS(status))
+            {
+                goto CleanUp;
+            }
+        }
+    }
+
+CleanUp:
+    /* A connection which failed mid-transfer is in an unknown state - close it. */
+    this->ReleaseConnection(connection,
+                            NT_SUCCESS(status));
+    return status;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+PdbHelper::PdbDownloader::CopyFromShare(
+    _In_ _Const_ const xpf::StringView<wchar_t>& PdbName,
+    _In_ _Const_ const xpf::StringView<wchar_t>& PdbGuidAndAge,
+    _Inout_ SysMon::File::FileObject& PdbFile
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    xpf::String<wchar_t> sourcePath{ SYSMON_PAGED_ALLOCATOR };
+    xpf::Optional<SysMon::File::FileObject> sourceFile;
+    xpf::Buffer chunk{ SYSMON_PAGED_ALLOCATOR };
+    uint64_t offset = 0;
+
+    status = PdbDownloaderBuildServerLocation(this->m_SymbolServer.View(),
+                                              L"\\",
+                                              PdbName,
+                                              PdbGuidAndAge,
+                                              &sourcePath);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    status = SysMon::File::FileObject::Create(sourcePath.View(),
+                                              XPF_FILE_ACCESS_READ,
+                                              &sourceFile);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    /* Copy in large chunks - the share may be across the network. */
+    while (offset < (*sourceFile).FileSize())
+    {
+        status = chunk.Resize(PdbHelper::PdbDownloader::COPY_CHUNK_SIZE);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+        status = (*sourceFile).Read(offset,
+                                    &chunk);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+        if (chunk.GetSize() == 0)
+        {
+            return STATUS_END_OF_FILE;
+        }
+        status = PdbFile.Write(chunk.GetBuffer(),
+                               chunk.GetSize());
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+        offset += chunk.GetSize();
+    }
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+size_t XPF_API
+PdbHelper::PdbDownloader::AcquireConnection(
+    void
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    while (true)
+    {
+        {
+            xpf::ExclusiveLockGuard guard{ *this->m_DownloaderLock };
+            for (size_t i = 0; i < this->m_Connections.Size(); ++i)
+            {
+                if (!this->m_Connections[i].InUse)
+                {
+                    this->m_Connections[i].InUse = true;
+                    return i;
+                }
+            }
+        }
+
+        /* All connections are busy - downloads are long, so a short sleep is fine. */
+        xpf::ApiSleep(PdbHelper::PdbDownloader::CONNECTION_WAIT_MS);
+    }
+}
+
+_Use_decl_annotations_
+void XPF_API
+PdbHelper::PdbDownloader::ReleaseConnection(
+    _In_ size_t Index,
+    _In_ bool KeepAlive
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    xpf::ExclusiveLockGuard guard{ *this->m_DownloaderLock };
+
+    if (!KeepAlive)
+    {
+        this->m_Connections[Index].Client.Reset();
+    }
+    this->m_Connections[Index].InUse = false;
+}
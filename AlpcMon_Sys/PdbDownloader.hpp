@@ -0,0 +1,264 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/PdbDownloader.hpp
+ *
+ * @brief       In this file we define the component which brings the
+ *              program databases (.pdb) from the symbol server on disk.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#pragma once
+
+#include "precomp.hpp"
+#include "FileObject.hpp"
+
+
+namespace PdbHelper
+{
+/**
+ * @brief   Describes a pdb which is being downloaded right now.
+ *
+ * @note    The download is allocated from non paged pool as it contains the event
+ *          on which the threads requesting the same pdb are waiting.
+ */
+struct PdbDownload
+{
+    /**
+     * @brief   Where the pdb is saved on disk. It identifies the pdb,
+     *          as it contains both the name and the guid and age.
+     */
+    xpf::String<wchar_t> PdbFullFilePath{ SYSMON_PAGED_ALLOCATOR };
+
+    /**
+     * @brief   The result of the download. Valid after the event is signaled.
+     */
+    NTSTATUS Status = STATUS_UNSUCCESSFUL;
+
+    /**
+     * @brief   Notification event signaled when the download finished.
+     */
+    KEVENT Done = { 0 };
+};
+
+/**
+ * @brief   A connection to the symbol server. It is kept open between downloads.
+ */
+struct PdbConnection
+{
+    /**
+     * @brief   The client connection. Empty if no connection was opened yet,
+     *          or if the last request on it failed.
+     */
+    xpf::SharedPointer<xpf::IClient> Client{ SYSMON_PAGED_ALLOCATOR };
+
+    /**
+     * @brief   Set while a download uses this connection.
+     */
+    bool InUse = false;
+};
+
+/**
+ * @brief   This class downloads the pdbs from a symbol server. The server is either
+ *          an http one (like http://msdl.microsoft.com/download/symbols) or a path
+ *          to a local directory or file share with the same layout.
+ *
+ *          At most MAX_CONNECTIONS downloads run at once, each one on a kept-alive
+ *          connection. A pdb which is already downloading is not requested again -
+ *          the other threads wait for the first download to finish. Failed downloads
+ *          are retried a few times with an increasing delay.
+ */
+class PdbDownloader final
+{
+ private:
+    /**
+     * @brief  Default constructor - private as Create
+     *         method must be used to instantiate an object.
+     */
+    PdbDownloader(void) noexcept(true) = default;
+
+ public:
+    /**
+     * @brief   Default destructor.
+     */
+    ~PdbDownloader(void) noexcept(true) = default;
+
+    /**
+     * @brief   Copy and move are deleted for this class.
+     *          They can be implemented when required.
+     */
+    XPF_CLASS_COPY_MOVE_BEHAVIOR(PdbHelper::PdbDownloader, delete);
+
+    /**
+     * @brief       Creates a pdb downloader.
+     *
+     * @param[in]   SymbolServer     - The symbol server. Either an http url or a path to
+     *                                 a directory which has the symbol server layout.
+     * @param[in]   PdbDirectoryPath - The directory where to save the pdbs on disk.
+     *                                 This must exist.
+     * @param[out]  Downloader       - On success, it will contain a properly initialized object.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    static NTSTATUS XPF_API
+    Create(
+        _In_ _Const_ const xpf::StringView<wchar_t>& SymbolServer,
+        _In_ _Const_ const xpf::StringView<wchar_t>& PdbDirectoryPath,
+        _Out_ xpf::Optional<PdbHelper::PdbDownloader>* Downloader
+    ) noexcept(true);
+
+    /**
+     * @brief       Checks if the pdb is available locally, otherwise it downloads it.
+     *
+     * @param[in]   PdbName         - The name of the pdb. For example "ntdll.pdb".
+     * @param[in]   PdbGuidAndAge   - As there can be multiple ntdll versions, the specific
+     *                                version is identified by its guid and age.
+     * @param[out]  PdbFullFilePath - On success, the path of the pdb on disk.
+     *                                PdbDirectoryPath/PdbGuidAndAge_PdbName.
+     *
+     * @return      A proper NTSTATUS error code.
+     *
+     * @note        It is recommended to use a system thread for this functionality.
+     *              Leverage work queue or threadpool mechanisms.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    ResolvePdb(
+        _In_ _Const_ const xpf::StringView<wchar_t>& PdbName,
+        _In_ _Const_ const xpf::StringView<wchar_t>& PdbGuidAndAge,
+        _Out_ xpf::String<wchar_t>* PdbFullFilePath
+    ) noexcept(true);
+
+ private:
+    /**
+     * @brief       Downloads a pdb, retrying on transient failures.
+     *              A partially written pdb is deleted.
+     *
+     * @param[in]   PdbName         - The name of the pdb.
+     * @param[in]   PdbGuidAndAge   - The guid and age of the pdb.
+     * @param[in]   PdbFullFilePath - Where to save the pdb on disk.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    Download(
+        _In_ _Const_ const xpf::StringView<wchar_t>& PdbName,
+        _In_ _Const_ const xpf::StringView<wchar_t>& PdbGuidAndAge,
+        _In_ _Const_ const xpf::StringView<wchar_t>& PdbFullFilePath
+    ) noexcept(true);
+
+    /**
+     * @brief       Performs one http request for a pdb, on a kept-alive connection.
+     *
+     * @param[in]   PdbName         - The name of the pdb.
+     * @param[in]   PdbGuidAndAge   - The guid and age of the pdb.
+     * @param[in]   PdbFile         - The opened file where the pdb is written.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    DownloadFromHttp(
+        _In_ _Const_ const xpf::StringView<wchar_t>& PdbName,
+        _In_ _Const_ const xpf::StringView<wchar_t>& PdbGuidAndAge,
+        _Inout_ SysMon::File::FileObject& PdbFile
+    ) noexcept(true);
+
+    /**
+     * @brief       Copies a pdb from a directory or file share.
+     *
+     * @param[in]   PdbName         - The name of the pdb.
+     * @param[in]   PdbGuidAndAge   - The guid and age of the pdb.
+     * @param[in]   PdbFile         - The opened file where the pdb is written.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    CopyFromShare(
+        _In_ _Const_ const xpf::StringView<wchar_t>& PdbName,
+        _In_ _Const_ const xpf::StringView<wchar_t>& PdbGuidAndAge,
+        _Inout_ SysMon::File::FileObject& PdbFile
+    ) noexcept(true);
+
+    /**
+     * @brief       Grabs a free connection. Waits if all of them are in use.
+     *
+     * @return      The index of the connection in m_Connections.
+     */
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    size_t XPF_API
+    AcquireConnection(
+        void
+    ) noexcept(true);
+
+    /**
+     * @brief       Gives back a connection.
+     *
+     * @param[in]   Index       - The index returned by AcquireConnection.
+     * @param[in]   KeepAlive   - false if the connection is broken and must be closed.
+     *
+     * @return      Nothing.
+     */
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    void XPF_API
+    ReleaseConnection(
+        _In_ size_t Index,
+        _In_ bool KeepAlive
+    ) noexcept(true);
+
+ private:
+    /**
+     * @brief   How many downloads are performed at once.
+     */
+    static constexpr size_t MAX_CONNECTIONS = 4;
+
+    /**
+     * @brief   How many times a download is attempted.
+     */
+    static constexpr uint32_t MAX_ATTEMPTS = 3;
+
+    /**
+     * @brief   The delay before the first retry. It doubles with each retry.
+     */
+    static constexpr uint32_t RETRY_BASE_DELAY_MS = 500;
+
+    /**
+     * @brief   How long to wait before checking again for a free connection.
+     */
+    static constexpr uint32_t CONNECTION_WAIT_MS = 100;
+
+    /**
+     * @brief   How many bytes are copied at once from a file share.
+     */
+    static constexpr size_t COPY_CHUNK_SIZE = 1024 * 1024;
+
+    xpf::String<wchar_t> m_SymbolServer{ SYSMON_PAGED_ALLOCATOR };
+    xpf::String<char> m_SymbolServerUrl{ SYSMON_PAGED_ALLOCATOR };
+    xpf::String<wchar_t> m_PdbDirectoryPath{ SYSMON_PAGED_ALLOCATOR };
+    bool m_IsHttpServer = false;
+
+    xpf::Optional<xpf::ReadWriteLock> m_DownloaderLock;
+    xpf::Vector<xpf::SharedPointer<PdbHelper::PdbDownload>> m_InFlight{ SYSMON_PAGED_ALLOCATOR };
+    xpf::Vector<PdbHelper::PdbConnection> m_Connections{ SYSMON_PAGED_ALLOCATOR };
+
+    /**
+     * @brief   Default MemoryAllocator is our friend as it requires access to the private
+     *          default constructor. It is used in the Create() method to ensure that
+     *          no partially constructed objects are created but instead they will be
+     *          all fully initialized.
+     */
+    friend class xpf::MemoryAllocator;
+};  // class PdbDownloader
+};  // namespace PdbHelper
@@ -20,7 +20,9 @@
 #include "HashUtils.hpp"
 #include "globals.hpp"
 
+#include "MsfReader.hpp"
 #include "PdbHelper.hpp"
+#include "PeDebugReader.hpp"
 #include "trace.hpp"
 
 /**
@@ -31,115 +33,44 @@
 XPF_SECTION_PAGED;
 
 /**
- *  @brief      See https://www.debuginfo.com/articles/debuginfomatch.html
+ * @brief       The names in the pdb records are null terminated, but the records come
+ *              from the file, so we don't trust the terminator to be there.
  *
- *  @details    "When debug information for an executable is stored in PDB file,
- *               the executables debug directory contains an entry of type IMAGE_DEBUG_TYPE_CODEVIEW.
- *               This entry points to a small data block, which tells the debugger where to look for the PDB file.
- *               But before we proceed to the details of the data stored in this block, a word about CodeView
- *               debug information in general should be said. If we look at CodeView format specification
- *               (available in older versions of MSDN), we can notice that several kinds of CodeView information exist.
- *               Since all of them are called CodeView and use the same type of debug directory entry
- *               (IMAGE_DEBUG_TYPE_CODEVIEW), debuggers must be given a way to determine which CodeView format is actually used.
- *               This is achieved with the help of a DWORD-sized signature, which is always placed at the beginning of 
- *               CodeView debug information. The most known signatures for CodeView debug information stored in the
- *               executable are "NB09" (CodeView 4.10) and "NB11" (CodeView 5.0). When CodeView information refers to a PDB file,
- *               the signature can be "NB10" (which is used with PDB 2.0 files) or "RSDS" (for PDB 7.0 files)."
+ * @param[in]   String     - The string in the record.
+ * @param[in]   MaxLength  - How many characters are available in the record.
+ *
+ * @return      A view over the string, without the terminator.
  */
-typedef struct _CODEVIEW_PDB_INFO
+static xpf::StringView<char> XPF_API
+PdbHelperBoundedStringView(
+    _In_reads_(MaxLength) const char* String,
+    _In_ size_t MaxLength
+) noexcept(true)
 {
-    /**
-     * @brief   Indicates that the pdb format is 2.0.
-     */
-    #define CODEVIEW_PDB_NB10_SINGATURE '90BN'
-
-    /**
-     * @brief   Indicates that the pdb format is 7.0.
-     */
-    #define CODEVIEW_PDB_RSDS_SINGATURE 'SDSR'
-
-    /**
-     *  @brief  Equals to "NB10" for PDB 2.0 files or "RSDS" for PDB 7.0 files.
-     */
-    uint32_t    CodeViewSignature;
-
-    union
+    size_t length = 0;
+    while (length < MaxLength && String[length] != '\0')
     {
-        struct CODEVIEW_INFO_PDB20
-        {
-            /**
-             * @brief    CodeView offset. Set to 0, because debug information is usually stored in a separate file. 
-             */
-            uint32_t    Offset;
-
-            /**
-             *  @brief   The time when debug information was created (in seconds since 01.01.1970) 
-             */
-            uint32_t    Signature;
-
-            /**
-             * @brief   Ever-incrementing value, which is initially set to 1 and incremented every
-             *          time when a part of the PDB file is updated without rewriting the whole file. 
-             */
-            uint32_t    Age;
-
-            /**
-             * @brief   Null-terminated name of the PDB file. It can also contain full or partial path to the file.
-             */
-            char        PdbFileName[1];
-        } Pdb20;
-
-        struct CODEVIEW_INFO_PDB70
-        {
-            /**
-             * @brief   A unique identifier, which changes with every rebuild of the executable and PDB file. 
-             */
-            uuid_t      Signature;
-
-            /**
-             * @brief   Ever-incrementing value, which is initially set to 1 and incremented every
-             *          time when a part of the PDB file is updated without rewriting the whole file.
-             */
-            uint32_t    Age;
-
-            /**
-             * @brief   Null-terminated name of the PDB file. It can also contain full or partial path to the file.
-             */
-            char        PdbFileName[1];
-        } Pdb70;
-    } Info;
-} CODEVIEW_PDB_INFO;
+        ++length;
+    }
+    return xpf::StringView<char>(String,
+                                 length);
+}
 
-/**
- * @brief           This extracts the program database information from an already opened file.
- *                  The file must have been opened with read access. The file must be a dll or executable.
- *
- * @param[in,out]   File            - The opened module file.
- * @param[out]      PdbGuidAndAge   - Extracted PDB information required to download the pdb symbol.
- * @param[out]      PdbName         - Extracted PDB name required to download the pdb symbol.
- *
- * @return          A proper NTSTATUS error code.
- */
-_Must_inspect_result_
-_IRQL_requires_max_(PASSIVE_LEVEL)
-static NTSTATUS XPF_API
-PdbHelperExtractPdbInformationFromFile(
+_Use_decl_annotations_
+NTSTATUS XPF_API
+PdbHelper::ExtractImageIdentity(
     _Inout_ SysMon::File::FileObject& File,
-    _Out_ xpf::String<wchar_t>* PdbGuidAndAge,
-    _Out_ xpf::String<wchar_t>* PdbName
+    _Out_ PdbHelper::ImageIdentity* Identity
 ) noexcept(true)
 {
     XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != Identity);
 
     NTSTATUS status = STATUS_UNSUCCESSFUL;
-    xpf::Buffer bufferFile{ SYSMON_PAGED_ALLOCATOR };
+    NTSTATUS readStatus = STATUS_SUCCESS;
 
-    ULONG debugEntrySize = 0;
-    PIMAGE_DEBUG_DIRECTORY debugEntryDirectory = NULL;
-
-    ULONG debugEntriesCount = 0;
-    PIMAGE_DEBUG_DIRECTORY imageDebugCodeViewSection = NULL;
-    CODEVIEW_PDB_INFO* rawData = NULL;
+    xpf::Buffer readBuffer{ SYSMON_PAGED_ALLOCATOR };
+    SysMon::PeDebugReader::PdbInfo pdbInfo;
 
     WCHAR buffer[100] = { 0 };
     UNICODE_STRING ustrBuffer = { 0 };
@@ -148,96 +79,94 @@ PdbHelperExtractPdbInformationFromFile(
 
     xpf::String<wchar_t> widePdbName{ SYSMON_PAGED_ALLOCATOR };
 
+    /* Only the headers, the debug directory and the codeview record are read - never the whole file. */
+    auto readFile = [&](uint64_t Offset, void* Destination, size_t Size) -> bool
+                    {
+                        uint64_t endOffset = 0;
+                        if (!xpf::ApiNumbersSafeAdd(Offset, static_cast<uint64_t>(Size), &endOffset) ||
+                            endOffset > File.FileSize())
+                        {
+                            return false;
+                        }
+                        readStatus = readBuffer.Resize(Size);
+                        if (NT_SUCCESS(readStatus))
+                        {
+                            readStatus = File.Read(Offset, &readBuffer);
+                        }
+                        if (!NT_SUCCESS(readStatus) || readBuffer.GetSize() != Size)
+                        {
+                            return false;
+                        }
+                        xpf::ApiCopyMemory(Destination,
+                                           readBuffer.GetBuffer(),
+                                           Size);
+                        return true;
+                    };
+
     /* The buffer we'll be using for printing data. */
     ::RtlInitEmptyUnicodeString(&ustrBuffer,
                                 buffer,
                                 sizeof(buffer));
 
     /* Clear output. */
-    (*PdbGuidAndAge).Reset();
-    (*PdbName).Reset();
-
-    /* We limit this to size_t max bytes. */
-    if (File.FileSize() > xpf::NumericLimits<size_t>::MaxValue())
-    {
-        status = STATUS_FILE_TOO_LARGE;
-        goto CleanUp;
-    }
-
-    /* Read the file in the system addres space. */
-    status = bufferFile.Resize(static_cast<size_t>(File.FileSize()));
-    if (!NT_SUCCESS(status))
-    {
-        goto CleanUp;
-    }
-    status = File.Read(0, &bufferFile);
-    if (!NT_SUCCESS(status))
-    {
+    Identity->TimeDateStamp = 0;
+    Identity->SizeOfImage = 0;
+    xpf::ApiZeroMemory(&Identity->PdbGuid, sizeof(Identity->PdbGuid));
+    Identity->PdbAge = 0;
+    Identity->HasPdbInformation = false;
+    Identity->PdbGuidAndAge.Reset();
+    Identity->PdbName.Reset();
+
+    if (!SysMon::PeDebugReader::ReadPdbInfo(readFile, &pdbInfo))
+    {
+        /* A failed read is reported as it is - otherwise the image is malformed. */
+        status = NT_SUCCESS(readStatus) ? STATUS_INVALID_IMAGE_FORMAT
+                                        : readStatus;
         goto CleanUp;
     }
 
-    /* Go to the debug directory. */
-    debugEntryDirectory = static_cast<PIMAGE_DEBUG_DIRECTORY>(::RtlImageDirectoryEntryToData(bufferFile.GetBuffer(),
-                                                                                             FALSE,
-                                                                                             IMAGE_DIRECTORY_ENTRY_DEBUG,
-                                                                                             &debugEntrySize));
-    if (NULL == debugEntryDirectory || 0 == debugEntrySize)
+    /* The timestamp and the size of image identify the build. */
+    Identity->TimeDateStamp = pdbInfo.TimeDateStamp;
+    Identity->SizeOfImage = pdbInfo.SizeOfImage;
+    if (!pdbInfo.HasPdbInformation)
     {
-        status = STATUS_INVALID_IMAGE_FORMAT;
+        /* No pdb information - the image identity is still valid. */
+        status = STATUS_SUCCESS;
         goto CleanUp;
     }
 
-    /* Find the codeview PDBINFO directory section. */
-    debugEntriesCount = debugEntrySize / sizeof(IMAGE_DEBUG_DIRECTORY);
-    for (ULONG i = 0; i < debugEntriesCount; ++i)
-    {
-        if (debugEntryDirectory[i].Type == IMAGE_DEBUG_TYPE_CODEVIEW)
-        {
-            imageDebugCodeViewSection = &debugEntryDirectory[i];
-            break;
-        }
-    }
-    if (NULL == imageDebugCodeViewSection)
-    {
-        status = STATUS_INVALID_IMAGE_FORMAT;
-        goto CleanUp;
-    }
+    /* The guid is stored in the file with the same layout as in memory. */
+    xpf::ApiCopyMemory(&Identity->PdbGuid,
+                       &pdbInfo.PdbGuid[0],
+                       sizeof(Identity->PdbGuid));
+    Identity->PdbAge = pdbInfo.PdbAge;
+    pdbName = xpf::StringView<char>(&pdbInfo.PdbName[0],
+                                    pdbInfo.PdbNameLength);
 
     /* Print the signature and age to a buffer. */
-    rawData = static_cast<CODEVIEW_PDB_INFO*>(xpf::AlgoAddToPointer(bufferFile.GetBuffer(),
-                                                                    imageDebugCodeViewSection->PointerToRawData));
-
-    if (rawData->CodeViewSignature == CODEVIEW_PDB_NB10_SINGATURE)
+    if (pdbInfo.CodeViewSignature == SysMon::PeDebugReader::CODEVIEW_NB10_SIGNATURE)
     {
-        pdbName = xpf::StringView<char>(rawData->Info.Pdb20.PdbFileName);
-
         status = ::RtlUnicodeStringPrintf(&ustrBuffer,
                                           L"%02X%x",
-                                          rawData->Info.Pdb20.Signature,
-                                          rawData->Info.Pdb20.Age);
+                                          Identity->PdbGuid.Data1,
+                                          Identity->PdbAge);
     }
-    else if (rawData->CodeViewSignature == CODEVIEW_PDB_RSDS_SINGATURE)
+    else
     {
-        pdbName = xpf::StringView<char>(rawData->Info.Pdb70.PdbFileName);
-
         status = ::RtlUnicodeStringPrintf(&ustrBuffer,
                                           L"%08X%04X%04X%02X%02X%02X%02X%02X%02X%02X%02X%x",
-                                          rawData->Info.Pdb70.Signature.Data1,
-                                          rawData->Info.Pdb70.Signature.Data2,
-                                          rawData->Info.Pdb70.Signature.Data3,
-                                          rawData->Info.Pdb70.Signature.Data4[0],
-                                          rawData->Info.Pdb70.Signature.Data4[1],
-                                          rawData->Info.Pdb70.Signature.Data4[2],
-                                          rawData->Info.Pdb70.Signature.Data4[3],
-                                          rawData->Info.Pdb70.Signature.Data4[4],
-                                          rawData->Info.Pdb70.Signature.Data4[5],
-                                          rawData->Info.Pdb70.Signature.Data4[6],
-                                          rawData->Info.Pdb70.Signature.Data4[7],
-                                          rawData->Info.Pdb70.Age);
-    }
-    else
-    {
-        status = STATUS_INVALID_IMAGE_FORMAT;
+                                          Identity->PdbGuid.Data1,
+                                          Identity->PdbGuid.Data2,
+                                          Identity->PdbGuid.Data3,
+                                          Identity->PdbGuid.Data4[0],
+                                          Identity->PdbGuid.Data4[1],
+                                          Identity->PdbGuid.Data4[2],
+                                          Identity->PdbGuid.Data4[3],
+                                          Identity->PdbGuid.Data4[4],
+                                          Identity->PdbGuid.Data4[5],
+                                          Identity->PdbGuid.Data4[6],
+                                          Identity->PdbGuid.Data4[7],
+                                          Identity->PdbAge);
     }
     if (!NT_SUCCESS(status))
     {
@@ -251,7 +180,7 @@ PdbHelperExtractPdbInformationFromFile(
     {
         goto CleanUp;
     }
-    status = PdbGuidAndAge->Append(bufferView);
+    status = Identity->PdbGuidAndAge.Append(bufferView);
     if (!NT_SUCCESS(status))
     {
         goto CleanUp;
@@ -264,226 +193,318 @@ PdbHelperExtractPdbInformationFromFile(
         goto CleanUp;
     }
 
-    status = PdbName->Append(widePdbName.View());
+    status = Identity->PdbName.Append(widePdbName.View());
     if (!NT_SUCCESS(status))
     {
         goto CleanUp;
     }
 
+    /* The pdb can now be resolved. */
+    Identity->HasPdbInformation = true;
+
 CleanUp:
     return status;
 }
 
 /**
- * @brief       Helper method to compute the full pdb path of a file.
- *
- * @param[in]   FileName         - Name of the file for which the pdb is requested.
- *                                 For example "ntdll"
- * @param[in]   PdbGuidAndAge    - As there can be multiple ntdll versions, the specific
- *                                 version is identified by its guid and age.
- * @param[in]   PdbDirectoryPath - The directory where to save the pdb on disk.
- *                                 This must exist.
- * @param[out]  PdbFullFilePath  - Will store the full pdb file path. Its form will be:
- *                                 PdbDirectoryPath/PdbGuidAndAge_FileName.
- *
- * @return      A proper NTSTATUS error code.
+ * @brief   The structures below are read as they are from the pdb streams.
+ *          See https://llvm.org/docs/PDB/DbiStream.html and
+ *          https://llvm.org/docs/PDB/PublicStream.html
  */
-_Must_inspect_result_
-_IRQL_requires_max_(PASSIVE_LEVEL)
-static NTSTATUS XPF_API
-PdbHelperComputePdbFullFilePath(
-    _In_ _Const_ const xpf::StringView<wchar_t>& FileName,
-    _In_ _Const_ const xpf::StringView<wchar_t>& PdbGuidAndAge,
-    _In_ _Const_ const xpf::StringView<wchar_t>& PdbDirectoryPath,
-    _Out_ xpf::String<wchar_t>* PdbFullFilePath
-) noexcept(true)
+#pragma pack(push, 1)
+
+/**
+ * @brief   The header of the debug information stream. We only need it to find the
+ *          symbol records stream and the section headers stream.
+ */
+typedef struct _PDB_DBI_STREAM_HEADER
 {
-    XPF_MAX_PASSIVE_LEVEL();
-    XPF_DEATH_ON_FAILURE(nullptr != PdbFullFilePath);
+    int32_t     VersionSignature;
+    uint32_t    VersionHeader;
+    uint32_t    Age;
+    uint16_t    GlobalStreamIndex;
+    uint16_t    BuildNumber;
+    uint16_t    PublicStreamIndex;
+    uint16_t    PdbDllVersion;
+    uint16_t    SymRecordStream;
+    uint16_t    PdbDllRbld;
+    int32_t     ModInfoSize;
+    int32_t     SectionContributionSize;
+    int32_t     SectionMapSize;
+    int32_t     SourceInfoSize;
+    int32_t     TypeServerMapSize;
+    uint32_t    MFCTypeServerIndex;
+    int32_t     OptionalDbgHeaderSize;
+    int32_t     ECSubstreamSize;
+    uint16_t    Flags;
+    uint16_t    Machine;
+    uint32_t    Padding;
+} PDB_DBI_STREAM_HEADER;
 
-    NTSTATUS status = STATUS_UNSUCCESSFUL;
+/**
+ * @brief   Every symbol record starts with this header.
+ */
+typedef struct _PDB_SYMBOL_RECORD_HEADER
+{
+    /**
+     * @brief   The length of the record, without this field.
+     */
+    uint16_t    RecordLength;
 
-    /* Preinit output. */
-    PdbFullFilePath->Reset();
-
-    /* Helper macro to help build the full file path */
-    #ifndef DOXYGEN_SHOULD_SKIP_THIS
-        #define HELPER_APPEND_DATA_TO_STRING(string, data)          \
-        {                                                           \
-            status = string->Append(data);                          \
-            if (!NT_SUCCESS(status))                                \
-            {                                                       \
-                return status;                                      \
-            }                                                       \
-        }
-    #endif  // DOXYGEN_SHOULD_SKIP_THIS
+    /**
+     * @brief   One of the S_* values.
+     */
+    uint16_t    RecordKind;
+} PDB_SYMBOL_RECORD_HEADER;
 
-    /* Construct path. */
-    HELPER_APPEND_DATA_TO_STRING(PdbFullFilePath, PdbDirectoryPath);
-    if (!PdbDirectoryPath.EndsWith(L"\\", false))
-    {
-        HELPER_APPEND_DATA_TO_STRING(PdbFullFilePath, L"\\");
-    }
-    HELPER_APPEND_DATA_TO_STRING(PdbFullFilePath, PdbGuidAndAge);
-    HELPER_APPEND_DATA_TO_STRING(PdbFullFilePath, L"_");
-    HELPER_APPEND_DATA_TO_STRING(PdbFullFilePath, FileName);
+/**
+ * @brief   The fixed part of a S_PUB32 record. It is followed by the null terminated name.
+ */
+typedef struct _PDB_PUBLIC_SYMBOL
+{
+    uint32_t    Flags;
+    uint32_t    Offset;
+    uint16_t    Segment;
+} PDB_PUBLIC_SYMBOL;
 
-    /* Macro no longer needed */
-    #undef HELPER_APPEND_DATA_TO_STRING
+#pragma pack(pop)
 
-    /* All good. */
-    return STATUS_SUCCESS;
-}
+/**
+ * @brief   The msf stream which holds the debug information.
+ */
+#define PDB_DBI_STREAM_INDEX                3
 
 /**
- * @brief       Checks if pdb is available locally, otherwise it downloads the pdb for the given file name.
- *              The pdb file is saved on disk.
- *
- * @param[in]   FileName         - Name of the file for which the pdb is requested.
- *                                 For example "ntdll"
- * @param[in]   PdbGuidAndAge    - As there can be multiple ntdll versions, the specific
- *                                 version is identified by its guid and age.
- * @param[in]   PdbFullFilePath  - The location where to save the pdb on disk.
+ * @brief   The index of the section headers stream in the optional debug header.
+ */
+#define PDB_DBG_HEADER_SECTION_HDR_INDEX    5
+
+/**
+ * @brief   Marks a stream which is not present.
+ */
+#define PDB_INVALID_STREAM_INDEX            0xFFFF
+
+/**
+ * @brief   A public symbol record.
+ */
+#define PDB_S_PUB32                         0x110E
+
+/**
+ * @brief       Finds the symbol records stream and reads the section headers of the image.
  *
- * @return      A proper NTSTATUS error code.
- *              On success, the PdbDirectoryPath/PdbGuidAndAge_FileName.pdb file is created.
+ * @param[in,out]   Msf                 - The pdb file.
+ * @param[out]      SymRecordStream     - The index of the symbol records stream.
+ * @param[out]      SectionHeaders      - The section headers, as they are in the image.
  *
- * @note        An HTTP request to http://msdl.microsoft.com/download/symbols is performed.
- * @note        It is recommended to use a system thread for this functionality.
- *              Leverage work queue or threadpool mechanisms.
+ * @return      STATUS_FILE_CORRUPT_ERROR if the streams are not valid,
+ *              or a proper NTSTATUS error code.
  */
 _Must_inspect_result_
 _IRQL_requires_max_(PASSIVE_LEVEL)
 static NTSTATUS XPF_API
-PdbHelperResolvePdb(
-    _In_ _Const_ const xpf::StringView<wchar_t>& FileName,
-    _In_ _Const_ const xpf::StringView<wchar_t>& PdbGuidAndAge,
-    _In_ _Const_ const xpf::StringView<wchar_t>& PdbFullFilePath
+PdbHelperReadDbiStream(
+    _Inout_ PdbHelper::MsfReader& Msf,
+    _Out_ uint16_t* SymRecordStream,
+    _Inout_ xpf::Buffer* SectionHeaders
 ) noexcept(true)
 {
     XPF_MAX_PASSIVE_LEVEL();
 
-    xpf::String<char> url{ SYSMON_PAGED_ALLOCATOR };
-    xpf::SharedPointer<xpf::IClient> client{ SYSMON_PAGED_ALLOCATOR };
     NTSTATUS status = STATUS_UNSUCCESSFUL;
+    PDB_DBI_STREAM_HEADER dbiHeader = { 0 };
 
-    xpf::String<char> ansiFileName{ SYSMON_PAGED_ALLOCATOR };
-    xpf::String<char> ansiGuidAndAge{ SYSMON_PAGED_ALLOCATOR };
-    xpf::Optional<SysMon::File::FileObject> pdbFile;
-
-    xpf::http::HttpResponse response;
+    uint64_t dbgHeaderOffset = sizeof(dbiHeader);
+    uint16_t sectionHeadersStream = PDB_INVALID_STREAM_INDEX;
 
-    response.ResponseBuffer = xpf::SharedPointer<xpf::Buffer>(SYSMON_PAGED_ALLOCATOR);
-    response.Headers = xpf::Move(xpf::Vector<xpf::http::HeaderItem>(SYSMON_PAGED_ALLOCATOR));
+    *SymRecordStream = PDB_INVALID_STREAM_INDEX;
 
-    /* Get the ansi name for request. */
-    status = xpf::StringConversion::WideToUTF8(FileName, ansiFileName);
+    status = Msf.ReadStream(PDB_DBI_STREAM_INDEX,
+                            0,
+                            sizeof(dbiHeader),
+                            &dbiHeader);
     if (!NT_SUCCESS(status))
     {
         return status;
     }
-    status = xpf::StringConversion::WideToUTF8(PdbGuidAndAge, ansiGuidAndAge);
+
+    /* The optional debug header follows all other substreams. */
+    const int32_t substreamSizes[] = { dbiHeader.ModInfoSize,
+                                       dbiHeader.SectionContributionSize,
+                                       dbiHeader.SectionMapSize,
+                                       dbiHeader.SourceInfoSize,
+                                       dbiHeader.TypeServerMapSize,
+                                       dbiHeader.ECSubstreamSize };
+    for (size_t i = 0; i < XPF_ARRAYSIZE(substreamSizes); ++i)
+    {
+        if (substreamSizes[i] < 0)
+        {
+            return STATUS_FILE_CORRUPT_ERROR;
+        }
+        dbgHeaderOffset += static_cast<uint64_t>(substreamSizes[i]);
+    }
+    if (dbiHeader.OptionalDbgHeaderSize < static_cast<int32_t>((PDB_DBG_HEADER_SECTION_HDR_INDEX + 1) * sizeof(uint16_t)) ||
+        dbgHeaderOffset > Msf.StreamSize(PDB_DBI_STREAM_INDEX))
+    {
+        return STATUS_FILE_CORRUPT_ERROR;
+    }
+    status = Msf.ReadStream(PDB_DBI_STREAM_INDEX,
+                            static_cast<uint32_t>(dbgHeaderOffset + PDB_DBG_HEADER_SECTION_HDR_INDEX * sizeof(uint16_t)),
+                            sizeof(sectionHeadersStream),
+                            &sectionHeadersStream);
     if (!NT_SUCCESS(status))
     {
         return status;
     }
-
-    /* Header items to be used. */
-    const xpf::http::HeaderItem headerItems[] =
+    if (PDB_INVALID_STREAM_INDEX == sectionHeadersStream || PDB_INVALID_STREAM_INDEX == dbiHeader.SymRecordStream)
     {
-        { "Accept",             "application/octet-stream" },
-        { "Accept-Encoding",    "gzip, deflate, br" },
-        { "User-Agent",         "Microsoft-Symbol-Server/10.0.10036.206" },
-        { "Connection",         "close" },
-    };
-
-    /* Helper macro to help build the request path and the full file path */
-    #ifndef DOXYGEN_SHOULD_SKIP_THIS
-        #define HELPER_APPEND_DATA_TO_STRING(string, data)          \
-        {                                                           \
-            status = string.Append(data);                           \
-            if (!NT_SUCCESS(status))                                \
-            {                                                       \
-                return status;                                      \
-            }                                                       \
-        }
-    #endif  // DOXYGEN_SHOULD_SKIP_THIS
-
-    HELPER_APPEND_DATA_TO_STRING(url, "http://msdl.microsoft.com/download/symbols/");
-    HELPER_APPEND_DATA_TO_STRING(url, ansiFileName.View());
-    HELPER_APPEND_DATA_TO_STRING(url, "/");
-    HELPER_APPEND_DATA_TO_STRING(url, ansiGuidAndAge.View());
-    HELPER_APPEND_DATA_TO_STRING(url, "/");
-    HELPER_APPEND_DATA_TO_STRING(url, ansiFileName.View());
-
-    #undef HELPER_APPEND_DATA_TO_STRING
+        return STATUS_FILE_CORRUPT_ERROR;
+    }
 
-    /* Check if the pdb is there. */
-    status = SysMon::File::FileObject::Create(PdbFullFilePath,
-                                              XPF_FILE_ACCESS_READ,
-                                              &pdbFile);
-    if (NT_SUCCESS(status))
+    /* The section headers are small - we keep them around to translate the symbols. */
+    status = SectionHeaders->Resize(Msf.StreamSize(sectionHeadersStream));
+    if (!NT_SUCCESS(status))
     {
-        return STATUS_SUCCESS;
+        return status;
     }
-
-    /* Connect to msdl to grab the .pdb file. This will also grab the first chunk. */
-    status = xpf::http::InitiateHttpDownload(url.View(),
-                                             headerItems,
-                                             XPF_ARRAYSIZE(headerItems),
-                                             &response,
-                                             client);
+    status = Msf.ReadStream(sectionHeadersStream,
+                            0,
+                            SectionHeaders->GetSize(),
+                            SectionHeaders->GetBuffer());
     if (!NT_SUCCESS(status))
     {
         return status;
     }
 
-    /* Open the file and write the first chunk. */
-    status = SysMon::File::FileObject::Create(PdbFullFilePath,
-                                              XPF_FILE_ACCESS_WRITE,
-                                              &pdbFile);
+    *SymRecordStream = dbiHeader.SymRecordStream;
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @brief       Walks the symbol records stream and emits the public symbols found in
+ *              executable sections. Only one record is kept in memory at a time.
+ *
+ * @param[in,out]   Msf      - The pdb file.
+ * @param[out]      Symbols  - The public symbols, sorted by their rva.
+ *
+ * @return      STATUS_FILE_CORRUPT_ERROR if the streams are not valid,
+ *              or a proper NTSTATUS error code.
+ */
+_Must_inspect_result_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static NTSTATUS XPF_API
+PdbHelperExtractPublicSymbols(
+    _Inout_ PdbHelper::MsfReader& Msf,
+    _Out_ xpf::Vector<xpf::pdb::SymbolInformation>* Symbols
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    uint16_t symRecordStream = PDB_INVALID_STREAM_INDEX;
+    xpf::Buffer sectionHeaders{ SYSMON_PAGED_ALLOCATOR };
+    xpf::Buffer record{ SYSMON_PAGED_ALLOCATOR };
+
+    const IMAGE_SECTION_HEADER* sections = nullptr;
+    size_t sectionsCount = 0;
+
+    uint32_t streamOffset = 0;
+    uint32_t streamSize = 0;
+
+    status = PdbHelperReadDbiStream(Msf,
+                                    &symRecordStream,
+                                    &sectionHeaders);
     if (!NT_SUCCESS(status))
     {
         return status;
     }
-    status = (*pdbFile).Write(response.Body.Buffer(),
-                              response.Body.BufferSize());
+    sections = static_cast<const IMAGE_SECTION_HEADER*>(sectionHeaders.GetBuffer());
+    sectionsCount = sectionHeaders.GetSize() / sizeof(IMAGE_SECTION_HEADER);
+
+    /* A record is at most 64k - allocate once and reuse it for all records. */
+    status = record.Resize(xpf::NumericLimits<uint16_t>::MaxValue());
     if (!NT_SUCCESS(status))
     {
         return status;
     }
 
-    /* No grab the rest of .pdb */
-    bool hasMoreData = true;
-    while (hasMoreData)
+    streamSize = Msf.StreamSize(symRecordStream);
+    while (streamSize - streamOffset >= sizeof(PDB_SYMBOL_RECORD_HEADER))
     {
-        /* And keep downloading. */
-        status = xpf::http::HttpContinueDownload(client,
-                                                 &response,
-                                                 &hasMoreData);
+        PDB_SYMBOL_RECORD_HEADER recordHeader = { 0 };
+        PDB_PUBLIC_SYMBOL publicSymbol = { 0 };
+        size_t recordSize = 0;
+
+        status = Msf.ReadStream(symRecordStream,
+                                streamOffset,
+                                sizeof(recordHeader),
+                                &recordHeader);
         if (!NT_SUCCESS(status))
         {
-            break;
+            return status;
         }
+        if (recordHeader.RecordLength < sizeof(recordHeader.RecordKind) ||
+            recordHeader.RecordLength - sizeof(recordHeader.RecordKind) > streamSize - streamOffset - sizeof(recordHeader))
+        {
+            return STATUS_FILE_CORRUPT_ERROR;
+        }
+        recordSize = recordHeader.RecordLength - sizeof(recordHeader.RecordKind);
 
-        if (!response.Body.IsEmpty())
+        /* We only care about public symbols. Other records are skipped without reading them. */
+        if (PDB_S_PUB32 == recordHeader.RecordKind && recordSize > sizeof(publicSymbol))
         {
-            status = (*pdbFile).Write(response.Body.Buffer(),
-                                      response.Body.BufferSize());
+            status = Msf.ReadStream(symRecordStream,
+                                    streamOffset + static_cast<uint32_t>(sizeof(recordHeader)),
+                                    recordSize,
+                                    record.GetBuffer());
             if (!NT_SUCCESS(status))
             {
-                break;
+                return status;
+            }
+            xpf::ApiCopyMemory(&publicSymbol,
+                               record.GetBuffer(),
+                               sizeof(publicSymbol));
+
+            /* Segments are 1-based. Data symbols would only confuse the stack decoration. */
+            if (publicSymbol.Segment >= 1 && publicSymbol.Segment <= sectionsCount &&
+                (sections[publicSymbol.Segment - 1].Characteristics & IMAGE_SCN_MEM_EXECUTE) != 0)
+            {
+                xpf::pdb::SymbolInformation symbol;
+                symbol.SymbolRVA = sections[publicSymbol.Segment - 1].VirtualAddress + publicSymbol.Offset;
+
+                status = symbol.SymbolName.Append(PdbHelperBoundedStringView(static_cast<const char*>(xpf::AlgoAddToPointer(record.GetBuffer(),
+                                                                                                                             sizeof(publicSymbol))),
+                                                                             recordSize - sizeof(publicSymbol)));
+                if (!NT_SUCCESS(status))
+                {
+                    return status;
+                }
+                status = Symbols->Emplace(xpf::Move(symbol));
+                if (!NT_SUCCESS(status))
+                {
+                    return status;
+                }
             }
         }
+
+        streamOffset += static_cast<uint32_t>(sizeof(recordHeader) + recordSize);
     }
-    return status;
+
+    /* Symbols are looked up with a binary search - keep them sorted by rva. */
+    Symbols->Sort([&](const xpf::pdb::SymbolInformation& Left,
+                      const xpf::pdb::SymbolInformation& Right)
+                  {
+                      XPF_MAX_PASSIVE_LEVEL();
+                      return Left.SymbolRVA < Right.SymbolRVA;
+                  });
+    return STATUS_SUCCESS;
 }
 
 _Use_decl_annotations_
 NTSTATUS XPF_API
 PdbHelper::ExtractPdbSymbolInformation(
-    _Inout_ SysMon::File::FileObject& File,
-    _In_ _Const_ const xpf::StringView<wchar_t>& PdbDirectoryPath,
+    _In_ _Const_ const PdbHelper::ImageIdentity& Identity,
+    _Inout_ PdbHelper::PdbDownloader& Downloader,
     _Out_ xpf::Vector<xpf::pdb::SymbolInformation>* Symbols
 ) noexcept(true)
 {
@@ -493,42 +514,29 @@ PdbHelper::ExtractPdbSymbolInformation(
     NTSTATUS status = STATUS_UNSUCCESSFUL;
 
     xpf::Optional<SysMon::File::FileObject> pdbFile;
-    xpf::Buffer pdbFileBuffer{ SYSMON_PAGED_ALLOCATOR };
+    xpf::Optional<PdbHelper::MsfReader> pdbReader;
 
-    xpf::String<wchar_t> pdbGuidAndAge{ SYSMON_PAGED_ALLOCATOR };
-    xpf::String<wchar_t> pdbName{ SYSMON_PAGED_ALLOCATOR };
     xpf::String<wchar_t> pdbFullFilePath{ SYSMON_PAGED_ALLOCATOR };
 
     /* Preinit output. */
     Symbols->Clear();
 
-    /* Grab details about pdb. */
-    status = PdbHelperExtractPdbInformationFromFile(File,
-                                                    &pdbGuidAndAge,
-                                                    &pdbName);
-    if (!NT_SUCCESS(status))
-    {
-        return status;
-    }
-    status = PdbHelperComputePdbFullFilePath(pdbName.View(),
-                                             pdbGuidAndAge.View(),
-                                             PdbDirectoryPath,
-                                             &pdbFullFilePath);
-    if (!NT_SUCCESS(status))
+    /* Without a codeview entry there is no pdb to look for. */
+    if (!Identity.HasPdbInformation)
     {
-        return status;
+        return STATUS_NOT_FOUND;
     }
 
     /* Ensure the pdb exists. */
-    status = PdbHelperResolvePdb(pdbName.View(),
-                                 pdbGuidAndAge.View(),
-                                 pdbFullFilePath.View());
+    status = Downloader.ResolvePdb(Identity.PdbName.View(),
+                                   Identity.PdbGuidAndAge.View(),
+                                   &pdbFullFilePath);
     if (!NT_SUCCESS(status))
     {
         return status;
     }
 
-    /* Map it in memory. */
+    /* Open it. Only the streams we need are read, never the whole file. */
     status = SysMon::File::FileObject::Create(pdbFullFilePath.View(),
                                               XPF_FILE_ACCESS_READ,
                                               &pdbFile);
@@ -536,38 +544,19 @@ PdbHelper::ExtractPdbSymbolInformation(
     {
         return status;
     }
-
-    /* Now extract information. */
-    if ((*pdbFile).FileSize() > xpf::NumericLimits<size_t>::MaxValue())
-    {
-        return STATUS_FILE_TOO_LARGE;
-    }
-    status = pdbFileBuffer.Resize(static_cast<size_t>((*pdbFile).FileSize()));
-    if (!NT_SUCCESS(status))
-    {
-        return status;
-    }
-    status = (*pdbFile).Read(0, &pdbFileBuffer);
+    status = PdbHelper::MsfReader::Create((*pdbFile),
+                                          &pdbReader);
     if (!NT_SUCCESS(status))
     {
         return status;
     }
 
-    /* This assumes an aligned size - so fill with 0. */
-    const size_t alignedSize = xpf::AlgoAlignValueUp(pdbFileBuffer.GetSize(),
-                                                     size_t{PAGE_SIZE});
-    if (alignedSize < pdbFileBuffer.GetSize())
-    {
-        return STATUS_FILE_TOO_LARGE;
-    }
-    status = pdbFileBuffer.Resize(alignedSize);
+    /* And finally extract the symbols. */
+    status = PdbHelperExtractPublicSymbols((*pdbReader),
+                                           Symbols);
     if (!NT_SUCCESS(status))
     {
-        return status;
+        Symbols->Clear();
     }
-
-    /* And finally extract the symbols. */
-    return xpf::pdb::ExtractSymbols(pdbFileBuffer.GetBuffer(),
-                                    pdbFileBuffer.GetSize(),
-                                    Symbols);
+    return status;
 }
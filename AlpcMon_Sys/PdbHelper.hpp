@@ -16,18 +16,78 @@
 
 #include "precomp.hpp"
 #include "FileObject.hpp"
+#include "PdbDownloader.hpp"
 
 namespace PdbHelper
 {
 /**
- * @brief       This extracts the program database information for an already opened file.
+ * @brief   Describes a specific build of an image. Two files with the same
+ *          identity have the same layout and the same program database.
+ */
+struct ImageIdentity
+{
+    /**
+     * @brief   The TimeDateStamp from the image file header.
+     */
+    uint32_t TimeDateStamp = 0;
+
+    /**
+     * @brief   The SizeOfImage from the image optional header.
+     */
+    uint32_t SizeOfImage = 0;
+
+    /**
+     * @brief   The guid of the program database. For NB10 pdbs only Data1 is
+     *          populated and it contains the signature.
+     */
+    uuid_t PdbGuid = { 0 };
+
+    /**
+     * @brief   The age of the program database.
+     */
+    uint32_t PdbAge = 0;
+
+    /**
+     * @brief   False if the image has no codeview debug directory entry.
+     *          In this case the members describing the pdb are not populated.
+     */
+    bool HasPdbInformation = false;
+
+    /**
+     * @brief   The guid and age as used by the symbol server.
+     */
+    xpf::String<wchar_t> PdbGuidAndAge{ SYSMON_PAGED_ALLOCATOR };
+
+    /**
+     * @brief   The name of the pdb file - as it is in the codeview entry.
+     */
+    xpf::String<wchar_t> PdbName{ SYSMON_PAGED_ALLOCATOR };
+};
+
+/**
+ * @brief       This extracts the identity of an already opened file.
  *              The file must be a .exe or .dll.
- *              An HTTP request to http://msdl.microsoft.com/download/symbols is performed
- *              to retrieve the required .pdb file.
  *
- * @param[in,out]   File             - The opened module file.
- * @param[in]       PdbDirectoryPath - The directory where to save the pdb on disk.
- *                                     This must exist.
+ * @param[in,out]   File     - The opened module file.
+ * @param[out]      Identity - The image identity.
+ *
+ * @return          A proper NTSTATUS error code.
+ */
+_Must_inspect_result_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+NTSTATUS XPF_API
+ExtractImageIdentity(
+    _Inout_ SysMon::File::FileObject& File,
+    _Out_ PdbHelper::ImageIdentity* Identity
+) noexcept(true);
+
+/**
+ * @brief       This extracts the program database information for an image.
+ *              The required .pdb file is retrieved from the symbol server if it
+ *              is not already on disk.
+ *
+ * @param[in]       Identity         - The image identity, as returned by ExtractImageIdentity.
+ * @param[in,out]   Downloader       - Brings the pdb from the symbol server.
  * @param[out]      Symbols          - Extracted symbols from the .pdb files.
  *
  * @return          A proper NTSTATUS error code.
@@ -36,8 +96,8 @@ _Must_inspect_result_
 _IRQL_requires_max_(PASSIVE_LEVEL)
 NTSTATUS XPF_API
 ExtractPdbSymbolInformation(
-    _Inout_ SysMon::File::FileObject& File,
-    _In_ _Const_ const xpf::StringView<wchar_t>& PdbDirectoryPath,
+    _In_ _Const_ const PdbHelper::ImageIdentity& Identity,
+    _Inout_ PdbHelper::PdbDownloader& Downloader,
     _Out_ xpf::Vector<xpf::pdb::SymbolInformation>* Symbols
 ) noexcept(true);
 
@@ -0,0 +1,364 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/PeDebugReader.hpp
+ *
+ * @brief       In this file we define a reader which extracts the program database
+ *              information (the codeview record) of a pe file, as it is on disk.
+ *              Only the headers, the debug directory and the codeview record are read -
+ *              never the whole file.
+ *
+ * @note        This header is portable on purpose - it does not depend on the kernel
+ *              or on xpf, so it is also built and tested on linux. See the Tests folder.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "PeExportReader.hpp"
+
+
+namespace SysMon
+{
+namespace PeDebugReader
+{
+/**
+ * @brief   The fields of IMAGE_DEBUG_DIRECTORY. Read as they are from the file.
+ */
+#pragma pack(push, 1)
+struct DebugDirectory
+{
+    uint32_t    Characteristics;
+    uint32_t    TimeDateStamp;
+    uint16_t    MajorVersion;
+    uint16_t    MinorVersion;
+    uint32_t    Type;
+    uint32_t    SizeOfData;
+    uint32_t    AddressOfRawData;
+    uint32_t    PointerToRawData;
+};
+#pragma pack(pop)
+
+/**
+ *  @brief      See https://www.debuginfo.com/articles/debuginfomatch.html
+ *
+ *  @details    "When debug information for an executable is stored in PDB file,
+ *               the executables debug directory contains an entry of type IMAGE_DEBUG_TYPE_CODEVIEW.
+ *               This entry points to a small data block, which tells the debugger where to look for the PDB file.
+ *               [...] When CodeView information refers to a PDB file,
+ *               the signature can be "NB10" (which is used with PDB 2.0 files) or "RSDS" (for PDB 7.0 files)."
+ *
+ *              NB10: signature, offset, timestamp signature, age, then the null terminated name.
+ *              RSDS: signature, guid, age, then the null terminated name.
+ */
+static constexpr uint32_t CODEVIEW_NB10_SIGNATURE = 0x3031424E;
+static constexpr uint32_t CODEVIEW_RSDS_SIGNATURE = 0x53445352;
+static constexpr uint32_t CODEVIEW_NB10_NAME_OFFSET = 16;
+static constexpr uint32_t CODEVIEW_RSDS_NAME_OFFSET = 24;
+
+/**
+ * @brief   IMAGE_DIRECTORY_ENTRY_DEBUG and IMAGE_DEBUG_TYPE_CODEVIEW.
+ */
+static constexpr uint32_t DEBUG_DIRECTORY_INDEX = 6;
+static constexpr uint32_t DEBUG_TYPE_CODEVIEW = 2;
+
+/**
+ * @brief   Upper bounds for the pe structures we read. Anything above is considered corrupt.
+ *          They keep a malformed file from making us read too much.
+ */
+static constexpr uint16_t MAX_SECTIONS = 1024;
+static constexpr uint32_t MAX_DEBUG_ENTRIES = 64;
+static constexpr uint32_t MAX_CODEVIEW_SIZE = 4 * 1024;
+
+/**
+ * @brief   Longer pdb names are considered corrupt. The name is kept on the stack.
+ */
+static constexpr size_t MAX_PDB_NAME_LENGTH = 260;
+
+/**
+ * @brief   What is extracted from an image.
+ */
+struct PdbInfo
+{
+    /**
+     * @brief   The TimeDateStamp and SizeOfImage - they identify the build of the image.
+     */
+    uint32_t TimeDateStamp = 0;
+    uint32_t SizeOfImage = 0;
+
+    /**
+     * @brief   False if the image has no codeview debug directory entry.
+     *          In this case the members below are not populated.
+     */
+    bool HasPdbInformation = false;
+
+    /**
+     * @brief   CODEVIEW_NB10_SIGNATURE or CODEVIEW_RSDS_SIGNATURE.
+     */
+    uint32_t CodeViewSignature = 0;
+
+    /**
+     * @brief   The guid of the program database, as it is stored in the file.
+     *          For NB10 pdbs only the first 4 bytes are populated - with the signature.
+     */
+    uint8_t PdbGuid[16] = { 0 };
+
+    /**
+     * @brief   The age of the program database.
+     */
+    uint32_t PdbAge = 0;
+
+    /**
+     * @brief   The name of the pdb file, null terminated. It can also contain a path.
+     */
+    char PdbName[MAX_PDB_NAME_LENGTH + 1] = { 0 };
+    size_t PdbNameLength = 0;
+};
+
+/**
+ * @brief       Translates a relative virtual address to an offset in the file. The same as
+ *              SysMon::PeExportReader::RvaToFileOffset, but the section table is read one
+ *              entry at a time - images can have more sections than fit on the stack.
+ *
+ * @param[in]   Read                - Reads from the file, see ReadPdbInfo.
+ * @param[in]   SectionTableOffset  - Where the section table starts in the file.
+ * @param[in]   NumberOfSections    - The number of entries in the section table.
+ * @param[in]   SizeOfHeaders       - The size of the headers. They are not part of any section.
+ * @param[in]   Rva                 - The relative virtual address to be translated.
+ * @param[out]  Offset              - The offset in the file.
+ *
+ * @return      false if the rva is not backed by the file, true otherwise.
+ */
+template <class Reader>
+inline bool
+RvaToFileOffset(
+    Reader& Read,
+    uint64_t SectionTableOffset,
+    uint16_t NumberOfSections,
+    uint32_t SizeOfHeaders,
+    uint32_t Rva,
+    uint64_t* Offset
+) noexcept(true)
+{
+    /* The headers are mapped as they are - no need to read any section. */
+    if (SysMon::PeExportReader::RvaToFileOffset(nullptr, 0, SizeOfHeaders, Rva, Offset))
+    {
+        return true;
+    }
+
+    for (uint16_t i = 0; i < NumberOfSections; ++i)
+    {
+        SysMon::PeExportReader::SectionHeader section = { 0 };
+        if (!Read(SectionTableOffset + uint64_t{ i } * sizeof(section), &section, sizeof(section)))
+        {
+            return false;
+        }
+        if (SysMon::PeExportReader::RvaToFileOffset(&section, 1, SizeOfHeaders, Rva, Offset))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief       Extracts the program database information of a pe file.
+ *
+ * @param[in]   Read    - Reads from the file: bool Read(uint64_t Offset, void* Destination, size_t Size).
+ *                        It must fail when the range is not entirely inside the file.
+ * @param[out]  Info    - The extracted information.
+ *
+ * @return      false if the file is malformed, true otherwise - even if it has no pdb information.
+ *
+ * @note        The sizes found in the file are bounds checked before they are used, and
+ *              the pdb name is not trusted to be null terminated.
+ */
+template <class Reader>
+inline bool
+ReadPdbInfo(
+    Reader& Read,
+    SysMon::PeDebugReader::PdbInfo* Info
+) noexcept(true)
+{
+    uint16_t dosSignature = 0;
+    int32_t ntHeadersOffset = 0;
+    uint32_t ntSignature = 0;
+    uint16_t optionalMagic = 0;
+    uint32_t sizeOfHeaders = 0;
+    uint32_t directoriesOffset = 0;
+    uint32_t numberOfRvaAndSizes = 0;
+    uint32_t debugDataDirectory[2] = { 0 };
+    uint64_t debugDirectoryOffset = 0;
+    SysMon::PeExportReader::FileHeader fileHeader = { 0 };
+    SysMon::PeDebugReader::DebugDirectory codeView = { 0 };
+    bool foundCodeView = false;
+    uint32_t nameOffset = 0;
+
+    *Info = SysMon::PeDebugReader::PdbInfo{};
+
+    /* The dos header tells us where the nt headers are. */
+    if (!Read(0, &dosSignature, sizeof(dosSignature)) || dosSignature != SysMon::PeExportReader::DOS_SIGNATURE)
+    {
+        return false;
+    }
+    if (!Read(0x3C, &ntHeadersOffset, sizeof(ntHeadersOffset)) || ntHeadersOffset < 0)
+    {
+        return false;
+    }
+
+    /* The nt headers - signature, file header, then the optional header. */
+    const uint64_t fileHeaderOffset = static_cast<uint64_t>(ntHeadersOffset) + sizeof(ntSignature);
+    const uint64_t optionalHeaderOffset = fileHeaderOffset + sizeof(fileHeader);
+    if (!Read(static_cast<uint64_t>(ntHeadersOffset), &ntSignature, sizeof(ntSignature)) ||
+        ntSignature != SysMon::PeExportReader::NT_SIGNATURE)
+    {
+        return false;
+    }
+    if (!Read(fileHeaderOffset, &fileHeader, sizeof(fileHeader)) ||
+        !Read(optionalHeaderOffset, &optionalMagic, sizeof(optionalMagic)))
+    {
+        return false;
+    }
+    if (SysMon::PeExportReader::OPTIONAL_HDR32_MAGIC == optionalMagic)
+    {
+        directoriesOffset = SysMon::PeExportReader::OPTIONAL_HDR32_DIRECTORIES_OFFSET;
+    }
+    else if (SysMon::PeExportReader::OPTIONAL_HDR64_MAGIC == optionalMagic)
+    {
+        directoriesOffset = SysMon::PeExportReader::OPTIONAL_HDR64_DIRECTORIES_OFFSET;
+    }
+    else
+    {
+        return false;
+    }
+
+    /* The timestamp and the size of image identify the build. NumberOfRvaAndSizes precedes the directories. */
+    if (!Read(optionalHeaderOffset + SysMon::PeExportReader::OPTIONAL_HDR_SIZE_OF_IMAGE_OFFSET,
+              &Info->SizeOfImage,
+              sizeof(Info->SizeOfImage)) ||
+        !Read(optionalHeaderOffset + SysMon::PeExportReader::OPTIONAL_HDR_SIZE_OF_HEADERS_OFFSET,
+              &sizeOfHeaders,
+              sizeof(sizeOfHeaders)) ||
+        !Read(optionalHeaderOffset + directoriesOffset - sizeof(numberOfRvaAndSizes),
+              &numberOfRvaAndSizes,
+              sizeof(numberOfRvaAndSizes)))
+    {
+        return false;
+    }
+    Info->TimeDateStamp = fileHeader.TimeDateStamp;
+
+    /* No debug directory - the image identity is still valid. */
+    if (numberOfRvaAndSizes <= SysMon::PeDebugReader::DEBUG_DIRECTORY_INDEX)
+    {
+        return true;
+    }
+    const uint32_t debugDataDirectoryOffset = directoriesOffset +
+                                              SysMon::PeDebugReader::DEBUG_DIRECTORY_INDEX * sizeof(debugDataDirectory);
+    if (fileHeader.SizeOfOptionalHeader < debugDataDirectoryOffset + sizeof(debugDataDirectory) ||
+        !Read(optionalHeaderOffset + debugDataDirectoryOffset, &debugDataDirectory[0], sizeof(debugDataDirectory)))
+    {
+        return false;
+    }
+    if (0 == debugDataDirectory[0] || 0 == debugDataDirectory[1])
+    {
+        return true;
+    }
+    if (fileHeader.NumberOfSections > SysMon::PeDebugReader::MAX_SECTIONS ||
+        debugDataDirectory[1] > SysMon::PeDebugReader::MAX_DEBUG_ENTRIES * sizeof(codeView))
+    {
+        return false;
+    }
+
+    /* The section table follows the optional header. We need it to translate the debug directory rva. */
+    if (!SysMon::PeDebugReader::RvaToFileOffset(Read,
+                                                optionalHeaderOffset + fileHeader.SizeOfOptionalHeader,
+                                                fileHeader.NumberOfSections,
+                                                sizeOfHeaders,
+                                                debugDataDirectory[0],
+                                                &debugDirectoryOffset))
+    {
+        return false;
+    }
+
+    /* Find the codeview entry. It is usually the first one. */
+    const uint32_t entriesCount = debugDataDirectory[1] / sizeof(codeView);
+    for (uint32_t i = 0; i < entriesCount && !foundCodeView; ++i)
+    {
+        if (!Read(debugDirectoryOffset + uint64_t{ i } * sizeof(codeView), &codeView, sizeof(codeView)))
+        {
+            return false;
+        }
+        foundCodeView = (SysMon::PeDebugReader::DEBUG_TYPE_CODEVIEW == codeView.Type);
+    }
+    if (!foundCodeView)
+    {
+        return true;
+    }
+
+    /* The record must at least hold the pdb 2.0 fixed fields. */
+    if (codeView.SizeOfData <= SysMon::PeDebugReader::CODEVIEW_NB10_NAME_OFFSET ||
+        codeView.SizeOfData > SysMon::PeDebugReader::MAX_CODEVIEW_SIZE)
+    {
+        return false;
+    }
+    const uint64_t record = codeView.PointerToRawData;
+    if (!Read(record, &Info->CodeViewSignature, sizeof(Info->CodeViewSignature)))
+    {
+        return false;
+    }
+    if (SysMon::PeDebugReader::CODEVIEW_NB10_SIGNATURE == Info->CodeViewSignature)
+    {
+        /* The offset is skipped - the signature takes the place of the guid. */
+        if (!Read(record + 8, &Info->PdbGuid[0], sizeof(uint32_t)) ||
+            !Read(record + 12, &Info->PdbAge, sizeof(Info->PdbAge)))
+        {
+            return false;
+        }
+        nameOffset = SysMon::PeDebugReader::CODEVIEW_NB10_NAME_OFFSET;
+    }
+    else if (SysMon::PeDebugReader::CODEVIEW_RSDS_SIGNATURE == Info->CodeViewSignature &&
+             codeView.SizeOfData > SysMon::PeDebugReader::CODEVIEW_RSDS_NAME_OFFSET)
+    {
+        if (!Read(record + 4, &Info->PdbGuid[0], sizeof(Info->PdbGuid)) ||
+            !Read(record + 20, &Info->PdbAge, sizeof(Info->PdbAge)))
+        {
+            return false;
+        }
+        nameOffset = SysMon::PeDebugReader::CODEVIEW_RSDS_NAME_OFFSET;
+    }
+    else
+    {
+        return false;
+    }
+
+    /* The name is null terminated, but the record comes from the file - don't trust the terminator. */
+    const size_t available = codeView.SizeOfData - nameOffset;
+    const size_t toRead = (available < sizeof(Info->PdbName)) ? available
+                                                              : sizeof(Info->PdbName);
+    if (!Read(record + nameOffset, &Info->PdbName[0], toRead))
+    {
+        return false;
+    }
+    while (Info->PdbNameLength < toRead && '\0' != Info->PdbName[Info->PdbNameLength])
+    {
+        Info->PdbNameLength++;
+    }
+    if (Info->PdbNameLength > SysMon::PeDebugReader::MAX_PDB_NAME_LENGTH)
+    {
+        return false;
+    }
+    Info->PdbName[Info->PdbNameLength] = '\0';
+
+    Info->HasPdbInformation = true;
+    return true;
+}
+};  // namespace PeDebugReader
+};  // namespace SysMon
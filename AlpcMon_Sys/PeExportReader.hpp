@@ -0,0 +1,361 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/PeExportReader.hpp
+ *
+ * @brief       In this file we define a reader which finds an export in a pe file,
+ *              as it is on disk. The mapped image of a process can be modified by the
+ *              process itself, the file it was loaded from can not.
+ *
+ * @note        This header is portable on purpose - it does not depend on the kernel
+ *              or on xpf, so it is also built and tested on linux. See the Tests folder.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+
+namespace SysMon
+{
+namespace PeExportReader
+{
+/**
+ * @brief   The values which identify a build of an image. Same fields as the loader checks.
+ */
+struct ImageIdentity
+{
+    uint32_t TimeDateStamp = 0;
+    uint32_t SizeOfImage = 0;
+    uint16_t Machine = 0;
+};
+
+/**
+ * @brief   The structures below are read as they are from the file.
+ *          See https://learn.microsoft.com/en-us/windows/win32/debug/pe-format
+ */
+#pragma pack(push, 1)
+
+/**
+ * @brief   The fields of IMAGE_FILE_HEADER.
+ */
+struct FileHeader
+{
+    uint16_t    Machine;
+    uint16_t    NumberOfSections;
+    uint32_t    TimeDateStamp;
+    uint32_t    PointerToSymbolTable;
+    uint32_t    NumberOfSymbols;
+    uint16_t    SizeOfOptionalHeader;
+    uint16_t    Characteristics;
+};
+
+/**
+ * @brief   The fields of IMAGE_SECTION_HEADER.
+ */
+struct SectionHeader
+{
+    uint8_t     Name[8];
+    uint32_t    VirtualSize;
+    uint32_t    VirtualAddress;
+    uint32_t    SizeOfRawData;
+    uint32_t    PointerToRawData;
+    uint32_t    PointerToRelocations;
+    uint32_t    PointerToLinenumbers;
+    uint16_t    NumberOfRelocations;
+    uint16_t    NumberOfLinenumbers;
+    uint32_t    Characteristics;
+};
+
+/**
+ * @brief   The fields of IMAGE_EXPORT_DIRECTORY.
+ */
+struct ExportDirectory
+{
+    uint32_t    Characteristics;
+    uint32_t    TimeDateStamp;
+    uint16_t    MajorVersion;
+    uint16_t    MinorVersion;
+    uint32_t    Name;
+    uint32_t    Base;
+    uint32_t    NumberOfFunctions;
+    uint32_t    NumberOfNames;
+    uint32_t    AddressOfFunctions;
+    uint32_t    AddressOfNames;
+    uint32_t    AddressOfNameOrdinals;
+};
+
+#pragma pack(pop)
+
+/**
+ * @brief   "MZ" and "PE\0\0".
+ */
+static constexpr uint16_t DOS_SIGNATURE = 0x5A4D;
+static constexpr uint32_t NT_SIGNATURE = 0x00004550;
+
+/**
+ * @brief   The optional header magic of 32 and 64 bit images.
+ */
+static constexpr uint16_t OPTIONAL_HDR32_MAGIC = 0x10B;
+static constexpr uint16_t OPTIONAL_HDR64_MAGIC = 0x20B;
+
+/**
+ * @brief   Offsets in the optional header. SizeOfImage and SizeOfHeaders are at the same
+ *          offset in both variants - the data directories are not.
+ */
+static constexpr uint32_t OPTIONAL_HDR_SIZE_OF_IMAGE_OFFSET = 56;
+static constexpr uint32_t OPTIONAL_HDR_SIZE_OF_HEADERS_OFFSET = 60;
+static constexpr uint32_t OPTIONAL_HDR32_DIRECTORIES_OFFSET = 96;
+static constexpr uint32_t OPTIONAL_HDR64_DIRECTORIES_OFFSET = 112;
+
+/**
+ * @brief   The section table is kept on the stack. The system dlls have less than 10 sections,
+ *          images with more than this are not read.
+ */
+static constexpr uint16_t MAX_SECTIONS = 32;
+
+/**
+ * @brief   Longer export names are not looked up.
+ */
+static constexpr size_t MAX_EXPORT_NAME_LENGTH = 256;
+
+/**
+ * @brief       Translates a relative virtual address to an offset in the file,
+ *              using the section table - the same as the loader does.
+ *
+ * @param[in]   Sections          - The section table of the image.
+ * @param[in]   NumberOfSections  - The number of entries in the section table.
+ * @param[in]   SizeOfHeaders     - The size of the headers. They are not part of any section.
+ * @param[in]   Rva               - The relative virtual address to be translated.
+ * @param[out]  Offset            - The offset in the file.
+ *
+ * @return      false if the rva is not backed by the file, true otherwise.
+ */
+inline bool
+RvaToFileOffset(
+    const SysMon::PeExportReader::SectionHeader* Sections,
+    uint16_t NumberOfSections,
+    uint32_t SizeOfHeaders,
+    uint32_t Rva,
+    uint64_t* Offset
+) noexcept(true)
+{
+    *Offset = 0;
+
+    /* The headers are mapped as they are. */
+    if (Rva < SizeOfHeaders)
+    {
+        *Offset = Rva;
+        return true;
+    }
+
+    for (uint16_t i = 0; i < NumberOfSections; ++i)
+    {
+        const uint64_t sectionStart = Sections[i].VirtualAddress;
+        const uint64_t sectionEnd = sectionStart + Sections[i].SizeOfRawData;
+
+        if (Rva >= sectionStart && Rva < sectionEnd)
+        {
+            *Offset = uint64_t{ Sections[i].PointerToRawData } + (Rva - sectionStart);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief       Finds a named export in a pe file.
+ *
+ * @param[in]   Read        - Reads from the file: bool Read(uint64_t Offset, void* Destination, size_t Size).
+ *                            It must fail when the range is not entirely inside the file.
+ * @param[in]   ExportName  - A null terminated string containing the export name. Case sensitive,
+ *                            the same as GetProcAddress.
+ * @param[out]  Identity    - The identity of the image, from its headers.
+ * @param[out]  ExportRva   - The rva of the export.
+ *
+ * @return      false if the file is malformed, or the export is not found or is forwarded,
+ *              true otherwise.
+ *
+ * @note        The names are binary searched, as the loader does - only a few of them are read.
+ */
+template <class Reader>
+inline bool
+FindExport(
+    Reader& Read,
+    const char* ExportName,
+    SysMon::PeExportReader::ImageIdentity* Identity,
+    uint32_t* ExportRva
+) noexcept(true)
+{
+    uint16_t dosSignature = 0;
+    int32_t ntHeadersOffset = 0;
+    uint32_t ntSignature = 0;
+    uint16_t optionalMagic = 0;
+    uint32_t sizeOfHeaders = 0;
+    uint32_t directoriesOffset = 0;
+    uint32_t exportDataDirectory[2] = { 0 };
+    SysMon::PeExportReader::FileHeader fileHeader = { 0 };
+    SysMon::PeExportReader::ExportDirectory exportDirectory = { 0 };
+    SysMon::PeExportReader::SectionHeader sections[SysMon::PeExportReader::MAX_SECTIONS];
+
+    *ExportRva = 0;
+    *Identity = SysMon::PeExportReader::ImageIdentity{};
+
+    const size_t exportNameLength = ::strlen(ExportName);
+    if (0 == exportNameLength || exportNameLength > SysMon::PeExportReader::MAX_EXPORT_NAME_LENGTH)
+    {
+        return false;
+    }
+
+    /* The dos header tells us where the nt headers are. */
+    if (!Read(0, &dosSignature, sizeof(dosSignature)) || dosSignature != SysMon::PeExportReader::DOS_SIGNATURE)
+    {
+        return false;
+    }
+    if (!Read(0x3C, &ntHeadersOffset, sizeof(ntHeadersOffset)) || ntHeadersOffset < 0)
+    {
+        return false;
+    }
+
+    /* The nt headers - signature, file header, then the optional header. */
+    const uint64_t fileHeaderOffset = static_cast<uint64_t>(ntHeadersOffset) + sizeof(ntSignature);
+    const uint64_t optionalHeaderOffset = fileHeaderOffset + sizeof(fileHeader);
+    if (!Read(static_cast<uint64_t>(ntHeadersOffset), &ntSignature, sizeof(ntSignature)) ||
+        ntSignature != SysMon::PeExportReader::NT_SIGNATURE)
+    {
+        return false;
+    }
+    if (!Read(fileHeaderOffset, &fileHeader, sizeof(fileHeader)) ||
+        fileHeader.NumberOfSections > SysMon::PeExportReader::MAX_SECTIONS)
+    {
+        return false;
+    }
+    if (!Read(optionalHeaderOffset, &optionalMagic, sizeof(optionalMagic)))
+    {
+        return false;
+    }
+    if (SysMon::PeExportReader::OPTIONAL_HDR32_MAGIC == optionalMagic)
+    {
+        directoriesOffset = SysMon::PeExportReader::OPTIONAL_HDR32_DIRECTORIES_OFFSET;
+    }
+    else if (SysMon::PeExportReader::OPTIONAL_HDR64_MAGIC == optionalMagic)
+    {
+        directoriesOffset = SysMon::PeExportReader::OPTIONAL_HDR64_DIRECTORIES_OFFSET;
+    }
+    else
+    {
+        return false;
+    }
+
+    /* The export directory is the first data directory - it must be inside the optional header. */
+    if (fileHeader.SizeOfOptionalHeader < directoriesOffset + sizeof(exportDataDirectory))
+    {
+        return false;
+    }
+    if (!Read(optionalHeaderOffset + SysMon::PeExportReader::OPTIONAL_HDR_SIZE_OF_IMAGE_OFFSET,
+              &Identity->SizeOfImage,
+              sizeof(Identity->SizeOfImage)) ||
+        !Read(optionalHeaderOffset + SysMon::PeExportReader::OPTIONAL_HDR_SIZE_OF_HEADERS_OFFSET,
+              &sizeOfHeaders,
+              sizeof(sizeOfHeaders)) ||
+        !Read(optionalHeaderOffset + directoriesOffset,
+              &exportDataDirectory[0],
+              sizeof(exportDataDirectory)))
+    {
+        return false;
+    }
+    Identity->TimeDateStamp = fileHeader.TimeDateStamp;
+    Identity->Machine = fileHeader.Machine;
+
+    const uint32_t exportStart = exportDataDirectory[0];
+    const uint32_t exportSize = exportDataDirectory[1];
+    if (0 == exportStart || exportSize < sizeof(exportDirectory))
+    {
+        return false;
+    }
+
+    /* The section table follows the optional header. */
+    if (0 != fileHeader.NumberOfSections &&
+        !Read(optionalHeaderOffset + fileHeader.SizeOfOptionalHeader,
+              &sections[0],
+              fileHeader.NumberOfSections * sizeof(sections[0])))
+    {
+        return false;
+    }
+
+    /* Helper to read a structure found at an rva. */
+    auto readRva = [&](uint32_t Rva, void* Destination, size_t Size) -> bool
+                   {
+                       uint64_t offset = 0;
+                       return SysMon::PeExportReader::RvaToFileOffset(sections,
+                                                                      fileHeader.NumberOfSections,
+                                                                      sizeOfHeaders,
+                                                                      Rva,
+                                                                      &offset) &&
+                              Read(offset, Destination, Size);
+                   };
+
+    if (!readRva(exportStart, &exportDirectory, sizeof(exportDirectory)))
+    {
+        return false;
+    }
+
+    /* The names are sorted - the loader binary searches them too. */
+    uint32_t left = 0;
+    uint32_t right = exportDirectory.NumberOfNames;
+    while (left < right)
+    {
+        const uint32_t middle = left + (right - left) / 2;
+        uint32_t nameRva = 0;
+        char name[SysMon::PeExportReader::MAX_EXPORT_NAME_LENGTH + 1] = { 0 };
+
+        /* The terminator is compared too - so a longer name with the same prefix is greater. */
+        if (!readRva(exportDirectory.AddressOfNames + middle * sizeof(uint32_t), &nameRva, sizeof(nameRva)) ||
+            !readRva(nameRva, &name[0], exportNameLength + 1))
+        {
+            return false;
+        }
+
+        const int compare = ::memcmp(&name[0], ExportName, exportNameLength + 1);
+        if (compare < 0)
+        {
+            left = middle + 1;
+            continue;
+        }
+        if (compare > 0)
+        {
+            right = middle;
+            continue;
+        }
+
+        /* Found it - the ordinal indexes the functions. */
+        uint16_t ordinal = 0;
+        uint32_t functionRva = 0;
+        if (!readRva(exportDirectory.AddressOfNameOrdinals + middle * sizeof(uint16_t), &ordinal, sizeof(ordinal)) ||
+            ordinal >= exportDirectory.NumberOfFunctions ||
+            !readRva(exportDirectory.AddressOfFunctions + ordinal * sizeof(uint32_t), &functionRva, sizeof(functionRva)))
+        {
+            return false;
+        }
+
+        /* A forwarder points to a string inside the export directory - there is no code to run. */
+        if ((functionRva >= exportStart && functionRva - exportStart < exportSize) ||
+            0 == functionRva || functionRva >= Identity->SizeOfImage)
+        {
+            return false;
+        }
+
+        *ExportRva = functionRva;
+        return true;
+    }
+    return false;
+}
+};  // namespace PeExportReader
+};  // namespace SysMon
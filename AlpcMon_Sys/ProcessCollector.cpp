@@ -71,6 +71,7 @@ SysMon::ProcessData::InsertNewModule(
     XPF_MAX_APC_LEVEL();
 
     NTSTATUS status = STATUS_UNSUCCESSFUL;
+    uint32_t modulePathHash = 0;
 
     /* We need to take ownership of the path, so duplicate it here. */
     xpf::String<wchar_t> modulePath{ SYSMON_PAGED_ALLOCATOR };
@@ -80,10 +81,19 @@ SysMon::ProcessData::InsertNewModule(
         return status;
     }
 
+    /* Hash the path once here, so stack decoration won't need to do it for every frame. */
+    status = KmHelper::HelperHashUnicodeString(modulePath.View(),
+                                               &modulePathHash);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
     /* Create the new module. */
     xpf::SharedPointer<SysMon::ProcessModuleData> moduleData{ SYSMON_PAGED_ALLOCATOR };
     moduleData = xpf::MakeSharedWithAllocator<SysMon::ProcessModuleData>(SYSMON_PAGED_ALLOCATOR,
                                                                          xpf::Move(modulePath),
+                                                                         modulePathHash,
                                                                          ModuleBase,
                                                                          ModuleSize);
     if (moduleData.IsEmpty())
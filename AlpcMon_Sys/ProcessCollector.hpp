@@ -36,14 +36,18 @@ class ProcessModuleData final
      * @brief   The constructor for ProcessModuleData.
      *
      * @param[in,out]   ModulePath     - a string which contains the path of the module.
+     * @param[in]       PathHash       - the hash of the ModulePath string.
+     *                                   It is computed once, when the module is loaded.
      * @param[in]       ModuleBase     - where the module is loaded in the current process.
      * @param[in]       ModuleSize     - the size of the laoded modules (in bytes). 
      */
     ProcessModuleData(
         _Inout_ xpf::String<wchar_t>&& ModulePath,
+        _In_ uint32_t PathHash,
         _In_ _Const_ const void* ModuleBase,
         _In_ _Const_ const size_t& ModuleSize
     ) noexcept(true) : m_ModulePath{xpf::Move(ModulePath)},
+                       m_PathHash{PathHash},
                        m_ModuleBase{ModuleBase},
                        m_ModuleSize{ModuleSize},
                        m_ModuleEnd{xpf::AlgoAddToPointer(ModuleBase, ModuleSize)}
@@ -89,6 +93,21 @@ class ProcessModuleData final
         return this->m_ModulePath.View();
     }
 
+    /**
+     * @brief   Getter for the hash of the path string.
+     *
+     * @return  The hash of the module path, as computed by KmHelper::HelperHashUnicodeString.
+     *          Used to lookup the module in the module collector without rehashing.
+     */
+    inline
+    uint32_t XPF_API
+    PathHash(
+        void
+    ) const noexcept(true)
+    {
+        return this->m_PathHash;
+    }
+
     /**
      * @brief   Getter for the module base.
      *
@@ -134,6 +153,7 @@ class ProcessModuleData final
 
  private:
      xpf::String<wchar_t> m_ModulePath{ SYSMON_PAGED_ALLOCATOR };
+    uint32_t m_PathHash = 0;
 
     const void* m_ModuleBase = nullptr;
     const void* m_ModuleEnd = nullptr;
@@ -249,6 +269,20 @@ class ProcessData final
         return this->m_ProcessId;
     }
 
+    /**
+     * @brief   Getter for the process path.
+     *
+     * @return  The path of the process image.
+     */
+    inline
+    const xpf::String<wchar_t>& XPF_API
+    ProcessPath(
+        void
+    ) const noexcept(true)
+    {
+        return this->m_ProcessPath;
+    }
+
  private:
     /**
      * @brief       Looks up the index in m_LoadedModules where we can find a given module.
@@ -208,6 +208,7 @@ ProcessFilterProcessNotifyRoutineCallback(
         //
         status = SysMon::ProcessCreateEvent::Create(broadcastEvent,
                                                     HandleToUlong(ProcessId),
+                                                    HandleToUlong(CreateInfo->ParentProcessId),
                                                     architecture,
                                                     processPath);
         if (!NT_SUCCESS(status))
@@ -0,0 +1,130 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/RundownProtection.cpp
+ *
+ * @brief       In this file we define a rundown protection used by the queues
+ *              to wait for their outstanding work without polling.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "precomp.hpp"
+
+#include "RundownProtection.hpp"
+#include "trace.hpp"
+
+
+//
+// ************************************************************************************************
+// *                                This contains the paged section code.                         *
+// ************************************************************************************************
+//
+
+/**
+ * @brief   Everything from belows goes into paged section.
+ */
+XPF_SECTION_PAGED;
+
+KmHelper::RundownProtection::RundownProtection(
+    void
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    ::KeInitializeEvent(&this->m_Drained,
+                        EVENT_TYPE::NotificationEvent,
+                        FALSE);
+}
+
+KmHelper::RundownProtection::~RundownProtection(
+    void
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    /* The owner must wait for the outstanding work before going away. */
+    XPF_DEATH_ON_FAILURE(this->m_IsRanDown);
+}
+
+_Use_decl_annotations_
+void XPF_API
+KmHelper::RundownProtection::WaitForRelease(
+    void
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    /* Only once. */
+    XPF_DEATH_ON_FAILURE(!this->m_IsRanDown);
+
+    /* Drop the owner reference - the last one to release signals the event. */
+    this->Release();
+
+    /* We're not expecting this to fail. */
+    NTSTATUS status = ::KeWaitForSingleObject(&this->m_Drained,
+                                              KWAIT_REASON::Executive,
+                                              KernelMode,
+                                              FALSE,
+                                              NULL);
+    XPF_DEATH_ON_FAILURE(NT_SUCCESS(status));
+
+    this->m_IsRanDown = true;
+}
+
+//
+// ************************************************************************************************
+// *                                This contains the nonpaged section code.                      *
+// ************************************************************************************************
+//
+
+/**
+ * @brief   Everything from belows goes into default section.
+ */
+XPF_SECTION_DEFAULT;
+
+_Use_decl_annotations_
+bool XPF_API
+KmHelper::RundownProtection::Acquire(
+    void
+) noexcept(true)
+{
+    XPF_MAX_DISPATCH_LEVEL();
+
+    /* Never move the counter away from zero - the event is already signaled then. */
+    uint32_t references = this->m_References;
+    while (0 != references)
+    {
+        const uint32_t previous = xpf::ApiAtomicCompareExchange(&this->m_References,
+                                                                references + 1,
+                                                                references);
+        if (previous == references)
+        {
+            return true;
+        }
+        references = previous;
+    }
+
+    /* It's too late. */
+    return false;
+}
+
+_Use_decl_annotations_
+void XPF_API
+KmHelper::RundownProtection::Release(
+    void
+) noexcept(true)
+{
+    XPF_MAX_DISPATCH_LEVEL();
+
+    const uint32_t references = xpf::ApiAtomicDecrement(&this->m_References);
+    if (0 == references)
+    {
+        ::KeSetEvent(&this->m_Drained,
+                     IO_NO_INCREMENT,
+                     FALSE);
+    }
+}
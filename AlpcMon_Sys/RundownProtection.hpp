@@ -0,0 +1,96 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/RundownProtection.hpp
+ *
+ * @brief       In this file we define a rundown protection used by the queues
+ *              to wait for their outstanding work without polling.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#pragma once
+
+#include "precomp.hpp"
+
+namespace KmHelper
+{
+/**
+ * @brief   A counter of the outstanding work and a notification event signaled when
+ *          the counter drops to zero, similar to EX_RUNDOWN_REF. The owner holds one
+ *          reference, which is dropped by WaitForRelease - so the event can be signaled
+ *          only once the owner started waiting.
+ *
+ *          Unlike EX_RUNDOWN_REF, references can still be acquired while waiting, as long
+ *          as the outstanding work did not drain yet. This allows a work item to enqueue
+ *          more work. Once drained, Acquire fails - the caller must not start new work.
+ *
+ * @note    The object must be in non paged memory, as it is used at DISPATCH_LEVEL.
+ */
+class RundownProtection final
+{
+ public:
+     /**
+      * @brief  Default constructor.
+      */
+     RundownProtection(void) noexcept(true);
+
+     /**
+      * @brief  Default destructor. WaitForRelease must be called before.
+      */
+     ~RundownProtection(void) noexcept(true);
+
+     /**
+      * @brief  The copy and move semantics are deleted.
+      *         We can implement them when needed.
+      */
+     XPF_CLASS_COPY_MOVE_BEHAVIOR(RundownProtection, delete);
+
+     /**
+      * @brief      Acquires a reference for a piece of outstanding work.
+      *
+      * @return     true if the reference was acquired - it must be released with Release,
+      *             false if the outstanding work already drained - the owner is going away.
+      */
+     _Must_inspect_result_
+     _IRQL_requires_max_(DISPATCH_LEVEL)
+     bool XPF_API
+     Acquire(
+        void
+     ) noexcept(true);
+
+     /**
+      * @brief      Releases a reference previously acquired with Acquire.
+      *
+      * @return     Nothing.
+      *
+      * @note       The last release may free the owner of this object -
+      *             it must not be touched by the caller afterwards.
+      */
+     _IRQL_requires_max_(DISPATCH_LEVEL)
+     void XPF_API
+     Release(
+        void
+     ) noexcept(true);
+
+     /**
+      * @brief      Drops the owner reference and waits until all the other ones are released.
+      *             Returns as soon as the outstanding work finished.
+      *
+      * @return     Nothing.
+      */
+     _IRQL_requires_max_(APC_LEVEL)
+     void XPF_API
+     WaitForRelease(
+        void
+     ) noexcept(true);
+
+ private:
+    volatile uint32_t m_References = 1;
+    volatile bool m_IsRanDown = false;
+    KEVENT m_Drained = { 0 };
+};  // class RundownProtection
+};  // namespace KmHelper
@@ -34,6 +34,7 @@ SysMonStackTracePrintFrame(
     _In_ _Const_ const xpf::StringView<char>& FunctioName,
     _In_ _Const_ const uint64_t& OriginalAddress,
     _In_ _Const_ const uint64_t& Offset,
+    _Inout_ xpf::Buffer& Buffer,
     _Out_ xpf::String<wchar_t>* DecoratedFrame
 ) noexcept(true)
 {
@@ -43,26 +44,19 @@ SysMonStackTracePrintFrame(
     /* Preinit output. */
     (*DecoratedFrame).Reset();
 
-    /* Prepare the buffer for printf. */
-    xpf::Buffer buffer{ SYSMON_PAGED_ALLOCATOR };
-    NTSTATUS status = buffer.Resize(PAGE_SIZE);
-    if (!NT_SUCCESS(status))
-    {
-        return status;
-    }
-
+    /* The buffer is shared by all frames of a trace - it is allocated once by the caller. */
     UNICODE_STRING ustrBuffer = { 0 };
     ::RtlInitEmptyUnicodeString(&ustrBuffer,
-                                static_cast<PWCHAR>(buffer.GetBuffer()),
-                                static_cast<USHORT>(buffer.GetSize()));
+                                static_cast<PWCHAR>(Buffer.GetBuffer()),
+                                static_cast<USHORT>(Buffer.GetSize()));
 
     /* Pretty print. */
-    status = ::RtlUnicodeStringPrintf(&ustrBuffer,
-                                      L"(0x%016llx) -- %s!%S + 0x%llx",
-                                      OriginalAddress,
-                                      ModuleName.Buffer(),
-                                      FunctioName.Buffer(),
-                                      Offset);
+    NTSTATUS status = ::RtlUnicodeStringPrintf(&ustrBuffer,
+                                               L"(0x%016llx) -- %s!%S + 0x%llx",
+                                               OriginalAddress,
+                                               ModuleName.Buffer(),
+                                               FunctioName.Buffer(),
+                                               Offset);
     if (!NT_SUCCESS(status))
     {
         return status;
@@ -81,93 +75,70 @@ SysMonStackTracePrintFrame(
 
 static NTSTATUS XPF_API
 SysMonStackTraceDecorateFrame(
-    _In_ xpf::SharedPointer<SysMon::ProcessData>& ProcessData,
-    _In_ const void* Frame,
+    _In_ _Const_ const SysMon::StackKey::Frame& Frame,
+    _Inout_ xpf::Buffer& Buffer,
     _Out_ xpf::String<wchar_t>* DecoratedFrame
 ) noexcept(true)
 {
     /* We shouldn't decorate stacks at higher IRQLs*/
     XPF_MAX_PASSIVE_LEVEL();
 
-    const uint64_t address = xpf::AlgoPointerToValue(Frame);
-    uint64_t offset = address;
+    const uint64_t address = Frame.Address;
+    uint64_t offset = Frame.Rva;
 
-    xpf::SharedPointer<SysMon::ProcessModuleData> processModuleData{ SYSMON_PAGED_ALLOCATOR };
     xpf::SharedPointer<SysMon::ModuleData> moduleData{ SYSMON_PAGED_ALLOCATOR };
 
-    /* Lookup the module containing data. */
-    processModuleData = ProcessData.Get()->FindModuleContainingAddress(Frame);
-    if (processModuleData.IsEmpty())
+    /* The frame was not inside a known module when it was captured. */
+    if (!SysMon::StackKey::IsInModule(Frame))
     {
         return SysMonStackTracePrintFrame(L"unknown",
                                           "unknown",
                                           address,
-                                          offset,
+                                          address,
+                                          Buffer,
                                           DecoratedFrame);
     }
 
-    /* Offset is now relative to image base of the found module. */
-    offset = address - xpf::AlgoPointerToValue(processModuleData.Get()->ModuleBase());
-
     /* Now we need to find information about the module to go further. */
-    moduleData = ModuleCollectorFindModule(processModuleData.Get()->ModulePath());
+    moduleData = ModuleCollectorFindModuleByPathHash(Frame.PathHash);
     if (moduleData.IsEmpty())
     {
-        return SysMonStackTracePrintFrame(processModuleData.Get()->ModulePath(),
+        return SysMonStackTracePrintFrame(L"unloaded",
                                           "imgbase",
                                           address,
                                           offset,
+                                          Buffer,
                                           DecoratedFrame);
     }
 
-    /* The symbols are sorted by their RVA, find the closest one smaller than the offset. */
-    xpf::Optional<size_t> index;
-    const xpf::Vector<xpf::pdb::SymbolInformation>& symbols = moduleData.Get()->ModuleSymbols();
+    /* Find the closest symbol whose rva is smaller than the offset. */
+    /* Symbols are loaded on first use - until then the frame is printed relative to image base. */
+    uint32_t symbolRva = 0;
+    xpf::String<char> symbolName{ SYSMON_PAGED_ALLOCATOR };
 
-    if (!symbols.IsEmpty())
-    {
-        size_t lo = 0;
-        size_t hi = symbols.Size() - 1;
-        while (lo <= hi)
-        {
-            size_t mid = lo + ((hi - lo) / 2);
-
-            if (symbols[mid].SymbolRVA <= offset)
-            {
-                index.Emplace(mid);
-                if (mid == xpf::NumericLimits<size_t>::MaxValue())
-                {
-                    break;
-                }
-                lo = mid + 1;
-            }
-            else
-            {
-                if (mid == 0)
-                {
-                    break;
-                }
-                hi = mid - 1;
-            }
-        }
-    }
+    NTSTATUS status = ModuleCollectorFindSymbol(moduleData,
+                                                Frame.Rva,
+                                                &symbolRva,
+                                                &symbolName);
 
     /* If we could not find a match, we print relative to image base. */
-    if (!index.HasValue())
+    if (!NT_SUCCESS(status))
     {
-        return SysMonStackTracePrintFrame(processModuleData.Get()->ModulePath(),
+        return SysMonStackTracePrintFrame(moduleData.Get()->ModulePath(),
                                           "imgbase",
                                           address,
                                           offset,
+                                          Buffer,
                                           DecoratedFrame);
     }
 
     /* Found the symbol - so we adjust. */
-    offset = offset - symbols[*index].SymbolRVA;
-    return SysMonStackTracePrintFrame(processModuleData.Get()->ModulePath(),
-                                      symbols[*index].SymbolName.View(),
+    offset = offset - symbolRva;
+    return SysMonStackTracePrintFrame(moduleData.Get()->ModulePath(),
+                                      symbolName.View(),
                                       address,
                                       offset,
+                                      Buffer,
                                       DecoratedFrame);
 }
 
@@ -195,16 +166,21 @@ SysMon::StackTraceCapture(
 
 _Use_decl_annotations_
 NTSTATUS XPF_API
-SysMon::StackTraceDecorate(
+SysMon::StackTraceResolveModules(
     _Inout_ StackTrace* Trace
 ) noexcept(true)
 {
-    XPF_MAX_PASSIVE_LEVEL();
+    XPF_MAX_APC_LEVEL();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
 
     /* First we need the process and the system process for km modules. */
     xpf::SharedPointer<SysMon::ProcessData> process{ SYSMON_PAGED_ALLOCATOR };
     xpf::SharedPointer<SysMon::ProcessData> systemProcess{ SYSMON_PAGED_ALLOCATOR };
 
+    /* Preinit output. */
+    Trace->ResolvedFrames.Clear();
+
     /* If we can't find the processes, we bail.*/
     process = ProcessCollectorFindProcess(Trace->ProcessPid);
     if (process.IsEmpty())
@@ -217,27 +193,74 @@ SysMon::StackTraceDecorate(
         return STATUS_NOT_FOUND;
     }
 
-    /* Now we decorate each frame. */
+    /* Now we find the module of each frame. */
     for (size_t i = 0; i < Trace->CapturedFrames; ++i)
+    {
+        SysMon::StackFrame resolvedFrame;
+
+        xpf::SharedPointer<SysMon::ProcessData>& owner = KmHelper::HelperIsUserAddress(Trace->Frames[i]) ? process
+                                                                                                         : systemProcess;
+        resolvedFrame.Module = owner.Get()->FindModuleContainingAddress(Trace->Frames[i]);
+        if (!resolvedFrame.Module.IsEmpty())
+        {
+            /* Offset is relative to image base of the found module - images are smaller than 4GB. */
+            resolvedFrame.Rva = static_cast<uint32_t>(xpf::AlgoPointerToValue(Trace->Frames[i]) -
+                                                      xpf::AlgoPointerToValue(resolvedFrame.Module.Get()->ModuleBase()));
+        }
+
+        status = Trace->ResolvedFrames.Emplace(xpf::Move(resolvedFrame));
+        if (!NT_SUCCESS(status))
+        {
+            Trace->ResolvedFrames.Clear();
+            return status;
+        }
+    }
+
+    /* Resolved the frames. */
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::StackFramesDecorate(
+    _In_ _Const_ const xpf::Vector<SysMon::StackKey::Frame>& Frames,
+    _Out_ xpf::Vector<xpf::String<wchar_t>>* DecoratedFrames
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != DecoratedFrames);
+
+    /* Preinit output. */
+    DecoratedFrames->Clear();
+
+    /* One buffer for printf, reused for all frames. */
+    xpf::Buffer buffer{ SYSMON_PAGED_ALLOCATOR };
+    NTSTATUS status = buffer.Resize(PAGE_SIZE);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    /* Now we decorate each frame. */
+    for (size_t i = 0; i < Frames.Size(); ++i)
     {
         xpf::String<wchar_t> decoratedFrame{ SYSMON_PAGED_ALLOCATOR };
 
         /* Decorate current frame. */
-        NTSTATUS status = SysMonStackTraceDecorateFrame(KmHelper::HelperIsUserAddress(Trace->Frames[i]) ? process
-                                                                                                        : systemProcess,
-                                                        Trace->Frames[i],
-                                                        &decoratedFrame);
+        status = SysMonStackTraceDecorateFrame(Frames[i],
+                                               buffer,
+                                               &decoratedFrame);
         if (!NT_SUCCESS(status))
         {
-            Trace->DecoratedFrames.Clear();
+            DecoratedFrames->Clear();
             return status;
         }
 
         /* Append it. */
-        status = Trace->DecoratedFrames.Emplace(xpf::Move(decoratedFrame));
+        status = DecoratedFrames->Emplace(xpf::Move(decoratedFrame));
         if (!NT_SUCCESS(status))
         {
-            Trace->DecoratedFrames.Clear();
+            DecoratedFrames->Clear();
             return status;
         }
     }
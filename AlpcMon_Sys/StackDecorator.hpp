@@ -15,9 +15,29 @@
 #pragma once
 
 #include "precomp.hpp"
+#include "ProcessCollector.hpp"
+#include "StackKey.hpp"
 
 namespace SysMon
 {
+/**
+ * @brief    A frame in compact form - the module containing it and the offset inside.
+ *           This is all that is needed to decorate the frame later.
+ */
+struct StackFrame
+{
+    /**
+     * @brief   The module containing the frame. Empty if the frame is not inside a known module.
+     *          It keeps the process module alive - so frames are kept only until the stack is
+     *          stored. See StackTraceKeyFrame for the form which is kept for long.
+     */
+    xpf::SharedPointer<SysMon::ProcessModuleData> Module{ SYSMON_PAGED_ALLOCATOR };
+    /**
+     * @brief   The offset of the frame relative to the module base.
+     */
+    uint32_t    Rva = 0;
+};  // struct StackFrame
+
 /**
  * @brief    An object containing the stack trace. 
  */
@@ -36,11 +56,37 @@ struct StackTrace
      */
     uint32_t    ProcessPid = 0;
     /**
-     * @brief   The decorated frames containing module!symbol information. 
+     * @brief   The frames as (module, rva) pairs. Populated by StackTraceResolveModules.
      */
-    xpf::Vector<xpf::String<wchar_t>> DecoratedFrames;
+    xpf::Vector<SysMon::StackFrame> ResolvedFrames{ SYSMON_PAGED_ALLOCATOR };
 };  // struct StackTrace
 
+/**
+ * @brief           Gets a resolved frame in stable form - it does not keep the module alive.
+ *
+ * @param[in]       Trace - a stack trace, with resolved modules.
+ * @param[in]       Index - the index of the frame, smaller than CapturedFrames.
+ *
+ * @return          The frame as module path hash and rva, or as address if it is not in a module.
+ */
+inline SysMon::StackKey::Frame XPF_API
+StackTraceKeyFrame(
+    _In_ _Const_ const StackTrace& Trace,
+    _In_ size_t Index
+) noexcept(true)
+{
+    SysMon::StackKey::Frame frame;
+    const SysMon::StackFrame& resolvedFrame = Trace.ResolvedFrames[Index];
+
+    frame.Address = xpf::AlgoPointerToValue(Trace.Frames[Index]);
+    if (!resolvedFrame.Module.IsEmpty())
+    {
+        frame.PathHash = resolvedFrame.Module.Get()->PathHash();
+        frame.Rva = resolvedFrame.Rva;
+    }
+    return frame;
+}
+
 /**
  * @brief           Captures the current thread stack trace.
  *
@@ -56,17 +102,39 @@ StackTraceCapture(
 ) noexcept(true);
 
 /**
- * @brief           Decorates the current stack trace.
+ * @brief           Finds the module containing each frame. This only does module range
+ *                  lookups - no symbols and no strings - so it is cheap enough to be done
+ *                  when the event is created. The modules may be unloaded afterwards.
  *
  * @param[in,out]   Trace - a previosuly captured stack trace.
- *                  This API will populate the DecoratedFrames member.
+ *                  This API will populate the ResolvedFrames member.
  *
  * @return          A proper NTSTATUS error code.
  */
 _Must_inspect_result_
 _IRQL_requires_max_(APC_LEVEL)
 NTSTATUS XPF_API
-StackTraceDecorate(
+StackTraceResolveModules(
     _Inout_ StackTrace* Trace
 ) noexcept(true);
+
+/**
+ * @brief           Decorates a stack. This is the expensive part - the modules are looked up
+ *                  again by their path hash, the symbols are looked up and the frames are
+ *                  printed - so it is done only on demand, when someone needs the text form.
+ *
+ * @param[in]       Frames          - the frames of the stack, in stable form.
+ * @param[out]      DecoratedFrames - the frames containing module!symbol information.
+ *
+ * @return          A proper NTSTATUS error code.
+ *
+ * @note            The modules which were forgotten since the capture are printed as unloaded.
+ */
+_Must_inspect_result_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+NTSTATUS XPF_API
+StackFramesDecorate(
+    _In_ _Const_ const xpf::Vector<SysMon::StackKey::Frame>& Frames,
+    _Out_ xpf::Vector<xpf::String<wchar_t>>* DecoratedFrames
+) noexcept(true);
 };  // namespace SysMon
@@ -0,0 +1,159 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/StackKey.hpp
+ *
+ * @brief       In this file we define the stable form of a stack - each frame is kept
+ *              as the path hash of its module and the rva inside it, so a stored stack
+ *              does not keep any module alive and does not depend on where it was loaded.
+ *
+ * @note        This header is portable on purpose - it does not depend on the kernel
+ *              or on xpf, so it is also built and tested on linux. See the Tests folder.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+namespace SysMon
+{
+namespace StackKey
+{
+/**
+ * @brief   A frame in stable form.
+ */
+struct Frame
+{
+    /**
+     * @brief   The address of the frame when it was first captured.
+     *          For frames outside of any known module, this is all we have.
+     */
+    uint64_t Address = 0;
+
+    /**
+     * @brief   The hash of the path of the module containing the frame.
+     *          0 if the frame is not inside a known module.
+     */
+    uint32_t PathHash = 0;
+
+    /**
+     * @brief   The offset of the frame relative to the module base.
+     */
+    uint32_t Rva = 0;
+};
+
+/**
+ * @brief       Tells whether a frame was inside a known module.
+ *
+ * @param[in]   Frame - The frame.
+ *
+ * @return      true if the frame is identified by module and rva, false if only by address.
+ */
+inline bool
+IsInModule(
+    const SysMon::StackKey::Frame& Frame
+) noexcept(true)
+{
+    return 0 != Frame.PathHash;
+}
+
+/**
+ * @brief       Checks whether two frames are the same. Frames inside modules are compared by
+ *              module and rva - the address differs from one process to another.
+ *
+ * @param[in]   Left    - A frame.
+ * @param[in]   Right   - Another frame.
+ *
+ * @return      true if the frames are the same, false otherwise.
+ */
+inline bool
+IsSameFrame(
+    const SysMon::StackKey::Frame& Left,
+    const SysMon::StackKey::Frame& Right
+) noexcept(true)
+{
+    if (IsInModule(Left) != IsInModule(Right))
+    {
+        return false;
+    }
+    if (!IsInModule(Left))
+    {
+        return Left.Address == Right.Address;
+    }
+    return (Left.PathHash == Right.PathHash) && (Left.Rva == Right.Rva);
+}
+
+/**
+ * @brief       Computes the id of a stack - FNV-1a over the frames. Frames inside modules
+ *              contribute the module path hash and the rva, the others their address.
+ *
+ * @param[in]   FramesCount - The number of frames.
+ * @param[in]   FrameAt     - Called with an index, returns the frame at that index.
+ *                            This way the frames are not copied just to be hashed.
+ *
+ * @return      The stack id. Never zero - zero means no stack.
+ */
+template <class FrameAccessor>
+inline uint64_t
+ComputeStackId(
+    size_t FramesCount,
+    const FrameAccessor& FrameAt
+) noexcept(true)
+{
+    uint64_t stackId = 0xCBF29CE484222325;
+    for (size_t i = 0; i < FramesCount; ++i)
+    {
+        const SysMon::StackKey::Frame frame = FrameAt(i);
+        const uint64_t value = IsInModule(frame) ? ((uint64_t{ frame.PathHash } << 32) | frame.Rva)
+                                                 : frame.Address;
+        for (size_t shift = 0; shift < 64; shift += 8)
+        {
+            stackId = stackId ^ ((value >> shift) & 0xFF);
+            stackId = stackId * 0x100000001B3;
+        }
+    }
+    return (0 == stackId) ? 1 : stackId;
+}
+
+/**
+ * @brief       Checks whether two stacks are the same - used to tell apart the stacks
+ *              with the same id.
+ *
+ * @param[in]   LeftCount   - The number of frames in the first stack.
+ * @param[in]   LeftAt      - Returns the frame at an index of the first stack.
+ * @param[in]   RightCount  - The number of frames in the second stack.
+ * @param[in]   RightAt     - Returns the frame at an index of the second stack.
+ *
+ * @return      true if the stacks have the same frames, false otherwise.
+ */
+template <class LeftAccessor, class RightAccessor>
+inline bool
+IsSameStack(
+    size_t LeftCount,
+    const LeftAccessor& LeftAt,
+    size_t RightCount,
+    const RightAccessor& RightAt
+) noexcept(true)
+{
+    if (LeftCount != RightCount)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < LeftCount; ++i)
+    {
+        if (!IsSameFrame(LeftAt(i), RightAt(i)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+};  // namespace StackKey
+};  // namespace SysMon
@@ -0,0 +1,471 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/StackStore.cpp
+ *
+ * @brief       In this file we define the table which keeps each unique
+ *              stack trace once, so events carry only its id.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "precomp.hpp"
+
+#include "StackStore.hpp"
+#include "trace.hpp"
+
+/**
+ * @brief   The store is paged. It is only used at max APC_LEVEL.
+ */
+XPF_SECTION_PAGED;
+
+/**
+ * @brief       Decorates a stack and logs it.
+ *
+ * @param[in]   Entry   - The stack to be logged.
+ *
+ * @return      Nothing.
+ */
+static void XPF_API
+StackStoreLogStack(
+    _In_ _Const_ const SysMon::StackStoreEntry& Entry
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    xpf::Vector<xpf::String<wchar_t>> decoratedFrames{ SYSMON_PAGED_ALLOCATOR };
+
+    NTSTATUS status = SysMon::StackFramesDecorate(Entry.Frames,
+                                                  &decoratedFrames);
+    if (!NT_SUCCESS(status))
+    {
+        SysMonLogWarning("Failed to decorate stack 0x%016llx with status %!STATUS!",
+                         Entry.StackId,
+                         status);
+        return;
+    }
+
+    SysMonLogInfo("Stack 0x%016llx - %llu hits:",
+                  Entry.StackId,
+                  Entry.Hits);
+    for (size_t i = 0; i < decoratedFrames.Size(); ++i)
+    {
+        SysMonLogInfo("    %S",
+                      decoratedFrames[i].View().Buffer());
+    }
+}
+
+SysMon::StackStore::~StackStore(
+    void
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    /* Wait for the export in progress - the rest is done here. */
+    this->m_ExportQueue.Reset();
+
+    /* Nothing can be interned anymore, so the lock is not needed. */
+    for (size_t i = 0; i < this->m_Buckets.Size(); ++i)
+    {
+        for (size_t j = 0; j < this->m_Buckets[i].Size(); ++j)
+        {
+            SysMon::StackStoreEntry* entry = this->m_Buckets[i][j].Get();
+            if (!entry->IsExported)
+            {
+                entry->IsExported = true;
+                StackStoreLogStack(*entry);
+            }
+            else
+            {
+                SysMonLogInfo("Stack 0x%016llx - %llu hits",
+                              entry->StackId,
+                              entry->Hits);
+            }
+        }
+    }
+
+    SysMonLogInfo("Stack store: %llu unique stacks, %llu dropped",
+                  static_cast<uint64_t>(this->m_UniqueStacks),
+                  this->m_DroppedStacks);
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::StackStore::Create(
+    _Out_ xpf::Optional<SysMon::StackStore>* Store
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != Store);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    /* Preinit output. */
+    Store->Reset();
+    Store->Emplace();
+
+    SysMon::StackStore& store = (*(*Store));
+
+    status = xpf::ReadWriteLock::Create(&store.m_StoreLock);
+    if (!NT_SUCCESS(status))
+    {
+        Store->Reset();
+        return status;
+    }
+    for (size_t i = 0; i < SysMon::StackStore::STACK_BUCKETS_COUNT; ++i)
+    {
+        status = store.m_Buckets.Emplace(xpf::Vector<xpf::SharedPointer<SysMon::StackStoreEntry>>{ SYSMON_PAGED_ALLOCATOR });
+        if (!NT_SUCCESS(status))
+        {
+            Store->Reset();
+            return status;
+        }
+    }
+    store.m_ExportQueue.Emplace();
+
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::StackStore::Intern(
+    _In_ _Const_ const SysMon::StackTrace& Trace,
+    _Out_ uint64_t* StackId
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != StackId);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    xpf::SharedPointer<SysMon::StackStoreEntry> newEntry{ SYSMON_PAGED_ALLOCATOR };
+    bool shouldExport = false;
+
+    /* Preinit output. */
+    *StackId = 0;
+
+    if (Trace.ResolvedFrames.Size() != Trace.CapturedFrames)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+    const uint64_t stackId = SysMon::StackStore::ComputeStackId(Trace);
+
+    /* Most stacks were seen before - a shared lock is enough to count the hit. */
+    {
+        xpf::SharedLockGuard guard{ *this->m_StoreLock };
+
+        SysMon::StackStoreEntry* entry = this->FindLocked(stackId, &Trace);
+        if (nullptr != entry)
+        {
+            xpf::ApiAtomicIncrement(&entry->Hits);
+            *StackId = stackId;
+            return STATUS_SUCCESS;
+        }
+    }
+
+    /* A new stack - prepare it outside of the lock. */
+    newEntry = xpf::MakeSharedWithAllocator<SysMon::StackStoreEntry>(SYSMON_PAGED_ALLOCATOR);
+    if (newEntry.IsEmpty())
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    newEntry.Get()->StackId = stackId;
+    newEntry.Get()->Hits = 1;
+
+    /* Only the stable form is kept - the process modules are released with the trace. */
+    for (size_t i = 0; i < Trace.CapturedFrames; ++i)
+    {
+        status = newEntry.Get()->Frames.Emplace(SysMon::StackTraceKeyFrame(Trace, i));
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+    }
+
+    {
+        xpf::ExclusiveLockGuard guard{ *this->m_StoreLock };
+
+        /* Someone else may have stored it meanwhile. */
+        SysMon::StackStoreEntry* entry = this->FindLocked(stackId, &Trace);
+        if (nullptr != entry)
+        {
+            xpf::ApiAtomicIncrement(&entry->Hits);
+            *StackId = stackId;
+            return STATUS_SUCCESS;
+        }
+
+        /* A different stack with the same id - rare enough to not be worth storing. */
+        if (nullptr != this->FindLocked(stackId, nullptr))
+        {
+            xpf::ApiAtomicIncrement(&this->m_DroppedStacks);
+            return STATUS_OBJECT_NAME_COLLISION;
+        }
+        if (this->m_UniqueStacks >= SysMon::StackStore::MAX_UNIQUE_STACKS)
+        {
+            xpf::ApiAtomicIncrement(&this->m_DroppedStacks);
+            return STATUS_QUOTA_EXCEEDED;
+        }
+
+        status = this->m_Buckets[stackId & (SysMon::StackStore::STACK_BUCKETS_COUNT - 1)].Emplace(newEntry);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+        this->m_UniqueStacks++;
+        this->m_UnexportedStacks++;
+
+        /* Enough new stacks - log them from a work item. */
+        if (this->m_UnexportedStacks >= SysMon::StackStore::EXPORT_BATCH_SIZE &&
+            0 == xpf::ApiAtomicCompareExchange(&this->m_IsExportPending, uint32_t{ 1 }, uint32_t{ 0 }))
+        {
+            this->m_UnexportedStacks = 0;
+            shouldExport = true;
+        }
+    }
+
+    if (shouldExport)
+    {
+        const NTSTATUS exportStatus = (*this->m_ExportQueue).EnqueueWork(SysMon::StackStore::ExportNewStacks,
+                                                                         this,
+                                                                         false);
+        if (!NT_SUCCESS(exportStatus))
+        {
+            /* The store is going away - the stack is kept, it is just not logged. */
+            xpf::ApiAtomicCompareExchange(&this->m_IsExportPending, uint32_t{ 0 }, uint32_t{ 1 });
+        }
+    }
+
+    *StackId = stackId;
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+xpf::SharedPointer<SysMon::StackStoreEntry> XPF_API
+SysMon::StackStore::Find(
+    _In_ uint64_t StackId
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    xpf::SharedPointer<SysMon::StackStoreEntry> foundEntry{ SYSMON_PAGED_ALLOCATOR };
+    xpf::SharedLockGuard guard{ *this->m_StoreLock };
+
+    const auto& bucket = this->m_Buckets[StackId & (SysMon::StackStore::STACK_BUCKETS_COUNT - 1)];
+    for (size_t i = 0; i < bucket.Size(); ++i)
+    {
+        if (bucket[i].Get()->StackId == StackId)
+        {
+            foundEntry = bucket[i];
+            break;
+        }
+    }
+    return foundEntry;
+}
+
+_Use_decl_annotations_
+uint64_t XPF_API
+SysMon::StackStore::ComputeStackId(
+    _In_ _Const_ const SysMon::StackTrace& Trace
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    return SysMon::StackKey::ComputeStackId(Trace.CapturedFrames,
+                                            [&Trace](size_t Index) { return SysMon::StackTraceKeyFrame(Trace, Index); });
+}
+
+_Use_decl_annotations_
+bool XPF_API
+SysMon::StackStore::IsSameStack(
+    _In_ _Const_ const SysMon::StackStoreEntry& Entry,
+    _In_ _Const_ const SysMon::StackTrace& Trace
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    return SysMon::StackKey::IsSameStack(Entry.Frames.Size(),
+                                         [&Entry](size_t Index) { return Entry.Frames[Index]; },
+                                         Trace.CapturedFrames,
+                                         [&Trace](size_t Index) { return SysMon::StackTraceKeyFrame(Trace, Index); });
+}
+
+_Use_decl_annotations_
+SysMon::StackStoreEntry* XPF_API
+SysMon::StackStore::FindLocked(
+    _In_ uint64_t StackId,
+    _In_opt_ const SysMon::StackTrace* Trace
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    auto& bucket = this->m_Buckets[StackId & (SysMon::StackStore::STACK_BUCKETS_COUNT - 1)];
+    for (size_t i = 0; i < bucket.Size(); ++i)
+    {
+        SysMon::StackStoreEntry* entry = bucket[i].Get();
+        if (entry->StackId != StackId)
+        {
+            continue;
+        }
+        if (nullptr == Trace || SysMon::StackStore::IsSameStack(*entry, *Trace))
+        {
+            return entry;
+        }
+    }
+    return nullptr;
+}
+
+_Use_decl_annotations_
+void XPF_API
+SysMon::StackStore::ExportNewStacks(
+    _In_opt_ xpf::thread::CallbackArgument Argument
+) noexcept(true)
+{
+    /* The routine can be called only at max PASSIVE_LEVEL from worker thread. */
+    XPF_MAX_PASSIVE_LEVEL();
+
+    SysMon::StackStore* store = static_cast<SysMon::StackStore*>(Argument);
+    if (nullptr == store)
+    {
+        XPF_ASSERT(false);
+        return;
+    }
+
+    xpf::Vector<xpf::SharedPointer<SysMon::StackStoreEntry>> newStacks{ SYSMON_PAGED_ALLOCATOR };
+
+    /* Grab the new stacks - they are decorated outside of the lock. */
+    {
+        xpf::ExclusiveLockGuard guard{ *store->m_StoreLock };
+        for (size_t i = 0; i < store->m_Buckets.Size(); ++i)
+        {
+            for (size_t j = 0; j < store->m_Buckets[i].Size(); ++j)
+            {
+                if (store->m_Buckets[i][j].Get()->IsExported)
+                {
+                    continue;
+                }
+                if (!NT_SUCCESS(newStacks.Emplace(store->m_Buckets[i][j])))
+                {
+                    /* The rest are exported next time. */
+                    break;
+                }
+                store->m_Buckets[i][j].Get()->IsExported = true;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < newStacks.Size(); ++i)
+    {
+        StackStoreLogStack(*newStacks[i].Get());
+    }
+
+    xpf::ApiAtomicCompareExchange(&store->m_IsExportPending, uint32_t{ 0 }, uint32_t{ 1 });
+}
+
+
+//
+// ************************************************************************************************
+// *                                The global stack store.                                       *
+// ************************************************************************************************
+//
+
+/**
+ * @brief   Global instance containing the unique stacks.
+ */
+static xpf::Optional<SysMon::StackStore>* gStackStore = nullptr;
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+StackStoreCreate(
+    void
+) noexcept(true)
+{
+    /* The routine can be called only at PASSIVE_LEVEL. */
+    XPF_MAX_PASSIVE_LEVEL();
+
+    /* This should not be called twice. */
+    XPF_DEATH_ON_FAILURE(gStackStore == nullptr);
+
+    SysMonLogInfo("Creating stack store...");
+
+    gStackStore = static_cast<xpf::Optional<SysMon::StackStore>*>(xpf::MemoryAllocator::AllocateMemory(sizeof(xpf::Optional<SysMon::StackStore>)));
+    if (nullptr == gStackStore)
+    {
+        SysMonLogError("Insufficient resources to create the stack store!");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    xpf::MemoryAllocator::Construct(gStackStore);
+
+    NTSTATUS status = SysMon::StackStore::Create(gStackStore);
+    if (!NT_SUCCESS(status))
+    {
+        SysMonLogError("Failed to create the stack store %!STATUS!",
+                       status);
+        StackStoreDestroy();
+        return status;
+    }
+
+    SysMonLogInfo("Successfully created the stack store!");
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+void XPF_API
+StackStoreDestroy(
+    void
+) noexcept(true)
+{
+    /* The routine can be called only at PASSIVE_LEVEL. */
+    XPF_MAX_PASSIVE_LEVEL();
+
+    SysMonLogInfo("Destroying the stack store...");
+
+    if (nullptr != gStackStore)
+    {
+        /* Destroy the object. */
+        xpf::MemoryAllocator::Destruct(gStackStore);
+        /* Free memory. */
+        xpf::MemoryAllocator::FreeMemory(gStackStore);
+        gStackStore = nullptr;
+    }
+
+    SysMonLogInfo("Successfully destroyed the stack store!");
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+StackStoreIntern(
+    _In_ _Const_ const SysMon::StackTrace& Trace,
+    _Out_ uint64_t* StackId
+) noexcept(true)
+{
+    /* The store is paged. */
+    XPF_MAX_APC_LEVEL();
+
+    return (*(*gStackStore)).Intern(Trace,
+                                    StackId);
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+StackStoreDecorate(
+    _In_ uint64_t StackId,
+    _Out_ xpf::Vector<xpf::String<wchar_t>>* DecoratedFrames
+) noexcept(true)
+{
+    /* The routine can be called only at max PASSIVE_LEVEL. */
+    XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != DecoratedFrames);
+
+    /* Preinit output. */
+    DecoratedFrames->Clear();
+
+    xpf::SharedPointer<SysMon::StackStoreEntry> entry = (*(*gStackStore)).Find(StackId);
+    if (entry.IsEmpty())
+    {
+        return STATUS_NOT_FOUND;
+    }
+    return SysMon::StackFramesDecorate(entry.Get()->Frames,
+                                       DecoratedFrames);
+}
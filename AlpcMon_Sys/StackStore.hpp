@@ -0,0 +1,287 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/StackStore.hpp
+ *
+ * @brief       In this file we define the table which keeps each unique
+ *              stack trace once, so events carry only its id.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#pragma once
+
+#include "precomp.hpp"
+
+#include "StackDecorator.hpp"
+#include "StackKey.hpp"
+#include "WorkQueue.hpp"
+
+
+namespace SysMon
+{
+/**
+ * @brief   A unique stack trace.
+ */
+struct StackStoreEntry
+{
+    /**
+     * @brief   Identifies the stack. Computed from the modules and the rvas of the frames.
+     */
+    uint64_t StackId = 0;
+
+    /**
+     * @brief   How many times this stack was seen.
+     */
+    volatile uint64_t Hits = 0;
+
+    /**
+     * @brief   Set once the stack was decorated and logged. Only used by the export.
+     */
+    bool IsExported = false;
+
+    /**
+     * @brief   The frames, as module path hash and rva. They do not keep the modules alive -
+     *          the modules are looked up again when the stack is decorated.
+     *          They are not modified once stored.
+     */
+    xpf::Vector<SysMon::StackKey::Frame> Frames{ SYSMON_PAGED_ALLOCATOR };
+};
+
+/**
+ * @brief   This class keeps the unique stack traces.
+ *
+ *          The same call sites produce the same stacks over and over. Each stack is hashed
+ *          into a stack id and stored once, with a hit count - the events only carry the id.
+ *          The new stacks are decorated and logged in batches, from a work item, so the
+ *          text form is produced once per unique stack and never on the hot path.
+ */
+class StackStore final
+{
+ private:
+    /**
+     * @brief  Default constructor - private as Create
+     *         method must be used to instantiate an object.
+     */
+    StackStore(void) noexcept(true) = default;
+
+ public:
+    /**
+     * @brief   Destructor. Waits for the export in progress and logs the hit counts.
+     */
+    ~StackStore(void) noexcept(true);
+
+    /**
+     * @brief   Copy and move are deleted for this class.
+     *          They can be implemented when required.
+     */
+    XPF_CLASS_COPY_MOVE_BEHAVIOR(SysMon::StackStore, delete);
+
+    /**
+     * @brief       Creates a stack store.
+     *
+     * @param[out]  Store - On success, it will contain a properly initialized object.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    static NTSTATUS XPF_API
+    Create(
+        _Out_ xpf::Optional<SysMon::StackStore>* Store
+    ) noexcept(true);
+
+    /**
+     * @brief       Finds the stack in the store, or adds it if it is new.
+     *
+     * @param[in]   Trace   - A captured stack trace, with resolved modules.
+     *                        If the stack is new, its frames are stored in stable form.
+     * @param[out]  StackId - The id of the stack.
+     *
+     * @return      STATUS_QUOTA_EXCEEDED if the store is full,
+     *              or a proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(APC_LEVEL)
+    NTSTATUS XPF_API
+    Intern(
+        _In_ _Const_ const SysMon::StackTrace& Trace,
+        _Out_ uint64_t* StackId
+    ) noexcept(true);
+
+    /**
+     * @brief       Finds a stack by its id.
+     *
+     * @param[in]   StackId - The id returned by Intern.
+     *
+     * @return      The stack, or an empty pointer if there is no such stack.
+     */
+    _IRQL_requires_max_(APC_LEVEL)
+    xpf::SharedPointer<SysMon::StackStoreEntry> XPF_API
+    Find(
+        _In_ uint64_t StackId
+    ) noexcept(true);
+
+ private:
+    /**
+     * @brief       Computes the id of a stack. Frames inside modules are hashed by the
+     *              module path hash and the rva, so the id does not depend on where the
+     *              modules are loaded. See SysMon::StackKey::ComputeStackId.
+     *
+     * @param[in]   Trace   - A stack trace, with resolved modules.
+     *
+     * @return      The stack id. Never zero.
+     */
+    static uint64_t XPF_API
+    ComputeStackId(
+        _In_ _Const_ const SysMon::StackTrace& Trace
+    ) noexcept(true);
+
+    /**
+     * @brief       Checks whether a stored stack is the same as a captured one - used to
+     *              tell apart the stacks with the same id.
+     *
+     * @param[in]   Entry   - A stored stack.
+     * @param[in]   Trace   - A stack trace, with resolved modules.
+     *
+     * @return      true if the stacks have the same frames, false otherwise.
+     */
+    static bool XPF_API
+    IsSameStack(
+        _In_ _Const_ const SysMon::StackStoreEntry& Entry,
+        _In_ _Const_ const SysMon::StackTrace& Trace
+    ) noexcept(true);
+
+    /**
+     * @brief       Finds a stack in its bucket. The store lock must be held.
+     *
+     * @param[in]   StackId - The id of the stack.
+     * @param[in]   Trace   - The stack trace. If null, only the id is matched.
+     *
+     * @return      The stack, or nullptr if it is not stored.
+     */
+    SysMon::StackStoreEntry* XPF_API
+    FindLocked(
+        _In_ uint64_t StackId,
+        _In_opt_ const SysMon::StackTrace* Trace
+    ) noexcept(true);
+
+    /**
+     * @brief       Runs on the work queue. Decorates and logs the stacks which were
+     *              not exported yet.
+     *
+     * @param[in]   Argument - The StackStore.
+     *
+     * @return      Nothing.
+     */
+    static void XPF_API
+    ExportNewStacks(
+        _In_opt_ xpf::thread::CallbackArgument Argument
+    ) noexcept(true);
+
+ private:
+    /**
+     * @brief   How many buckets are used. Must be a power of 2.
+     */
+    static constexpr size_t STACK_BUCKETS_COUNT = 256;
+
+    /**
+     * @brief   How many unique stacks are kept. Beyond this, new stacks are not stored.
+     */
+    static constexpr size_t MAX_UNIQUE_STACKS = 8192;
+
+    /**
+     * @brief   The new stacks are exported once there are this many of them.
+     */
+    static constexpr size_t EXPORT_BATCH_SIZE = 32;
+
+    xpf::Optional<xpf::ReadWriteLock> m_StoreLock;
+    xpf::Vector<xpf::Vector<xpf::SharedPointer<SysMon::StackStoreEntry>>> m_Buckets{ SYSMON_PAGED_ALLOCATOR };
+    size_t m_UniqueStacks = 0;
+    size_t m_UnexportedStacks = 0;
+    volatile uint64_t m_DroppedStacks = 0;
+    volatile uint32_t m_IsExportPending = 0;
+    xpf::Optional<KmHelper::WorkQueue> m_ExportQueue;
+
+    /**
+     * @brief   Default MemoryAllocator is our friend as it requires access to the private
+     *          default constructor. It is used in the Create() method to ensure that
+     *          no partially constructed objects are created but instead they will be
+     *          all fully initialized.
+     */
+    friend class xpf::MemoryAllocator;
+};  // class StackStore
+};  // namespace SysMon
+
+
+/**
+ * @brief       Creates the stack store.
+ *
+ * @return      A proper ntstatus error code.
+ *
+ * @note        This method can be called only at passive level.
+ *              It is expected to be called only at driver entry.
+ *
+ * @note        Must be called before registering the process filter.
+ */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Must_inspect_result_
+NTSTATUS XPF_API
+StackStoreCreate(
+    void
+) noexcept(true);
+
+/**
+ * @brief       Destroys the previously created stack store.
+ *              The stacks which were not exported yet are exported now.
+ *
+ * @return      VOID.
+ *
+ * @note        This method can be called only at passive level.
+ *              It is expected to be called only at driver unload.
+ *
+ * @note        Must be called after unregistering the process filter and
+ *              before destroying the module collector - exporting needs the symbols.
+ */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+void XPF_API
+StackStoreDestroy(
+    void
+) noexcept(true);
+
+/**
+ * @brief       Stores a stack trace, if it was not seen before, and counts the hit.
+ *
+ * @param[in]   Trace   - A captured stack trace, with resolved modules.
+ *                        If the stack is new, its frames are stored in stable form.
+ * @param[out]  StackId - The id of the stack.
+ *
+ * @return      A proper ntstatus error code.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_Must_inspect_result_
+NTSTATUS XPF_API
+StackStoreIntern(
+    _In_ _Const_ const SysMon::StackTrace& Trace,
+    _Out_ uint64_t* StackId
+) noexcept(true);
+
+/**
+ * @brief       Decorates a stored stack trace.
+ *
+ * @param[in]   StackId         - The id returned by StackStoreIntern.
+ * @param[out]  DecoratedFrames - The frames containing module!symbol information.
+ *
+ * @return      STATUS_NOT_FOUND if there is no such stack,
+ *              or a proper ntstatus error code.
+ */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Must_inspect_result_
+NTSTATUS XPF_API
+StackStoreDecorate(
+    _In_ uint64_t StackId,
+    _Out_ xpf::Vector<xpf::String<wchar_t>>* DecoratedFrames
+) noexcept(true);
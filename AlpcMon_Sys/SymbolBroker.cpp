@@ -0,0 +1,530 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/SymbolBroker.cpp
+ *
+ * @brief       In this file we define the component which hands the pdb parsing
+ *              over to the user mode symbol service.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "precomp.hpp"
+
+#include "SymbolBroker.hpp"
+#include "trace.hpp"
+
+/**
+ * @brief   The broker is paged. It is only used at max APC_LEVEL.
+ */
+XPF_SECTION_PAGED;
+
+SysMon::SymbolBroker::~SymbolBroker(
+    void
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    if (nullptr != this->m_ServiceProcess)
+    {
+        ::ObDereferenceObject(this->m_ServiceProcess);
+        this->m_ServiceProcess = nullptr;
+    }
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::SymbolBroker::Create(
+    _Out_ xpf::Optional<SysMon::SymbolBroker>* Broker
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != Broker);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    /* Preinit output. */
+    Broker->Reset();
+    Broker->Emplace();
+
+    SysMon::SymbolBroker& broker = (*(*Broker));
+
+    status = xpf::ReadWriteLock::Create(&broker.m_BrokerLock);
+    if (!NT_SUCCESS(status))
+    {
+        Broker->Reset();
+        return status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::SymbolBroker::Resolve(
+    _In_ _Const_ const PdbHelper::ImageIdentity& Identity,
+    _Out_ xpf::Vector<xpf::pdb::SymbolInformation>* Symbols
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != Symbols);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    xpf::SharedPointer<SysMon::SymbolBrokerRequest> request{ SYSMON_NPAGED_ALLOCATOR };
+    int64_t waitedMs = 0;
+
+    /* Preinit output. */
+    Symbols->Clear();
+
+    if (!Identity.HasPdbInformation)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+    if (this->m_IsRunningDown || !this->IsServiceConnected())
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+    if (Identity.PdbName.View().BufferSize() >= UM_KM_SYMBOLS_MAX_PDB_NAME ||
+        Identity.PdbGuidAndAge.View().BufferSize() >= UM_KM_SYMBOLS_MAX_GUID_AND_AGE)
+    {
+        return STATUS_NAME_TOO_LONG;
+    }
+
+    request = xpf::MakeSharedWithAllocator<SysMon::SymbolBrokerRequest>(SYSMON_NPAGED_ALLOCATOR);
+    if (request.IsEmpty())
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    request.Get()->PdbGuid = Identity.PdbGuid;
+    request.Get()->PdbAge = Identity.PdbAge;
+    status = request.Get()->PdbName.Append(Identity.PdbName.View());
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    status = request.Get()->PdbGuidAndAge.Append(Identity.PdbGuidAndAge.View());
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    ::KeInitializeEvent(&request.Get()->Done,
+                        EVENT_TYPE::NotificationEvent,
+                        FALSE);
+
+    {
+        xpf::ExclusiveLockGuard guard{ *this->m_BrokerLock };
+
+        /* Checked again under lock - RunDown will not see this request otherwise. */
+        if (this->m_IsRunningDown)
+        {
+            return STATUS_NOT_SUPPORTED;
+        }
+        request.Get()->RequestId = this->m_NextRequestId++;
+        status = this->m_Requests.Emplace(request);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+    }
+
+    /* Wait in slices, so we notice if the service went away meanwhile. */
+    while (true)
+    {
+        LARGE_INTEGER timeout = { 0 };
+        timeout.QuadPart = -SysMon::SymbolBroker::SERVICE_CHECK_INTERVAL_MS * 10000;
+
+        status = ::KeWaitForSingleObject(&request.Get()->Done,
+                                         KWAIT_REASON::Executive,
+                                         KernelMode,
+                                         FALSE,
+                                         &timeout);
+        if (STATUS_TIMEOUT != status)
+        {
+            break;
+        }
+        waitedMs += SysMon::SymbolBroker::SERVICE_CHECK_INTERVAL_MS;
+
+        /* A claimed request belongs to the process which claimed it - a restarted service won't reply. */
+        /* It may be busy with this pdb for a long time, so only its exit or the reply timeout count.    */
+        PEPROCESS claimant = nullptr;
+        {
+            xpf::SharedLockGuard guard{ *this->m_BrokerLock };
+            claimant = request.Get()->Claimant;
+        }
+        const bool isServiceGone = (nullptr != claimant) ? !SysMon::SymbolBroker::IsProcessAlive(claimant)
+                                                         : !this->IsServiceConnected();
+        if (!isServiceGone && waitedMs < SysMon::SymbolBroker::REPLY_TIMEOUT_MS)
+        {
+            continue;
+        }
+
+        /* Give up on the request - a late reply will not find it anymore. */
+        bool isPending = false;
+        bool isClaimed = false;
+        {
+            xpf::ExclusiveLockGuard guard{ *this->m_BrokerLock };
+            for (size_t i = 0; i < this->m_Requests.Size(); ++i)
+            {
+                if (this->m_Requests[i].Get() == request.Get())
+                {
+                    isPending = true;
+                    isClaimed = request.Get()->IsClaimed;
+
+                    status = this->m_Requests.Erase(i);
+                    XPF_DEATH_ON_FAILURE(NT_SUCCESS(status));
+                    break;
+                }
+            }
+        }
+
+        /* The reply was just completed - use it. */
+        if (!isPending)
+        {
+            status = ::KeWaitForSingleObject(&request.Get()->Done,
+                                             KWAIT_REASON::Executive,
+                                             KernelMode,
+                                             FALSE,
+                                             NULL);
+            break;
+        }
+
+        /* The service never saw this pdb - the caller may extract the symbols itself.        */
+        /* If it picked the pdb up and then vanished, the pdb may be what crashed it - so no. */
+        if (isServiceGone)
+        {
+            return isClaimed ? STATUS_CONNECTION_ABORTED
+                             : STATUS_NOT_SUPPORTED;
+        }
+        return STATUS_TIMEOUT;
+    }
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    if (!NT_SUCCESS(request.Get()->Status))
+    {
+        return request.Get()->Status;
+    }
+    *Symbols = xpf::Move(request.Get()->Symbols);
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+void XPF_API
+SysMon::SymbolBroker::RunDown(
+    void
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    {
+        xpf::ExclusiveLockGuard guard{ *this->m_BrokerLock };
+        this->m_IsRunningDown = true;
+    }
+
+    /* Complete removes the request - so always pick the first one. */
+    while (true)
+    {
+        uint64_t requestId = 0;
+        {
+            xpf::SharedLockGuard guard{ *this->m_BrokerLock };
+            if (this->m_Requests.IsEmpty())
+            {
+                break;
+            }
+            requestId = this->m_Requests[0].Get()->RequestId;
+        }
+
+        NTSTATUS status = this->Complete(requestId,
+                                         STATUS_CANCELLED,
+                                         xpf::Vector<xpf::pdb::SymbolInformation>{ SYSMON_PAGED_ALLOCATOR });
+        XPF_UNREFERENCED_PARAMETER(status);
+    }
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::SymbolBroker::HandleMessage(
+    _Inout_ UM_KM_MESSAGE_HEADER* Message,
+    _In_ size_t MessageSize
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    if (nullptr == Message || MessageSize < sizeof(UM_KM_MESSAGE_HEADER) + sizeof(uint64_t))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    /* Any process can reach this channel - only a service running as system may feed symbols. */
+    if (FALSE == ::SeSinglePrivilegeCheck(::RtlConvertLongToLuid(SE_TCB_PRIVILEGE), UserMode))
+    {
+        return STATUS_PRIVILEGE_NOT_HELD;
+    }
+
+    const uint64_t messageType = UmKmMessageGetType(Message);
+    if (UM_KM_MESSAGE_TYPE_SYMBOLS_GET_REQUEST == messageType)
+    {
+        if (MessageSize < sizeof(UM_KM_SYMBOLS_GET_REQUEST))
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+        return this->HandleGetRequest(reinterpret_cast<UM_KM_SYMBOLS_GET_REQUEST*>(Message));
+    }
+    if (UM_KM_MESSAGE_TYPE_SYMBOLS_REPLY == messageType)
+    {
+        return this->HandleReply(reinterpret_cast<const UM_KM_SYMBOLS_REPLY*>(Message),
+                                 MessageSize);
+    }
+    return STATUS_NOT_SUPPORTED;
+}
+
+_Use_decl_annotations_
+bool XPF_API
+SysMon::SymbolBroker::IsServiceConnected(
+    void
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    /* The reference is dropped only when another process polls - so hold the lock while checking. */
+    xpf::SharedLockGuard guard{ *this->m_BrokerLock };
+    return SysMon::SymbolBroker::IsProcessAlive(this->m_ServiceProcess);
+}
+
+_Use_decl_annotations_
+bool XPF_API
+SysMon::SymbolBroker::IsProcessAlive(
+    _In_opt_ PEPROCESS Process
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    if (nullptr == Process)
+    {
+        return false;
+    }
+
+    /* The process object is signaled when the process exits. */
+    LARGE_INTEGER timeout = { 0 };
+    const NTSTATUS status = ::KeWaitForSingleObject(Process,
+                                                    KWAIT_REASON::Executive,
+                                                    KernelMode,
+                                                    FALSE,
+                                                    &timeout);
+    return STATUS_TIMEOUT == status;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::SymbolBroker::HandleGetRequest(
+    _Inout_ UM_KM_SYMBOLS_GET_REQUEST* Message
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    /* Nothing to do is reported with a zero request id. */
+    Message->RequestId = 0;
+    xpf::ApiZeroMemory(&Message->PdbGuid, sizeof(Message->PdbGuid));
+    Message->PdbAge = 0;
+    Message->Reserved = 0;
+    xpf::ApiZeroMemory(&Message->PdbName[0], sizeof(Message->PdbName));
+    xpf::ApiZeroMemory(&Message->PdbGuidAndAge[0], sizeof(Message->PdbGuidAndAge));
+
+    /* We are called in the context of the service - remember it, so the workers can tell when it exits. */
+    PEPROCESS currentProcess = ::PsGetCurrentProcess();
+    PEPROCESS previousProcess = nullptr;
+    {
+        xpf::ExclusiveLockGuard guard{ *this->m_BrokerLock };
+        if (this->m_ServiceProcess != currentProcess)
+        {
+            ::ObReferenceObject(currentProcess);
+            previousProcess = this->m_ServiceProcess;
+            this->m_ServiceProcess = currentProcess;
+        }
+    }
+    if (nullptr != previousProcess)
+    {
+        ::ObDereferenceObject(previousProcess);
+    }
+
+    uint32_t waitedMs = 0;
+    while (true)
+    {
+        {
+            xpf::ExclusiveLockGuard guard{ *this->m_BrokerLock };
+            for (size_t i = 0; i < this->m_Requests.Size(); ++i)
+            {
+                SysMon::SymbolBrokerRequest* request = this->m_Requests[i].Get();
+                if (request->IsClaimed)
+                {
+                    continue;
+                }
+                ::ObReferenceObject(currentProcess);
+                request->Claimant = currentProcess;
+                request->IsClaimed = true;
+
+                /* The lengths were checked when the request was created - they fit with their terminators. */
+                Message->RequestId = request->RequestId;
+                Message->PdbGuid = request->PdbGuid;
+                Message->PdbAge = request->PdbAge;
+                xpf::ApiCopyMemory(&Message->PdbName[0],
+                                   request->PdbName.View().Buffer(),
+                                   request->PdbName.View().BufferSize() * sizeof(wchar_t));
+                xpf::ApiCopyMemory(&Message->PdbGuidAndAge[0],
+                                   request->PdbGuidAndAge.View().Buffer(),
+                                   request->PdbGuidAndAge.View().BufferSize() * sizeof(wchar_t));
+                return STATUS_SUCCESS;
+            }
+        }
+
+        /* Hold the service for a little while, so it does not spin when there is nothing to do. */
+        if (waitedMs >= SysMon::SymbolBroker::POLL_WAIT_MS || this->m_IsRunningDown)
+        {
+            break;
+        }
+        xpf::ApiSleep(SysMon::SymbolBroker::POLL_INTERVAL_MS);
+        waitedMs += SysMon::SymbolBroker::POLL_INTERVAL_MS;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::SymbolBroker::HandleReply(
+    _In_ _Const_ const UM_KM_SYMBOLS_REPLY* Message,
+    _In_ size_t MessageSize
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    xpf::Vector<xpf::pdb::SymbolInformation> symbols{ SYSMON_PAGED_ALLOCATOR };
+
+    if (MessageSize < sizeof(UM_KM_SYMBOLS_REPLY))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    /* The service could not retrieve the pdb. */
+    if (0 != Message->Status)
+    {
+        return this->Complete(Message->RequestId,
+                              STATUS_NOT_FOUND,
+                              xpf::Move(symbols));
+    }
+
+    /* Everything below comes from user mode - nothing is trusted. */
+    const size_t symbolsCount = Message->SymbolsCount;
+    const size_t symbolsSize = symbolsCount * sizeof(UM_KM_SYMBOL);
+    if (symbolsCount > UM_KM_SYMBOLS_MAX_COUNT || symbolsSize > MessageSize - sizeof(UM_KM_SYMBOLS_REPLY))
+    {
+        status = STATUS_INVALID_PARAMETER;
+        goto CleanUp;
+    }
+
+    {
+        const uint8_t* payload = reinterpret_cast<const uint8_t*>(Message) + sizeof(UM_KM_SYMBOLS_REPLY);
+        const UM_KM_SYMBOL* entries = reinterpret_cast<const UM_KM_SYMBOL*>(payload);
+        const char* names = reinterpret_cast<const char*>(payload + symbolsSize);
+        const size_t namesSize = MessageSize - sizeof(UM_KM_SYMBOLS_REPLY) - symbolsSize;
+
+        for (size_t i = 0; i < symbolsCount; ++i)
+        {
+            UM_KM_SYMBOL entry = { 0 };
+            xpf::ApiCopyMemory(&entry,
+                               &entries[i],
+                               sizeof(entry));
+
+            /* The symbol table expects them sorted. */
+            if (i > 0 && entry.Rva < entries[i - 1].Rva)
+            {
+                status = STATUS_INVALID_PARAMETER;
+                goto CleanUp;
+            }
+            if (0 == entry.NameLength || entry.NameLength > UM_KM_SYMBOLS_MAX_NAME_LENGTH ||
+                entry.NameOffset > namesSize || entry.NameLength > namesSize - entry.NameOffset)
+            {
+                status = STATUS_INVALID_PARAMETER;
+                goto CleanUp;
+            }
+
+            xpf::pdb::SymbolInformation symbol;
+            symbol.SymbolRVA = entry.Rva;
+            status = symbol.SymbolName.Append(xpf::StringView<char>{ &names[entry.NameOffset],
+                                                                     entry.NameLength });
+            if (!NT_SUCCESS(status))
+            {
+                goto CleanUp;
+            }
+            status = symbols.Emplace(xpf::Move(symbol));
+            if (!NT_SUCCESS(status))
+            {
+                goto CleanUp;
+            }
+        }
+    }
+    status = STATUS_SUCCESS;
+
+CleanUp:
+    if (!NT_SUCCESS(status))
+    {
+        SysMonLogWarning("Rejected the symbols reply for request %llu %!STATUS!",
+                         Message->RequestId,
+                         status);
+        symbols.Clear();
+    }
+
+    /* Don't leave the worker waiting - it gets the failure too. */
+    NTSTATUS completeStatus = this->Complete(Message->RequestId,
+                                             status,
+                                             xpf::Move(symbols));
+    return NT_SUCCESS(status) ? completeStatus
+                              : status;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::SymbolBroker::Complete(
+    _In_ uint64_t RequestId,
+    _In_ NTSTATUS Status,
+    _Inout_ xpf::Vector<xpf::pdb::SymbolInformation>&& Symbols
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    xpf::SharedPointer<SysMon::SymbolBrokerRequest> request{ SYSMON_NPAGED_ALLOCATOR };
+
+    {
+        xpf::ExclusiveLockGuard guard{ *this->m_BrokerLock };
+        for (size_t i = 0; i < this->m_Requests.Size(); ++i)
+        {
+            if (this->m_Requests[i].Get()->RequestId == RequestId)
+            {
+                request = this->m_Requests[i];
+
+                NTSTATUS status = this->m_Requests.Erase(i);
+                XPF_DEATH_ON_FAILURE(NT_SUCCESS(status));
+                break;
+            }
+        }
+        if (request.IsEmpty())
+        {
+            return STATUS_NOT_FOUND;
+        }
+
+        request.Get()->Status = Status;
+        request.Get()->Symbols = xpf::Move(Symbols);
+    }
+
+    /* Wake the worker waiting for this pdb. */
+    ::KeSetEvent(&request.Get()->Done,
+                 IO_NO_INCREMENT,
+                 FALSE);
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,299 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/SymbolBroker.hpp
+ *
+ * @brief       In this file we define the component which hands the pdb parsing
+ *              over to the user mode symbol service.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#pragma once
+
+#include "precomp.hpp"
+
+#include "PdbHelper.hpp"
+#include "UmKmComms.hpp"
+
+
+namespace SysMon
+{
+/**
+ * @brief   A pdb whose symbols were requested from the symbol service.
+ *
+ * @note    The request is allocated from non paged pool as it contains the event
+ *          on which the module worker waits for the reply.
+ */
+struct SymbolBrokerRequest
+{
+    /**
+     * @brief   Releases the reference on the service process which claimed the request.
+     */
+    ~SymbolBrokerRequest(void) noexcept(true)
+    {
+        if (nullptr != this->Claimant)
+        {
+            ::ObDereferenceObject(this->Claimant);
+            this->Claimant = nullptr;
+        }
+    }
+
+    /**
+     * @brief   Identifies the request in the messages exchanged with the service.
+     */
+    uint64_t RequestId = 0;
+
+    /**
+     * @brief   The guid of the program database.
+     */
+    uuid_t PdbGuid = { 0 };
+
+    /**
+     * @brief   The age of the program database.
+     */
+    uint32_t PdbAge = 0;
+
+    /**
+     * @brief   The name of the pdb - as it is in the codeview entry.
+     */
+    xpf::String<wchar_t> PdbName{ SYSMON_PAGED_ALLOCATOR };
+
+    /**
+     * @brief   The guid and age as used by the symbol server.
+     */
+    xpf::String<wchar_t> PdbGuidAndAge{ SYSMON_PAGED_ALLOCATOR };
+
+    /**
+     * @brief   Set when the service picked up the request. Guarded by the broker lock.
+     */
+    bool IsClaimed = false;
+
+    /**
+     * @brief   The service process which claimed the request - referenced.
+     *          Set once, together with IsClaimed, under the broker lock.
+     */
+    PEPROCESS Claimant = nullptr;
+
+    /**
+     * @brief   The result of the request. Valid after the event is signaled.
+     */
+    NTSTATUS Status = STATUS_UNSUCCESSFUL;
+
+    /**
+     * @brief   The symbols sent by the service. Valid after the event is signaled.
+     */
+    xpf::Vector<xpf::pdb::SymbolInformation> Symbols{ SYSMON_PAGED_ALLOCATOR };
+
+    /**
+     * @brief   Notification event signaled when the reply arrived.
+     */
+    KEVENT Done = { 0 };
+};
+
+/**
+ * @brief   This class forwards the symbol requests to the user mode symbol service.
+ *
+ *          Downloading and parsing a pdb in kernel means large allocations, and a malformed
+ *          pdb could take the machine down. When the service is running, it polls the driver
+ *          for pending requests, does the work in user mode, and sends back only the rva and
+ *          the name of each symbol - which are validated here before they are used.
+ *
+ *          The messages travel over the firmware table channel, like the hook messages.
+ *          See UM_KM_SYMBOLS_GET_REQUEST and UM_KM_SYMBOLS_REPLY.
+ */
+class SymbolBroker final
+{
+ private:
+    /**
+     * @brief  Default constructor - private as Create
+     *         method must be used to instantiate an object.
+     */
+    SymbolBroker(void) noexcept(true) = default;
+
+ public:
+    /**
+     * @brief   Destructor - releases the reference on the service process.
+     */
+    ~SymbolBroker(void) noexcept(true);
+
+    /**
+     * @brief   Copy and move are deleted for this class.
+     *          They can be implemented when required.
+     */
+    XPF_CLASS_COPY_MOVE_BEHAVIOR(SysMon::SymbolBroker, delete);
+
+    /**
+     * @brief       Creates a symbol broker.
+     *
+     * @param[out]  Broker - On success, it will contain a properly initialized object.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    static NTSTATUS XPF_API
+    Create(
+        _Out_ xpf::Optional<SysMon::SymbolBroker>* Broker
+    ) noexcept(true);
+
+    /**
+     * @brief       Asks the symbol service for the symbols of an image and waits for the reply.
+     *
+     * @param[in]   Identity - The image identity. It must have pdb information.
+     * @param[out]  Symbols  - The symbols, sorted by their rva.
+     *
+     * @return      STATUS_NOT_SUPPORTED if the service is not running - the caller
+     *              may extract the symbols itself, STATUS_TIMEOUT if the service
+     *              did not reply in time, or a proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    Resolve(
+        _In_ _Const_ const PdbHelper::ImageIdentity& Identity,
+        _Out_ xpf::Vector<xpf::pdb::SymbolInformation>* Symbols
+    ) noexcept(true);
+
+    /**
+     * @brief       Fails all the pending requests and refuses new ones.
+     *              Called before unload, so the module workers don't wait for the service.
+     *
+     * @return      Nothing.
+     */
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    void XPF_API
+    RunDown(
+        void
+    ) noexcept(true);
+
+    /**
+     * @brief       Handles a message sent by the symbol service.
+     *
+     * @param[in,out]   Message     - The message. A get request is filled in place.
+     * @param[in]       MessageSize - The size of the message, including the header.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    HandleMessage(
+        _Inout_ UM_KM_MESSAGE_HEADER* Message,
+        _In_ size_t MessageSize
+    ) noexcept(true);
+
+ private:
+    /**
+     * @brief       Checks whether the process which last polled is still running.
+     *
+     *              The service is single threaded and does not poll while it downloads
+     *              or parses a pdb - so the time of the last poll says nothing about it.
+     *
+     * @return      true if the service is running, false otherwise.
+     */
+    _IRQL_requires_max_(APC_LEVEL)
+    bool XPF_API
+    IsServiceConnected(
+        void
+    ) noexcept(true);
+
+    /**
+     * @brief       Checks whether a process did not exit yet.
+     *
+     * @param[in]   Process - The process to check. Can be nullptr.
+     *
+     * @return      true if the process is running, false otherwise.
+     */
+    _IRQL_requires_max_(APC_LEVEL)
+    static bool XPF_API
+    IsProcessAlive(
+        _In_opt_ PEPROCESS Process
+    ) noexcept(true);
+
+    /**
+     * @brief       Hands the oldest pending request to the service. If there is none,
+     *              it waits a little for one - so the service does not spin.
+     *
+     * @param[in,out]   Message - The get request to be filled.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    HandleGetRequest(
+        _Inout_ UM_KM_SYMBOLS_GET_REQUEST* Message
+    ) noexcept(true);
+
+    /**
+     * @brief       Validates a reply and completes its request.
+     *
+     * @param[in]   Message     - The reply.
+     * @param[in]   MessageSize - The size of the reply, including the header.
+     *
+     * @return      STATUS_INVALID_PARAMETER if the reply is malformed,
+     *              or a proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    HandleReply(
+        _In_ _Const_ const UM_KM_SYMBOLS_REPLY* Message,
+        _In_ size_t MessageSize
+    ) noexcept(true);
+
+    /**
+     * @brief       Removes a request from the pending list and wakes its waiter.
+     *
+     * @param[in]   RequestId - The request to complete.
+     * @param[in]   Status    - The result of the request.
+     * @param[in]   Symbols   - The symbols. Moved into the request on success.
+     *
+     * @return      STATUS_NOT_FOUND if the request is no longer pending,
+     *              or a proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(APC_LEVEL)
+    NTSTATUS XPF_API
+    Complete(
+        _In_ uint64_t RequestId,
+        _In_ NTSTATUS Status,
+        _Inout_ xpf::Vector<xpf::pdb::SymbolInformation>&& Symbols
+    ) noexcept(true);
+
+ private:
+    /**
+     * @brief   How often a waiting worker checks whether the service process is still there. In ms.
+     */
+    static constexpr int64_t SERVICE_CHECK_INTERVAL_MS = 1000;
+
+    /**
+     * @brief   How long a worker waits for the service to reply. Large pdbs are downloaded first. In ms.
+     */
+    static constexpr int64_t REPLY_TIMEOUT_MS = 120000;
+
+    /**
+     * @brief   How long a get request waits for work, and how often it checks for it. In ms.
+     */
+    static constexpr uint32_t POLL_WAIT_MS = 500;
+    static constexpr uint32_t POLL_INTERVAL_MS = 50;
+
+    xpf::Optional<xpf::ReadWriteLock> m_BrokerLock;
+    xpf::Vector<xpf::SharedPointer<SysMon::SymbolBrokerRequest>> m_Requests{ SYSMON_PAGED_ALLOCATOR };
+    uint64_t m_NextRequestId = 1;
+    PEPROCESS m_ServiceProcess = nullptr;
+    volatile bool m_IsRunningDown = false;
+
+    /**
+     * @brief   Default MemoryAllocator is our friend as it requires access to the private
+     *          default constructor. It is used in the Create() method to ensure that
+     *          no partially constructed objects are created but instead they will be
+     *          all fully initialized.
+     */
+    friend class xpf::MemoryAllocator;
+};  // class SymbolBroker
+};  // namespace SysMon
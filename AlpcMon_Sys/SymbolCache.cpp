@@ -0,0 +1,248 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/SymbolCache.cpp
+ *
+ * @brief       In this file we define a small cache of the symbol lookups done
+ *              while decorating stacks. The same return addresses are resolved
+ *              over and over, so the result is remembered per symbol table and rva.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "precomp.hpp"
+
+#include "SymbolCache.hpp"
+#include "trace.hpp"
+
+/**
+ * @brief   The cache is paged. It is only used at max APC_LEVEL.
+ */
+XPF_SECTION_PAGED;
+
+SysMon::SymbolCache::~SymbolCache(
+    void
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    this->ReportStatistics();
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::SymbolCache::Create(
+    _Out_ xpf::Optional<SysMon::SymbolCache>* Cache
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != Cache);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    /* Preinit output. */
+    Cache->Reset();
+    Cache->Emplace();
+
+    SysMon::SymbolCache& cache = (*(*Cache));
+
+    for (size_t i = 0; i < SysMon::SymbolCache::SHARDS_COUNT; ++i)
+    {
+        status = xpf::ReadWriteLock::Create(&cache.m_ShardLocks[i]);
+        if (!NT_SUCCESS(status))
+        {
+            Cache->Reset();
+            return status;
+        }
+        status = cache.m_Shards.Emplace(xpf::Vector<xpf::SharedPointer<SysMon::SymbolCacheEntry>>{ SYSMON_PAGED_ALLOCATOR });
+        if (!NT_SUCCESS(status))
+        {
+            Cache->Reset();
+            return status;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::SymbolCache::Find(
+    _In_ _Const_ const xpf::SharedPointer<SysMon::SymbolTable>& Table,
+    _In_ uint32_t Rva,
+    _Out_ uint32_t* SymbolRva,
+    _Out_ xpf::String<char>* SymbolName
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != SymbolRva);
+    XPF_DEATH_ON_FAILURE(nullptr != SymbolName);
+
+    /* Preinit output. */
+    *SymbolRva = 0;
+    SymbolName->Reset();
+
+    if (Table.IsEmpty())
+    {
+        return STATUS_NOT_FOUND;
+    }
+
+    const size_t shardIndex = SysMon::SymbolCache::ShardIndex(Table.Get(), Rva);
+    {
+        xpf::SharedLockGuard guard{ *this->m_ShardLocks[shardIndex] };
+
+        const auto& shard = this->m_Shards[shardIndex];
+        for (size_t i = 0; i < shard.Size(); ++i)
+        {
+            SysMon::SymbolCacheEntry* entry = shard[i].Get();
+            if (entry->Rva != Rva || entry->Table.Get() != Table.Get())
+            {
+                continue;
+            }
+
+            /* Only a hint for replacement - a torn or lost update does no harm. */
+            entry->LastUsedTime = xpf::ApiCurrentTime();
+            xpf::ApiAtomicIncrement(&this->m_Hits);
+
+            *SymbolRva = entry->SymbolRva;
+            return SymbolName->Append(entry->SymbolName.View());
+        }
+    }
+
+    xpf::ApiAtomicIncrement(&this->m_Misses);
+    return STATUS_NOT_FOUND;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::SymbolCache::Insert(
+    _In_ _Const_ const xpf::SharedPointer<SysMon::SymbolTable>& Table,
+    _In_ uint32_t Rva,
+    _In_ uint32_t SymbolRva,
+    _In_ _Const_ const xpf::StringView<char>& SymbolName
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    if (Table.IsEmpty())
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    /* Prepare the entry outside of the lock. */
+    xpf::SharedPointer<SysMon::SymbolCacheEntry> newEntry = xpf::MakeSharedWithAllocator<SysMon::SymbolCacheEntry>(SYSMON_PAGED_ALLOCATOR);
+    if (newEntry.IsEmpty())
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    newEntry.Get()->Table = Table;
+    newEntry.Get()->Rva = Rva;
+    newEntry.Get()->SymbolRva = SymbolRva;
+    newEntry.Get()->LastUsedTime = xpf::ApiCurrentTime();
+
+    status = newEntry.Get()->SymbolName.Append(SymbolName);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    const size_t shardIndex = SysMon::SymbolCache::ShardIndex(Table.Get(), Rva);
+    xpf::ExclusiveLockGuard guard{ *this->m_ShardLocks[shardIndex] };
+
+    auto& shard = this->m_Shards[shardIndex];
+    size_t oldest = 0;
+    for (size_t i = 0; i < shard.Size(); ++i)
+    {
+        /* Someone else resolved it meanwhile. */
+        if (shard[i].Get()->Rva == Rva && shard[i].Get()->Table.Get() == Table.Get())
+        {
+            return STATUS_SUCCESS;
+        }
+        if (shard[i].Get()->LastUsedTime < shard[oldest].Get()->LastUsedTime)
+        {
+            oldest = i;
+        }
+    }
+
+    /* The shard is full - replace the least recently used entry. */
+    if (shard.Size() >= SysMon::SymbolCache::MAX_SHARD_ENTRIES)
+    {
+        shard[oldest] = newEntry;
+        return STATUS_SUCCESS;
+    }
+    return shard.Emplace(newEntry);
+}
+
+_Use_decl_annotations_
+void XPF_API
+SysMon::SymbolCache::InvalidateTable(
+    _In_ _Const_ const xpf::SharedPointer<SysMon::SymbolTable>& Table
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    if (Table.IsEmpty())
+    {
+        return;
+    }
+
+    /* The entries of a table are spread in all shards. */
+    for (size_t i = 0; i < SysMon::SymbolCache::SHARDS_COUNT; ++i)
+    {
+        xpf::ExclusiveLockGuard guard{ *this->m_ShardLocks[i] };
+
+        auto& shard = this->m_Shards[i];
+        size_t j = 0;
+        while (j < shard.Size())
+        {
+            if (shard[j].Get()->Table.Get() != Table.Get())
+            {
+                j++;
+                continue;
+            }
+
+            NTSTATUS status = shard.Erase(j);
+            XPF_DEATH_ON_FAILURE(NT_SUCCESS(status));
+
+            xpf::ApiAtomicIncrement(&this->m_Invalidations);
+        }
+    }
+}
+
+_Use_decl_annotations_
+void XPF_API
+SysMon::SymbolCache::ReportStatistics(
+    void
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    const uint64_t hits = this->m_Hits;
+    const uint64_t misses = this->m_Misses;
+    const uint64_t lookups = hits + misses;
+
+    SysMonLogInfo("Symbol cache: %llu lookups, %llu hits (%llu%%), %llu entries invalidated",
+                  lookups,
+                  hits,
+                  (0 == lookups) ? 0 : (hits * 100) / lookups,
+                  this->m_Invalidations);
+}
+
+_Use_decl_annotations_
+size_t XPF_API
+SysMon::SymbolCache::ShardIndex(
+    _In_ _Const_ const SysMon::SymbolTable* Table,
+    _In_ uint32_t Rva
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    /* Tables are allocated at aligned addresses - drop the low bits before mixing. */
+    const uint64_t key = (xpf::AlgoPointerToValue(Table) >> 4) ^ (uint64_t{ Rva } * 0x9E3779B1);
+    return static_cast<size_t>(key ^ (key >> 16)) % SysMon::SymbolCache::SHARDS_COUNT;
+}
@@ -0,0 +1,210 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/SymbolCache.hpp
+ *
+ * @brief       In this file we define a small cache of the symbol lookups done
+ *              while decorating stacks. The same return addresses are resolved
+ *              over and over, so the result is remembered per symbol table and rva.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#pragma once
+
+#include "precomp.hpp"
+
+#include "SymbolTable.hpp"
+
+
+namespace SysMon
+{
+/**
+ * @brief   A resolved address - an rva inside a module and the closest symbol before it.
+ */
+struct SymbolCacheEntry
+{
+    /**
+     * @brief   The table in which the rva was resolved. Modules with the same pdb share
+     *          the table, so they share the entries as well. Holding the table keeps its
+     *          address from being reused while the entry exists.
+     */
+    xpf::SharedPointer<SysMon::SymbolTable> Table{ SYSMON_PAGED_ALLOCATOR };
+
+    /**
+     * @brief   The rva which was resolved.
+     */
+    uint32_t Rva = 0;
+
+    /**
+     * @brief   The rva of the symbol containing it.
+     */
+    uint32_t SymbolRva = 0;
+
+    /**
+     * @brief   The name of the symbol containing it.
+     */
+    xpf::String<char> SymbolName{ SYSMON_PAGED_ALLOCATOR };
+
+    /**
+     * @brief   The last time the entry was used. The least recently used entry is replaced.
+     */
+    volatile uint64_t LastUsedTime = 0;
+};
+
+/**
+ * @brief   This class caches the symbol lookups keyed by (symbol table, rva).
+ *
+ *          The cache is split in shards, each with its own lock, so the decorating threads
+ *          do not contend. Each shard is bounded - when it is full, its least recently used
+ *          entry is replaced. The entries hold the symbol table they were resolved in, so
+ *          when a table is evicted or its module is forgotten, its entries must be
+ *          invalidated as well - otherwise they would keep the table alive.
+ */
+class SymbolCache final
+{
+ private:
+    /**
+     * @brief  Default constructor - private as Create
+     *         method must be used to instantiate an object.
+     */
+    SymbolCache(void) noexcept(true) = default;
+
+ public:
+    /**
+     * @brief   Destructor. Reports the hit ratio.
+     */
+    ~SymbolCache(void) noexcept(true);
+
+    /**
+     * @brief   Copy and move are deleted for this class.
+     *          They can be implemented when required.
+     */
+    XPF_CLASS_COPY_MOVE_BEHAVIOR(SysMon::SymbolCache, delete);
+
+    /**
+     * @brief       Creates a symbol cache.
+     *
+     * @param[out]  Cache - On success, it will contain a properly initialized object.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    static NTSTATUS XPF_API
+    Create(
+        _Out_ xpf::Optional<SysMon::SymbolCache>* Cache
+    ) noexcept(true);
+
+    /**
+     * @brief       Looks up a previously resolved rva.
+     *
+     * @param[in]   Table       - The symbols the module has now.
+     * @param[in]   Rva         - The rva to be resolved.
+     * @param[out]  SymbolRva   - The rva of the found symbol.
+     * @param[out]  SymbolName  - The name of the found symbol.
+     *
+     * @return      STATUS_NOT_FOUND if the rva is not cached,
+     *              or a proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(APC_LEVEL)
+    NTSTATUS XPF_API
+    Find(
+        _In_ _Const_ const xpf::SharedPointer<SysMon::SymbolTable>& Table,
+        _In_ uint32_t Rva,
+        _Out_ uint32_t* SymbolRva,
+        _Out_ xpf::String<char>* SymbolName
+    ) noexcept(true);
+
+    /**
+     * @brief       Remembers a resolved rva. If the shard is full, its least
+     *              recently used entry is replaced.
+     *
+     * @param[in]   Table       - The table in which the rva was resolved.
+     * @param[in]   Rva         - The rva which was resolved.
+     * @param[in]   SymbolRva   - The rva of the found symbol.
+     * @param[in]   SymbolName  - The name of the found symbol.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(APC_LEVEL)
+    NTSTATUS XPF_API
+    Insert(
+        _In_ _Const_ const xpf::SharedPointer<SysMon::SymbolTable>& Table,
+        _In_ uint32_t Rva,
+        _In_ uint32_t SymbolRva,
+        _In_ _Const_ const xpf::StringView<char>& SymbolName
+    ) noexcept(true);
+
+    /**
+     * @brief       Drops the entries resolved in a symbol table - used when the table
+     *              is evicted or when the module using it is forgotten.
+     *
+     * @param[in]   Table - The table.
+     *
+     * @return      Nothing.
+     */
+    _IRQL_requires_max_(APC_LEVEL)
+    void XPF_API
+    InvalidateTable(
+        _In_ _Const_ const xpf::SharedPointer<SysMon::SymbolTable>& Table
+    ) noexcept(true);
+
+    /**
+     * @brief       Logs how many lookups were served from the cache.
+     *
+     * @return      Nothing.
+     */
+    void XPF_API
+    ReportStatistics(
+        void
+    ) noexcept(true);
+
+ private:
+    /**
+     * @brief       Maps a table and an rva to the shard in which they are cached.
+     *
+     * @param[in]   Table   - The symbol table.
+     * @param[in]   Rva     - The rva.
+     *
+     * @return      The index of the shard.
+     */
+    static size_t XPF_API
+    ShardIndex(
+        _In_ _Const_ const SysMon::SymbolTable* Table,
+        _In_ uint32_t Rva
+    ) noexcept(true);
+
+ private:
+    /**
+     * @brief   How many shards are used. Each one has its own lock.
+     */
+    static constexpr size_t SHARDS_COUNT = 16;
+
+    /**
+     * @brief   How many entries a shard keeps. A few hundred hot return
+     *          addresses fit comfortably in the whole cache.
+     */
+    static constexpr size_t MAX_SHARD_ENTRIES = 64;
+
+    xpf::Optional<xpf::ReadWriteLock> m_ShardLocks[SHARDS_COUNT];
+    xpf::Vector<xpf::Vector<xpf::SharedPointer<SysMon::SymbolCacheEntry>>> m_Shards{ SYSMON_PAGED_ALLOCATOR };
+
+    volatile uint64_t m_Hits = 0;
+    volatile uint64_t m_Misses = 0;
+    volatile uint64_t m_Invalidations = 0;
+
+    /**
+     * @brief   Default MemoryAllocator is our friend as it requires access to the private
+     *          default constructor. It is used in the Create() method to ensure that
+     *          no partially constructed objects are created but instead they will be
+     *          all fully initialized.
+     */
+    friend class xpf::MemoryAllocator;
+};  // class SymbolCache
+};  // namespace SysMon
@@ -0,0 +1,286 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/SymbolStore.cpp
+ *
+ * @brief       In this file we define a store of symbol tables shared between modules.
+ *              Identical binaries loaded from different paths have the same pdb,
+ *              so their symbols are extracted and kept only once.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "precomp.hpp"
+
+#include "SymbolStore.hpp"
+#include "trace.hpp"
+
+/**
+ * @brief   The store is paged. It is only used at max APC_LEVEL.
+ */
+XPF_SECTION_PAGED;
+
+/**
+ * @brief       Checks whether an entry describes the given pdb.
+ *
+ * @param[in]   Entry   - The entry to be checked.
+ * @param[in]   PdbGuid - The guid of the program database.
+ * @param[in]   PdbAge  - The age of the program database.
+ *
+ * @return      true if the entry describes the pdb, false otherwise.
+ */
+static bool XPF_API
+SymbolStoreIsSamePdb(
+    _In_ _Const_ const SysMon::SymbolStoreEntry& Entry,
+    _In_ _Const_ const uuid_t& PdbGuid,
+    _In_ uint32_t PdbAge
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    return (Entry.PdbAge == PdbAge) &&
+           (sizeof(PdbGuid) == ::RtlCompareMemory(&Entry.PdbGuid, &PdbGuid, sizeof(PdbGuid)));
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::SymbolStore::Create(
+    _Out_ xpf::Optional<SysMon::SymbolStore>* Store
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != Store);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    /* Preinit output. */
+    Store->Reset();
+    Store->Emplace();
+
+    SysMon::SymbolStore& store = (*(*Store));
+
+    status = xpf::ReadWriteLock::Create(&store.m_StoreLock);
+    if (!NT_SUCCESS(status))
+    {
+        Store->Reset();
+        return status;
+    }
+    for (size_t i = 0; i < SysMon::SymbolStore::STORE_BUCKETS_COUNT; ++i)
+    {
+        status = store.m_Buckets.Emplace(xpf::Vector<xpf::SharedPointer<SysMon::SymbolStoreEntry>>{ SYSMON_PAGED_ALLOCATOR });
+        if (!NT_SUCCESS(status))
+        {
+            Store->Reset();
+            return status;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::SymbolStore::Acquire(
+    _In_ _Const_ const PdbHelper::ImageIdentity& Identity,
+    _Out_ xpf::SharedPointer<SysMon::SymbolStoreEntry>* Entry,
+    _Out_ bool* IsOwner
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != Entry);
+    XPF_DEATH_ON_FAILURE(nullptr != IsOwner);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    xpf::SharedPointer<SysMon::SymbolStoreEntry> newEntry{ SYSMON_NPAGED_ALLOCATOR };
+
+    /* Preinit output. */
+    Entry->Reset();
+    *IsOwner = false;
+
+    if (!Identity.HasPdbInformation)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    /* Fast path - the pdb is already known. */
+    {
+        xpf::SharedLockGuard guard{ *this->m_StoreLock };
+
+        const xpf::Vector<xpf::SharedPointer<SysMon::SymbolStoreEntry>>& bucket = this->Bucket(Identity.PdbGuid,
+                                                                                               Identity.PdbAge);
+        for (size_t i = 0; i < bucket.Size(); ++i)
+        {
+            if (SymbolStoreIsSamePdb(*bucket[i].Get(), Identity.PdbGuid, Identity.PdbAge))
+            {
+                *Entry = bucket[i];
+                return STATUS_SUCCESS;
+            }
+        }
+    }
+
+    /* Slow path - recheck under exclusive lock as someone may have added it meanwhile. */
+    xpf::ExclusiveLockGuard guard{ *this->m_StoreLock };
+
+    xpf::Vector<xpf::SharedPointer<SysMon::SymbolStoreEntry>>& bucket = this->Bucket(Identity.PdbGuid,
+                                                                                     Identity.PdbAge);
+    for (size_t i = 0; i < bucket.Size(); ++i)
+    {
+        if (SymbolStoreIsSamePdb(*bucket[i].Get(), Identity.PdbGuid, Identity.PdbAge))
+        {
+            *Entry = bucket[i];
+            return STATUS_SUCCESS;
+        }
+    }
+
+    newEntry = xpf::MakeSharedWithAllocator<SysMon::SymbolStoreEntry>(SYSMON_NPAGED_ALLOCATOR);
+    if (newEntry.IsEmpty())
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    newEntry.Get()->PdbGuid = Identity.PdbGuid;
+    newEntry.Get()->PdbAge = Identity.PdbAge;
+    ::KeInitializeEvent(&newEntry.Get()->Loaded,
+                        EVENT_TYPE::NotificationEvent,
+                        FALSE);
+
+    status = bucket.Emplace(newEntry);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    *Entry = newEntry;
+    *IsOwner = true;
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+void XPF_API
+SysMon::SymbolStore::Publish(
+    _In_ _Const_ const xpf::SharedPointer<SysMon::SymbolStoreEntry>& Entry,
+    _In_ _Const_ const xpf::SharedPointer<SysMon::SymbolTable>& Table
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    if (Entry.IsEmpty())
+    {
+        XPF_ASSERT(false);
+        return;
+    }
+
+    {
+        xpf::ExclusiveLockGuard guard{ *this->m_StoreLock };
+
+        Entry.Get()->Table = Table;
+
+        /* The load failed - forget the pdb so a later request can retry it. */
+        if (Table.IsEmpty())
+        {
+            xpf::Vector<xpf::SharedPointer<SysMon::SymbolStoreEntry>>& bucket = this->Bucket(Entry.Get()->PdbGuid,
+                                                                                             Entry.Get()->PdbAge);
+            for (size_t i = 0; i < bucket.Size(); ++i)
+            {
+                if (bucket[i].Get() == Entry.Get())
+                {
+                    NTSTATUS status = bucket.Erase(i);
+                    XPF_DEATH_ON_FAILURE(NT_SUCCESS(status));
+                    break;
+                }
+            }
+        }
+    }
+
+    /* Wake everyone waiting for this pdb. */
+    ::KeSetEvent(&Entry.Get()->Loaded,
+                 IO_NO_INCREMENT,
+                 FALSE);
+}
+
+_Use_decl_annotations_
+void XPF_API
+SysMon::SymbolStore::Evict(
+    _In_ _Const_ const xpf::SharedPointer<SysMon::SymbolTable>& Table
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    if (Table.IsEmpty())
+    {
+        return;
+    }
+
+    /* The table does not know its pdb - but evictions are rare, so walk all buckets. */
+    xpf::ExclusiveLockGuard guard{ *this->m_StoreLock };
+    for (size_t i = 0; i < this->m_Buckets.Size(); ++i)
+    {
+        xpf::Vector<xpf::SharedPointer<SysMon::SymbolStoreEntry>>& bucket = this->m_Buckets[i];
+        for (size_t j = 0; j < bucket.Size(); ++j)
+        {
+            if (bucket[j].Get()->Table.Get() == Table.Get())
+            {
+                NTSTATUS status = bucket.Erase(j);
+                XPF_DEATH_ON_FAILURE(NT_SUCCESS(status));
+                return;
+            }
+        }
+    }
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::SymbolStore::Wait(
+    _In_ _Const_ const xpf::SharedPointer<SysMon::SymbolStoreEntry>& Entry,
+    _Out_ xpf::SharedPointer<SysMon::SymbolTable>* Table
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != Table);
+
+    /* Preinit output. */
+    Table->Reset();
+
+    if (Entry.IsEmpty())
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    /* The owner always publishes - even on failure - so this wait is bounded by the load. */
+    NTSTATUS status = ::KeWaitForSingleObject(&Entry.Get()->Loaded,
+                                              KWAIT_REASON::Executive,
+                                              KernelMode,
+                                              FALSE,
+                                              NULL);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    xpf::SharedLockGuard guard{ *this->m_StoreLock };
+    if (Entry.Get()->Table.IsEmpty())
+    {
+        return STATUS_NOT_FOUND;
+    }
+    *Table = Entry.Get()->Table;
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+xpf::Vector<xpf::SharedPointer<SysMon::SymbolStoreEntry>>& XPF_API
+SysMon::SymbolStore::Bucket(
+    _In_ _Const_ const uuid_t& PdbGuid,
+    _In_ uint32_t PdbAge
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    /* The guid is already random - a couple of its fields spread the pdbs well enough. */
+    uint32_t hash = static_cast<uint32_t>(PdbGuid.Data1);
+    hash = (hash * 31) ^ ((static_cast<uint32_t>(PdbGuid.Data2) << 16) | PdbGuid.Data3);
+    hash = (hash * 31) ^ PdbAge;
+
+    return this->m_Buckets[hash % SysMon::SymbolStore::STORE_BUCKETS_COUNT];
+}
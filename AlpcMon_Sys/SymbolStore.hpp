@@ -0,0 +1,196 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/SymbolStore.hpp
+ *
+ * @brief       In this file we define a store of symbol tables shared between modules.
+ *              Identical binaries loaded from different paths have the same pdb,
+ *              so their symbols are extracted and kept only once.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#pragma once
+
+#include "precomp.hpp"
+
+#include "PdbHelper.hpp"
+#include "SymbolTable.hpp"
+
+
+namespace SysMon
+{
+/**
+ * @brief   An entry in the symbol store. It describes the symbols of one pdb.
+ *
+ * @note    The entry is allocated from non paged pool as it contains the event
+ *          on which the threads requesting the same pdb are waiting.
+ */
+struct SymbolStoreEntry
+{
+    /**
+     * @brief   The guid of the program database.
+     */
+    uuid_t PdbGuid = { 0 };
+
+    /**
+     * @brief   The age of the program database.
+     */
+    uint32_t PdbAge = 0;
+
+    /**
+     * @brief   The loaded symbols. Empty until the event is signaled. Guarded by the store lock.
+     */
+    xpf::SharedPointer<SysMon::SymbolTable> Table{ SYSMON_PAGED_ALLOCATOR };
+
+    /**
+     * @brief   Notification event signaled when the symbols were loaded.
+     */
+    KEVENT Loaded = { 0 };
+};
+
+/**
+ * @brief   This class keeps the symbol tables indexed by their pdb guid and age.
+ *
+ *          The first thread requesting a pdb is the owner - it must load the symbols
+ *          and publish them. Until then, the other threads requesting the same pdb wait
+ *          for the owner instead of extracting the symbols again. The tables are shared
+ *          with the modules, so a table lives as long as a module still points to it.
+ */
+class SymbolStore final
+{
+ private:
+    /**
+     * @brief  Default constructor - private as Create
+     *         method must be used to instantiate an object.
+     */
+    SymbolStore(void) noexcept(true) = default;
+
+ public:
+    /**
+     * @brief   Default destructor.
+     */
+    ~SymbolStore(void) noexcept(true) = default;
+
+    /**
+     * @brief   Copy and move are deleted for this class.
+     *          They can be implemented when required.
+     */
+    XPF_CLASS_COPY_MOVE_BEHAVIOR(SysMon::SymbolStore, delete);
+
+    /**
+     * @brief       Creates a symbol store.
+     *
+     * @param[out]  Store - On success, it will contain a properly initialized object.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    static NTSTATUS XPF_API
+    Create(
+        _Out_ xpf::Optional<SysMon::SymbolStore>* Store
+    ) noexcept(true);
+
+    /**
+     * @brief       Looks up the symbols of a pdb. If they are not in the store,
+     *              a new entry is added and the caller becomes its owner.
+     *
+     * @param[in]   Identity - The image identity. It must have pdb information.
+     * @param[out]  Entry    - The entry describing the pdb.
+     * @param[out]  IsOwner  - true if the caller must load the symbols and call Publish.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(APC_LEVEL)
+    NTSTATUS XPF_API
+    Acquire(
+        _In_ _Const_ const PdbHelper::ImageIdentity& Identity,
+        _Out_ xpf::SharedPointer<SysMon::SymbolStoreEntry>* Entry,
+        _Out_ bool* IsOwner
+    ) noexcept(true);
+
+    /**
+     * @brief       Publishes the symbols loaded by the owner of an entry and wakes the waiters.
+     *
+     * @param[in]   Entry - The entry returned by Acquire to its owner.
+     * @param[in]   Table - The loaded symbols. If it is empty, the load failed and
+     *                      the entry is dropped, so the pdb can be retried later.
+     *
+     * @return      Nothing.
+     */
+    _IRQL_requires_max_(APC_LEVEL)
+    void XPF_API
+    Publish(
+        _In_ _Const_ const xpf::SharedPointer<SysMon::SymbolStoreEntry>& Entry,
+        _In_ _Const_ const xpf::SharedPointer<SysMon::SymbolTable>& Table
+    ) noexcept(true);
+
+    /**
+     * @brief       Drops a table from the store, so its memory is released once
+     *              the modules stop pointing to it. A later request loads it again.
+     *
+     * @param[in]   Table - The table to be dropped.
+     *
+     * @return      Nothing.
+     */
+    _IRQL_requires_max_(APC_LEVEL)
+    void XPF_API
+    Evict(
+        _In_ _Const_ const xpf::SharedPointer<SysMon::SymbolTable>& Table
+    ) noexcept(true);
+
+    /**
+     * @brief       Waits for the owner of an entry to publish the symbols.
+     *
+     * @param[in]   Entry - The entry returned by Acquire.
+     * @param[out]  Table - The loaded symbols.
+     *
+     * @return      STATUS_NOT_FOUND if the owner failed to load the symbols,
+     *              or a proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS XPF_API
+    Wait(
+        _In_ _Const_ const xpf::SharedPointer<SysMon::SymbolStoreEntry>& Entry,
+        _Out_ xpf::SharedPointer<SysMon::SymbolTable>* Table
+    ) noexcept(true);
+
+ private:
+    /**
+     * @brief       Selects the bucket of a pdb.
+     *
+     * @param[in]   PdbGuid - The guid of the program database.
+     * @param[in]   PdbAge  - The age of the program database.
+     *
+     * @return      The bucket where the pdb belongs.
+     */
+    xpf::Vector<xpf::SharedPointer<SysMon::SymbolStoreEntry>>& XPF_API
+    Bucket(
+        _In_ _Const_ const uuid_t& PdbGuid,
+        _In_ uint32_t PdbAge
+    ) noexcept(true);
+
+ private:
+    /**
+     * @brief   The number of buckets. There are far fewer distinct pdbs than modules.
+     */
+    static constexpr size_t STORE_BUCKETS_COUNT = 127;
+
+    xpf::Optional<xpf::ReadWriteLock> m_StoreLock;
+    xpf::Vector<xpf::Vector<xpf::SharedPointer<SysMon::SymbolStoreEntry>>> m_Buckets{ SYSMON_PAGED_ALLOCATOR };
+
+    /**
+     * @brief   Default MemoryAllocator is our friend as it requires access to the private
+     *          default constructor. It is used in the Create() method to ensure that
+     *          no partially constructed objects are created but instead they will be
+     *          all fully initialized.
+     */
+    friend class xpf::MemoryAllocator;
+};  // class SymbolStore
+};  // namespace SysMon
@@ -0,0 +1,188 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/SymbolTable.cpp
+ *
+ * @brief       In this file we define a compact, read-only table of symbols.
+ *              It is used to resolve an rva inside a module to the closest symbol.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "precomp.hpp"
+
+#include "SymbolTable.hpp"
+#include "trace.hpp"
+
+/**
+ * @brief   The symbols are paged. They are only used at max APC_LEVEL.
+ */
+XPF_SECTION_PAGED;
+
+/**
+ * @brief       Gets a view over a symbol, as the codec expects it.
+ *
+ * @param[in]   Symbol - The symbol.
+ *
+ * @return      A non owning view over the symbol.
+ */
+static SysMon::SymbolTableCodec::SymbolView XPF_API
+SymbolTableView(
+    _In_ _Const_ const xpf::pdb::SymbolInformation& Symbol
+) noexcept(true)
+{
+    const xpf::StringView<char> name = Symbol.SymbolName.View();
+
+    SysMon::SymbolTableCodec::SymbolView view;
+    view.Rva = Symbol.SymbolRVA;
+    view.Name = name.Buffer();
+    view.NameLength = name.BufferSize();
+    return view;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::SymbolTable::Create(
+    _In_ _Const_ const xpf::Vector<xpf::pdb::SymbolInformation>& Symbols,
+    _Out_ xpf::SharedPointer<SysMon::SymbolTable>* Table
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != Table);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    xpf::SharedPointer<SysMon::SymbolTable> table{ SYSMON_PAGED_ALLOCATOR };
+
+    size_t blocksCount = 0;
+    size_t deltasSize = 0;
+    size_t namesSize = 0;
+    size_t deltasWritten = 0;
+    size_t namesWritten = 0;
+
+    const auto symbolAt = [&](size_t Index) -> SysMon::SymbolTableCodec::SymbolView
+    {
+        return SymbolTableView(Symbols[Index]);
+    };
+
+    /* Preinit output. */
+    Table->Reset();
+
+    /* First pass - validate the input and compute the exact size of the blobs. */
+    if (!SysMon::SymbolTableCodec::ComputeSizes(Symbols.Size(),
+                                                symbolAt,
+                                                &blocksCount,
+                                                &deltasSize,
+                                                &namesSize))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    /* Now create the table. */
+    table = xpf::MakeSharedWithAllocator<SysMon::SymbolTable>(SYSMON_PAGED_ALLOCATOR);
+    if (table.IsEmpty())
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    SysMon::SymbolTable& newTable = (*table.Get());
+
+    /* One allocation per blob. */
+    if (deltasSize > 0)
+    {
+        status = newTable.m_Deltas.Resize(deltasSize);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+    }
+    if (namesSize > 0)
+    {
+        status = newTable.m_Names.Resize(namesSize);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+    }
+
+    /* Second pass - fill the blobs. */
+    status = STATUS_SUCCESS;
+    auto onBlock = [&](const SysMon::SymbolTableCodec::Block& NewBlock) -> bool
+    {
+        status = newTable.m_Blocks.Emplace(NewBlock);
+        return NT_SUCCESS(status);
+    };
+    if (!SysMon::SymbolTableCodec::Encode(Symbols.Size(),
+                                          symbolAt,
+                                          onBlock,
+                                          static_cast<uint8_t*>(newTable.m_Deltas.GetBuffer()),
+                                          static_cast<uint8_t*>(newTable.m_Names.GetBuffer()),
+                                          &deltasWritten,
+                                          &namesWritten))
+    {
+        return NT_SUCCESS(status) ? STATUS_UNSUCCESSFUL
+                                  : status;
+    }
+    XPF_DEATH_ON_FAILURE(newTable.m_Blocks.Size() == blocksCount);
+    XPF_DEATH_ON_FAILURE(deltasWritten == deltasSize);
+    XPF_DEATH_ON_FAILURE(namesWritten == namesSize);
+
+    newTable.m_SymbolsCount = Symbols.Size();
+
+    /* All good. */
+    *Table = table;
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+SysMon::SymbolTable::Find(
+    _In_ uint64_t Rva,
+    _Out_ uint32_t* SymbolRva,
+    _Out_ xpf::String<char>* SymbolName
+) const noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != SymbolRva);
+    XPF_DEATH_ON_FAILURE(nullptr != SymbolName);
+
+    SysMon::SymbolTableCodec::Blobs blobs;
+    blobs.SymbolsCount = this->m_SymbolsCount;
+    blobs.BlocksCount = this->m_Blocks.Size();
+    blobs.Deltas = static_cast<const uint8_t*>(this->m_Deltas.GetBuffer());
+    blobs.DeltasSize = this->m_Deltas.GetSize();
+    blobs.Names = static_cast<const uint8_t*>(this->m_Names.GetBuffer());
+    blobs.NamesSize = this->m_Names.GetSize();
+
+    const auto blockAt = [&](size_t Index) -> const SysMon::SymbolTableCodec::Block&
+    {
+        return this->m_Blocks[Index];
+    };
+
+    char name[SymbolTable::MAX_NAME_LENGTH] = { 0 };
+    size_t nameLength = 0;
+
+    /* Preinit output. */
+    *SymbolRva = 0;
+    SymbolName->Reset();
+
+    switch (SysMon::SymbolTableCodec::Find(blobs, blockAt, Rva, SymbolRva, name, &nameLength))
+    {
+        case SysMon::SymbolTableCodec::FindResult::kFound:
+        {
+            break;
+        }
+        case SysMon::SymbolTableCodec::FindResult::kNotFound:
+        {
+            return STATUS_NOT_FOUND;
+        }
+        default:
+        {
+            return STATUS_DATA_ERROR;
+        }
+    }
+
+    return SymbolName->Append(xpf::StringView<char>(name,
+                                                    nameLength));
+}
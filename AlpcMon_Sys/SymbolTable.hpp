@@ -0,0 +1,143 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/SymbolTable.hpp
+ *
+ * @brief       In this file we define a compact, read-only table of symbols.
+ *              It is used to resolve an rva inside a module to the closest symbol.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#pragma once
+
+#include "precomp.hpp"
+#include "SymbolTableCodec.hpp"
+
+
+namespace SysMon
+{
+/**
+ * @brief   This class keeps the symbols of a module in a packed form.
+ *
+ *          Symbols are grouped in blocks of BLOCK_SIZE, sorted by rva. For each block
+ *          we keep the first rva and the offsets in two blobs:
+ *              - the deltas blob: the rva differences between consecutive symbols, as varints.
+ *              - the names blob:  the names, front-coded against the previous name in the block.
+ *
+ *          A lookup does a binary search over the (small and contiguous) block array and then
+ *          decodes at most one block. There is a single allocation per blob, instead of one
+ *          string allocation per symbol. The packing itself lives in SymbolTableCodec.hpp.
+ */
+class SymbolTable final
+{
+ private:
+    /**
+     * @brief  Default constructor - private as Create
+     *         method must be used to instantiate an object.
+     */
+    SymbolTable(void) noexcept(true) = default;
+
+ public:
+    /**
+     * @brief   Default destructor.
+     */
+    ~SymbolTable(void) noexcept(true) = default;
+
+    /**
+     * @brief   Copy and move are deleted for this class.
+     *          They can be implemented when required.
+     */
+    XPF_CLASS_COPY_MOVE_BEHAVIOR(SysMon::SymbolTable, delete);
+
+    /**
+     * @brief       Builds a symbol table.
+     *
+     * @param[in]   Symbols - The symbols, sorted by their rva.
+     * @param[out]  Table   - On success, it will contain the packed table.
+     *
+     * @return      STATUS_INVALID_PARAMETER if the symbols are not sorted,
+     *              or a proper NTSTATUS error code.
+     *
+     * @note        Names longer than MAX_NAME_LENGTH are truncated.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    static NTSTATUS XPF_API
+    Create(
+        _In_ _Const_ const xpf::Vector<xpf::pdb::SymbolInformation>& Symbols,
+        _Out_ xpf::SharedPointer<SysMon::SymbolTable>* Table
+    ) noexcept(true);
+
+    /**
+     * @brief       Gets the number of symbols in the table.
+     *
+     * @return      The number of symbols.
+     */
+    inline size_t XPF_API
+    Size(
+        void
+    ) const noexcept(true)
+    {
+        return this->m_SymbolsCount;
+    }
+
+    /**
+     * @brief       Gets how much memory the table holds - used to keep the symbols within a budget.
+     *
+     * @return      The size in bytes of the table and of its blobs.
+     */
+    inline size_t XPF_API
+    MemorySize(
+        void
+    ) const noexcept(true)
+    {
+        return sizeof(SysMon::SymbolTable) +
+               this->m_Blocks.Size() * sizeof(SysMon::SymbolTableCodec::Block) +
+               this->m_Deltas.GetSize() +
+               this->m_Names.GetSize();
+    }
+
+    /**
+     * @brief       Looks up the closest symbol whose rva is smaller or equal to the given one.
+     *
+     * @param[in]   Rva         - The rva to be resolved.
+     * @param[out]  SymbolRva   - The rva of the found symbol.
+     * @param[out]  SymbolName  - The name of the found symbol.
+     *
+     * @return      STATUS_NOT_FOUND if there is no such symbol,
+     *              or a proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(APC_LEVEL)
+    NTSTATUS XPF_API
+    Find(
+        _In_ uint64_t Rva,
+        _Out_ uint32_t* SymbolRva,
+        _Out_ xpf::String<char>* SymbolName
+    ) const noexcept(true);
+
+    /**
+     * @brief   Names longer than this are truncated. It bounds the decoding buffer.
+     */
+    static constexpr size_t MAX_NAME_LENGTH = SysMon::SymbolTableCodec::MAX_NAME_LENGTH;
+
+ private:
+    size_t m_SymbolsCount = 0;
+
+    xpf::Vector<SysMon::SymbolTableCodec::Block> m_Blocks{ SYSMON_PAGED_ALLOCATOR };
+    xpf::Buffer m_Deltas{ SYSMON_PAGED_ALLOCATOR };
+    xpf::Buffer m_Names{ SYSMON_PAGED_ALLOCATOR };
+
+    /**
+     * @brief   Default MemoryAllocator is our friend as it requires access to the private
+     *          default constructor. It is used in the Create() method to ensure that
+     *          no partially constructed objects are created but instead they will be
+     *          all fully initialized.
+     */
+    friend class xpf::MemoryAllocator;
+};  // class SymbolTable
+};  // namespace SysMon
@@ -0,0 +1,465 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/SymbolTableCodec.hpp
+ *
+ * @brief       In this file we define how the symbols of a module are packed and looked up.
+ *              SysMon::SymbolTable owns the blobs, this encodes and decodes them.
+ *
+ * @note        This header is portable on purpose - it does not depend on the kernel
+ *              or on xpf, so it is also built and tested on linux. See the Tests folder.
+ *              Nothing here allocates - the caller sizes the blobs with ComputeSizes.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+
+namespace SysMon
+{
+namespace SymbolTableCodec
+{
+/**
+ * @brief   How many symbols are grouped in a block.
+ */
+static constexpr size_t BLOCK_SIZE = 16;
+
+/**
+ * @brief   Names longer than this are truncated. It bounds the decoding buffer.
+ */
+static constexpr size_t MAX_NAME_LENGTH = 256;
+
+/**
+ * @brief   Describes a group of consecutive symbols in the table.
+ */
+struct Block
+{
+    /**
+     * @brief   The rva of the first symbol in the block.
+     */
+    uint32_t FirstRva = 0;
+
+    /**
+     * @brief   Where the rva deltas of the block start in the deltas blob.
+     */
+    uint32_t DeltasOffset = 0;
+
+    /**
+     * @brief   Where the names of the block start in the names blob.
+     */
+    uint32_t NamesOffset = 0;
+};
+
+/**
+ * @brief   A non owning view over a symbol which is to be packed.
+ */
+struct SymbolView
+{
+    uint64_t Rva = 0;
+    const char* Name = nullptr;
+    size_t NameLength = 0;
+};
+
+/**
+ * @brief   The packed table, as it is looked up. The blocks are reached through an accessor.
+ */
+struct Blobs
+{
+    size_t SymbolsCount = 0;
+    size_t BlocksCount = 0;
+    const uint8_t* Deltas = nullptr;
+    size_t DeltasSize = 0;
+    const uint8_t* Names = nullptr;
+    size_t NamesSize = 0;
+};
+
+/**
+ * @brief   The outcome of a lookup.
+ */
+enum class FindResult : uint32_t
+{
+    /**
+     * @brief   A symbol at or before the rva was found.
+     */
+    kFound = 0,
+
+    /**
+     * @brief   The rva is before the first symbol, or the table is empty.
+     */
+    kNotFound = 1,
+
+    /**
+     * @brief   The blobs are not consistent.
+     */
+    kCorrupt = 2,
+};
+
+/**
+ * @brief       Computes how many bytes a value needs when encoded as a varint.
+ *              7 bits are stored per byte, the high bit tells whether more bytes follow.
+ *
+ * @param[in]   Value - The value to be encoded.
+ *
+ * @return      The number of bytes.
+ */
+inline size_t
+VarintSize(
+    uint32_t Value
+) noexcept(true)
+{
+    size_t size = 1;
+    while (Value >= 0x80)
+    {
+        Value >>= 7;
+        ++size;
+    }
+    return size;
+}
+
+/**
+ * @brief       Encodes a value as a varint.
+ *
+ * @param[in]       Value   - The value to be encoded.
+ * @param[in,out]   Buffer  - The destination. Must have enough room - see VarintSize.
+ * @param[in,out]   Offset  - Where to write in buffer. Advanced with the written bytes.
+ *
+ * @return      Nothing.
+ */
+inline void
+WriteVarint(
+    uint32_t Value,
+    uint8_t* Buffer,
+    size_t* Offset
+) noexcept(true)
+{
+    while (Value >= 0x80)
+    {
+        Buffer[(*Offset)++] = static_cast<uint8_t>((Value & 0x7F) | 0x80);
+        Value >>= 7;
+    }
+    Buffer[(*Offset)++] = static_cast<uint8_t>(Value);
+}
+
+/**
+ * @brief       Decodes a varint.
+ *
+ * @param[in]       Buffer  - The encoded data.
+ * @param[in]       Size    - The size of the buffer.
+ * @param[in,out]   Offset  - Where to read from. Advanced with the read bytes.
+ * @param[out]      Value   - The decoded value.
+ *
+ * @return      false if the varint is truncated or too large, true otherwise.
+ */
+inline bool
+ReadVarint(
+    const uint8_t* Buffer,
+    size_t Size,
+    size_t* Offset,
+    uint32_t* Value
+) noexcept(true)
+{
+    *Value = 0;
+    for (uint32_t shift = 0; shift < 32; shift += 7)
+    {
+        if (*Offset >= Size)
+        {
+            return false;
+        }
+
+        const uint8_t byte = Buffer[(*Offset)++];
+        *Value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief       Gets the length of a name, truncated to MAX_NAME_LENGTH.
+ *
+ * @param[in]   Symbol - The symbol.
+ *
+ * @return      The (possibly truncated) length.
+ */
+inline size_t
+NameLength(
+    const SysMon::SymbolTableCodec::SymbolView& Symbol
+) noexcept(true)
+{
+    return (Symbol.NameLength < SysMon::SymbolTableCodec::MAX_NAME_LENGTH) ? Symbol.NameLength
+                                                                           : SysMon::SymbolTableCodec::MAX_NAME_LENGTH;
+}
+
+/**
+ * @brief       Computes how many characters two (truncated) names have in common at their start.
+ *
+ * @param[in]   Left  - First symbol.
+ * @param[in]   Right - Second symbol.
+ *
+ * @return      The length of the common prefix.
+ */
+inline size_t
+CommonPrefix(
+    const SysMon::SymbolTableCodec::SymbolView& Left,
+    const SysMon::SymbolTableCodec::SymbolView& Right
+) noexcept(true)
+{
+    const size_t leftLength = SysMon::SymbolTableCodec::NameLength(Left);
+    const size_t rightLength = SysMon::SymbolTableCodec::NameLength(Right);
+
+    size_t length = 0;
+    while (length < leftLength && length < rightLength && Left.Name[length] == Right.Name[length])
+    {
+        ++length;
+    }
+    return length;
+}
+
+/**
+ * @brief       First pass - validates the symbols and computes the exact size of the blobs.
+ *
+ * @param[in]   SymbolsCount    - The number of symbols.
+ * @param[in]   SymbolAt        - Returns the symbol at an index: SymbolView SymbolAt(size_t Index).
+ * @param[out]  BlocksCount     - The number of blocks.
+ * @param[out]  DeltasSize      - The size of the deltas blob, in bytes.
+ * @param[out]  NamesSize       - The size of the names blob, in bytes.
+ *
+ * @return      false if the symbols are not sorted by rva, or do not fit the 32 bit offsets.
+ */
+template <class SymbolAccessor>
+inline bool
+ComputeSizes(
+    size_t SymbolsCount,
+    const SymbolAccessor& SymbolAt,
+    size_t* BlocksCount,
+    size_t* DeltasSize,
+    size_t* NamesSize
+) noexcept(true)
+{
+    SysMon::SymbolTableCodec::SymbolView previous;
+    uint64_t deltasSize = 0;
+    uint64_t namesSize = 0;
+
+    *BlocksCount = 0;
+    *DeltasSize = 0;
+    *NamesSize = 0;
+
+    for (size_t i = 0; i < SymbolsCount; ++i)
+    {
+        const SysMon::SymbolTableCodec::SymbolView symbol = SymbolAt(i);
+        const bool isBlockStart = (i % SysMon::SymbolTableCodec::BLOCK_SIZE) == 0;
+        const size_t nameLength = SysMon::SymbolTableCodec::NameLength(symbol);
+        const size_t prefix = isBlockStart ? 0
+                                           : SysMon::SymbolTableCodec::CommonPrefix(previous, symbol);
+
+        if (symbol.Rva > UINT32_MAX || (i > 0 && symbol.Rva < previous.Rva))
+        {
+            return false;
+        }
+
+        if (!isBlockStart)
+        {
+            deltasSize += SysMon::SymbolTableCodec::VarintSize(static_cast<uint32_t>(symbol.Rva - previous.Rva));
+        }
+        namesSize += SysMon::SymbolTableCodec::VarintSize(static_cast<uint32_t>(prefix)) +
+                     SysMon::SymbolTableCodec::VarintSize(static_cast<uint32_t>(nameLength - prefix)) +
+                     (nameLength - prefix);
+        previous = symbol;
+    }
+    if (deltasSize > UINT32_MAX || namesSize > UINT32_MAX)
+    {
+        return false;
+    }
+
+    *BlocksCount = (SymbolsCount + SysMon::SymbolTableCodec::BLOCK_SIZE - 1) / SysMon::SymbolTableCodec::BLOCK_SIZE;
+    *DeltasSize = static_cast<size_t>(deltasSize);
+    *NamesSize = static_cast<size_t>(namesSize);
+    return true;
+}
+
+/**
+ * @brief       Second pass - fills the blobs sized by ComputeSizes.
+ *
+ * @param[in]   SymbolsCount    - The number of symbols. The same as for ComputeSizes.
+ * @param[in]   SymbolAt        - The same as for ComputeSizes.
+ * @param[in]   OnBlock         - Called for each block, in order: bool OnBlock(const Block& NewBlock).
+ * @param[out]  Deltas          - The deltas blob.
+ * @param[out]  Names           - The names blob.
+ * @param[out]  DeltasSize      - How many bytes were written in the deltas blob.
+ * @param[out]  NamesSize       - How many bytes were written in the names blob.
+ *
+ * @return      false if OnBlock returned false, true otherwise.
+ */
+template <class SymbolAccessor, class BlockCallback>
+inline bool
+Encode(
+    size_t SymbolsCount,
+    const SymbolAccessor& SymbolAt,
+    BlockCallback& OnBlock,
+    uint8_t* Deltas,
+    uint8_t* Names,
+    size_t* DeltasSize,
+    size_t* NamesSize
+) noexcept(true)
+{
+    SysMon::SymbolTableCodec::SymbolView previous;
+    size_t deltasOffset = 0;
+    size_t namesOffset = 0;
+
+    for (size_t i = 0; i < SymbolsCount; ++i)
+    {
+        const SysMon::SymbolTableCodec::SymbolView symbol = SymbolAt(i);
+        const bool isBlockStart = (i % SysMon::SymbolTableCodec::BLOCK_SIZE) == 0;
+        const size_t nameLength = SysMon::SymbolTableCodec::NameLength(symbol);
+        const size_t prefix = isBlockStart ? 0
+                                           : SysMon::SymbolTableCodec::CommonPrefix(previous, symbol);
+
+        if (isBlockStart)
+        {
+            SysMon::SymbolTableCodec::Block block;
+            block.FirstRva = static_cast<uint32_t>(symbol.Rva);
+            block.DeltasOffset = static_cast<uint32_t>(deltasOffset);
+            block.NamesOffset = static_cast<uint32_t>(namesOffset);
+
+            if (!OnBlock(block))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            SysMon::SymbolTableCodec::WriteVarint(static_cast<uint32_t>(symbol.Rva - previous.Rva),
+                                                  Deltas,
+                                                  &deltasOffset);
+        }
+
+        SysMon::SymbolTableCodec::WriteVarint(static_cast<uint32_t>(prefix), Names, &namesOffset);
+        SysMon::SymbolTableCodec::WriteVarint(static_cast<uint32_t>(nameLength - prefix), Names, &namesOffset);
+        if (nameLength > prefix)
+        {
+            ::memcpy(Names + namesOffset, symbol.Name + prefix, nameLength - prefix);
+            namesOffset += nameLength - prefix;
+        }
+        previous = symbol;
+    }
+
+    *DeltasSize = deltasOffset;
+    *NamesSize = namesOffset;
+    return true;
+}
+
+/**
+ * @brief       Looks up the closest symbol whose rva is smaller or equal to the given one.
+ *              A binary search over the blocks, then at most one block is decoded.
+ *
+ * @param[in]   Table       - The packed table.
+ * @param[in]   BlockAt     - Returns the block at an index: const Block& BlockAt(size_t Index).
+ * @param[in]   Rva         - The rva to be resolved.
+ * @param[out]  SymbolRva   - The rva of the found symbol.
+ * @param[out]  Name        - Receives the name of the found symbol. Room for MAX_NAME_LENGTH characters,
+ *                            it is not null terminated.
+ * @param[out]  NameLength  - The length of the name.
+ *
+ * @return      One of the FindResult values.
+ */
+template <class BlockAccessor>
+inline SysMon::SymbolTableCodec::FindResult
+Find(
+    const SysMon::SymbolTableCodec::Blobs& Table,
+    const BlockAccessor& BlockAt,
+    uint64_t Rva,
+    uint32_t* SymbolRva,
+    char* Name,
+    size_t* NameLength
+) noexcept(true)
+{
+    *SymbolRva = 0;
+    *NameLength = 0;
+
+    /* Find the last block starting at or before the rva. */
+    if (0 == Table.BlocksCount || Rva < BlockAt(0).FirstRva)
+    {
+        return SysMon::SymbolTableCodec::FindResult::kNotFound;
+    }
+    size_t lo = 0;
+    size_t hi = Table.BlocksCount;
+    while (hi - lo > 1)
+    {
+        const size_t mid = lo + ((hi - lo) / 2);
+        if (BlockAt(mid).FirstRva <= Rva)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    /* Now decode the block until we pass the rva. */
+    if (lo * SysMon::SymbolTableCodec::BLOCK_SIZE >= Table.SymbolsCount)
+    {
+        return SysMon::SymbolTableCodec::FindResult::kCorrupt;
+    }
+    size_t blockSymbols = Table.SymbolsCount - lo * SysMon::SymbolTableCodec::BLOCK_SIZE;
+    if (blockSymbols > SysMon::SymbolTableCodec::BLOCK_SIZE)
+    {
+        blockSymbols = SysMon::SymbolTableCodec::BLOCK_SIZE;
+    }
+    size_t deltasOffset = BlockAt(lo).DeltasOffset;
+    size_t namesOffset = BlockAt(lo).NamesOffset;
+    uint32_t rva = BlockAt(lo).FirstRva;
+
+    for (size_t i = 0; i < blockSymbols; ++i)
+    {
+        uint32_t prefix = 0;
+        uint32_t suffix = 0;
+
+        if (i > 0)
+        {
+            uint32_t delta = 0;
+            if (!SysMon::SymbolTableCodec::ReadVarint(Table.Deltas, Table.DeltasSize, &deltasOffset, &delta))
+            {
+                return SysMon::SymbolTableCodec::FindResult::kCorrupt;
+            }
+            if (uint64_t{ rva } + delta > Rva)
+            {
+                break;
+            }
+            rva += delta;
+        }
+
+        /* Names are front coded - rebuild this one from the previous one. */
+        if (!SysMon::SymbolTableCodec::ReadVarint(Table.Names, Table.NamesSize, &namesOffset, &prefix) ||
+            !SysMon::SymbolTableCodec::ReadVarint(Table.Names, Table.NamesSize, &namesOffset, &suffix))
+        {
+            return SysMon::SymbolTableCodec::FindResult::kCorrupt;
+        }
+        if (prefix > *NameLength || suffix > SysMon::SymbolTableCodec::MAX_NAME_LENGTH - prefix ||
+            suffix > Table.NamesSize - namesOffset)
+        {
+            return SysMon::SymbolTableCodec::FindResult::kCorrupt;
+        }
+        if (0 != suffix)
+        {
+            ::memcpy(&Name[prefix], &Table.Names[namesOffset], suffix);
+        }
+        namesOffset += suffix;
+        *NameLength = size_t{ prefix } + suffix;
+
+        *SymbolRva = rva;
+    }
+    return SysMon::SymbolTableCodec::FindResult::kFound;
+}
+};  // namespace SymbolTableCodec
+};  // namespace SysMon
@@ -16,6 +16,8 @@
 #include "Events.hpp"
 #include "globals.hpp"
 #include "KmHelper.hpp"
+#include "RegistryUtils.hpp"
+#include "ProcessCollector.hpp"
 
 #include "UmHookPlugin.hpp"
 #include "trace.hpp"
@@ -53,6 +55,12 @@ XPF_SECTION_PAGED;
 #define UM_INJECTION_DATA_SYSTEM32_WOW64WIN_FLAG            0x00000080
 #define UM_INJECTION_DATA_SYSTEM32_WOW64CPU_FLAG            0x00000100
 
+/**
+ * @brief   The trigger dlls configured in registry get the flags starting from here.
+ */
+#define UM_INJECTION_DATA_CONFIGURED_FIRST_FLAG             0x00010000
+#define UM_INJECTION_DATA_CONFIGURED_MAX_COUNT              16
+
 /**
  * @brief   Structure to help us map the dll path to the flag.
  */
@@ -112,7 +120,8 @@ static constexpr xpf::StringView<wchar_t> gUmDllx64Path     = L"AlpcMon_Dllx64.d
 //  2. A kernel APC is scheduled, as in our injection process we are creatin a new section,
 //     we risk of entering a deadlock with the previous load image notify routine.
 //     The APC is HelperUmHookPluginApcNormalRoutine.
-//  3. In here we are creating a section where we are copying the payload (dll name).
+//  3. In here we are mapping a read-only view of the section holding the payload (dll name).
+//     The section is created once per architecture, when the plugin starts.
 //     And we are scheduling the user APC responsible with loading our dll.
 //
 
@@ -125,75 +134,33 @@ HelperUmHookPluginMapSectionAndInject(
     XPF_MAX_PASSIVE_LEVEL();
 
     NTSTATUS status = STATUS_UNSUCCESSFUL;
-    HANDLE sectionHandle = NULL;
-    OBJECT_ATTRIBUTES objectAttributes = { 0 };
-
-    SIZE_T sectionSize = 0;
-    LARGE_INTEGER maximumSize = { 0 };
     PVOID baseAddress = nullptr;
 
     PKNORMAL_ROUTINE apcRoutine = nullptr;
     PVOID apcContext = nullptr;
-    UNICODE_STRING dllPath = { 0 };
 
     SysMonLogInfo("Enqueing injection APC in process %d...",
                    InjectionData.ProcessId);
-    //
-    // Convert the view to unicode string.
-    //
-    status = KmHelper::HelperViewToUnicodeString(InjectionData.InjectedDllPath,
-                                                 dllPath);
-    if (!NT_SUCCESS(status))
-    {
-        SysMonLogError("HelperViewToUnicodeString failed with status = %!STATUS!",
-                       status);
-        goto CleanUp;
-    }
-
-    //
-    // We only want to write the path.
-    //
-    sectionSize = static_cast<size_t>(dllPath.Length) + sizeof(L'\0');
-    maximumSize.QuadPart = sectionSize;
 
-    //
-    // We need to write dll path into the target process.
-    // ZwAllocateVirtualMemory is not exposed when targeting windows 7.
-    // So we create a section.
-    //
-    InitializeObjectAttributes(&objectAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
-    status = ::ZwCreateSection(&sectionHandle,
-                               GENERIC_READ | GENERIC_WRITE,
-                               &objectAttributes,
-                               &maximumSize,
-                               PAGE_READWRITE,
-                               SEC_COMMIT,
-                               NULL);
-    if (!NT_SUCCESS(status))
+    if (nullptr == InjectionData.InjectedDllSection)
     {
-        SysMonLogError("ZwCreateSection failed with status = %!STATUS!",
-                       status);
+        SysMonLogError("No injection section for process %d",
+                       InjectionData.ProcessId);
 
-        sectionHandle = NULL;
+        status = STATUS_INVALID_PARAMETER;
         goto CleanUp;
     }
 
     //
-    // Map the view as readwrite.
+    // We need the dll path in the target process.
+    // ZwAllocateVirtualMemory is not exposed when targeting windows 7.
+    // So we map a read-only view of the section which already holds it -
+    // it was created and filled once, when the plugin started.
     //
-    status = ::ZwMapViewOfSection(sectionHandle,
-                                  ZwCurrentProcess(),
-                                  &baseAddress,
-                                  0,
-                                  sectionSize,
-                                  NULL,
-                                  &sectionSize,
-                                  SECTION_INHERIT::ViewUnmap,
-                                  0,
-                                  PAGE_READWRITE);
+    status = InjectionData.InjectedDllSection->MapInCurrentProcess(&baseAddress);
     if (!NT_SUCCESS(status))
     {
-        SysMonLogError("ZwMapViewOfSection failed with status = %!STATUS!",
+        SysMonLogError("MapInCurrentProcess failed with status = %!STATUS!",
                        status);
 
         baseAddress = NULL;
@@ -201,32 +168,6 @@ HelperUmHookPluginMapSectionAndInject(
     }
     InjectionData.MapSectionData = baseAddress;
 
-    //
-    // Copy the path.
-    //
-    {
-        const wchar_t nullTerminator = L'\0';
-
-        status = KmHelper::HelperSafeWriteBuffer(static_cast<uint8_t*>(baseAddress),
-                                                 dllPath.Buffer,
-                                                 dllPath.Length);
-        if (!NT_SUCCESS(status))
-        {
-            SysMonLogError("HelperSafeWriteBuffer failed with status = %!STATUS!",
-                            status);
-            goto CleanUp;
-        }
-        status = KmHelper::HelperSafeWriteBuffer(static_cast<uint8_t*>(baseAddress) + dllPath.Length,
-                                                 &nullTerminator,
-                                                 sizeof(nullTerminator));
-        if (!NT_SUCCESS(status))
-        {
-            SysMonLogError("HelperSafeWriteBuffer failed with status = %!STATUS!",
-                            status);
-            goto CleanUp;
-        }
-    }
-
     //
     // HMODULE LoadLibraryExW(
     //   [in] LPCWSTR lpLibFileName,
@@ -278,13 +219,6 @@ CleanUp:
         baseAddress = NULL;
         InjectionData.MapSectionData = NULL;
     }
-    if (NULL != sectionHandle)
-    {
-        NTSTATUS closeStatus = ::ZwClose(sectionHandle);
-        XPF_DEATH_ON_FAILURE(NT_SUCCESS(closeStatus));
-
-        sectionHandle = NULL;
-    }
     return status;
 }
 
@@ -348,8 +282,7 @@ HelperUmHookPluginUnMapSectionApc(
                   mapSectionData,
                   data->ProcessId);
 
-    /* First remove the data. */
-    data->PluginData->RemoveInjectionDataForPidSafe(data->ProcessId);
+    /* The data is kept until the process exits - our dll still asks for its hook set. */
     data = nullptr;
 
     if (mapSectionData != nullptr)
@@ -467,6 +400,69 @@ HelperUmHookPluginCleanupInject(
     }
 }
 
+static void XPF_API
+HelperUmHookPluginQueryPolicyContext(
+    _In_ PEPROCESS Process,
+    _Inout_ SysMon::InjectionPolicyContext& Context
+) noexcept(true)
+{
+    //
+    // Gathers what the injection policy needs to know about a process which is being created.
+    // Whatever can not be retrieved is left as it is - the policy sees the defaults.
+    //
+
+    XPF_MAX_PASSIVE_LEVEL();
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    Context.IsProtected = KmHelper::WrapperIsProtectedProcess(Process);
+
+    //
+    // The session and the integrity level come from the primary token.
+    //
+    PACCESS_TOKEN primaryToken = ::PsReferencePrimaryToken(Process);
+    if (nullptr != primaryToken)
+    {
+        ULONG sessionId = 0;
+        status = ::SeQuerySessionIdToken(primaryToken,
+                                         &sessionId);
+        if (NT_SUCCESS(status))
+        {
+            Context.SessionId = sessionId;
+        }
+
+        PTOKEN_MANDATORY_LABEL mandatoryLabel = nullptr;
+        status = ::SeQueryInformationToken(primaryToken,
+                                           TOKEN_INFORMATION_CLASS::TokenIntegrityLevel,
+                                           reinterpret_cast<PVOID*>(&mandatoryLabel));
+        if (NT_SUCCESS(status) && nullptr != mandatoryLabel)
+        {
+            /* The integrity level is the last sub authority of the label sid. */
+            const UCHAR subAuthorityCount = *::RtlSubAuthorityCountSid(mandatoryLabel->Label.Sid);
+            if (subAuthorityCount > 0)
+            {
+                Context.IntegrityLevel = *::RtlSubAuthoritySid(mandatoryLabel->Label.Sid,
+                                                               subAuthorityCount - 1);
+            }
+            ::ExFreePool(mandatoryLabel);
+        }
+
+        ::PsDereferencePrimaryToken(primaryToken);
+    }
+
+    //
+    // The signature level of the image is not exported on older systems.
+    //
+    PFUNC_PsGetProcessSignatureLevel apiPsGetProcessSignatureLevel = GlobalDataGetDynamicData()->ApiPsGetProcessSignatureLevel;
+    if (nullptr != apiPsGetProcessSignatureLevel)
+    {
+        /* The section signature level is not used, but the api writes it unconditionally. */
+        UCHAR sectionSignatureLevel = 0;
+        Context.SigningLevel = apiPsGetProcessSignatureLevel(Process,
+                                                             &sectionSignatureLevel);
+    }
+}
+
 //
 // -------------------------------------------------------------------------------------------------------------------
 // | ****************************************************************************************************************|
@@ -503,14 +499,24 @@ SysMon::UmHookPlugin::Create(
     SysMon::UmHookPlugin& umHookPlugin = (*plugin);
 
     //
-    // Create the lock.
+    // Create the process data shards, each with its lock.
     //
-    status = xpf::ReadWriteLock::Create(&umHookPlugin.m_ProcessDataLock);
-    if (!NT_SUCCESS(status))
+    for (size_t i = 0; i < SysMon::UmHookPlugin::PROCESS_DATA_SHARDS_COUNT; ++i)
     {
-        SysMonLogError("xpf::ReadWriteLock::Create failed with status = %!STATUS!",
-                       status);
-        return status;
+        status = xpf::ReadWriteLock::Create(&umHookPlugin.m_ProcessDataLocks[i]);
+        if (!NT_SUCCESS(status))
+        {
+            SysMonLogError("xpf::ReadWriteLock::Create failed with status = %!STATUS!",
+                           status);
+            return status;
+        }
+        status = umHookPlugin.m_ProcessData.Emplace(xpf::Vector<xpf::SharedPointer<SysMon::UmInjectionDllData>>{ SYSMON_PAGED_ALLOCATOR });
+        if (!NT_SUCCESS(status))
+        {
+            SysMonLogError("Failed to create the process data shard. status = %!STATUS!",
+                           status);
+            return status;
+        }
     }
 
     //
@@ -553,6 +559,26 @@ SysMon::UmHookPlugin::Create(
     SysMonLogInfo("Using x64 injection dll from path %S",
                   umHookPlugin.m_UmDllX64Path.View().Buffer());
 
+    //
+    // And the sections holding the paths - mapped read-only in the processes.
+    //
+    status = SysMon::InjectionSection::Create(umHookPlugin.m_UmDllWin32Path.View(),
+                                              &umHookPlugin.m_UmDllWin32Section);
+    if (!NT_SUCCESS(status))
+    {
+        SysMonLogError("Win32 InjectionSection::Create failed with status = %!STATUS!",
+                       status);
+        return status;
+    }
+    status = SysMon::InjectionSection::Create(umHookPlugin.m_UmDllX64Path.View(),
+                                              &umHookPlugin.m_UmDllX64Section);
+    if (!NT_SUCCESS(status))
+    {
+        SysMonLogError("x64 InjectionSection::Create failed with status = %!STATUS!",
+                       status);
+        return status;
+    }
+
     //
     // On windows 7 we have some extra dependencies on user32.dll.
     //
@@ -562,6 +588,141 @@ SysMon::UmHookPlugin::Create(
         umHookPlugin.m_IsWindows7 = true;
     }
 
+    //
+    // The injection policy - a multi string of rules, evaluated in order. See SysMon::InjectionPolicy.
+    // A malformed rule is ignored, the others still apply.
+    //
+    status = SysMon::InjectionPolicy::Create(&umHookPlugin.m_InjectionPolicy);
+    if (!NT_SUCCESS(status))
+    {
+        SysMonLogError("InjectionPolicy::Create failed with status = %!STATUS!",
+                       status);
+        return status;
+    }
+    {
+        xpf::Buffer policyBuffer{ SYSMON_PAGED_ALLOCATOR };
+
+        status = KmHelper::WrapperRegistryQueryValueKey(GlobalDataGetRegistryKey(),
+                                                        L"InjectionPolicy",
+                                                        REG_MULTI_SZ,
+                                                        &policyBuffer);
+        if (NT_SUCCESS(status))
+        {
+            const wchar_t* rules = static_cast<const wchar_t*>(policyBuffer.GetBuffer());
+            const size_t rulesLength = policyBuffer.GetSize() / sizeof(wchar_t);
+
+            size_t start = 0;
+            while (start < rulesLength && L'\0' != rules[start])
+            {
+                size_t end = start;
+                while (end < rulesLength && L'\0' != rules[end])
+                {
+                    end++;
+                }
+
+                status = (*umHookPlugin.m_InjectionPolicy).AddRule(xpf::StringView<wchar_t>(&rules[start], end - start));
+                if (!NT_SUCCESS(status))
+                {
+                    SysMonLogWarning("Ignoring injection policy rule. status = %!STATUS!",
+                                     status);
+                }
+                start = end + 1;
+            }
+        }
+    }
+
+    //
+    // The exports we resolve in the processes are remembered per image.
+    //
+    status = SysMon::ExportCache::Create(&umHookPlugin.m_ExportCache);
+    if (!NT_SUCCESS(status))
+    {
+        SysMonLogError("ExportCache::Create failed with status = %!STATUS!",
+                       status);
+        return status;
+    }
+
+    //
+    // Build the matcher of the trigger dlls - the known ones first.
+    //
+    status = SysMon::DllTriggerMatcher::Create(&umHookPlugin.m_TriggerMatcher);
+    if (!NT_SUCCESS(status))
+    {
+        SysMonLogError("DllTriggerMatcher::Create failed with status = %!STATUS!",
+                       status);
+        return status;
+    }
+    for (size_t i = 0; i < XPF_ARRAYSIZE(UM_INJECTION_DLL_PATH_FLAGS); ++i)
+    {
+        status = (*umHookPlugin.m_TriggerMatcher).AddTrigger(UM_INJECTION_DLL_PATH_FLAGS[i].DllPath,
+                                                             UM_INJECTION_DLL_PATH_FLAGS[i].DllFlag);
+        if (!NT_SUCCESS(status))
+        {
+            SysMonLogError("Failed to add trigger dll %S. status = %!STATUS!",
+                           UM_INJECTION_DLL_PATH_FLAGS[i].DllPath.Buffer(),
+                           status);
+            return status;
+        }
+    }
+
+    //
+    // Then the ones configured in registry - a multi string of path suffixes, which must be
+    // loaded before injecting. A suffix like "\advapi32.dll" matches both native and wow dlls.
+    //
+    {
+        xpf::Buffer triggerDllsBuffer{ SYSMON_PAGED_ALLOCATOR };
+
+        status = KmHelper::WrapperRegistryQueryValueKey(GlobalDataGetRegistryKey(),
+                                                        L"InjectionTriggerDlls",
+                                                        REG_MULTI_SZ,
+                                                        &triggerDllsBuffer);
+        if (NT_SUCCESS(status))
+        {
+            const wchar_t* triggerDlls = static_cast<const wchar_t*>(triggerDllsBuffer.GetBuffer());
+            const size_t triggerDllsLength = triggerDllsBuffer.GetSize() / sizeof(wchar_t);
+
+            size_t configuredCount = 0;
+            size_t start = 0;
+            while (start < triggerDllsLength && L'\0' != triggerDlls[start])
+            {
+                size_t end = start;
+                while (end < triggerDllsLength && L'\0' != triggerDlls[end])
+                {
+                    end++;
+                }
+
+                if (configuredCount >= UM_INJECTION_DATA_CONFIGURED_MAX_COUNT)
+                {
+                    SysMonLogWarning("Too many trigger dlls configured - the rest are ignored.");
+                    break;
+                }
+
+                const uint32_t configuredFlag = UM_INJECTION_DATA_CONFIGURED_FIRST_FLAG << configuredCount;
+                status = (*umHookPlugin.m_TriggerMatcher).AddTrigger(xpf::StringView<wchar_t>(&triggerDlls[start], end - start),
+                                                                     configuredFlag);
+                if (NT_SUCCESS(status))
+                {
+                    umHookPlugin.m_ConfiguredDlls |= configuredFlag;
+                    configuredCount++;
+                }
+                else
+                {
+                    SysMonLogWarning("Ignoring configured trigger dll. status = %!STATUS!",
+                                     status);
+                }
+                start = end + 1;
+            }
+        }
+    }
+
+    status = (*umHookPlugin.m_TriggerMatcher).Build();
+    if (!NT_SUCCESS(status))
+    {
+        SysMonLogError("DllTriggerMatcher::Build failed with status = %!STATUS!",
+                       status);
+        return status;
+    }
+
     //
     // Cast it as IPlugin.
     //
@@ -615,6 +776,11 @@ SysMon::UmHookPlugin::OnEvent(
             this->OnImageLoadEvent(Event);
             break;
         }
+        case static_cast<xpf::EVENT_ID>(SysMon::EventId::UmHookMessage):
+        {
+            this->OnUmHookEvent(Event);
+            break;
+        }
         default:
         {
             break;
@@ -640,7 +806,11 @@ SysMon::UmHookPlugin::OnProcessCreateEvent(
     NTSTATUS status = STATUS_UNSUCCESSFUL;
 
     PEPROCESS eProcess = nullptr;
-    bool isEprocessProtected = false;
+    uint64_t processCreateTime = 0;
+
+    SysMon::InjectionPolicyContext policyContext;
+    SysMon::InjectionPolicyDecision policyDecision;
+    xpf::SharedPointer<SysMon::ProcessData> parentProcess{ SYSMON_PAGED_ALLOCATOR };
 
     //
     // First get a specific event.
@@ -665,7 +835,9 @@ SysMon::UmHookPlugin::OnProcessCreateEvent(
     //
     // Now query what we need with eprocess.
     //
-    isEprocessProtected = KmHelper::WrapperIsProtectedProcess(eProcess);
+    HelperUmHookPluginQueryPolicyContext(eProcess,
+                                         policyContext);
+    processCreateTime = static_cast<uint64_t>(::PsGetProcessCreateTimeQuadPart(eProcess));
 
     //
     // Dereference the object - we are on process create routine.
@@ -676,12 +848,30 @@ SysMon::UmHookPlugin::OnProcessCreateEvent(
     eProcess = nullptr;
 
     //
-    // If process is protected, we bail.
+    // The parent is still alive while it creates the child, so the collector knows it.
+    // Only the direct parent is considered.
+    //
+    parentProcess = ProcessCollectorFindProcess(eventInstanceRef.ParentPid());
+    if (!parentProcess.IsEmpty())
+    {
+        const xpf::StringView<wchar_t> parentPath = parentProcess.Get()->ProcessPath().View();
+        policyContext.ParentImagePath = { parentPath.Buffer(), parentPath.BufferSize() };
+    }
+    const xpf::StringView<wchar_t> imagePath = eventInstanceRef.ProcessPath().View();
+    policyContext.ImagePath = { imagePath.Buffer(), imagePath.BufferSize() };
+    policyContext.IsMinimal = (0 == policyContext.ImagePath.Length);
+
+    //
+    // Now ask the policy. Protected processes are always skipped.
     //
-    if (isEprocessProtected)
+    (*this->m_InjectionPolicy).Evaluate(policyContext,
+                                        &policyDecision);
+    if (policyDecision.Action == SysMon::InjectionPolicyAction::kSkip)
     {
-        SysMonLogInfo("Process with pid %d is protected! Will not inject!",
-                      eventInstanceRef.ProcessPid());
+        SysMonLogInfo("Process with pid %d is excluded by the injection policy (rule %d, protected %d)! Will not inject!",
+                      eventInstanceRef.ProcessPid(),
+                      static_cast<uint32_t>(policyDecision.RuleNumber),
+                      policyContext.IsProtected ? 1 : 0);
         return;
     }
 
@@ -699,7 +889,9 @@ SysMon::UmHookPlugin::OnProcessCreateEvent(
     SysMon::UmInjectionDllData& dllData = (*dllDataPtr);
 
     dllData.ProcessId = eventInstanceRef.ProcessPid();
+    dllData.ProcessCreateTime = processCreateTime;
     dllData.LoadedDlls = 0;
+    dllData.HookSet = policyDecision.HookSet;
     dllData.PluginData = this;
 
     //
@@ -714,6 +906,7 @@ SysMon::UmHookPlugin::OnProcessCreateEvent(
     {
         dllData.RequiredDlls |= UM_INJECTION_DATA_SYSTEM32_KERNEL32_FLAG;
     }
+    dllData.RequiredDlls |= this->m_ConfiguredDlls;
     dllData.LoadDllRoutineName = "LoadLibraryExW";
 
     //
@@ -743,6 +936,7 @@ SysMon::UmHookPlugin::OnProcessCreateEvent(
 
         dllData.MatchingDll = UM_INJECTION_DATA_SYSWOW64_KERNEL32_FLAG;
         dllData.InjectedDllPath = this->m_UmDllWin32Path.View();
+        dllData.InjectedDllSection = xpf::AddressOf(*this->m_UmDllWin32Section);
     }
     else if (eventInstanceRef.ProcessArchitecture() == SysMon::ProcessArchitecture::x64)
     {
@@ -750,6 +944,7 @@ SysMon::UmHookPlugin::OnProcessCreateEvent(
 
         dllData.MatchingDll = UM_INJECTION_DATA_SYSTEM32_KERNEL32_FLAG;
         dllData.InjectedDllPath = this->m_UmDllX64Path.View();
+        dllData.InjectedDllSection = xpf::AddressOf(*this->m_UmDllX64Section);
     }
     else if (eventInstanceRef.ProcessArchitecture() == SysMon::ProcessArchitecture::x86)
     {
@@ -757,23 +952,27 @@ SysMon::UmHookPlugin::OnProcessCreateEvent(
 
         dllData.MatchingDll = UM_INJECTION_DATA_SYSTEM32_KERNEL32_FLAG;
         dllData.InjectedDllPath = this->m_UmDllWin32Path.View();
+        dllData.InjectedDllSection = xpf::AddressOf(*this->m_UmDllWin32Section);
     }
 
-    SysMonLogInfo("Prepared injection data for pid %d. Required DLLs: %d. Matching dll for LdrLoad: %d. ",
+    SysMonLogInfo("Prepared injection data for pid %d. Required DLLs: %d. Matching dll for LdrLoad: %d. Hook set: %d. ",
                   dllData.ProcessId,
                   dllData.RequiredDlls,
-                  dllData.MatchingDll);
+                  dllData.MatchingDll,
+                  dllData.HookSet);
 
     //
     // Now we extend our list with this structure.
     // If for some reason we did not received a process termination event and we have
     // a pid reuse, we overwrite the structure.
     //
-    xpf::ExclusiveLockGuard guard{*this->m_ProcessDataLock};
+    const size_t shardIndex = SysMon::UmHookPlugin::ShardIndex(eventInstanceRef.ProcessPid());
+
+    xpf::ExclusiveLockGuard guard{*this->m_ProcessDataLocks[shardIndex]};
     this->RemoveInjectionDataForPid(eventInstanceRef.ProcessPid());
 
     /* Not much we can do if this fails. Simply skip process. */
-    status = this->m_ProcessData.Emplace(dllDataPtr);
+    status = this->m_ProcessData[shardIndex].Emplace(dllDataPtr);
     if (!NT_SUCCESS(status))
     {
         SysMonLogError("Failed to insert injection data for pid %d. Required DLLs %d. status = %!STATUS!",
@@ -813,9 +1012,15 @@ SysMon::UmHookPlugin::OnProcessTerminateEvent(
                    eventInstanceRef.ProcessPid());
 
     //
-    // Erase injection data for this process.
+    // The apcs which did not get to run in this process are cancelled first,
+    // as the kernel ones are given the injection data as context.
+    //
+    this->m_ApcQueue.PurgeProcessApcs(eventInstanceRef.ProcessPid());
+
+    //
+    // Erase injection data for this process. Only its shard is locked.
     //
-    xpf::ExclusiveLockGuard guard{*this->m_ProcessDataLock};
+    xpf::ExclusiveLockGuard guard{*this->m_ProcessDataLocks[SysMon::UmHookPlugin::ShardIndex(eventInstanceRef.ProcessPid())]};
     this->RemoveInjectionDataForPid(eventInstanceRef.ProcessPid());
 
     SysMonLogTrace("Handled UmHookPlugin::OnProcessTerminateEvent for pid %d",
@@ -846,48 +1051,77 @@ SysMon::UmHookPlugin::OnImageLoadEvent(
                    eventInstanceRef.ProcessPid(),
                    eventInstanceRef.ImagePath().View().Buffer());
     //
-    // Take exclusive lock as we also might erase data.
+    // The images are loaded in the context of the process - so we can get its creation time.
+    // The injection needs the same context, so there is nothing to do otherwise.
     //
-    xpf::ExclusiveLockGuard guard{ *this->m_ProcessDataLock };
+    if (::PsGetCurrentProcessId() != ULongToHandle(eventInstanceRef.ProcessPid()))
+    {
+        return;
+    }
+    const uint64_t processCreateTime = static_cast<uint64_t>(::PsGetProcessCreateTimeQuadPart(::PsGetCurrentProcess()));
 
-    SysMon::UmInjectionDllData* injectionData = this->FindInjectionDataForPid(eventInstanceRef.ProcessPid());
+    //
+    // A shared lock on the shard of the process is enough - the data of the process is
+    // only erased under the exclusive lock, and its state is updated with interlocked operations.
+    //
+    xpf::SharedLockGuard guard{ *this->m_ProcessDataLocks[SysMon::UmHookPlugin::ShardIndex(eventInstanceRef.ProcessPid())] };
+
+    SysMon::UmInjectionDllData* injectionData = this->FindInjectionDataForPid(eventInstanceRef.ProcessPid(),
+                                                                              processCreateTime);
     if (nullptr != injectionData)
     {
         if (eventInstanceRef.ImagePath().View().Substring(gUmDllWin32Path, false, nullptr) ||
             eventInstanceRef.ImagePath().View().Substring(gUmDllx64Path,   false, nullptr))
         {
-            /* No point in keeping this data after we get our dll. */
-            HelperUmHookPluginCleanupInject(*injectionData);
+            /* No point in keeping the section mapped after we get our dll. Only one event cleans up. */
+            const uint32_t previousState = xpf::ApiAtomicCompareExchange(&injectionData->State,
+                                                                         static_cast<uint32_t>(SysMon::UmInjectionState::kCleaningUp),
+                                                                         static_cast<uint32_t>(SysMon::UmInjectionState::kInjecting));
+            if (previousState == static_cast<uint32_t>(SysMon::UmInjectionState::kInjecting))
+            {
+                HelperUmHookPluginCleanupInject(*injectionData);
+            }
         }
-        else
+        else if (injectionData->State == static_cast<uint32_t>(SysMon::UmInjectionState::kWaitingForDlls))
         {
-            /* Injection data is present - now check if the loaded dll is one of the known ones. */
-            uint32_t systemDllFlag = 0;
-            for (size_t i = 0; i < XPF_ARRAYSIZE(UM_INJECTION_DLL_PATH_FLAGS); ++i)
+            /* Injection data is present - now check if the loaded dll is one of the known ones. It may match several. */
+            const uint32_t systemDllFlag = (*this->m_TriggerMatcher).Match(eventInstanceRef.ImagePath().View());
+
+            /* If this dll is the one we need to find the routine, we lookup here - before marking it as loaded. */
+            if (0 != (systemDllFlag & injectionData->MatchingDll))
+            {
+                injectionData->LoadDllRoutine = (*this->m_ExportCache).FindExport(eventInstanceRef.ImagePath().View(),
+                                                                                  eventInstanceRef.ImageBase(),
+                                                                                  eventInstanceRef.ImageSize(),
+                                                                                  injectionData->LoadDllRoutineName.Buffer());
+            }
+
+            /* Other images of the same process may be loaded in parallel. */
+            uint32_t loadedDlls = injectionData->LoadedDlls;
+            while (true)
             {
-                if (eventInstanceRef.ImagePath().View().EndsWith(UM_INJECTION_DLL_PATH_FLAGS[i].DllPath, false))
+                const uint32_t previousDlls = xpf::ApiAtomicCompareExchange(&injectionData->LoadedDlls,
+                                                                            loadedDlls | systemDllFlag,
+                                                                            loadedDlls);
+                if (previousDlls == loadedDlls)
                 {
-                    systemDllFlag = UM_INJECTION_DLL_PATH_FLAGS[i].DllFlag;
+                    loadedDlls |= systemDllFlag;
                     break;
                 }
+                loadedDlls = previousDlls;
             }
-            injectionData->LoadedDlls |= systemDllFlag;
 
-            /* If this dll is the one we need to find the routine, we lookup here. */
-            if (injectionData->MatchingDll == systemDllFlag)
-            {
-                injectionData->LoadDllRoutine = KmHelper::HelperFindExport(eventInstanceRef.ImageBase(),
-                                                                           eventInstanceRef.ImageSize(),
-                                                                           true,
-                                                                           injectionData->LoadDllRoutineName.Buffer());
-            }
-            /* Inject data. Reset loaded and required dlls to prevent 2x inject apcs. */
-            if (injectionData->LoadedDlls == injectionData->RequiredDlls)
+            /* Inject data. Only the event which moves the state forward does it - to prevent 2x inject apcs.  */
+            /* Dlls which are not required for this process (a configured one, or a wow one) may be loaded too. */
+            if ((loadedDlls & injectionData->RequiredDlls) == injectionData->RequiredDlls)
             {
-                injectionData->LoadedDlls = 0;
-                injectionData->RequiredDlls = xpf::NumericLimits<uint32_t>::MaxValue();
-
-                HelperUmHookPluginInject(*injectionData);
+                const uint32_t previousState = xpf::ApiAtomicCompareExchange(&injectionData->State,
+                                                                             static_cast<uint32_t>(SysMon::UmInjectionState::kInjecting),
+                                                                             static_cast<uint32_t>(SysMon::UmInjectionState::kWaitingForDlls));
+                if (previousState == static_cast<uint32_t>(SysMon::UmInjectionState::kWaitingForDlls))
+                {
+                    HelperUmHookPluginInject(*injectionData);
+                }
             }
         }
     }
@@ -912,13 +1146,14 @@ SysMon::UmHookPlugin::RemoveInjectionDataForPid(
 {
     XPF_MAX_APC_LEVEL();
 
+    auto& shard = this->m_ProcessData[SysMon::UmHookPlugin::ShardIndex(ProcessPid)];
     size_t i = 0;
 
-    while (i < this->m_ProcessData.Size())
+    while (i < shard.Size())
     {
-        if (this->m_ProcessData[i].Get()->ProcessId == ProcessPid)
+        if (shard[i].Get()->ProcessId == ProcessPid)
         {
-            NTSTATUS status = this->m_ProcessData.Erase(i);
+            NTSTATUS status = shard.Erase(i);
             XPF_DEATH_ON_FAILURE(NT_SUCCESS(status));
         }
         else
@@ -928,6 +1163,66 @@ SysMon::UmHookPlugin::RemoveInjectionDataForPid(
     }
 }
 
+//
+// -------------------------------------------------------------------------------------------------------------------
+// | ****************************************************************************************************************|
+// |                                       SysMon::UmHookPlugin::OnUmHookEvent                                       |
+// | ****************************************************************************************************************|
+// -------------------------------------------------------------------------------------------------------------------
+//
+
+void XPF_API
+SysMon::UmHookPlugin::OnUmHookEvent(
+    _In_ const xpf::IEvent* Event
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+
+    //
+    // First get a specific event and the underlying buffer.
+    //
+    const SysMon::UmHookEvent& eventInstanceRef = *(static_cast<const SysMon::UmHookEvent*>(Event));
+
+    UM_KM_MESSAGE_HEADER* messageHeader = static_cast<UM_KM_MESSAGE_HEADER*>(eventInstanceRef.Message());
+    if (nullptr == messageHeader)
+    {
+        return;
+    }
+
+    //
+    // We only answer the hook set requests. The message is filled in place.
+    //
+    if (UM_KM_MESSAGE_TYPE_HOOK_SET_REQUEST != UmKmMessageGetType(messageHeader))
+    {
+        return;
+    }
+    if (messageHeader->BufferLength < sizeof(UM_KM_HOOK_SET_REQUEST) - sizeof(UM_KM_MESSAGE_HEADER))
+    {
+        return;
+    }
+    UM_KM_HOOK_SET_REQUEST* hookSetRequest = reinterpret_cast<UM_KM_HOOK_SET_REQUEST*>(messageHeader);
+
+    //
+    // The request comes from our dll, in the context of the process it was injected in.
+    // If we do not know about the process, the hook set is left as the dll sent it.
+    //
+    const uint32_t processId = HandleToUlong(::PsGetCurrentProcessId());
+    const uint64_t processCreateTime = static_cast<uint64_t>(::PsGetProcessCreateTimeQuadPart(::PsGetCurrentProcess()));
+
+    xpf::SharedLockGuard guard{ *this->m_ProcessDataLocks[SysMon::UmHookPlugin::ShardIndex(processId)] };
+
+    const SysMon::UmInjectionDllData* injectionData = this->FindInjectionDataForPid(processId,
+                                                                                    processCreateTime);
+    if (nullptr != injectionData)
+    {
+        hookSetRequest->HookSet = injectionData->HookSet;
+
+        SysMonLogTrace("Answered hook set request for pid %d with %d",
+                       processId,
+                       injectionData->HookSet);
+    }
+}
+
 //
 // -------------------------------------------------------------------------------------------------------------------
 // | ****************************************************************************************************************|
@@ -938,17 +1233,38 @@ SysMon::UmHookPlugin::RemoveInjectionDataForPid(
 
 SysMon::UmInjectionDllData* XPF_API
 SysMon::UmHookPlugin::FindInjectionDataForPid(
-    _In_ uint32_t ProcessPid
+    _In_ uint32_t ProcessPid,
+    _In_ uint64_t ProcessCreateTime
 ) noexcept(true)
 {
     XPF_MAX_APC_LEVEL();
 
-    for (size_t i = 0; i < this->m_ProcessData.Size(); ++i)
+    const auto& shard = this->m_ProcessData[SysMon::UmHookPlugin::ShardIndex(ProcessPid)];
+    for (size_t i = 0; i < shard.Size(); ++i)
     {
-        if (this->m_ProcessData[i].Get()->ProcessId == ProcessPid)
+        if (shard[i].Get()->ProcessId == ProcessPid && shard[i].Get()->ProcessCreateTime == ProcessCreateTime)
         {
-            return this->m_ProcessData[i].Get();
+            return shard[i].Get();
         }
     }
     return nullptr;
 }
+
+//
+// -------------------------------------------------------------------------------------------------------------------
+// | ****************************************************************************************************************|
+// |                                       SysMon::UmHookPlugin::ShardIndex                                          |
+// | ****************************************************************************************************************|
+// -------------------------------------------------------------------------------------------------------------------
+//
+
+size_t XPF_API
+SysMon::UmHookPlugin::ShardIndex(
+    _In_ uint32_t ProcessPid
+) noexcept(true)
+{
+    XPF_MAX_APC_LEVEL();
+
+    /* Process ids are multiples of 4 - drop the low bits which are always zero. */
+    return static_cast<size_t>(ProcessPid >> 2) % SysMon::UmHookPlugin::PROCESS_DATA_SHARDS_COUNT;
+}
@@ -17,6 +17,10 @@
 
 #include "PluginManager.hpp"
 #include "ApcQueue.hpp"
+#include "DllTriggerMatcher.hpp"
+#include "InjectionSection.hpp"
+#include "InjectionPolicy.hpp"
+#include "ExportCache.hpp"
 
 namespace SysMon
 {
@@ -25,6 +29,30 @@ namespace SysMon
  */
 class UmHookPlugin;
 
+/**
+ * @brief   The steps of the injection in a process. The state only moves forward,
+ *          and every transition is done with a compare exchange - so the image load
+ *          events of a process can update its data under a shared lock.
+ */
+enum class UmInjectionState : uint32_t
+{
+    /**
+     * @brief   Waiting for the required dlls to be loaded.
+     */
+    kWaitingForDlls = 0,
+
+    /**
+     * @brief   The map section apc was scheduled - waiting for our dll to be loaded.
+     */
+    kInjecting = 1,
+
+    /**
+     * @brief   Our dll was loaded - the unmap section apc was scheduled.
+     *          The data is kept until the process exits, as our dll asks for its HookSet.
+     */
+    kCleaningUp = 2,
+};
+
 /**
  * @brief   Describes the injection state for a given process.
  *          Once all dlls specified in RequiredDlls are loaded,
@@ -37,15 +65,32 @@ struct UmInjectionDllData
      */
     uint32_t    ProcessId = 0;
 
+    /**
+     * @brief   The creation time of the process. Together with the
+     *          process id, it identifies the process even if the pid is reused.
+     */
+    uint64_t    ProcessCreateTime = 0;
+
+    /**
+     * @brief   The step of the injection - one of the UmInjectionState.
+     */
+    volatile uint32_t   State = static_cast<uint32_t>(UmInjectionState::kWaitingForDlls);
+
     /**
      * @brief   The required dlls to be loaded.
      */
     uint32_t    RequiredDlls = 0xFFFFFFFF;
 
     /**
-     * @brief   Actually loaded dlls.
+     * @brief   Actually loaded dlls. Updated with interlocked operations.
      */
-    uint32_t    LoadedDlls = 0;
+    volatile uint32_t   LoadedDlls = 0;
+
+    /**
+     * @brief   The hooks our dll installs in the process - UM_KM_HOOK_SET_* flags.
+     *          Chosen by the injection policy when the process is created.
+     */
+    uint32_t    HookSet = UM_KM_HOOK_SET_ALL;
 
     /**
      * @brief   The flag in which the LoadLibrary must be searched.
@@ -75,6 +120,11 @@ struct UmInjectionDllData
      */
     xpf::StringView<wchar_t>    InjectedDllPath;
 
+    /**
+     * @brief   The shared section holding InjectedDllPath - it is mapped in the process.
+     */
+    SysMon::InjectionSection*   InjectedDllSection = nullptr;
+
     /**
      * @brief   The instance of the UmHookPlugin
      */
@@ -172,24 +222,6 @@ class UmHookPlugin final : public IPlugin
         return this->m_ApcQueue;
     }
 
-    /**
-     * @brief       Removes the details about injection for a given PID.
-     *              This routine acquires the process data lock.
-     *
-     * @param[in]   ProcessPid - The id of the process for which the details
-     *                            we want to remove.
-     *
-     * @return      Nothing.
-     */
-    inline void XPF_API
-    RemoveInjectionDataForPidSafe(
-        _In_ uint32_t ProcessPid
-    ) noexcept(true)
-    {
-        xpf::ExclusiveLockGuard guard{ *this->m_ProcessDataLock };
-        this->RemoveInjectionDataForPid(ProcessPid);
-    }
-
  private:
     /**
      * @brief               This method is used to handle a process creation event.
@@ -228,14 +260,28 @@ class UmHookPlugin final : public IPlugin
     ) noexcept(true);
 
     /**
-     * @brief       Removes the details about injection for a given PID.
+     * @brief               This method is used to handle a message from our injected dll.
+     *                      Only the hook set requests are answered here.
+     *
+     * @param[in] Event     - A const reference to the event.
+     *
+     * @return              - void.
+     */
+    void XPF_API
+    OnUmHookEvent(
+        _In_ const xpf::IEvent* Event
+    ) noexcept(true);
+
+    /**
+     * @brief       Removes the details about injection for a given PID - regardless of
+     *              the creation time, as the pid can not be reused by a live process.
      *
      * @param[in]   ProcessId - The id of the process for which the details
      *                          we want to remove.
      *
      * @return      Nothing.
      *
-     * @note        It is the caller responsibility to hold the m_ProcessDataLock exclusively.
+     * @note        It is the caller responsibility to hold the lock of the pid shard exclusively.
      */
     void XPF_API
     RemoveInjectionDataForPid(
@@ -243,36 +289,77 @@ class UmHookPlugin final : public IPlugin
     ) noexcept(true);
 
     /**
-     * @brief       Find the details about injection for a given PID.
+     * @brief       Find the details about injection for a given process.
      *
-     * @param[in]   ProcessId - The id of the process for which the details
-     *                          we want to find.
+     * @param[in]   ProcessId           - The id of the process for which the details
+     *                                    we want to find.
+     * @param[in]   ProcessCreateTime   - The creation time of the process.
      *
      * @return      nullptr if no details are found, otherwise the injection details
-     *              corresponding for the pid.
+     *              corresponding for the process.
      *
-     * @note        It is the caller responsibility to hold the m_ProcessDataLock.
+     * @note        It is the caller responsibility to hold the lock of the pid shard.
      */
     SysMon::UmInjectionDllData* XPF_API
     FindInjectionDataForPid(
+        _In_ uint32_t ProcessPid,
+        _In_ uint64_t ProcessCreateTime
+    ) noexcept(true);
+
+    /**
+     * @brief       Maps a process id to the shard holding its details.
+     *
+     * @param[in]   ProcessPid - The process id.
+     *
+     * @return      The index of the shard.
+     */
+    static size_t XPF_API
+    ShardIndex(
         _In_ uint32_t ProcessPid
     ) noexcept(true);
 
  private:
      /**
-      * @brief  Holds the state for all processes.
+      * @brief  How many shards hold the process data. Each one has its own lock,
+      *         so the image load events of different processes do not contend.
       */
-     xpf::Vector<xpf::SharedPointer<SysMon::UmInjectionDllData>> m_ProcessData{ SYSMON_PAGED_ALLOCATOR };
+     static constexpr size_t PROCESS_DATA_SHARDS_COUNT = 16;
+
+     /**
+      * @brief  Holds the state for all processes - split in shards by process id.
+      */
+     xpf::Vector<xpf::Vector<xpf::SharedPointer<SysMon::UmInjectionDllData>>> m_ProcessData{ SYSMON_PAGED_ALLOCATOR };
      /**
-      * @brief  Guards the process data.
+      * @brief  Guards the process data - one lock per shard.
       */
-     xpf::Optional<xpf::ReadWriteLock> m_ProcessDataLock;
+     xpf::Optional<xpf::ReadWriteLock> m_ProcessDataLocks[PROCESS_DATA_SHARDS_COUNT];
 
      /**
       * @brief  On windows 7 we have extra dependencies.
       */
      bool m_IsWindows7 = false;
 
+     /**
+      * @brief  Maps the path of a loaded image to its UM_INJECTION_DATA_* flag.
+      */
+     xpf::Optional<SysMon::DllTriggerMatcher> m_TriggerMatcher;
+     /**
+      * @brief  The flags of the trigger dlls configured in registry.
+      *         They are required in every process.
+      */
+     uint32_t m_ConfiguredDlls = 0;
+
+     /**
+      * @brief  Remembers where LoadLibraryExW is in the images seen before -
+      *         the same kernel32 is loaded in most processes.
+      */
+     xpf::Optional<SysMon::ExportCache> m_ExportCache;
+
+     /**
+      * @brief  Decides which processes are injected, and with which hooks.
+      */
+     xpf::Optional<SysMon::InjectionPolicy> m_InjectionPolicy;
+
      /**
       * @brief  The full DOS path of the win32 injection dll. 
       */
@@ -282,6 +369,13 @@ class UmHookPlugin final : public IPlugin
       */
      xpf::String<wchar_t> m_UmDllX64Path{ SYSMON_PAGED_ALLOCATOR };
 
+     /**
+      * @brief  The read-only sections holding the paths above, shared by all processes.
+      *         They are declared before the apc queue, so they outlive the pending apcs.
+      */
+     xpf::Optional<SysMon::InjectionSection> m_UmDllWin32Section;
+     xpf::Optional<SysMon::InjectionSection> m_UmDllX64Section;
+
      /**
       * @brief Used to store a list of all scheduled APCs in order
       *        to prevent the driver unload.
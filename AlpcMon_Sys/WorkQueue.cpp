@@ -13,6 +13,8 @@
 
 #include "precomp.hpp"
 
+#include "WorkerPool.hpp"
+
 #include "WorkQueue.hpp"
 #include "trace.hpp"
 
@@ -34,6 +36,10 @@ struct WorkQueueItem
      * @brief   The WORK_QUEUE_ITEM structure is used to post a work items to a system work queue. 
      */
     WORK_QUEUE_ITEM WorkItem = { 0 };
+    /**
+     * @brief   Used instead of the WorkItem when the driver's worker pool is available.
+     */
+    KmHelper::WorkerPoolItem PoolItem;
     /**
      * @brief   The Callback that the caller wants to execute.
      */
@@ -51,8 +57,58 @@ struct WorkQueueItem
      *          for the result.
      */
     KEVENT* Signal = nullptr;
+    /**
+     * @brief   When the item was enqueued - used for the wait time metrics.
+     */
+    uint64_t EnqueueTime = 0;
 };  // struct WorkQueueItem
 
+/**
+ * @brief           Adds a value to a counter updated from multiple threads.
+ *
+ * @param[in,out]   Counter - The counter.
+ * @param[in]       Value   - What to add.
+ *
+ * @return          Nothing.
+ */
+static void XPF_API
+WorkQueueAtomicAdd(
+    _Inout_ volatile uint64_t* Counter,
+    _In_ uint64_t Value
+) noexcept(true)
+{
+    XPF_MAX_DISPATCH_LEVEL();
+
+    auto compareExchange = [](volatile uint64_t* Destination, uint64_t Exchange, uint64_t Comparand) -> uint64_t
+                           {
+                               return xpf::ApiAtomicCompareExchange(Destination, Exchange, Comparand);
+                           };
+    KmHelper::WorkQueueStats::AtomicAdd(Counter, Value, compareExchange);
+}
+
+/**
+ * @brief           Raises a counter updated from multiple threads to at least a value.
+ *
+ * @param[in,out]   Counter - The counter.
+ * @param[in]       Value   - The candidate maximum.
+ *
+ * @return          Nothing.
+ */
+static void XPF_API
+WorkQueueAtomicMax(
+    _Inout_ volatile uint64_t* Counter,
+    _In_ uint64_t Value
+) noexcept(true)
+{
+    XPF_MAX_DISPATCH_LEVEL();
+
+    auto compareExchange = [](volatile uint64_t* Destination, uint64_t Exchange, uint64_t Comparand) -> uint64_t
+                           {
+                               return xpf::ApiAtomicCompareExchange(Destination, Exchange, Comparand);
+                           };
+    KmHelper::WorkQueueStats::AtomicMax(Counter, Value, compareExchange);
+}
+
 
 //
 // ************************************************************************************************
@@ -81,10 +137,17 @@ KmHelper::WorkQueue::~WorkQueue(
     XPF_MAX_PASSIVE_LEVEL();
 
     /* Wait untill all enqueued items are ran. */
-    while (xpf::ApiAtomicCompareExchange(&this->m_EnqueuedItems, uint32_t{ 0 }, uint32_t{ 0 }) != 0)
-    {
-        xpf::ApiSleep(500);
-    }
+    this->m_Rundown.WaitForRelease();
+
+    SysMonLogTrace("Work queue: enqueued %llu, completed %llu, max queued %llu, "
+                   "total wait %llu, max wait %llu, total run %llu, max run %llu (100ns)",
+                   this->m_EnqueuedItems,
+                   this->m_CompletedItems,
+                   this->m_MaxQueuedItems,
+                   this->m_TotalWaitTime,
+                   this->m_MaxWaitTime,
+                   this->m_TotalRunTime,
+                   this->m_MaxRunTime);
 }
 
 _Use_decl_annotations_
@@ -99,12 +162,37 @@ KmHelper::WorkQueue::WorkQueueWorkItemRoutine(
     auto item = XPF_CONTAINING_RECORD(Parameter, WorkQueueItem, WorkItem);
     if (item)
     {
+        KmHelper::WorkQueue* itemQueue = item->WorkQueue;
+
+        const uint64_t startTime = xpf::ApiCurrentTime();
+        const uint64_t waitTime = KmHelper::WorkQueueStats::Elapsed(item->EnqueueTime, startTime);
+        if (itemQueue)
+        {
+            xpf::ApiAtomicDecrement(&itemQueue->m_QueuedItems);
+            xpf::ApiAtomicIncrement(&itemQueue->m_RunningItems);
+            xpf::ApiAtomicIncrement(&itemQueue->m_WaitTimeHistogram[KmHelper::WorkQueueStats::HistogramBucket(waitTime)]);
+            WorkQueueAtomicAdd(&itemQueue->m_TotalWaitTime, waitTime);
+            WorkQueueAtomicMax(&itemQueue->m_MaxWaitTime, waitTime);
+        }
+
         /* Invoke the callback. */
         if (item->Callback)
         {
             item->Callback(item->Context);
         }
 
+        /* Account the run before the queue can go away - it waits for the release below. */
+        const uint64_t endTime = xpf::ApiCurrentTime();
+        const uint64_t runTime = KmHelper::WorkQueueStats::Elapsed(startTime, endTime);
+        if (itemQueue)
+        {
+            xpf::ApiAtomicDecrement(&itemQueue->m_RunningItems);
+            xpf::ApiAtomicIncrement(&itemQueue->m_CompletedItems);
+            xpf::ApiAtomicIncrement(&itemQueue->m_RunTimeHistogram[KmHelper::WorkQueueStats::HistogramBucket(runTime)]);
+            WorkQueueAtomicAdd(&itemQueue->m_TotalRunTime, runTime);
+            WorkQueueAtomicMax(&itemQueue->m_MaxRunTime, runTime);
+        }
+
         /* Notify the caller. */
         if (item->Signal)
         {
@@ -119,7 +207,9 @@ KmHelper::WorkQueue::WorkQueueWorkItemRoutine(
         if (queue)
         {
             queue->m_WorkQueueAllocator.FreeMemory(item);
-            xpf::ApiAtomicDecrement(&queue->m_EnqueuedItems);
+
+            /* This may let the queue go away - don't touch it anymore. */
+            queue->m_Rundown.Release();
         }
     }
 }
@@ -135,7 +225,7 @@ KmHelper::WorkQueue::WorkQueueWorkItemRoutine(
  */
 XPF_SECTION_DEFAULT;
 
-void XPF_API
+NTSTATUS XPF_API
 KmHelper::WorkQueue::EnqueueWork(
     _In_ xpf::thread::Callback Callback,
     _In_opt_ xpf::thread::CallbackArgument Argument,
@@ -148,8 +238,11 @@ KmHelper::WorkQueue::EnqueueWork(
     WorkQueueItem* item = nullptr;
     KEVENT signal = { 0 };
 
-    /* We're enqueing another item. */
-    xpf::ApiAtomicIncrement(&this->m_EnqueuedItems);
+    /* We're enqueing another item - unless the queue is already gone. */
+    if (!this->m_Rundown.Acquire())
+    {
+        return STATUS_TOO_LATE;
+    }
 
     /* Allocate an item. */
     while (item == nullptr)
@@ -170,6 +263,12 @@ KmHelper::WorkQueue::EnqueueWork(
     item->Callback = Callback;
     item->Context = Argument;
     item->WorkQueue = this;
+    item->EnqueueTime = xpf::ApiCurrentTime();
+
+    /* The item is counted as queued until its routine starts. */
+    xpf::ApiAtomicIncrement(&this->m_EnqueuedItems);
+    WorkQueueAtomicMax(&this->m_MaxQueuedItems,
+                       xpf::ApiAtomicIncrement(&this->m_QueuedItems));
 
     /* Caller wants us to wait. */
     if (Wait)
@@ -182,10 +281,15 @@ KmHelper::WorkQueue::EnqueueWork(
         item->Signal = &signal;
     }
 
+    /* Prefer our own workers - the system ones are shared with the rest of the OS. */
+    item->PoolItem.Routine = (PWORKER_THREAD_ROUTINE)KmHelper::WorkQueue::WorkQueueWorkItemRoutine;
+    item->PoolItem.Parameter = item;
+
     /* Apis are marked deprecated. */
     #pragma warning(push)
     #pragma warning(disable: 4996)
 
+    if (!WorkerPoolSubmit(&item->PoolItem))
     {
         /* Initialize the work item. */
         ::ExInitializeWorkItem(&item->WorkItem,
@@ -214,4 +318,32 @@ KmHelper::WorkQueue::EnqueueWork(
                                                   NULL);
         XPF_DEATH_ON_FAILURE(NT_SUCCESS(status));
     }
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+void XPF_API
+KmHelper::WorkQueue::QueryMetrics(
+    _Out_ KmHelper::WorkQueueMetrics* Metrics
+) noexcept(true)
+{
+    /* Only plain reads - this can be called at any IRQL. */
+    XPF_MAX_DISPATCH_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != Metrics);
+
+    Metrics->QueuedItems = this->m_QueuedItems;
+    Metrics->MaxQueuedItems = this->m_MaxQueuedItems;
+    Metrics->RunningItems = this->m_RunningItems;
+    Metrics->EnqueuedItems = this->m_EnqueuedItems;
+    Metrics->CompletedItems = this->m_CompletedItems;
+    Metrics->TotalWaitTime = this->m_TotalWaitTime;
+    Metrics->MaxWaitTime = this->m_MaxWaitTime;
+    Metrics->TotalRunTime = this->m_TotalRunTime;
+    Metrics->MaxRunTime = this->m_MaxRunTime;
+
+    for (size_t i = 0; i < KmHelper::WorkQueueMetrics::HISTOGRAM_BUCKETS; ++i)
+    {
+        Metrics->WaitTimeHistogram[i] = this->m_WaitTimeHistogram[i];
+        Metrics->RunTimeHistogram[i] = this->m_RunTimeHistogram[i];
+    }
 }
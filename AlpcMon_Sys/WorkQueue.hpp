@@ -14,13 +14,74 @@
 #pragma once
 
 #include "precomp.hpp"
+#include "RundownProtection.hpp"
+#include "WorkQueueStats.hpp"
 
 namespace KmHelper
 {
 /**
- * @brief   In Windows KM we have a more light-weight mechanism instead of using threadpools.
- *          This is a work-queue where we just insert items and they are processed on already
- *          spawned system threads. This is more optimal as the OS takes care for us of synchronization.
+ * @brief   A snapshot of the work queue counters.
+ *          Times are in the units returned by xpf::ApiCurrentTime (100ns).
+ */
+struct WorkQueueMetrics
+{
+    /**
+     * @brief   How many buckets the histograms have - see KmHelper::WorkQueueStats.
+     */
+    static constexpr size_t HISTOGRAM_BUCKETS = KmHelper::WorkQueueStats::HISTOGRAM_BUCKETS;
+
+    /**
+     * @brief   How many items were enqueued and did not start yet.
+     */
+    uint64_t QueuedItems = 0;
+
+    /**
+     * @brief   The largest number of items which were waiting at once.
+     */
+    uint64_t MaxQueuedItems = 0;
+
+    /**
+     * @brief   How many items are running right now.
+     */
+    uint64_t RunningItems = 0;
+
+    /**
+     * @brief   How many items were enqueued.
+     */
+    uint64_t EnqueuedItems = 0;
+
+    /**
+     * @brief   How many items finished running.
+     */
+    uint64_t CompletedItems = 0;
+
+    /**
+     * @brief   The total and the longest time an item waited before starting.
+     */
+    uint64_t TotalWaitTime = 0;
+    uint64_t MaxWaitTime = 0;
+
+    /**
+     * @brief   The total and the longest time an item ran.
+     */
+    uint64_t TotalRunTime = 0;
+    uint64_t MaxRunTime = 0;
+
+    /**
+     * @brief   The distribution of the time from enqueue to start.
+     */
+    uint64_t WaitTimeHistogram[HISTOGRAM_BUCKETS] = { 0 };
+
+    /**
+     * @brief   The distribution of the time the items ran.
+     */
+    uint64_t RunTimeHistogram[HISTOGRAM_BUCKETS] = { 0 };
+};  // struct WorkQueueMetrics
+
+/**
+ * @brief   This is a work-queue where we just insert items and they are processed on the
+ *          driver's worker pool (see KmHelper::WorkerPool). Until the pool is created, the
+ *          items are processed on the already spawned system threads.
  */
 class WorkQueue final
 {
@@ -31,7 +92,7 @@ class WorkQueue final
      WorkQueue(void) noexcept(true);
 
      /**
-      * @brief  Default destructor.
+      * @brief  Default destructor. Waits for the enqueued items to run.
       */
      ~WorkQueue(void) noexcept(true);
 
@@ -55,14 +116,30 @@ class WorkQueue final
       *             directly called from the work item. This is required as we need
       *             to free some resources.
       *
-      * @return     Nothing. This API is guaranteed to succeed.
+      * @return     STATUS_TOO_LATE if the queue is running down and its items already
+      *             drained - the callback will not run, or STATUS_SUCCESS otherwise.
       */
-     void XPF_API
+     _Must_inspect_result_
+     NTSTATUS XPF_API
      EnqueueWork(
         _In_ xpf::thread::Callback Callback,
         _In_opt_ xpf::thread::CallbackArgument Argument,
         _In_ bool Wait
      ) noexcept(true);
+
+     /**
+      * @brief      Takes a snapshot of the queue counters. The counters are updated
+      *             without a lock, so they may be slightly out of sync with each other.
+      *
+      * @param[out] Metrics - The current counters.
+      *
+      * @return     Nothing.
+      */
+     _IRQL_requires_max_(DISPATCH_LEVEL)
+     void XPF_API
+     QueryMetrics(
+        _Out_ KmHelper::WorkQueueMetrics* Metrics
+     ) noexcept(true);
  private:
      /**
       * @brief      We are using a separated callback so we can have better control
@@ -80,6 +157,21 @@ class WorkQueue final
 
  private:
     xpf::LookasideListAllocator m_WorkQueueAllocator;
-    volatile uint32_t m_EnqueuedItems = 0;
+    KmHelper::RundownProtection m_Rundown;
+
+    /**
+     * @brief   Updated with interlocked operations - items are enqueued at DISPATCH_LEVEL.
+     */
+    volatile uint64_t m_QueuedItems = 0;
+    volatile uint64_t m_MaxQueuedItems = 0;
+    volatile uint64_t m_RunningItems = 0;
+    volatile uint64_t m_EnqueuedItems = 0;
+    volatile uint64_t m_CompletedItems = 0;
+    volatile uint64_t m_TotalWaitTime = 0;
+    volatile uint64_t m_MaxWaitTime = 0;
+    volatile uint64_t m_TotalRunTime = 0;
+    volatile uint64_t m_MaxRunTime = 0;
+    volatile uint64_t m_WaitTimeHistogram[KmHelper::WorkQueueMetrics::HISTOGRAM_BUCKETS] = { 0 };
+    volatile uint64_t m_RunTimeHistogram[KmHelper::WorkQueueMetrics::HISTOGRAM_BUCKETS] = { 0 };
 };  // class WorkQueue
 };  // namespace KmHelper
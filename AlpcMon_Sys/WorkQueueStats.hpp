@@ -0,0 +1,142 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/WorkQueueStats.hpp
+ *
+ * @brief       In this file we define how the work queue metrics are accumulated -
+ *              the duration histograms, the totals and the maxima.
+ *              KmHelper::WorkQueue keeps the counters, this updates them.
+ *
+ * @note        This header is portable on purpose - it does not depend on the kernel
+ *              or on xpf, so it is also built and tested on linux. See the Tests folder.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+namespace KmHelper
+{
+namespace WorkQueueStats
+{
+/**
+ * @brief   How many buckets the histograms have. Bucket 0 counts the durations
+ *          below 100us, and each next bucket covers ten times more - so the
+ *          last one counts everything above 100 seconds.
+ */
+static constexpr size_t HISTOGRAM_BUCKETS = 8;
+
+/**
+ * @brief   The upper limit of bucket 0, in 100ns units - 100us.
+ */
+static constexpr uint64_t HISTOGRAM_FIRST_LIMIT = 1000;
+
+/**
+ * @brief       Finds the histogram bucket of a duration.
+ *
+ * @param[in]   Duration - In 100ns units.
+ *
+ * @return      The index of the bucket.
+ */
+inline size_t
+HistogramBucket(
+    uint64_t Duration
+) noexcept(true)
+{
+    /* 100us, then a decade per bucket. */
+    uint64_t limit = KmHelper::WorkQueueStats::HISTOGRAM_FIRST_LIMIT;
+    size_t bucket = 0;
+
+    while (bucket + 1 < KmHelper::WorkQueueStats::HISTOGRAM_BUCKETS && Duration >= limit)
+    {
+        limit *= 10;
+        bucket++;
+    }
+    return bucket;
+}
+
+/**
+ * @brief       Computes the time between two readings of the clock.
+ *
+ * @param[in]   Start   - The first reading.
+ * @param[in]   End     - The second reading.
+ *
+ * @return      The elapsed time. 0 if the clock went backwards - the system time can be adjusted.
+ */
+inline uint64_t
+Elapsed(
+    uint64_t Start,
+    uint64_t End
+) noexcept(true)
+{
+    return (End > Start) ? (End - Start)
+                         : 0;
+}
+
+/**
+ * @brief           Adds a value to a counter updated from multiple threads.
+ *
+ * @param[in,out]   Counter         - The counter.
+ * @param[in]       Value           - What to add.
+ * @param[in]       CompareExchange - uint64_t CompareExchange(volatile uint64_t* Destination,
+ *                                    uint64_t Exchange, uint64_t Comparand). Returns the previous value.
+ *
+ * @return          Nothing.
+ */
+template <class Exchanger>
+inline void
+AtomicAdd(
+    volatile uint64_t* Counter,
+    uint64_t Value,
+    Exchanger& CompareExchange
+) noexcept(true)
+{
+    uint64_t current = *Counter;
+    while (true)
+    {
+        const uint64_t previous = CompareExchange(Counter, current + Value, current);
+        if (previous == current)
+        {
+            return;
+        }
+        current = previous;
+    }
+}
+
+/**
+ * @brief           Raises a counter updated from multiple threads to at least a value.
+ *
+ * @param[in,out]   Counter         - The counter.
+ * @param[in]       Value           - The candidate maximum.
+ * @param[in]       CompareExchange - The same as for AtomicAdd.
+ *
+ * @return          Nothing.
+ */
+template <class Exchanger>
+inline void
+AtomicMax(
+    volatile uint64_t* Counter,
+    uint64_t Value,
+    Exchanger& CompareExchange
+) noexcept(true)
+{
+    uint64_t current = *Counter;
+    while (current < Value)
+    {
+        const uint64_t previous = CompareExchange(Counter, Value, current);
+        if (previous == current)
+        {
+            return;
+        }
+        current = previous;
+    }
+}
+};  // namespace WorkQueueStats
+};  // namespace KmHelper
@@ -0,0 +1,353 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/WorkerPool.cpp
+ *
+ * @brief       In this file we define the pool of worker threads owned by the driver.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "precomp.hpp"
+
+#include "globals.hpp"
+#include "RegistryUtils.hpp"
+
+#include "WorkerPool.hpp"
+#include "trace.hpp"
+
+
+/**
+ * @brief   Global instance of the worker pool. It is read at DISPATCH_LEVEL,
+ *          so it must not be paged.
+ */
+static xpf::Optional<KmHelper::WorkerPool>* gWorkerPool = nullptr;
+
+
+//
+// ************************************************************************************************
+// *                                This contains the paged section code.                         *
+// ************************************************************************************************
+//
+
+/**
+ * @brief   Everything from belows goes into paged section.
+ */
+XPF_SECTION_PAGED;
+
+KmHelper::WorkerPool::~WorkerPool(
+    void
+) noexcept(true)
+{
+    /* We should run down the pool at passive. */
+    XPF_MAX_PASSIVE_LEVEL();
+
+    /* Wake every worker - they exit once there is nothing left to run. */
+    this->m_IsRunningDown = true;
+    if (this->m_WorkersCount > 0)
+    {
+        ::KeReleaseSemaphore(&this->m_WorkSignal,
+                             IO_NO_INCREMENT,
+                             static_cast<LONG>(this->m_WorkersCount),
+                             FALSE);
+    }
+    for (size_t i = 0; i < this->m_WorkersCount; ++i)
+    {
+        this->m_Threads[i].Join();
+    }
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+KmHelper::WorkerPool::Create(
+    _In_ uint32_t ThreadsCount,
+    _In_ KPRIORITY Priority,
+    _Out_ xpf::Optional<KmHelper::WorkerPool>* Pool
+) noexcept(true)
+{
+    XPF_MAX_PASSIVE_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != Pool);
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    /* Preinit output. */
+    Pool->Reset();
+    Pool->Emplace();
+
+    KmHelper::WorkerPool& pool = (*(*Pool));
+
+    /* Keep the threads within sane limits - dynamic priorities only. */
+    if (ThreadsCount < 1)
+    {
+        ThreadsCount = 1;
+    }
+    if (ThreadsCount > KmHelper::WorkerPool::MAX_WORKERS_COUNT)
+    {
+        ThreadsCount = static_cast<uint32_t>(KmHelper::WorkerPool::MAX_WORKERS_COUNT);
+    }
+    if (Priority <= LOW_PRIORITY)
+    {
+        Priority = LOW_PRIORITY + 1;
+    }
+    if (Priority >= LOW_REALTIME_PRIORITY)
+    {
+        Priority = LOW_REALTIME_PRIORITY - 1;
+    }
+    pool.m_Priority = Priority;
+
+    ::KeInitializeSemaphore(&pool.m_WorkSignal,
+                            0,
+                            MAXLONG);
+    for (size_t i = 0; i < KmHelper::WorkerPool::MAX_WORKERS_COUNT; ++i)
+    {
+        ::InitializeListHead(&pool.m_Deques[i]);
+    }
+
+    /* Start the workers. The ones already started are stopped by the destructor on failure. */
+    for (size_t i = 0; i < ThreadsCount; ++i)
+    {
+        pool.m_Workers[i].Pool = &pool;
+        pool.m_Workers[i].Index = i;
+
+        status = pool.m_Threads[i].Run(KmHelper::WorkerPool::WorkerThreadRoutine,
+                                       &pool.m_Workers[i]);
+        if (!NT_SUCCESS(status))
+        {
+            Pool->Reset();
+            return status;
+        }
+        pool.m_WorkersCount++;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+void XPF_API
+KmHelper::WorkerPool::WorkerThreadRoutine(
+    _In_opt_ xpf::thread::CallbackArgument Argument
+) noexcept(true)
+{
+    /* This routine runs on our own system thread. */
+    XPF_MAX_PASSIVE_LEVEL();
+
+    KmHelper::WorkerPoolWorker* worker = static_cast<KmHelper::WorkerPoolWorker*>(Argument);
+    if (nullptr == worker || nullptr == worker->Pool)
+    {
+        XPF_ASSERT(false);
+        return;
+    }
+    KmHelper::WorkerPool* pool = worker->Pool;
+
+    ::KeSetPriorityThread(::KeGetCurrentThread(),
+                          pool->m_Priority);
+
+    while (true)
+    {
+        /* We're not expecting this to fail. */
+        NTSTATUS status = ::KeWaitForSingleObject(&pool->m_WorkSignal,
+                                                  KWAIT_REASON::Executive,
+                                                  KernelMode,
+                                                  FALSE,
+                                                  NULL);
+        XPF_DEATH_ON_FAILURE(NT_SUCCESS(status));
+
+        while (true)
+        {
+            KmHelper::WorkerPoolItem* item = pool->TakeItem(worker->Index);
+            if (nullptr != item)
+            {
+                /* The item belongs to the caller - it may be freed by the routine. */
+                item->Routine(item->Parameter);
+                break;
+            }
+            if (pool->m_IsRunningDown)
+            {
+                return;
+            }
+
+            /* The item we were woken for was taken by another worker, */
+            /* so the one that worker was woken for is already queued - look again. */
+            xpf::ApiYieldProcesor();
+        }
+    }
+}
+
+_Use_decl_annotations_
+NTSTATUS XPF_API
+WorkerPoolCreate(
+    void
+) noexcept(true)
+{
+    /* The routine can be called only at PASSIVE_LEVEL. */
+    XPF_MAX_PASSIVE_LEVEL();
+
+    /* This should not be called twice. */
+    XPF_DEATH_ON_FAILURE(gWorkerPool == nullptr);
+
+    xpf::Buffer threadsCountBuffer{ SYSMON_PAGED_ALLOCATOR };
+    xpf::Buffer threadsPriorityBuffer{ SYSMON_PAGED_ALLOCATOR };
+
+    uint32_t threadsCount = KmHelper::WorkerPool::DEFAULT_WORKERS_COUNT;
+    KPRIORITY threadsPriority = KmHelper::WorkerPool::DEFAULT_WORKERS_PRIORITY;
+
+    SysMonLogInfo("Creating worker pool...");
+
+    /* The number of threads and their priority can be overwritten from registry. */
+    NTSTATUS status = KmHelper::WrapperRegistryQueryValueKey(GlobalDataGetRegistryKey(),
+                                                             L"WorkerThreadsCount",
+                                                             REG_DWORD,
+                                                             &threadsCountBuffer);
+    if (NT_SUCCESS(status) && threadsCountBuffer.GetSize() >= sizeof(uint32_t))
+    {
+        threadsCount = *static_cast<const uint32_t*>(threadsCountBuffer.GetBuffer());
+    }
+    else
+    {
+        /* By default, no more threads than processors. */
+        const uint32_t processorsCount = static_cast<uint32_t>(::KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS));
+        if (processorsCount < threadsCount)
+        {
+            threadsCount = processorsCount;
+        }
+    }
+    status = KmHelper::WrapperRegistryQueryValueKey(GlobalDataGetRegistryKey(),
+                                                    L"WorkerThreadsPriority",
+                                                    REG_DWORD,
+                                                    &threadsPriorityBuffer);
+    if (NT_SUCCESS(status) && threadsPriorityBuffer.GetSize() >= sizeof(uint32_t))
+    {
+        threadsPriority = static_cast<KPRIORITY>(*static_cast<const uint32_t*>(threadsPriorityBuffer.GetBuffer()));
+    }
+
+    gWorkerPool = static_cast<xpf::Optional<KmHelper::WorkerPool>*>(xpf::MemoryAllocator::AllocateMemory(sizeof(xpf::Optional<KmHelper::WorkerPool>)));
+    if (nullptr == gWorkerPool)
+    {
+        SysMonLogError("Insufficient resources to create the worker pool!");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    xpf::MemoryAllocator::Construct(gWorkerPool);
+
+    status = KmHelper::WorkerPool::Create(threadsCount,
+                                          threadsPriority,
+                                          gWorkerPool);
+    if (!NT_SUCCESS(status))
+    {
+        SysMonLogError("Failed to create the worker pool %!STATUS!",
+                       status);
+        WorkerPoolDestroy();
+        return status;
+    }
+
+    SysMonLogInfo("Successfully created the worker pool!");
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+void XPF_API
+WorkerPoolDestroy(
+    void
+) noexcept(true)
+{
+    /* The routine can be called only at PASSIVE_LEVEL. */
+    XPF_MAX_PASSIVE_LEVEL();
+
+    SysMonLogInfo("Destroying the worker pool...");
+
+    if (nullptr != gWorkerPool)
+    {
+        /* Nothing is submitted anymore - so no one reads the pointer. */
+        xpf::Optional<KmHelper::WorkerPool>* pool = gWorkerPool;
+        gWorkerPool = nullptr;
+
+        /* Destroy the object. */
+        xpf::MemoryAllocator::Destruct(pool);
+        /* Free memory. */
+        xpf::MemoryAllocator::FreeMemory(pool);
+    }
+
+    SysMonLogInfo("Successfully destroyed the worker pool!");
+}
+
+//
+// ************************************************************************************************
+// *                                This contains the nonpaged section code.                      *
+// ************************************************************************************************
+//
+
+/**
+ * @brief   Everything from belows goes into default section.
+ */
+XPF_SECTION_DEFAULT;
+
+_Use_decl_annotations_
+void XPF_API
+KmHelper::WorkerPool::Submit(
+    _Inout_ KmHelper::WorkerPoolItem* Item
+) noexcept(true)
+{
+    /* We can submit at any IRQL. */
+    XPF_MAX_DISPATCH_LEVEL();
+    XPF_DEATH_ON_FAILURE(nullptr != Item);
+
+    /* The items stay close to the processor which submitted them. */
+    const size_t index = ::KeGetCurrentProcessorNumberEx(NULL) % this->m_WorkersCount;
+    {
+        xpf::ExclusiveLockGuard guard{ this->m_DequeLocks[index] };
+        ::InsertTailList(&this->m_Deques[index],
+                         &Item->ListEntry);
+    }
+
+    /* Wake a worker - not necessarily the owner, it steals if its deque is empty. */
+    ::KeReleaseSemaphore(&this->m_WorkSignal,
+                         IO_NO_INCREMENT,
+                         1,
+                         FALSE);
+}
+
+_Use_decl_annotations_
+KmHelper::WorkerPoolItem* XPF_API
+KmHelper::WorkerPool::TakeItem(
+    _In_ size_t WorkerIndex
+) noexcept(true)
+{
+    XPF_MAX_DISPATCH_LEVEL();
+
+    /* First our own deque, newest item first. */
+    for (size_t i = 0; i < this->m_WorkersCount; ++i)
+    {
+        const size_t index = (WorkerIndex + i) % this->m_WorkersCount;
+        xpf::ExclusiveLockGuard guard{ this->m_DequeLocks[index] };
+
+        if (::IsListEmpty(&this->m_Deques[index]))
+        {
+            continue;
+        }
+
+        /* The owner takes from the tail for locality, the thieves take the oldest from the head. */
+        PLIST_ENTRY entry = (0 == i) ? ::RemoveTailList(&this->m_Deques[index])
+                                     : ::RemoveHeadList(&this->m_Deques[index]);
+        return XPF_CONTAINING_RECORD(entry, KmHelper::WorkerPoolItem, ListEntry);
+    }
+    return nullptr;
+}
+
+_Use_decl_annotations_
+bool XPF_API
+WorkerPoolSubmit(
+    _Inout_ KmHelper::WorkerPoolItem* Item
+) noexcept(true)
+{
+    /* We can submit at any IRQL. */
+    XPF_MAX_DISPATCH_LEVEL();
+
+    if (nullptr == gWorkerPool || !gWorkerPool->HasValue())
+    {
+        return false;
+    }
+    (*(*gWorkerPool)).Submit(Item);
+    return true;
+}
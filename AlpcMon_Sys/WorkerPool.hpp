@@ -0,0 +1,245 @@
+/**
+ * @file        ALPC-Tools/AlpcMon_Sys/WorkerPool.hpp
+ *
+ * @brief       In this file we define the pool of worker threads owned by the driver.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#pragma once
+
+#include "precomp.hpp"
+
+namespace KmHelper
+{
+/**
+ * @brief   Forward definition - declared below.
+ */
+class WorkerPool;
+
+/**
+ * @brief   An item which can be submitted to the worker pool. It is embedded
+ *          in the caller structure - the pool does not allocate anything.
+ *
+ * @note    The item must be allocated from non paged pool, as it is
+ *          submitted at max DISPATCH_LEVEL.
+ */
+struct WorkerPoolItem
+{
+    /**
+     * @brief   Links the item in the deque of a worker.
+     */
+    LIST_ENTRY ListEntry = { 0 };
+    /**
+     * @brief   The routine to be executed on the worker thread.
+     */
+    PWORKER_THREAD_ROUTINE Routine = nullptr;
+    /**
+     * @brief   The parameter passed to the Routine.
+     */
+    PVOID Parameter = nullptr;
+};  // struct WorkerPoolItem
+
+/**
+ * @brief   The context of a worker thread.
+ */
+struct WorkerPoolWorker
+{
+    /**
+     * @brief   The pool to which the worker belongs.
+     */
+    KmHelper::WorkerPool* Pool = nullptr;
+    /**
+     * @brief   The index of the deque owned by the worker.
+     */
+    size_t Index = 0;
+};  // struct WorkerPoolWorker
+
+/**
+ * @brief   A pool of system threads owned by the driver. The system worker threads are
+ *          shared with the rest of the OS, so our symbol and hash work would compete with
+ *          the file system and memory manager work items on busy machines.
+ *
+ *          Each worker owns a deque. An item is pushed on the deque of the worker matching
+ *          the current processor. A worker takes the newest item from the tail of its own
+ *          deque, while its data is still in cache, and, when that one is empty, steals the
+ *          oldest item from the head of the other deques.
+ */
+class WorkerPool final
+{
+ private:
+    /**
+     * @brief  Default constructor - private as Create
+     *         method must be used to instantiate an object.
+     */
+    WorkerPool(void) noexcept(true) = default;
+
+ public:
+    /**
+     * @brief   Destructor. Runs the items left and waits for the workers to finish.
+     */
+    ~WorkerPool(void) noexcept(true);
+
+    /**
+     * @brief   Copy and move are deleted for this class.
+     *          They can be implemented when required.
+     */
+    XPF_CLASS_COPY_MOVE_BEHAVIOR(KmHelper::WorkerPool, delete);
+
+    /**
+     * @brief       Creates the pool and starts the worker threads.
+     *
+     * @param[in]   ThreadsCount    - How many worker threads are started.
+     *                                Clamped to [1, MAX_WORKERS_COUNT].
+     * @param[in]   Priority        - The priority of the worker threads.
+     *                                Clamped to the dynamic priorities.
+     * @param[out]  Pool            - On success, it will contain a properly initialized object.
+     *
+     * @return      A proper NTSTATUS error code.
+     */
+    _Must_inspect_result_
+    _IRQL_requires_max_(PASSIVE_LEVEL)
+    static NTSTATUS XPF_API
+    Create(
+        _In_ uint32_t ThreadsCount,
+        _In_ KPRIORITY Priority,
+        _Out_ xpf::Optional<KmHelper::WorkerPool>* Pool
+    ) noexcept(true);
+
+    /**
+     * @brief           Submits an item to be executed on one of the workers.
+     *
+     * @param[in,out]   Item - The item. It must stay valid until its routine runs.
+     *
+     * @return          Nothing. This API is guaranteed to succeed.
+     */
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    void XPF_API
+    Submit(
+        _Inout_ KmHelper::WorkerPoolItem* Item
+    ) noexcept(true);
+
+    /**
+     * @brief   The maximum number of worker threads.
+     */
+    static constexpr size_t MAX_WORKERS_COUNT = 32;
+
+    /**
+     * @brief   How many worker threads are started, if not configured in registry.
+     *          At most one per processor.
+     */
+    static constexpr uint32_t DEFAULT_WORKERS_COUNT = 4;
+
+    /**
+     * @brief   The priority of the worker threads, if not configured in registry.
+     *          Below the system delayed workers, so our work does not starve them.
+     */
+    static constexpr KPRIORITY DEFAULT_WORKERS_PRIORITY = 8;
+
+ private:
+    /**
+     * @brief       Takes an item - first the newest from the tail of the worker's own deque,
+     *              then the oldest from the head of the others.
+     *
+     * @param[in]   WorkerIndex - The index of the deque owned by the worker.
+     *
+     * @return      The item, or nullptr if all deques are empty.
+     */
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    KmHelper::WorkerPoolItem* XPF_API
+    TakeItem(
+        _In_ size_t WorkerIndex
+    ) noexcept(true);
+
+    /**
+     * @brief       The routine of the worker threads.
+     *
+     * @param[in]   Argument - The KmHelper::WorkerPoolWorker of the thread.
+     *
+     * @return      Nothing.
+     */
+    static void XPF_API
+    WorkerThreadRoutine(
+        _In_opt_ xpf::thread::CallbackArgument Argument
+    ) noexcept(true);
+
+ private:
+    /**
+     * @brief   Signaled once for every submitted item, and once for every worker
+     *          on rundown. A worker woken for an item keeps looking until it gets one.
+     */
+    KSEMAPHORE m_WorkSignal = { 0 };
+    volatile bool m_IsRunningDown = false;
+
+    size_t m_WorkersCount = 0;
+    KPRIORITY m_Priority = 0;
+
+    xpf::BusyLock m_DequeLocks[MAX_WORKERS_COUNT];
+    LIST_ENTRY m_Deques[MAX_WORKERS_COUNT] = { 0 };
+    KmHelper::WorkerPoolWorker m_Workers[MAX_WORKERS_COUNT];
+    xpf::thread::Thread m_Threads[MAX_WORKERS_COUNT];
+
+    /**
+     * @brief   Default MemoryAllocator is our friend as it requires access to the private
+     *          default constructor. It is used in the Create() method to ensure that
+     *          no partially constructed objects are created but instead they will be
+     *          all fully initialized.
+     */
+    friend class xpf::MemoryAllocator;
+};  // class WorkerPool
+};  // namespace KmHelper
+
+
+/**
+ * @brief       Creates the worker pool. The number of threads and their priority
+ *              can be overwritten from registry (WorkerThreadsCount, WorkerThreadsPriority).
+ *
+ * @return      A proper ntstatus error code.
+ *
+ * @note        This method can be called only at passive level.
+ *              It is expected to be called only at driver entry.
+ *
+ * @note        Must be called after the global data is created - and before
+ *              anything which enqueues work.
+ */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Must_inspect_result_
+NTSTATUS XPF_API
+WorkerPoolCreate(
+    void
+) noexcept(true);
+
+/**
+ * @brief       Destroys the previously created worker pool.
+ *
+ * @return      VOID.
+ *
+ * @note        This method can be called only at passive level.
+ *              It is expected to be called only at driver unload.
+ *
+ * @note        Must be called after everything which enqueues work was destroyed.
+ */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+void XPF_API
+WorkerPoolDestroy(
+    void
+) noexcept(true);
+
+/**
+ * @brief           Submits an item to the worker pool.
+ *
+ * @param[in,out]   Item - The item. It must stay valid until its routine runs.
+ *
+ * @return          false if the pool is not created - the caller should use the
+ *                  system work queues instead. true otherwise.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool XPF_API
+WorkerPoolSubmit(
+    _Inout_ KmHelper::WorkerPoolItem* Item
+) noexcept(true);
@@ -378,6 +378,8 @@ GlobalDataCreate(
                                                                   KmHelper::WrapperMmGetSystemRoutine(L"PsIsProtectedProcessLight"));       // NOLINT(*)
     gGlobalData->DynamicExportData.ApiPsGetProcessWow64Process = static_cast<PFUNC_PsGetProcessWow64Process>(
                                                                  KmHelper::WrapperMmGetSystemRoutine(L"PsGetProcessWow64Process"));         // NOLINT(*)
+    gGlobalData->DynamicExportData.ApiPsGetProcessSignatureLevel = static_cast<PFUNC_PsGetProcessSignatureLevel>(
+                                                                   KmHelper::WrapperMmGetSystemRoutine(L"PsGetProcessSignatureLevel"));     // NOLINT(*)
     gGlobalData->DynamicExportData.ApiKeRemoveQueueApc = static_cast<PFUNC_KeRemoveQueueApc>(
                                                          KmHelper::WrapperMmGetSystemRoutine(L"KeRemoveQueueApc"));                         // NOLINT(*)
     gGlobalData->DynamicExportData.ApiKeInitializeApc = static_cast<PFUNC_KeInitializeApc>(
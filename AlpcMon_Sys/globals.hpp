@@ -189,6 +189,17 @@ typedef BOOLEAN(NTAPI* PFUNC_PsIsProtectedProcessLight)(_In_ PEPROCESS Process);
 typedef PVOID(NTAPI* PFUNC_PsGetProcessWow64Process)(_In_ PEPROCESS Process);
 
 
+//
+// -------------------------------------------------------------------------------------------------------------------
+// | ****************************************************************************************************************|
+// |                         PsGetProcessSignatureLevel                                                              |
+// | ****************************************************************************************************************|
+// -------------------------------------------------------------------------------------------------------------------
+//
+typedef UCHAR(NTAPI* PFUNC_PsGetProcessSignatureLevel)(_In_ PEPROCESS Process,
+                                                       _Out_opt_ PUCHAR SectionSignatureLevel);
+
+
 //
 // -------------------------------------------------------------------------------------------------------------------
 // | ****************************************************************************************************************|
@@ -241,6 +252,7 @@ typedef struct _SYSMON_GLOBAL_DYNAMIC_EXPORT_DATA
     PFUNC_PsIsProtectedProcess          ApiPsIsProtectedProcess;
     PFUNC_PsIsProtectedProcessLight     ApiPsIsProtectedProcessLight;
     PFUNC_PsGetProcessWow64Process      ApiPsGetProcessWow64Process;
+    PFUNC_PsGetProcessSignatureLevel    ApiPsGetProcessSignatureLevel;
     PFUNC_KeRemoveQueueApc              ApiKeRemoveQueueApc;
     PFUNC_KeInitializeApc               ApiKeInitializeApc;
     PFUNC_KeInsertQueueApc              ApiKeInsertQueueApc;
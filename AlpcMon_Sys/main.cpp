@@ -21,6 +21,8 @@
 #include "FirmwareTableHandlerFilter.hpp"
 #include "ModuleCollector.hpp"
 #include "ProcessCollector.hpp"
+#include "StackStore.hpp"
+#include "WorkerPool.hpp"
 
 #include "PdbHelper.hpp"
 
@@ -110,12 +112,22 @@ DriverUnload(
     ThreadFilterStop();
     ProcessFilterStop();
 
+    //
+    // Destroy the stack store - it still needs the modules to export the stacks.
+    //
+    StackStoreDestroy();
+
     //
     // Destroy the collectors.
     //
     ModuleCollectorDestroy();
     ProcessCollectorDestroy();
 
+    //
+    // Nothing enqueues work anymore - stop the workers.
+    //
+    WorkerPoolDestroy();
+
     //
     // Destroy the globals.
     //
@@ -170,9 +182,11 @@ DriverEntry(
     NTSTATUS status = STATUS_UNSUCCESSFUL;
     BOOLEAN isCppSupportInitialized = FALSE;
     BOOLEAN isGlobalDataCreated = FALSE;
+    BOOLEAN isWorkerPoolCreated = FALSE;
 
     BOOLEAN isModuleCollectorCreated = FALSE;
     BOOLEAN isProcessCollectorCreated = FALSE;
+    BOOLEAN isStackStoreCreated = FALSE;
 
     BOOLEAN isProcessFilteringStarted = FALSE;
     BOOLEAN isThreadFilteringStarted = FALSE;
@@ -219,6 +233,18 @@ DriverEntry(
     }
     isGlobalDataCreated = TRUE;
 
+    //
+    // Then the workers - they are configured from registry, so after the globals.
+    //
+    status = WorkerPoolCreate();
+    if (!NT_SUCCESS(status))
+    {
+        SysMonLogError("Failed to create the worker pool %!STATUS!",
+                       status);
+        goto CleanUp;
+    }
+    isWorkerPoolCreated = TRUE;
+
     //
     // Now the collectors.
     //
@@ -240,6 +266,15 @@ DriverEntry(
     }
     isModuleCollectorCreated = TRUE;
 
+    status = StackStoreCreate();
+    if (!NT_SUCCESS(status))
+    {
+        SysMonLogError("Failed to create the stack store %!STATUS!",
+                       status);
+        goto CleanUp;
+    }
+    isStackStoreCreated = TRUE;
+
     //
     // Now start the process filter.
     //
@@ -345,6 +380,12 @@ CleanUp:
             isProcessFilteringStarted = FALSE;
         }
 
+        if (FALSE != isStackStoreCreated)
+        {
+            StackStoreDestroy();
+            isStackStoreCreated = FALSE;
+        }
+
         if (FALSE != isModuleCollectorCreated)
         {
             ModuleCollectorDestroy();
@@ -357,6 +398,12 @@ CleanUp:
             isProcessCollectorCreated = FALSE;
         }
 
+        if (FALSE != isWorkerPoolCreated)
+        {
+            WorkerPoolDestroy();
+            isWorkerPoolCreated = FALSE;
+        }
+
         if (FALSE != isGlobalDataCreated)
         {
             GlobalDataDestroy();
@@ -0,0 +1,271 @@
+/**
+ * @file        ALPC-Tools/Tests/InjectionPolicyRulesTests.cpp
+ *
+ * @brief       Tests for SysMon::InjectionPolicyRules - parsing the rules from registry
+ *              and deciding, for a process, whether it is injected and with which hooks.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "TestFramework.hpp"
+#include "InjectionPolicyRules.hpp"
+
+#include <stdint.h>
+#include <wchar.h>
+#include <vector>
+
+
+/**
+ * @brief   The hooks of the dll - mirrors UM_KM_HOOK_SET_ALL.
+ */
+static constexpr uint32_t FIXTURE_HOOK_SET_ALL = 0x7;
+
+/**
+ * @brief   Integrity levels - SECURITY_MANDATORY_*_RID.
+ */
+static constexpr uint32_t FIXTURE_MEDIUM_IL = 0x2000;
+static constexpr uint32_t FIXTURE_SYSTEM_IL = 0x4000;
+
+/**
+ * @brief   Wraps a null terminated string.
+ */
+static SysMon::InjectionPolicyRules::TextView
+FixtureText(
+    const wchar_t* Text
+)
+{
+    return SysMon::InjectionPolicyRules::TextView{ Text, wcslen(Text) };
+}
+
+/**
+ * @brief   Parses a rule with the fixture hook set.
+ */
+static bool
+FixtureParse(
+    const wchar_t* Text,
+    SysMon::InjectionPolicyRules::Rule* Rule
+)
+{
+    return SysMon::InjectionPolicyRules::ParseRule(FixtureText(Text), FIXTURE_HOOK_SET_ALL, Rule);
+}
+
+/**
+ * @brief   Builds a policy from the given rules - all of them must be valid.
+ */
+static std::vector<SysMon::InjectionPolicyRules::Rule>
+FixturePolicy(
+    std::initializer_list<const wchar_t*> Rules
+)
+{
+    std::vector<SysMon::InjectionPolicyRules::Rule> policy;
+    for (const wchar_t* text : Rules)
+    {
+        SysMon::InjectionPolicyRules::Rule rule;
+        if (FixtureParse(text, &rule))
+        {
+            policy.push_back(rule);
+        }
+    }
+    return policy;
+}
+
+/**
+ * @brief   Evaluates the policy for a process.
+ */
+static SysMon::InjectionPolicyRules::Decision
+FixtureEvaluate(
+    const std::vector<SysMon::InjectionPolicyRules::Rule>& Policy,
+    const SysMon::InjectionPolicyRules::Context& Context
+)
+{
+    SysMon::InjectionPolicyRules::Decision decision;
+    SysMon::InjectionPolicyRules::Evaluate(Policy, Policy.size(), FIXTURE_HOOK_SET_ALL, Context, &decision);
+    return decision;
+}
+
+/**
+ * @brief   A medium integrity notepad started by explorer in session 1.
+ */
+static SysMon::InjectionPolicyRules::Context
+FixtureContext(void)
+{
+    SysMon::InjectionPolicyRules::Context context;
+    context.ImagePath = FixtureText(L"\\Device\\HarddiskVolume2\\Windows\\System32\\notepad.exe");
+    context.ParentImagePath = FixtureText(L"\\Device\\HarddiskVolume2\\Windows\\explorer.exe");
+    context.SessionId = 1;
+    context.IntegrityLevel = FIXTURE_MEDIUM_IL;
+    context.SigningLevel = 8;
+    return context;
+}
+
+ALPC_TEST(InjectionPolicyRules, ParsesActions)
+{
+    SysMon::InjectionPolicyRules::Rule rule;
+
+    ALPC_EXPECT_TRUE(FixtureParse(L"skip", &rule));
+    ALPC_EXPECT_TRUE(rule.Decision.Action == SysMon::InjectionPolicyRules::Action::kSkip);
+    ALPC_EXPECT_EQ(rule.Conditions, 0u);
+
+    ALPC_EXPECT_TRUE(FixtureParse(L"INJECT", &rule));
+    ALPC_EXPECT_TRUE(rule.Decision.Action == SysMon::InjectionPolicyRules::Action::kInject);
+    ALPC_EXPECT_EQ(rule.Decision.HookSet, FIXTURE_HOOK_SET_ALL);
+
+    ALPC_EXPECT_TRUE(FixtureParse(L"inject:0x2", &rule));
+    ALPC_EXPECT_EQ(rule.Decision.HookSet, 0x2u);
+
+    ALPC_EXPECT_TRUE(FixtureParse(L"inject:5", &rule));
+    ALPC_EXPECT_EQ(rule.Decision.HookSet, 0x5u);
+}
+
+ALPC_TEST(InjectionPolicyRules, RejectsMalformedActions)
+{
+    SysMon::InjectionPolicyRules::Rule rule;
+
+    ALPC_EXPECT_FALSE(FixtureParse(L"", &rule));
+    ALPC_EXPECT_FALSE(FixtureParse(L";session=0", &rule));
+    ALPC_EXPECT_FALSE(FixtureParse(L"allow", &rule));
+    ALPC_EXPECT_FALSE(FixtureParse(L"inject:", &rule));
+    ALPC_EXPECT_FALSE(FixtureParse(L"inject:0x", &rule));
+    ALPC_EXPECT_FALSE(FixtureParse(L"inject:zz", &rule));
+
+    /* The hook set must be non empty and known to the dll. */
+    ALPC_EXPECT_FALSE(FixtureParse(L"inject:0", &rule));
+    ALPC_EXPECT_FALSE(FixtureParse(L"inject:0x8", &rule));
+    ALPC_EXPECT_FALSE(FixtureParse(L"inject:0x100000000", &rule));
+}
+
+ALPC_TEST(InjectionPolicyRules, ParsesConditions)
+{
+    SysMon::InjectionPolicyRules::Rule rule;
+
+    ALPC_EXPECT_TRUE(FixtureParse(L"inject:0x1;path=\\svchost.exe;parent=\\services.exe;session=0;"
+                                  L"minil=0x1000;maxil=0x3000;minsigning=12;", &rule));
+    ALPC_EXPECT_EQ(rule.Conditions, SysMon::InjectionPolicyRules::CONDITION_PATH |
+                                    SysMon::InjectionPolicyRules::CONDITION_PARENT |
+                                    SysMon::InjectionPolicyRules::CONDITION_SESSION |
+                                    SysMon::InjectionPolicyRules::CONDITION_MIN_INTEGRITY |
+                                    SysMon::InjectionPolicyRules::CONDITION_MAX_INTEGRITY |
+                                    SysMon::InjectionPolicyRules::CONDITION_MIN_SIGNING);
+    ALPC_EXPECT_EQ(rule.ImagePathSuffixLength, wcslen(L"\\svchost.exe"));
+    ALPC_EXPECT_EQ(wmemcmp(rule.ImagePathSuffix, L"\\svchost.exe", rule.ImagePathSuffixLength), 0);
+    ALPC_EXPECT_EQ(rule.ParentPathSuffixLength, wcslen(L"\\services.exe"));
+    ALPC_EXPECT_EQ(rule.SessionId, 0u);
+    ALPC_EXPECT_EQ(rule.MinIntegrityLevel, 0x1000u);
+    ALPC_EXPECT_EQ(rule.MaxIntegrityLevel, 0x3000u);
+    ALPC_EXPECT_EQ(rule.MinSigningLevel, 12u);
+
+    /* Keys are case insensitive, empty fields are tolerated. */
+    ALPC_EXPECT_TRUE(FixtureParse(L"skip;;Session=0xA", &rule));
+    ALPC_EXPECT_EQ(rule.SessionId, 10u);
+}
+
+ALPC_TEST(InjectionPolicyRules, RejectsMalformedConditions)
+{
+    SysMon::InjectionPolicyRules::Rule rule;
+    std::vector<wchar_t> longSuffix(SysMon::InjectionPolicyRules::MAX_SUFFIX_LENGTH + 1, L'a');
+    std::vector<wchar_t> longRule = { L's', L'k', L'i', L'p', L';', L'p', L'a', L't', L'h', L'=' };
+    longRule.insert(longRule.end(), longSuffix.begin(), longSuffix.end());
+
+    ALPC_EXPECT_FALSE(FixtureParse(L"skip;user=admin", &rule));
+    ALPC_EXPECT_FALSE(FixtureParse(L"skip;session", &rule));
+    ALPC_EXPECT_FALSE(FixtureParse(L"skip;session=", &rule));
+    ALPC_EXPECT_FALSE(FixtureParse(L"skip;=1", &rule));
+    ALPC_EXPECT_FALSE(FixtureParse(L"skip;session=-1", &rule));
+    ALPC_EXPECT_FALSE(FixtureParse(L"skip;minil=4294967296", &rule));
+    ALPC_EXPECT_FALSE(SysMon::InjectionPolicyRules::ParseRule({ longRule.data(), longRule.size() },
+                                                              FIXTURE_HOOK_SET_ALL,
+                                                              &rule));
+}
+
+ALPC_TEST(InjectionPolicyRules, NoRuleInjectsAllHooks)
+{
+    const SysMon::InjectionPolicyRules::Decision decision = FixtureEvaluate({}, FixtureContext());
+
+    ALPC_EXPECT_TRUE(decision.Action == SysMon::InjectionPolicyRules::Action::kInject);
+    ALPC_EXPECT_EQ(decision.HookSet, FIXTURE_HOOK_SET_ALL);
+    ALPC_EXPECT_EQ(decision.RuleNumber, 0u);
+}
+
+ALPC_TEST(InjectionPolicyRules, FirstMatchingRuleDecides)
+{
+    const std::vector<SysMon::InjectionPolicyRules::Rule> policy = FixturePolicy({
+        L"skip;session=0",
+        L"inject:0x2;path=\\NOTEPAD.EXE",
+        L"skip;path=\\notepad.exe",
+    });
+    ALPC_EXPECT_EQ(policy.size(), 3u);
+
+    SysMon::InjectionPolicyRules::Context context = FixtureContext();
+    SysMon::InjectionPolicyRules::Decision decision = FixtureEvaluate(policy, context);
+    ALPC_EXPECT_TRUE(decision.Action == SysMon::InjectionPolicyRules::Action::kInject);
+    ALPC_EXPECT_EQ(decision.HookSet, 0x2u);
+    ALPC_EXPECT_EQ(decision.RuleNumber, 2u);
+
+    context.SessionId = 0;
+    decision = FixtureEvaluate(policy, context);
+    ALPC_EXPECT_TRUE(decision.Action == SysMon::InjectionPolicyRules::Action::kSkip);
+    ALPC_EXPECT_EQ(decision.RuleNumber, 1u);
+}
+
+ALPC_TEST(InjectionPolicyRules, MatchesPathSuffixes)
+{
+    const std::vector<SysMon::InjectionPolicyRules::Rule> policy = FixturePolicy({
+        L"skip;parent=\\Explorer.exe;path=notepad.exe",
+    });
+    SysMon::InjectionPolicyRules::Context context = FixtureContext();
+
+    ALPC_EXPECT_EQ(FixtureEvaluate(policy, context).RuleNumber, 1u);
+
+    /* A suffix longer than the path never matches. */
+    context.ImagePath = FixtureText(L"notepad.exe");
+    ALPC_EXPECT_EQ(FixtureEvaluate(policy, context).RuleNumber, 1u);
+    context.ImagePath = FixtureText(L"pad.exe");
+    ALPC_EXPECT_EQ(FixtureEvaluate(policy, context).RuleNumber, 0u);
+
+    /* An unknown parent does not match any parent rule. */
+    context = FixtureContext();
+    context.ParentImagePath = SysMon::InjectionPolicyRules::TextView{};
+    ALPC_EXPECT_EQ(FixtureEvaluate(policy, context).RuleNumber, 0u);
+}
+
+ALPC_TEST(InjectionPolicyRules, MatchesLevels)
+{
+    const std::vector<SysMon::InjectionPolicyRules::Rule> policy = FixturePolicy({
+        L"skip;minil=0x3000;maxil=0x4000",
+        L"inject:0x1;minsigning=8",
+    });
+    SysMon::InjectionPolicyRules::Context context = FixtureContext();
+
+    ALPC_EXPECT_EQ(FixtureEvaluate(policy, context).RuleNumber, 2u);
+
+    context.IntegrityLevel = FIXTURE_SYSTEM_IL;
+    ALPC_EXPECT_EQ(FixtureEvaluate(policy, context).RuleNumber, 1u);
+
+    context.IntegrityLevel = FIXTURE_SYSTEM_IL + 0x1000;
+    context.SigningLevel = 7;
+    ALPC_EXPECT_EQ(FixtureEvaluate(policy, context).RuleNumber, 0u);
+}
+
+ALPC_TEST(InjectionPolicyRules, ProtectedAndMinimalAreAlwaysSkipped)
+{
+    const std::vector<SysMon::InjectionPolicyRules::Rule> policy = FixturePolicy({
+        L"inject",
+    });
+    SysMon::InjectionPolicyRules::Context context = FixtureContext();
+
+    context.IsProtected = true;
+    SysMon::InjectionPolicyRules::Decision decision = FixtureEvaluate(policy, context);
+    ALPC_EXPECT_TRUE(decision.Action == SysMon::InjectionPolicyRules::Action::kSkip);
+    ALPC_EXPECT_EQ(decision.RuleNumber, 0u);
+
+    context = FixtureContext();
+    context.IsMinimal = true;
+    decision = FixtureEvaluate(policy, context);
+    ALPC_EXPECT_TRUE(decision.Action == SysMon::InjectionPolicyRules::Action::kSkip);
+    ALPC_EXPECT_EQ(decision.RuleNumber, 0u);
+}
@@ -0,0 +1,40 @@
+/**
+ * @file        ALPC-Tools/Tests/Main.cpp
+ *
+ * @brief       Runs all the registered portable unit tests.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "TestFramework.hpp"
+
+
+int main(void)
+{
+    int failedTests = 0;
+
+    for (const AlpcTests::TestCase& test : AlpcTests::Tests())
+    {
+        const int failedChecks = AlpcTests::FailedChecks();
+
+        printf("[ RUN  ] %s\n", test.Name);
+        test.Routine();
+        if (failedChecks != AlpcTests::FailedChecks())
+        {
+            printf("[ FAIL ] %s\n", test.Name);
+            failedTests++;
+        }
+        else
+        {
+            printf("[  OK  ] %s\n", test.Name);
+        }
+    }
+
+    printf("%zu tests, %d failed\n", AlpcTests::Tests().size(), failedTests);
+    return (0 == failedTests) ? 0 : 1;
+}
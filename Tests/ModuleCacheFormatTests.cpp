@@ -0,0 +1,373 @@
+/**
+ * @file        ALPC-Tools/Tests/ModuleCacheFormatTests.cpp
+ *
+ * @brief       Tests for SysMon::ModuleCacheFormat - the on-disk format of the module cache.
+ *              The cache file is read at boot, so a damaged one must be rejected, not trusted.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "TestFramework.hpp"
+#include "ModuleCacheFormat.hpp"
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+
+/**
+ * @brief   The entry header used by the fixture. The driver puts the module key and the
+ *          file identity in front of the same fields - the format does not look at them.
+ */
+#pragma pack(push, 1)
+struct FixtureEntryHeader
+{
+    uint64_t    Key;
+    uint32_t    HashType;
+    uint32_t    HashSize;
+    uint32_t    SymbolsCount;
+    uint32_t    DataSize;
+};
+#pragma pack(pop)
+
+/**
+ * @brief   A symbol, as the driver keeps it before it is serialized.
+ */
+struct FixtureSymbol
+{
+    uint32_t Rva;
+    std::string Name;
+};
+
+/**
+ * @brief   What is extracted from an entry.
+ */
+struct FixtureModule
+{
+    std::vector<uint8_t> Hash;
+    std::vector<FixtureSymbol> Symbols;
+};
+
+/**
+ * @brief   The module used by most tests - a md5 sized hash and a few symbols.
+ */
+static FixtureModule
+FixtureSampleModule(
+    void
+)
+{
+    FixtureModule module;
+    module.Hash = { 0xD4, 0x1D, 0x8C, 0xD9, 0x8F, 0x00, 0xB2, 0x04, 0xE9, 0x80, 0x09, 0x98, 0xEC, 0xF8, 0x42, 0x7E };
+    module.Symbols = {
+        { 0x1000, "NtCreateFile" },
+        { 0x1040, "" },
+        { 0x2A30, "RtlpAllocateHeapInternal" },
+    };
+    return module;
+}
+
+/**
+ * @brief   Serializes an entry. Empty if the format refuses it.
+ */
+static std::vector<uint8_t>
+FixtureWriteEntry(
+    uint64_t Key,
+    const FixtureModule& Module
+)
+{
+    std::vector<uint8_t> entry;
+    size_t entrySize = 0;
+    FixtureEntryHeader header = { 0 };
+
+    auto symbolAt = [&Module](size_t Index) -> SysMon::ModuleCacheFormat::SymbolView
+                    {
+                        SysMon::ModuleCacheFormat::SymbolView symbol;
+                        symbol.Rva = Module.Symbols[Index].Rva;
+                        symbol.Name = Module.Symbols[Index].Name.data();
+                        symbol.NameLength = Module.Symbols[Index].Name.size();
+                        return symbol;
+                    };
+
+    if (!SysMon::ModuleCacheFormat::ComputeEntrySize<FixtureEntryHeader>(Module.Hash.size(),
+                                                                         Module.Symbols.size(),
+                                                                         symbolAt,
+                                                                         &entrySize))
+    {
+        return entry;
+    }
+    entry.resize(entrySize);
+
+    header.Key = Key;
+    header.HashType = 1;
+    if (!SysMon::ModuleCacheFormat::WriteEntry(header,
+                                               Module.Hash.data(),
+                                               Module.Hash.size(),
+                                               Module.Symbols.size(),
+                                               symbolAt,
+                                               entry.data(),
+                                               entry.size()))
+    {
+        entry.clear();
+    }
+    return entry;
+}
+
+/**
+ * @brief   Parses an entry into Module.
+ */
+static bool
+FixtureParseEntry(
+    const std::vector<uint8_t>& Entry,
+    FixtureModule* Module
+)
+{
+    auto onHash = [Module](const void* Hash, size_t HashSize) -> bool
+                  {
+                      const uint8_t* bytes = static_cast<const uint8_t*>(Hash);
+                      Module->Hash.assign(bytes, bytes + HashSize);
+                      return true;
+                  };
+    auto onSymbol = [Module](const SysMon::ModuleCacheFormat::SymbolView& Symbol) -> bool
+                    {
+                        Module->Symbols.push_back({ Symbol.Rva, std::string(Symbol.Name, Symbol.NameLength) });
+                        return true;
+                    };
+
+    *Module = FixtureModule{};
+    return SysMon::ModuleCacheFormat::ParseEntry<FixtureEntryHeader>(Entry.data(), Entry.size(), onHash, onSymbol);
+}
+
+/**
+ * @brief   Builds a cache file from serialized entries - the same as the driver flushes it.
+ */
+static std::vector<uint8_t>
+FixtureWriteFile(
+    const std::vector<std::vector<uint8_t>>& Entries
+)
+{
+    std::vector<uint8_t> content(sizeof(SysMon::ModuleCacheFormat::FileHeader));
+    for (const std::vector<uint8_t>& entry : Entries)
+    {
+        content.insert(content.end(), entry.begin(), entry.end());
+    }
+    SysMon::ModuleCacheFormat::SealFile(content.data(), content.size(), static_cast<uint32_t>(Entries.size()));
+    return content;
+}
+
+/**
+ * @brief   Parses a cache file into Entries.
+ */
+static bool
+FixtureParseFile(
+    const std::vector<uint8_t>& Content,
+    std::vector<std::vector<uint8_t>>* Entries
+)
+{
+    auto onEntry = [Entries](const void* Entry, size_t EntrySize) -> bool
+                   {
+                       const uint8_t* bytes = static_cast<const uint8_t*>(Entry);
+                       Entries->emplace_back(bytes, bytes + EntrySize);
+                       return true;
+                   };
+
+    Entries->clear();
+    return SysMon::ModuleCacheFormat::ParseFile<FixtureEntryHeader>(Content.data(), Content.size(), onEntry);
+}
+
+/**
+ * @brief   Overwrites a field of a serialized structure.
+ */
+static void
+FixturePatch(
+    std::vector<uint8_t>* Buffer,
+    size_t Offset,
+    uint32_t Value
+)
+{
+    ::memcpy(Buffer->data() + Offset, &Value, sizeof(Value));
+}
+
+ALPC_TEST(ModuleCacheFormat, EntryRoundTrip)
+{
+    const FixtureModule module = FixtureSampleModule();
+    const std::vector<uint8_t> entry = FixtureWriteEntry(7, module);
+    FixtureModule parsed;
+
+    ALPC_EXPECT_FALSE(entry.empty());
+    ALPC_EXPECT_TRUE(FixtureParseEntry(entry, &parsed));
+    ALPC_EXPECT_TRUE(parsed.Hash == module.Hash);
+    ALPC_EXPECT_EQ(parsed.Symbols.size(), module.Symbols.size());
+    for (size_t i = 0; i < parsed.Symbols.size() && i < module.Symbols.size(); ++i)
+    {
+        ALPC_EXPECT_EQ(parsed.Symbols[i].Rva, module.Symbols[i].Rva);
+        ALPC_EXPECT_TRUE(parsed.Symbols[i].Name == module.Symbols[i].Name);
+    }
+
+    /* The fields identifying the module are written as they are given. */
+    FixtureEntryHeader header = { 0 };
+    ::memcpy(&header, entry.data(), sizeof(header));
+    ALPC_EXPECT_EQ(header.Key, 7u);
+    ALPC_EXPECT_EQ(header.HashType, 1u);
+    ALPC_EXPECT_EQ(header.DataSize, entry.size() - sizeof(header));
+
+    /* A module without a hash and without symbols is still cached. */
+    const std::vector<uint8_t> empty = FixtureWriteEntry(8, FixtureModule{});
+    ALPC_EXPECT_EQ(empty.size(), sizeof(FixtureEntryHeader));
+    ALPC_EXPECT_TRUE(FixtureParseEntry(empty, &parsed));
+    ALPC_EXPECT_TRUE(parsed.Hash.empty());
+    ALPC_EXPECT_TRUE(parsed.Symbols.empty());
+}
+
+ALPC_TEST(ModuleCacheFormat, FileRoundTrip)
+{
+    const std::vector<std::vector<uint8_t>> entries = {
+        FixtureWriteEntry(1, FixtureSampleModule()),
+        FixtureWriteEntry(2, FixtureModule{}),
+    };
+    std::vector<uint8_t> content = FixtureWriteFile(entries);
+    std::vector<std::vector<uint8_t>> parsed;
+
+    ALPC_EXPECT_TRUE(FixtureParseFile(content, &parsed));
+    ALPC_EXPECT_TRUE(parsed == entries);
+
+    /* A previous, larger file might leave bytes after the payload - they are ignored. */
+    content.insert(content.end(), { 0xCC, 0xCC, 0xCC });
+    ALPC_EXPECT_TRUE(FixtureParseFile(content, &parsed));
+    ALPC_EXPECT_TRUE(parsed == entries);
+
+    /* An empty cache is valid. */
+    ALPC_EXPECT_TRUE(FixtureParseFile(FixtureWriteFile({}), &parsed));
+    ALPC_EXPECT_TRUE(parsed.empty());
+}
+
+ALPC_TEST(ModuleCacheFormat, TruncatedDataIsRejected)
+{
+    const std::vector<uint8_t> entry = FixtureWriteEntry(1, FixtureSampleModule());
+    const std::vector<uint8_t> content = FixtureWriteFile({ entry });
+    std::vector<std::vector<uint8_t>> parsed;
+
+    for (size_t size = 0; size < entry.size(); ++size)
+    {
+        std::vector<uint8_t> truncated(entry.begin(), entry.begin() + size);
+        ALPC_EXPECT_FALSE(SysMon::ModuleCacheFormat::IsValidEntry<FixtureEntryHeader>(truncated.data(), truncated.size()));
+
+        /* Even when the entry size agrees, the symbols must still be all there. */
+        if (size >= sizeof(FixtureEntryHeader))
+        {
+            FixturePatch(&truncated,
+                         offsetof(FixtureEntryHeader, DataSize),
+                         static_cast<uint32_t>(size - sizeof(FixtureEntryHeader)));
+            ALPC_EXPECT_FALSE(SysMon::ModuleCacheFormat::IsValidEntry<FixtureEntryHeader>(truncated.data(),
+                                                                                          truncated.size()));
+        }
+    }
+
+    for (size_t size = 0; size < content.size(); ++size)
+    {
+        const std::vector<uint8_t> truncated(content.begin(), content.begin() + size);
+        ALPC_EXPECT_FALSE(FixtureParseFile(truncated, &parsed));
+    }
+}
+
+ALPC_TEST(ModuleCacheFormat, BadChecksumIsRejected)
+{
+    const std::vector<uint8_t> content = FixtureWriteFile({ FixtureWriteEntry(1, FixtureSampleModule()) });
+    std::vector<std::vector<uint8_t>> parsed;
+
+    /* Any flipped bit of the payload. */
+    for (size_t i = sizeof(SysMon::ModuleCacheFormat::FileHeader); i < content.size(); ++i)
+    {
+        std::vector<uint8_t> damaged = content;
+        damaged[i] ^= 0x10;
+        ALPC_EXPECT_FALSE(FixtureParseFile(damaged, &parsed));
+    }
+
+    /* The checksum itself. */
+    std::vector<uint8_t> damaged = content;
+    damaged[offsetof(SysMon::ModuleCacheFormat::FileHeader, Checksum)] ^= 0x01;
+    ALPC_EXPECT_FALSE(FixtureParseFile(damaged, &parsed));
+
+    /* Another format or another version. */
+    damaged = content;
+    FixturePatch(&damaged, offsetof(SysMon::ModuleCacheFormat::FileHeader, Magic), 0x46464646);
+    ALPC_EXPECT_FALSE(FixtureParseFile(damaged, &parsed));
+
+    damaged = content;
+    FixturePatch(&damaged, offsetof(SysMon::ModuleCacheFormat::FileHeader, Version), SysMon::ModuleCacheFormat::FILE_VERSION + 1);
+    ALPC_EXPECT_FALSE(FixtureParseFile(damaged, &parsed));
+}
+
+ALPC_TEST(ModuleCacheFormat, OversizedLengthsAreRejected)
+{
+    const std::vector<uint8_t> entry = FixtureWriteEntry(1, FixtureSampleModule());
+    const size_t firstSymbol = sizeof(FixtureEntryHeader) + FixtureSampleModule().Hash.size();
+    const size_t firstNameLength = firstSymbol + offsetof(SysMon::ModuleCacheFormat::SymbolHeader, NameLength);
+
+    /* The hash can not go past the entry. */
+    std::vector<uint8_t> damaged = entry;
+    FixturePatch(&damaged, offsetof(FixtureEntryHeader, HashSize), 0xFFFFFFFF);
+    ALPC_EXPECT_FALSE(SysMon::ModuleCacheFormat::IsValidEntry<FixtureEntryHeader>(damaged.data(), damaged.size()));
+
+    /* Neither can a name - nor can it eat the next symbol. */
+    damaged = entry;
+    FixturePatch(&damaged, firstNameLength, 0xFFFFFFFF);
+    ALPC_EXPECT_FALSE(SysMon::ModuleCacheFormat::IsValidEntry<FixtureEntryHeader>(damaged.data(), damaged.size()));
+
+    damaged = entry;
+    FixturePatch(&damaged, firstNameLength, static_cast<uint32_t>(FixtureSampleModule().Symbols[0].Name.size() + 1));
+    ALPC_EXPECT_FALSE(SysMon::ModuleCacheFormat::IsValidEntry<FixtureEntryHeader>(damaged.data(), damaged.size()));
+
+    /* More symbols than there are bytes for. */
+    damaged = entry;
+    FixturePatch(&damaged, offsetof(FixtureEntryHeader, SymbolsCount), 0xFFFFFFFF);
+    ALPC_EXPECT_FALSE(SysMon::ModuleCacheFormat::IsValidEntry<FixtureEntryHeader>(damaged.data(), damaged.size()));
+
+    /* An entry can not go past the payload, even with a valid checksum. */
+    damaged = entry;
+    FixturePatch(&damaged, offsetof(FixtureEntryHeader, DataSize), 0xFFFFFFF0);
+    std::vector<std::vector<uint8_t>> parsed;
+    ALPC_EXPECT_FALSE(FixtureParseFile(FixtureWriteFile({ damaged }), &parsed));
+
+    /* A module which does not fit the 32 bit sizes is not written at all. */
+    size_t entrySize = 0;
+    auto hugeSymbol = [](size_t) -> SysMon::ModuleCacheFormat::SymbolView
+                      {
+                          SysMon::ModuleCacheFormat::SymbolView symbol;
+                          symbol.NameLength = UINT32_MAX;
+                          return symbol;
+                      };
+    ALPC_EXPECT_FALSE(SysMon::ModuleCacheFormat::ComputeEntrySize<FixtureEntryHeader>(0, 1, hugeSymbol, &entrySize));
+    ALPC_EXPECT_EQ(entrySize, 0u);
+}
+
+ALPC_TEST(ModuleCacheFormat, CallbackFailureStopsTheParsing)
+{
+    const std::vector<uint8_t> entry = FixtureWriteEntry(1, FixtureSampleModule());
+    const std::vector<uint8_t> content = FixtureWriteFile({ entry, entry });
+    size_t symbolsSeen = 0;
+    size_t entriesSeen = 0;
+
+    auto onHash = [](const void*, size_t) -> bool { return true; };
+    auto onSymbol = [&symbolsSeen](const SysMon::ModuleCacheFormat::SymbolView&) -> bool
+                    {
+                        symbolsSeen++;
+                        return false;
+                    };
+    auto onEntry = [&entriesSeen](const void*, size_t) -> bool
+                   {
+                       entriesSeen++;
+                       return false;
+                   };
+
+    ALPC_EXPECT_FALSE(SysMon::ModuleCacheFormat::ParseEntry<FixtureEntryHeader>(entry.data(), entry.size(), onHash, onSymbol));
+    ALPC_EXPECT_EQ(symbolsSeen, 1u);
+
+    ALPC_EXPECT_FALSE(SysMon::ModuleCacheFormat::ParseFile<FixtureEntryHeader>(content.data(), content.size(), onEntry));
+    ALPC_EXPECT_EQ(entriesSeen, 1u);
+}
@@ -0,0 +1,229 @@
+/**
+ * @file        ALPC-Tools/Tests/MultiDigestTests.cpp
+ *
+ * @brief       Tests for KmHelper::MultiDigest - which digests are fed when hashing
+ *              a file, and how the file is read for them.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "TestFramework.hpp"
+#include "MultiDigest.hpp"
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+
+/**
+ * @brief   A file in memory, which counts how it is read.
+ */
+struct FixtureHashedFile
+{
+    std::vector<uint8_t> Content;
+    size_t MaxReadSize = KmHelper::MultiDigest::CHUNK_SIZE;
+    size_t ReadsCount = 0;
+    size_t FailingRead = SIZE_MAX;
+};
+
+/**
+ * @brief   What each algorithm was fed, in order.
+ */
+struct FixtureDigests
+{
+    std::vector<uint8_t> Fed[KmHelper::MultiDigest::ALGORITHMS_COUNT];
+    size_t FailingIndex = SIZE_MAX;
+};
+
+/**
+ * @brief   A file of the given size, with a non repeating content.
+ */
+static FixtureHashedFile
+FixtureFile(
+    size_t Size
+)
+{
+    FixtureHashedFile file;
+    uint32_t seed = 0x9E3779B9;
+
+    file.Content.resize(Size);
+    for (uint8_t& byte : file.Content)
+    {
+        seed = seed * 1664525 + 1013904223;
+        byte = static_cast<uint8_t>(seed >> 24);
+    }
+    return file;
+}
+
+/**
+ * @brief   Hashes the file the same way FileHasher::HashFile does.
+ */
+static bool
+FixtureHash(
+    FixtureHashedFile& File,
+    const bool* IsRequested,
+    FixtureDigests& Digests,
+    bool* IsDirty
+)
+{
+    auto readChunk = [&File](uint64_t Offset, const uint8_t** Data, size_t* Size)
+    {
+        if (File.ReadsCount++ == File.FailingRead)
+        {
+            return false;
+        }
+
+        const size_t offset = static_cast<size_t>(std::min<uint64_t>(Offset, File.Content.size()));
+        *Data = File.Content.data() + offset;
+        *Size = std::min(File.MaxReadSize, File.Content.size() - offset);
+        return true;
+    };
+    auto feedChunk = [&Digests](size_t Index, const uint8_t* Data, size_t Size)
+    {
+        if (Index == Digests.FailingIndex)
+        {
+            return false;
+        }
+        Digests.Fed[Index].insert(Digests.Fed[Index].end(), Data, Data + Size);
+        return true;
+    };
+
+    return KmHelper::MultiDigest::HashChunks(File.Content.size(),
+                                             IsRequested,
+                                             readChunk,
+                                             feedChunk,
+                                             IsDirty);
+}
+
+/**
+ * @brief   Selects the algorithms for the given indexes. An index of SIZE_MAX fails the mapping.
+ */
+static bool
+FixtureSelect(
+    const std::vector<size_t>& Indexes,
+    bool* IsRequested
+)
+{
+    auto indexAt = [&Indexes](size_t Request, size_t* Index)
+    {
+        *Index = Indexes[Request];
+        return Indexes[Request] != SIZE_MAX;
+    };
+    return KmHelper::MultiDigest::SelectAlgorithms(Indexes.size(),
+                                                   indexAt,
+                                                   IsRequested);
+}
+
+ALPC_TEST(MultiDigest, EveryRequestedDigestSeesTheWholeFileOnce)
+{
+    /* Two and a half chunks. */
+    FixtureHashedFile file = FixtureFile(KmHelper::MultiDigest::CHUNK_SIZE * 2 + KmHelper::MultiDigest::CHUNK_SIZE / 2);
+    FixtureDigests digests;
+    bool isRequested[KmHelper::MultiDigest::ALGORITHMS_COUNT] = { false };
+    bool isDirty = false;
+
+    ALPC_EXPECT_TRUE(FixtureSelect({ 2, 0 }, isRequested));
+    ALPC_EXPECT_TRUE(FixtureHash(file, isRequested, digests, &isDirty));
+
+    /* The file is read once, in 1 MB chunks, for both digests. */
+    ALPC_EXPECT_EQ(file.ReadsCount, size_t{ 3 });
+    ALPC_EXPECT_TRUE(digests.Fed[0] == file.Content);
+    ALPC_EXPECT_TRUE(digests.Fed[1].empty());
+    ALPC_EXPECT_TRUE(digests.Fed[2] == file.Content);
+    ALPC_EXPECT_TRUE(isDirty);
+}
+
+ALPC_TEST(MultiDigest, ShortReadsAreContinued)
+{
+    FixtureHashedFile file = FixtureFile(10000);
+    FixtureDigests digests;
+    bool isRequested[KmHelper::MultiDigest::ALGORITHMS_COUNT] = { false };
+    bool isDirty = false;
+
+    file.MaxReadSize = 4093;
+    ALPC_EXPECT_TRUE(FixtureSelect({ 0, 1, 2 }, isRequested));
+    ALPC_EXPECT_TRUE(FixtureHash(file, isRequested, digests, &isDirty));
+
+    ALPC_EXPECT_EQ(file.ReadsCount, size_t{ 3 });
+    for (const std::vector<uint8_t>& fed : digests.Fed)
+    {
+        ALPC_EXPECT_TRUE(fed == file.Content);
+    }
+}
+
+ALPC_TEST(MultiDigest, EmptyFileIsNotRead)
+{
+    FixtureHashedFile file = FixtureFile(0);
+    FixtureDigests digests;
+    bool isRequested[KmHelper::MultiDigest::ALGORITHMS_COUNT] = { false };
+    bool isDirty = true;
+
+    ALPC_EXPECT_TRUE(FixtureSelect({ 1 }, isRequested));
+    ALPC_EXPECT_TRUE(FixtureHash(file, isRequested, digests, &isDirty));
+
+    ALPC_EXPECT_EQ(file.ReadsCount, size_t{ 0 });
+    ALPC_EXPECT_FALSE(isDirty);
+}
+
+ALPC_TEST(MultiDigest, FailuresStopTheHashing)
+{
+    bool isRequested[KmHelper::MultiDigest::ALGORITHMS_COUNT] = { false };
+    bool isDirty = false;
+    ALPC_EXPECT_TRUE(FixtureSelect({ 0, 2 }, isRequested));
+
+    /* The first read fails - nothing was fed, nothing to reset. */
+    FixtureHashedFile failingRead = FixtureFile(KmHelper::MultiDigest::CHUNK_SIZE * 2);
+    FixtureDigests digests;
+    failingRead.FailingRead = 0;
+    ALPC_EXPECT_FALSE(FixtureHash(failingRead, isRequested, digests, &isDirty));
+    ALPC_EXPECT_FALSE(isDirty);
+
+    /* A later read fails - the digests were fed and must be reset. */
+    failingRead.ReadsCount = 0;
+    failingRead.FailingRead = 1;
+    ALPC_EXPECT_FALSE(FixtureHash(failingRead, isRequested, digests, &isDirty));
+    ALPC_EXPECT_TRUE(isDirty);
+
+    /* A read which makes no progress. */
+    FixtureHashedFile stuck = FixtureFile(100);
+    FixtureDigests stuckDigests;
+    stuck.MaxReadSize = 0;
+    ALPC_EXPECT_FALSE(FixtureHash(stuck, isRequested, stuckDigests, &isDirty));
+    ALPC_EXPECT_EQ(stuck.ReadsCount, size_t{ 1 });
+
+    /* A read larger than the chunk. */
+    FixtureHashedFile oversized = FixtureFile(KmHelper::MultiDigest::CHUNK_SIZE * 2);
+    FixtureDigests oversizedDigests;
+    oversized.MaxReadSize = KmHelper::MultiDigest::CHUNK_SIZE + 1;
+    ALPC_EXPECT_FALSE(FixtureHash(oversized, isRequested, oversizedDigests, &isDirty));
+    ALPC_EXPECT_TRUE(oversizedDigests.Fed[0].empty());
+
+    /* A digest fails - the next ones are not fed anymore. */
+    FixtureHashedFile file = FixtureFile(100);
+    FixtureDigests failingDigest;
+    failingDigest.FailingIndex = 0;
+    ALPC_EXPECT_FALSE(FixtureHash(file, isRequested, failingDigest, &isDirty));
+    ALPC_EXPECT_TRUE(isDirty);
+    ALPC_EXPECT_TRUE(failingDigest.Fed[2].empty());
+}
+
+ALPC_TEST(MultiDigest, InvalidRequestsAreRejected)
+{
+    bool isRequested[KmHelper::MultiDigest::ALGORITHMS_COUNT] = { false };
+
+    ALPC_EXPECT_FALSE(FixtureSelect({}, isRequested));
+    ALPC_EXPECT_FALSE(FixtureSelect({ 1, 1 }, isRequested));
+    ALPC_EXPECT_FALSE(FixtureSelect({ 0, SIZE_MAX }, isRequested));
+    ALPC_EXPECT_FALSE(FixtureSelect({ KmHelper::MultiDigest::ALGORITHMS_COUNT }, isRequested));
+
+    /* A valid request clears what a previous one selected. */
+    ALPC_EXPECT_TRUE(FixtureSelect({ 1 }, isRequested));
+    ALPC_EXPECT_FALSE(isRequested[0]);
+    ALPC_EXPECT_TRUE(isRequested[1]);
+    ALPC_EXPECT_FALSE(isRequested[2]);
+}
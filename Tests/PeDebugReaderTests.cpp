@@ -0,0 +1,354 @@
+/**
+ * @file        ALPC-Tools/Tests/PeDebugReaderTests.cpp
+ *
+ * @brief       Tests for SysMon::PeDebugReader. The fixture is a small pe file built
+ *              in memory - a header, one section with the debug directory, and the
+ *              codeview record at the very end of the file.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "TestFramework.hpp"
+#include "PeDebugReader.hpp"
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+
+/**
+ * @brief   The layout of the fixture.
+ */
+static constexpr uint32_t FIXTURE_NT_HEADERS_OFFSET = 0x80;
+static constexpr uint32_t FIXTURE_SECTION_VA = 0x1000;
+static constexpr uint32_t FIXTURE_SECTION_RAW = 0x200;
+static constexpr uint32_t FIXTURE_SECTION_SIZE = 0x200;
+static constexpr uint32_t FIXTURE_CODEVIEW_RAW = 0x240;
+static constexpr uint32_t FIXTURE_SIZE_OF_IMAGE = 0x3000;
+static constexpr uint32_t FIXTURE_TIMESTAMP = 0x5F3C1A2B;
+static constexpr uint32_t FIXTURE_AGE = 3;
+
+/**
+ * @brief   The guid of the fixture pdb, as it is stored in the file.
+ */
+static constexpr uint8_t FIXTURE_GUID[16] = { 0x78, 0x56, 0x34, 0x12, 0xBC, 0x9A, 0xF0, 0xDE,
+                                              0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF };
+
+/**
+ * @brief   Offsets of the fields patched by the tests.
+ */
+static constexpr size_t FIXTURE_FILE_HEADER = FIXTURE_NT_HEADERS_OFFSET + 4;
+static constexpr size_t FIXTURE_OPTIONAL_HEADER = FIXTURE_FILE_HEADER + 20;
+static constexpr size_t FIXTURE_DEBUG_DIRECTORY = FIXTURE_SECTION_RAW;
+static constexpr size_t FIXTURE_CODEVIEW_ENTRY = FIXTURE_DEBUG_DIRECTORY + sizeof(SysMon::PeDebugReader::DebugDirectory);
+
+/**
+ * @brief   Writes a value in the fixture at a given offset.
+ */
+template <class Type>
+static void
+FixtureWrite(
+    std::vector<uint8_t>& File,
+    size_t Offset,
+    Type Value
+)
+{
+    memcpy(&File[Offset], &Value, sizeof(Value));
+}
+
+/**
+ * @brief   Offset of the debug data directory in the fixture.
+ */
+static size_t
+FixtureDebugDataDirectory(
+    bool Is64Bit
+)
+{
+    return FIXTURE_OPTIONAL_HEADER + (Is64Bit ? 112 : 96) + 6 * 8;
+}
+
+/**
+ * @brief   Builds the fixture - a 32 or a 64 bit image, with an RSDS or a NB10 record.
+ *          The file ends right after the pdb name.
+ */
+static std::vector<uint8_t>
+FixtureBuild(
+    bool Is64Bit,
+    bool IsRsds,
+    const std::string& PdbName
+)
+{
+    const uint32_t nameOffset = IsRsds ? SysMon::PeDebugReader::CODEVIEW_RSDS_NAME_OFFSET
+                                       : SysMon::PeDebugReader::CODEVIEW_NB10_NAME_OFFSET;
+    const uint32_t codeViewSize = nameOffset + static_cast<uint32_t>(PdbName.size()) + 1;
+    std::vector<uint8_t> file(FIXTURE_CODEVIEW_RAW + codeViewSize, 0);
+
+    const uint16_t sizeOfOptionalHeader = Is64Bit ? 240 : 224;
+    const uint32_t directoriesOffset = Is64Bit ? 112 : 96;
+    const size_t sectionTable = FIXTURE_OPTIONAL_HEADER + sizeOfOptionalHeader;
+
+    /* Dos header. */
+    FixtureWrite<uint16_t>(file, 0, 0x5A4D);
+    FixtureWrite<int32_t>(file, 0x3C, FIXTURE_NT_HEADERS_OFFSET);
+
+    /* Nt headers. */
+    FixtureWrite<uint32_t>(file, FIXTURE_NT_HEADERS_OFFSET, 0x00004550);
+    FixtureWrite<uint16_t>(file, FIXTURE_FILE_HEADER + 0, Is64Bit ? 0x8664 : 0x014C);
+    FixtureWrite<uint16_t>(file, FIXTURE_FILE_HEADER + 2, 1);
+    FixtureWrite<uint32_t>(file, FIXTURE_FILE_HEADER + 4, FIXTURE_TIMESTAMP);
+    FixtureWrite<uint16_t>(file, FIXTURE_FILE_HEADER + 16, sizeOfOptionalHeader);
+    FixtureWrite<uint16_t>(file, FIXTURE_OPTIONAL_HEADER + 0, Is64Bit ? 0x20B : 0x10B);
+    FixtureWrite<uint32_t>(file, FIXTURE_OPTIONAL_HEADER + 56, FIXTURE_SIZE_OF_IMAGE);
+    FixtureWrite<uint32_t>(file, FIXTURE_OPTIONAL_HEADER + 60, FIXTURE_SECTION_RAW);
+    FixtureWrite<uint32_t>(file, FIXTURE_OPTIONAL_HEADER + directoriesOffset - 4, 16);
+    FixtureWrite<uint32_t>(file, FixtureDebugDataDirectory(Is64Bit) + 0, FIXTURE_SECTION_VA);
+    FixtureWrite<uint32_t>(file, FixtureDebugDataDirectory(Is64Bit) + 4, 2 * sizeof(SysMon::PeDebugReader::DebugDirectory));
+
+    /* The only section. */
+    memcpy(&file[sectionTable], ".rdata", 6);
+    FixtureWrite<uint32_t>(file, sectionTable + 8, FIXTURE_SECTION_SIZE);
+    FixtureWrite<uint32_t>(file, sectionTable + 12, FIXTURE_SECTION_VA);
+    FixtureWrite<uint32_t>(file, sectionTable + 16, FIXTURE_SECTION_SIZE);
+    FixtureWrite<uint32_t>(file, sectionTable + 20, FIXTURE_SECTION_RAW);
+
+    /* The debug directory - a repro entry, then the codeview one. */
+    FixtureWrite<uint32_t>(file, FIXTURE_DEBUG_DIRECTORY + 12, 16);
+    FixtureWrite<uint32_t>(file, FIXTURE_CODEVIEW_ENTRY + 12, SysMon::PeDebugReader::DEBUG_TYPE_CODEVIEW);
+    FixtureWrite<uint32_t>(file, FIXTURE_CODEVIEW_ENTRY + 16, codeViewSize);
+    FixtureWrite<uint32_t>(file, FIXTURE_CODEVIEW_ENTRY + 24, FIXTURE_CODEVIEW_RAW);
+
+    /* The codeview record. */
+    if (IsRsds)
+    {
+        FixtureWrite<uint32_t>(file, FIXTURE_CODEVIEW_RAW + 0, SysMon::PeDebugReader::CODEVIEW_RSDS_SIGNATURE);
+        memcpy(&file[FIXTURE_CODEVIEW_RAW + 4], FIXTURE_GUID, sizeof(FIXTURE_GUID));
+        FixtureWrite<uint32_t>(file, FIXTURE_CODEVIEW_RAW + 20, FIXTURE_AGE);
+    }
+    else
+    {
+        FixtureWrite<uint32_t>(file, FIXTURE_CODEVIEW_RAW + 0, SysMon::PeDebugReader::CODEVIEW_NB10_SIGNATURE);
+        FixtureWrite<uint32_t>(file, FIXTURE_CODEVIEW_RAW + 8, FIXTURE_TIMESTAMP);
+        FixtureWrite<uint32_t>(file, FIXTURE_CODEVIEW_RAW + 12, FIXTURE_AGE);
+    }
+    memcpy(&file[FIXTURE_CODEVIEW_RAW + nameOffset], PdbName.c_str(), PdbName.size() + 1);
+
+    return file;
+}
+
+/**
+ * @brief   Reads from the fixture - fails outside of it, like the driver does for files.
+ */
+struct FixtureDebugReader
+{
+    const std::vector<uint8_t>& File;
+    size_t BytesRead = 0;
+
+    bool operator()(uint64_t Offset, void* Destination, size_t Size)
+    {
+        if (Offset > this->File.size() || Size > this->File.size() - Offset)
+        {
+            return false;
+        }
+        memcpy(Destination, &this->File[static_cast<size_t>(Offset)], Size);
+        this->BytesRead += Size;
+        return true;
+    }
+};
+
+/**
+ * @brief   Extracts the pdb information from the fixture.
+ */
+static bool
+FixtureRead(
+    const std::vector<uint8_t>& File,
+    SysMon::PeDebugReader::PdbInfo* Info
+)
+{
+    FixtureDebugReader reader{ File };
+    return SysMon::PeDebugReader::ReadPdbInfo(reader, Info);
+}
+
+ALPC_TEST(PeDebugReader, ReadsRsdsRecords)
+{
+    for (const bool is64Bit : { false, true })
+    {
+        const std::vector<uint8_t> file = FixtureBuild(is64Bit, true, "ntkrnlmp.pdb");
+        SysMon::PeDebugReader::PdbInfo info;
+
+        ALPC_EXPECT_TRUE(FixtureRead(file, &info));
+        ALPC_EXPECT_EQ(info.TimeDateStamp, FIXTURE_TIMESTAMP);
+        ALPC_EXPECT_EQ(info.SizeOfImage, FIXTURE_SIZE_OF_IMAGE);
+        ALPC_EXPECT_TRUE(info.HasPdbInformation);
+        ALPC_EXPECT_EQ(info.CodeViewSignature, SysMon::PeDebugReader::CODEVIEW_RSDS_SIGNATURE);
+        ALPC_EXPECT_EQ(0, memcmp(info.PdbGuid, FIXTURE_GUID, sizeof(FIXTURE_GUID)));
+        ALPC_EXPECT_EQ(info.PdbAge, FIXTURE_AGE);
+        ALPC_EXPECT_EQ(std::string(info.PdbName, info.PdbNameLength), "ntkrnlmp.pdb");
+    }
+}
+
+ALPC_TEST(PeDebugReader, ReadsNb10Records)
+{
+    const std::vector<uint8_t> file = FixtureBuild(false, false, "legacy.pdb");
+    SysMon::PeDebugReader::PdbInfo info;
+    uint32_t signature = 0;
+
+    ALPC_EXPECT_TRUE(FixtureRead(file, &info));
+    ALPC_EXPECT_TRUE(info.HasPdbInformation);
+    ALPC_EXPECT_EQ(info.CodeViewSignature, SysMon::PeDebugReader::CODEVIEW_NB10_SIGNATURE);
+    memcpy(&signature, info.PdbGuid, sizeof(signature));
+    ALPC_EXPECT_EQ(signature, FIXTURE_TIMESTAMP);
+    ALPC_EXPECT_EQ(info.PdbAge, FIXTURE_AGE);
+    ALPC_EXPECT_EQ(std::string(info.PdbName, info.PdbNameLength), "legacy.pdb");
+}
+
+ALPC_TEST(PeDebugReader, OnlyTheHeadersAreRead)
+{
+    const std::vector<uint8_t> file = FixtureBuild(true, true, "ntkrnlmp.pdb");
+    SysMon::PeDebugReader::PdbInfo info;
+    FixtureDebugReader reader{ file };
+
+    ALPC_EXPECT_TRUE(SysMon::PeDebugReader::ReadPdbInfo(reader, &info));
+
+    /* The headers, one section, two debug entries and the record - far less than the file. */
+    ALPC_EXPECT_TRUE(reader.BytesRead < 256 + sizeof(info.PdbName));
+}
+
+ALPC_TEST(PeDebugReader, ImagesWithoutPdbAreValid)
+{
+    SysMon::PeDebugReader::PdbInfo info;
+
+    /* No debug directory at all. */
+    std::vector<uint8_t> file = FixtureBuild(true, true, "ntkrnlmp.pdb");
+    FixtureWrite<uint32_t>(file, FixtureDebugDataDirectory(true) + 0, 0);
+    FixtureWrite<uint32_t>(file, FixtureDebugDataDirectory(true) + 4, 0);
+    ALPC_EXPECT_TRUE(FixtureRead(file, &info));
+    ALPC_EXPECT_FALSE(info.HasPdbInformation);
+    ALPC_EXPECT_EQ(info.TimeDateStamp, FIXTURE_TIMESTAMP);
+
+    /* Fewer data directories than the debug one. */
+    file = FixtureBuild(true, true, "ntkrnlmp.pdb");
+    FixtureWrite<uint32_t>(file, FIXTURE_OPTIONAL_HEADER + 108, 6);
+    ALPC_EXPECT_TRUE(FixtureRead(file, &info));
+    ALPC_EXPECT_FALSE(info.HasPdbInformation);
+
+    /* A debug directory without a codeview entry. */
+    file = FixtureBuild(true, true, "ntkrnlmp.pdb");
+    FixtureWrite<uint32_t>(file, FIXTURE_CODEVIEW_ENTRY + 12, 16);
+    ALPC_EXPECT_TRUE(FixtureRead(file, &info));
+    ALPC_EXPECT_FALSE(info.HasPdbInformation);
+    ALPC_EXPECT_EQ(info.PdbNameLength, 0u);
+}
+
+ALPC_TEST(PeDebugReader, RejectsTruncatedFiles)
+{
+    const std::vector<uint8_t> file = FixtureBuild(true, true, "ntkrnlmp.pdb");
+    SysMon::PeDebugReader::PdbInfo info;
+
+    /* Everything up to the name terminator is needed. */
+    for (size_t size = 0; size < file.size() - 1; ++size)
+    {
+        const std::vector<uint8_t> truncated(file.begin(), file.begin() + size);
+        ALPC_EXPECT_FALSE(FixtureRead(truncated, &info));
+    }
+}
+
+ALPC_TEST(PeDebugReader, RejectsMalformedHeaders)
+{
+    const std::vector<uint8_t> file = FixtureBuild(true, true, "ntkrnlmp.pdb");
+    SysMon::PeDebugReader::PdbInfo info;
+    std::vector<uint8_t> damaged;
+
+    /* Signatures and magics. */
+    damaged = file;
+    FixtureWrite<uint16_t>(damaged, 0, 0x4D5A);
+    ALPC_EXPECT_FALSE(FixtureRead(damaged, &info));
+
+    damaged = file;
+    FixtureWrite<int32_t>(damaged, 0x3C, -4);
+    ALPC_EXPECT_FALSE(FixtureRead(damaged, &info));
+
+    damaged = file;
+    FixtureWrite<uint32_t>(damaged, FIXTURE_NT_HEADERS_OFFSET, 0x00014550);
+    ALPC_EXPECT_FALSE(FixtureRead(damaged, &info));
+
+    damaged = file;
+    FixtureWrite<uint16_t>(damaged, FIXTURE_OPTIONAL_HEADER, 0x107);
+    ALPC_EXPECT_FALSE(FixtureRead(damaged, &info));
+
+    /* The debug data directory must be inside the optional header. */
+    damaged = file;
+    FixtureWrite<uint16_t>(damaged, FIXTURE_FILE_HEADER + 16, 112 + 6 * 8);
+    ALPC_EXPECT_FALSE(FixtureRead(damaged, &info));
+
+    /* Too many sections, or too many debug entries. */
+    damaged = file;
+    FixtureWrite<uint16_t>(damaged, FIXTURE_FILE_HEADER + 2, SysMon::PeDebugReader::MAX_SECTIONS + 1);
+    ALPC_EXPECT_FALSE(FixtureRead(damaged, &info));
+
+    damaged = file;
+    FixtureWrite<uint32_t>(damaged,
+                           FixtureDebugDataDirectory(true) + 4,
+                           (SysMon::PeDebugReader::MAX_DEBUG_ENTRIES + 1) * sizeof(SysMon::PeDebugReader::DebugDirectory));
+    ALPC_EXPECT_FALSE(FixtureRead(damaged, &info));
+
+    /* The debug directory rva is not backed by any section. */
+    damaged = file;
+    FixtureWrite<uint32_t>(damaged, FixtureDebugDataDirectory(true) + 0, 0x2800);
+    ALPC_EXPECT_FALSE(FixtureRead(damaged, &info));
+}
+
+ALPC_TEST(PeDebugReader, RejectsMalformedCodeViewRecords)
+{
+    const std::vector<uint8_t> file = FixtureBuild(true, true, "ntkrnlmp.pdb");
+    SysMon::PeDebugReader::PdbInfo info;
+    std::vector<uint8_t> damaged;
+
+    /* Too small to hold the fixed fields, or larger than any sane record. */
+    damaged = file;
+    FixtureWrite<uint32_t>(damaged, FIXTURE_CODEVIEW_ENTRY + 16, SysMon::PeDebugReader::CODEVIEW_NB10_NAME_OFFSET);
+    ALPC_EXPECT_FALSE(FixtureRead(damaged, &info));
+
+    damaged = file;
+    FixtureWrite<uint32_t>(damaged, FIXTURE_CODEVIEW_ENTRY + 16, SysMon::PeDebugReader::CODEVIEW_RSDS_NAME_OFFSET);
+    ALPC_EXPECT_FALSE(FixtureRead(damaged, &info));
+
+    damaged = file;
+    FixtureWrite<uint32_t>(damaged, FIXTURE_CODEVIEW_ENTRY + 16, SysMon::PeDebugReader::MAX_CODEVIEW_SIZE + 1);
+    ALPC_EXPECT_FALSE(FixtureRead(damaged, &info));
+
+    /* The record points past the end of the file. */
+    damaged = file;
+    FixtureWrite<uint32_t>(damaged, FIXTURE_CODEVIEW_ENTRY + 24, 0xFFFFFFF0);
+    ALPC_EXPECT_FALSE(FixtureRead(damaged, &info));
+
+    /* NB09 and the other codeview formats don't point to a pdb. */
+    damaged = file;
+    FixtureWrite<uint32_t>(damaged, FIXTURE_CODEVIEW_RAW, 0x3930424E);
+    ALPC_EXPECT_FALSE(FixtureRead(damaged, &info));
+}
+
+ALPC_TEST(PeDebugReader, PdbNameIsBounded)
+{
+    SysMon::PeDebugReader::PdbInfo info;
+
+    /* The terminator is missing - the name ends with the record. */
+    std::vector<uint8_t> file = FixtureBuild(true, true, "short.pdb");
+    file.back() = 'x';
+    ALPC_EXPECT_TRUE(FixtureRead(file, &info));
+    ALPC_EXPECT_EQ(std::string(info.PdbName, info.PdbNameLength), "short.pdbx");
+    ALPC_EXPECT_EQ(info.PdbName[info.PdbNameLength], '\0');
+
+    /* The longest accepted name. */
+    const std::string longest(SysMon::PeDebugReader::MAX_PDB_NAME_LENGTH, 'a');
+    ALPC_EXPECT_TRUE(FixtureRead(FixtureBuild(true, true, longest), &info));
+    ALPC_EXPECT_EQ(info.PdbNameLength, SysMon::PeDebugReader::MAX_PDB_NAME_LENGTH);
+
+    /* One more character does not fit. */
+    ALPC_EXPECT_FALSE(FixtureRead(FixtureBuild(true, true, longest + "a"), &info));
+}
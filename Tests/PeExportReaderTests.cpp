@@ -0,0 +1,266 @@
+/**
+ * @file        ALPC-Tools/Tests/PeExportReaderTests.cpp
+ *
+ * @brief       Tests for SysMon::PeExportReader. The fixture is a small pe file built
+ *              in memory - a header, one section with the export directory, and nothing else.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "TestFramework.hpp"
+#include "PeExportReader.hpp"
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+
+/**
+ * @brief   The layout of the fixture.
+ */
+static constexpr uint32_t FIXTURE_NT_HEADERS_OFFSET = 0x80;
+static constexpr uint32_t FIXTURE_SECTION_VA = 0x1000;
+static constexpr uint32_t FIXTURE_SECTION_RAW = 0x200;
+static constexpr uint32_t FIXTURE_SECTION_SIZE = 0x200;
+static constexpr uint32_t FIXTURE_EXPORT_SIZE = 0x100;
+static constexpr uint32_t FIXTURE_SIZE_OF_IMAGE = 0x3000;
+static constexpr uint32_t FIXTURE_TIMESTAMP = 0x5F3C1A2B;
+
+/**
+ * @brief   The exports of the fixture, sorted by name as the linker emits them.
+ *          Beta is forwarded - its rva points inside the export directory.
+ */
+static constexpr uint32_t FIXTURE_ALPHA_RVA = 0x2000;
+static constexpr uint32_t FIXTURE_LOAD_LIBRARY_RVA = 0x2040;
+
+/**
+ * @brief   Writes a value in the fixture at a given offset.
+ */
+template <class Type>
+static void
+FixtureWrite(
+    std::vector<uint8_t>& File,
+    size_t Offset,
+    Type Value
+)
+{
+    memcpy(&File[Offset], &Value, sizeof(Value));
+}
+
+/**
+ * @brief   Translates an rva of the only section to its offset in the fixture.
+ */
+static size_t
+FixtureOffset(
+    uint32_t Rva
+)
+{
+    return FIXTURE_SECTION_RAW + (Rva - FIXTURE_SECTION_VA);
+}
+
+/**
+ * @brief   Builds the fixture - a 32 or a 64 bit image.
+ */
+static std::vector<uint8_t>
+FixtureBuild(
+    bool Is64Bit
+)
+{
+    std::vector<uint8_t> file(FIXTURE_SECTION_RAW + FIXTURE_SECTION_SIZE, 0);
+
+    const uint16_t machine = Is64Bit ? 0x8664 : 0x014C;
+    const uint16_t sizeOfOptionalHeader = Is64Bit ? 240 : 224;
+    const uint32_t directoriesOffset = Is64Bit ? 112 : 96;
+    const size_t fileHeader = FIXTURE_NT_HEADERS_OFFSET + 4;
+    const size_t optionalHeader = fileHeader + 20;
+    const size_t sectionTable = optionalHeader + sizeOfOptionalHeader;
+
+    /* Dos header. */
+    FixtureWrite<uint16_t>(file, 0, 0x5A4D);
+    FixtureWrite<int32_t>(file, 0x3C, FIXTURE_NT_HEADERS_OFFSET);
+
+    /* Nt headers. */
+    FixtureWrite<uint32_t>(file, FIXTURE_NT_HEADERS_OFFSET, 0x00004550);
+    FixtureWrite<uint16_t>(file, fileHeader + 0, machine);
+    FixtureWrite<uint16_t>(file, fileHeader + 2, 1);
+    FixtureWrite<uint32_t>(file, fileHeader + 4, FIXTURE_TIMESTAMP);
+    FixtureWrite<uint16_t>(file, fileHeader + 16, sizeOfOptionalHeader);
+    FixtureWrite<uint16_t>(file, optionalHeader + 0, Is64Bit ? 0x20B : 0x10B);
+    FixtureWrite<uint32_t>(file, optionalHeader + 56, FIXTURE_SIZE_OF_IMAGE);
+    FixtureWrite<uint32_t>(file, optionalHeader + 60, FIXTURE_SECTION_RAW);
+    FixtureWrite<uint32_t>(file, optionalHeader + directoriesOffset + 0, FIXTURE_SECTION_VA);
+    FixtureWrite<uint32_t>(file, optionalHeader + directoriesOffset + 4, FIXTURE_EXPORT_SIZE);
+
+    /* The only section. */
+    memcpy(&file[sectionTable], ".rdata", 6);
+    FixtureWrite<uint32_t>(file, sectionTable + 8, FIXTURE_SECTION_SIZE);
+    FixtureWrite<uint32_t>(file, sectionTable + 12, FIXTURE_SECTION_VA);
+    FixtureWrite<uint32_t>(file, sectionTable + 16, FIXTURE_SECTION_SIZE);
+    FixtureWrite<uint32_t>(file, sectionTable + 20, FIXTURE_SECTION_RAW);
+
+    /* The export directory, followed by its tables and names. */
+    const uint32_t functionsRva = FIXTURE_SECTION_VA + 0x28;
+    const uint32_t namesRva = FIXTURE_SECTION_VA + 0x40;
+    const uint32_t ordinalsRva = FIXTURE_SECTION_VA + 0x50;
+    const uint32_t stringsRva = FIXTURE_SECTION_VA + 0x60;
+    const char* names[] = { "Alpha", "Beta", "LoadLibraryExW" };
+    const uint32_t functions[] = { FIXTURE_ALPHA_RVA,
+                                   FIXTURE_SECTION_VA + 0xA0,
+                                   FIXTURE_LOAD_LIBRARY_RVA };
+
+    const size_t exportDirectory = FixtureOffset(FIXTURE_SECTION_VA);
+    FixtureWrite<uint32_t>(file, exportDirectory + 16, 1);
+    FixtureWrite<uint32_t>(file, exportDirectory + 20, 3);
+    FixtureWrite<uint32_t>(file, exportDirectory + 24, 3);
+    FixtureWrite<uint32_t>(file, exportDirectory + 28, functionsRva);
+    FixtureWrite<uint32_t>(file, exportDirectory + 32, namesRva);
+    FixtureWrite<uint32_t>(file, exportDirectory + 36, ordinalsRva);
+
+    uint32_t stringRva = stringsRva;
+    for (uint16_t i = 0; i < 3; ++i)
+    {
+        FixtureWrite<uint32_t>(file, FixtureOffset(functionsRva) + i * 4, functions[i]);
+        FixtureWrite<uint32_t>(file, FixtureOffset(namesRva) + i * 4, stringRva);
+        FixtureWrite<uint16_t>(file, FixtureOffset(ordinalsRva) + i * 2, i);
+
+        memcpy(&file[FixtureOffset(stringRva)], names[i], strlen(names[i]) + 1);
+        stringRva += static_cast<uint32_t>(strlen(names[i]) + 1);
+    }
+    memcpy(&file[FixtureOffset(FIXTURE_SECTION_VA + 0xA0)], "OTHER.Beta", 11);
+
+    return file;
+}
+
+/**
+ * @brief   Reads from the fixture - fails outside of it, like the driver does for files.
+ */
+struct FixtureReader
+{
+    const std::vector<uint8_t>& File;
+    size_t Reads = 0;
+
+    bool operator()(uint64_t Offset, void* Destination, size_t Size)
+    {
+        this->Reads++;
+        if (Offset > this->File.size() || Size > this->File.size() - Offset)
+        {
+            return false;
+        }
+        memcpy(Destination, &this->File[static_cast<size_t>(Offset)], Size);
+        return true;
+    }
+};
+
+ALPC_TEST(PeExportReader, FindsExportIn64BitImage)
+{
+    const std::vector<uint8_t> file = FixtureBuild(true);
+    FixtureReader reader{ file };
+    SysMon::PeExportReader::ImageIdentity identity;
+    uint32_t rva = 0;
+
+    ALPC_EXPECT_TRUE(SysMon::PeExportReader::FindExport(reader, "LoadLibraryExW", &identity, &rva));
+    ALPC_EXPECT_EQ(rva, FIXTURE_LOAD_LIBRARY_RVA);
+    ALPC_EXPECT_EQ(identity.TimeDateStamp, FIXTURE_TIMESTAMP);
+    ALPC_EXPECT_EQ(identity.SizeOfImage, FIXTURE_SIZE_OF_IMAGE);
+    ALPC_EXPECT_EQ(identity.Machine, 0x8664);
+
+    ALPC_EXPECT_TRUE(SysMon::PeExportReader::FindExport(reader, "Alpha", &identity, &rva));
+    ALPC_EXPECT_EQ(rva, FIXTURE_ALPHA_RVA);
+}
+
+ALPC_TEST(PeExportReader, FindsExportIn32BitImage)
+{
+    const std::vector<uint8_t> file = FixtureBuild(false);
+    FixtureReader reader{ file };
+    SysMon::PeExportReader::ImageIdentity identity;
+    uint32_t rva = 0;
+
+    ALPC_EXPECT_TRUE(SysMon::PeExportReader::FindExport(reader, "LoadLibraryExW", &identity, &rva));
+    ALPC_EXPECT_EQ(rva, FIXTURE_LOAD_LIBRARY_RVA);
+    ALPC_EXPECT_EQ(identity.Machine, 0x014C);
+}
+
+ALPC_TEST(PeExportReader, NamesAreExactAndCaseSensitive)
+{
+    const std::vector<uint8_t> file = FixtureBuild(true);
+    FixtureReader reader{ file };
+    SysMon::PeExportReader::ImageIdentity identity;
+    uint32_t rva = 0;
+
+    ALPC_EXPECT_FALSE(SysMon::PeExportReader::FindExport(reader, "LoadLibraryEx", &identity, &rva));
+    ALPC_EXPECT_FALSE(SysMon::PeExportReader::FindExport(reader, "LoadLibraryExWW", &identity, &rva));
+    ALPC_EXPECT_FALSE(SysMon::PeExportReader::FindExport(reader, "loadlibraryexw", &identity, &rva));
+    ALPC_EXPECT_FALSE(SysMon::PeExportReader::FindExport(reader, "Zeta", &identity, &rva));
+    ALPC_EXPECT_FALSE(SysMon::PeExportReader::FindExport(reader, "", &identity, &rva));
+    ALPC_EXPECT_EQ(rva, 0u);
+}
+
+ALPC_TEST(PeExportReader, ForwardedExportIsNotReturned)
+{
+    const std::vector<uint8_t> file = FixtureBuild(true);
+    FixtureReader reader{ file };
+    SysMon::PeExportReader::ImageIdentity identity;
+    uint32_t rva = 0;
+
+    ALPC_EXPECT_FALSE(SysMon::PeExportReader::FindExport(reader, "Beta", &identity, &rva));
+}
+
+ALPC_TEST(PeExportReader, OnlyAFewNamesAreRead)
+{
+    const std::vector<uint8_t> file = FixtureBuild(true);
+    FixtureReader reader{ file };
+    SysMon::PeExportReader::ImageIdentity identity;
+    uint32_t rva = 0;
+
+    ALPC_EXPECT_TRUE(SysMon::PeExportReader::FindExport(reader, "LoadLibraryExW", &identity, &rva));
+
+    /* 11 reads for the headers and the directory, then 2 per probed name and 2 for the function. */
+    ALPC_EXPECT_TRUE(reader.Reads <= 11 + 2 * 2 + 2);
+}
+
+ALPC_TEST(PeExportReader, RejectsMalformedFiles)
+{
+    SysMon::PeExportReader::ImageIdentity identity;
+    uint32_t rva = 0;
+
+    /* Not a pe. */
+    std::vector<uint8_t> file = FixtureBuild(true);
+    file[0] = 'X';
+    FixtureReader badDos{ file };
+    ALPC_EXPECT_FALSE(SysMon::PeExportReader::FindExport(badDos, "Alpha", &identity, &rva));
+
+    /* Nt headers outside of the file. */
+    file = FixtureBuild(true);
+    FixtureWrite<int32_t>(file, 0x3C, 0x7FFFFFF0);
+    FixtureReader badNt{ file };
+    ALPC_EXPECT_FALSE(SysMon::PeExportReader::FindExport(badNt, "Alpha", &identity, &rva));
+
+    /* Names array pointing outside of the file. */
+    file = FixtureBuild(true);
+    FixtureWrite<uint32_t>(file, FixtureOffset(FIXTURE_SECTION_VA) + 32, 0xFFFFFF00);
+    FixtureReader badNames{ file };
+    ALPC_EXPECT_FALSE(SysMon::PeExportReader::FindExport(badNames, "Alpha", &identity, &rva));
+
+    /* An ordinal past the functions. */
+    file = FixtureBuild(true);
+    FixtureWrite<uint16_t>(file, FixtureOffset(FIXTURE_SECTION_VA + 0x50), 7);
+    FixtureReader badOrdinal{ file };
+    ALPC_EXPECT_FALSE(SysMon::PeExportReader::FindExport(badOrdinal, "Alpha", &identity, &rva));
+
+    /* A function past the image. */
+    file = FixtureBuild(true);
+    FixtureWrite<uint32_t>(file, FixtureOffset(FIXTURE_SECTION_VA + 0x28), FIXTURE_SIZE_OF_IMAGE);
+    FixtureReader badFunction{ file };
+    ALPC_EXPECT_FALSE(SysMon::PeExportReader::FindExport(badFunction, "Alpha", &identity, &rva));
+
+    /* Truncated in the middle of the export directory. */
+    file = FixtureBuild(true);
+    file.resize(FixtureOffset(FIXTURE_SECTION_VA) + 8);
+    FixtureReader truncated{ file };
+    ALPC_EXPECT_FALSE(SysMon::PeExportReader::FindExport(truncated, "Alpha", &identity, &rva));
+}
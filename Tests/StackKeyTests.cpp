@@ -0,0 +1,160 @@
+/**
+ * @file        ALPC-Tools/Tests/StackKeyTests.cpp
+ *
+ * @brief       Tests for SysMon::StackKey - the stack ids and the comparison used by the
+ *              stack store to deduplicate the captured stacks.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "TestFramework.hpp"
+#include "StackKey.hpp"
+
+#include <stdint.h>
+#include <vector>
+
+
+/**
+ * @brief   The path hashes of the modules in the fixture.
+ */
+static constexpr uint32_t FIXTURE_NTDLL_HASH = 0x1A2B3C4D;
+static constexpr uint32_t FIXTURE_KERNEL32_HASH = 0x5E6F7A8B;
+
+/**
+ * @brief   A frame inside a module, loaded at a given base.
+ */
+static SysMon::StackKey::Frame
+FixtureModuleFrame(
+    uint64_t ModuleBase,
+    uint32_t PathHash,
+    uint32_t Rva
+)
+{
+    SysMon::StackKey::Frame frame;
+    frame.Address = ModuleBase + Rva;
+    frame.PathHash = PathHash;
+    frame.Rva = Rva;
+    return frame;
+}
+
+/**
+ * @brief   A frame outside of any known module.
+ */
+static SysMon::StackKey::Frame
+FixtureRawFrame(
+    uint64_t Address
+)
+{
+    SysMon::StackKey::Frame frame;
+    frame.Address = Address;
+    return frame;
+}
+
+/**
+ * @brief   The same call site, with ntdll and kernel32 loaded at the given bases.
+ */
+static std::vector<SysMon::StackKey::Frame>
+FixtureStack(
+    uint64_t NtdllBase,
+    uint64_t Kernel32Base
+)
+{
+    return {
+        FixtureModuleFrame(NtdllBase, FIXTURE_NTDLL_HASH, 0x1234),
+        FixtureModuleFrame(Kernel32Base, FIXTURE_KERNEL32_HASH, 0x40),
+        FixtureModuleFrame(NtdllBase, FIXTURE_NTDLL_HASH, 0x9F00),
+        FixtureRawFrame(0xFFFFF80012345678),
+    };
+}
+
+static uint64_t
+FixtureStackId(
+    const std::vector<SysMon::StackKey::Frame>& Stack
+)
+{
+    return SysMon::StackKey::ComputeStackId(Stack.size(),
+                                            [&Stack](size_t Index) { return Stack[Index]; });
+}
+
+static bool
+FixtureIsSameStack(
+    const std::vector<SysMon::StackKey::Frame>& Left,
+    const std::vector<SysMon::StackKey::Frame>& Right
+)
+{
+    return SysMon::StackKey::IsSameStack(Left.size(),
+                                         [&Left](size_t Index) { return Left[Index]; },
+                                         Right.size(),
+                                         [&Right](size_t Index) { return Right[Index]; });
+}
+
+ALPC_TEST(StackKey, SameCallSiteInDifferentProcessesIsOneStack)
+{
+    const std::vector<SysMon::StackKey::Frame> first = FixtureStack(0x7FFE00000000, 0x7FFD00000000);
+    const std::vector<SysMon::StackKey::Frame> second = FixtureStack(0x7FF900000000, 0x7FF800000000);
+
+    ALPC_EXPECT_EQ(FixtureStackId(first), FixtureStackId(second));
+    ALPC_EXPECT_TRUE(FixtureIsSameStack(first, second));
+}
+
+ALPC_TEST(StackKey, DifferentFramesAreDifferentStacks)
+{
+    const std::vector<SysMon::StackKey::Frame> stack = FixtureStack(0x7FFE00000000, 0x7FFD00000000);
+
+    /* Another rva in the same module. */
+    std::vector<SysMon::StackKey::Frame> other = stack;
+    other[1].Rva += 4;
+    ALPC_EXPECT_TRUE(FixtureStackId(stack) != FixtureStackId(other));
+    ALPC_EXPECT_FALSE(FixtureIsSameStack(stack, other));
+
+    /* The same rva in another module. */
+    other = stack;
+    other[0].PathHash = FIXTURE_KERNEL32_HASH;
+    ALPC_EXPECT_TRUE(FixtureStackId(stack) != FixtureStackId(other));
+    ALPC_EXPECT_FALSE(FixtureIsSameStack(stack, other));
+
+    /* Frames outside of modules are compared by address. */
+    other = stack;
+    other[3].Address += 8;
+    ALPC_EXPECT_TRUE(FixtureStackId(stack) != FixtureStackId(other));
+    ALPC_EXPECT_FALSE(FixtureIsSameStack(stack, other));
+
+    /* One frame less. */
+    other = stack;
+    other.pop_back();
+    ALPC_EXPECT_TRUE(FixtureStackId(stack) != FixtureStackId(other));
+    ALPC_EXPECT_FALSE(FixtureIsSameStack(stack, other));
+
+    /* The order matters. */
+    other = stack;
+    const SysMon::StackKey::Frame first = other[0];
+    other[0] = other[1];
+    other[1] = first;
+    ALPC_EXPECT_TRUE(FixtureStackId(stack) != FixtureStackId(other));
+    ALPC_EXPECT_FALSE(FixtureIsSameStack(stack, other));
+}
+
+ALPC_TEST(StackKey, ModuleFramesIgnoreTheAddress)
+{
+    const SysMon::StackKey::Frame inModule = FixtureModuleFrame(0x10000, FIXTURE_NTDLL_HASH, 0x20);
+    SysMon::StackKey::Frame moved = inModule;
+    moved.Address = 0x90020;
+
+    ALPC_EXPECT_TRUE(SysMon::StackKey::IsSameFrame(inModule, moved));
+
+    /* A raw frame is never the same as a module frame, even at the same address. */
+    ALPC_EXPECT_FALSE(SysMon::StackKey::IsSameFrame(inModule, FixtureRawFrame(inModule.Address)));
+}
+
+ALPC_TEST(StackKey, StackIdIsNeverZero)
+{
+    const std::vector<SysMon::StackKey::Frame> empty;
+
+    ALPC_EXPECT_TRUE(0 != FixtureStackId(empty));
+    ALPC_EXPECT_TRUE(FixtureIsSameStack(empty, empty));
+}
@@ -0,0 +1,347 @@
+/**
+ * @file        ALPC-Tools/Tests/SymbolTableCodecTests.cpp
+ *
+ * @brief       Tests for SysMon::SymbolTableCodec - the packed symbols of a module
+ *              and the rva to name lookup done over them.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "TestFramework.hpp"
+#include "SymbolTableCodec.hpp"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+
+/**
+ * @brief   A symbol as it comes from the pdb.
+ */
+struct FixturePdbSymbol
+{
+    uint64_t Rva;
+    std::string Name;
+};
+
+/**
+ * @brief   The packed form of a list of symbols - what SymbolTable keeps.
+ */
+struct FixturePackedSymbols
+{
+    size_t SymbolsCount = 0;
+    std::vector<SysMon::SymbolTableCodec::Block> Blocks;
+    std::vector<uint8_t> Deltas;
+    std::vector<uint8_t> Names;
+
+    size_t
+    Size(
+        void
+    ) const
+    {
+        return this->Blocks.size() * sizeof(SysMon::SymbolTableCodec::Block) + this->Deltas.size() + this->Names.size();
+    }
+};
+
+/**
+ * @brief   Packs the symbols the same way SymbolTable::Create does.
+ */
+static bool
+FixturePack(
+    const std::vector<FixturePdbSymbol>& Symbols,
+    FixturePackedSymbols* Packed
+)
+{
+    const auto symbolAt = [&Symbols](size_t Index)
+    {
+        SysMon::SymbolTableCodec::SymbolView view;
+        view.Rva = Symbols[Index].Rva;
+        view.Name = Symbols[Index].Name.data();
+        view.NameLength = Symbols[Index].Name.size();
+        return view;
+    };
+    auto onBlock = [&Packed](const SysMon::SymbolTableCodec::Block& NewBlock)
+    {
+        Packed->Blocks.push_back(NewBlock);
+        return true;
+    };
+
+    size_t blocksCount = 0;
+    size_t deltasSize = 0;
+    size_t namesSize = 0;
+    size_t deltasWritten = 0;
+    size_t namesWritten = 0;
+
+    if (!SysMon::SymbolTableCodec::ComputeSizes(Symbols.size(), symbolAt, &blocksCount, &deltasSize, &namesSize))
+    {
+        return false;
+    }
+    Packed->SymbolsCount = Symbols.size();
+    Packed->Deltas.resize(deltasSize);
+    Packed->Names.resize(namesSize);
+
+    if (!SysMon::SymbolTableCodec::Encode(Symbols.size(),
+                                          symbolAt,
+                                          onBlock,
+                                          Packed->Deltas.data(),
+                                          Packed->Names.data(),
+                                          &deltasWritten,
+                                          &namesWritten))
+    {
+        return false;
+    }
+    return Packed->Blocks.size() == blocksCount && deltasWritten == deltasSize && namesWritten == namesSize;
+}
+
+/**
+ * @brief   Looks up an rva the same way SymbolTable::Find does.
+ */
+static SysMon::SymbolTableCodec::FindResult
+FixtureFind(
+    const FixturePackedSymbols& Packed,
+    uint64_t Rva,
+    uint32_t* SymbolRva,
+    std::string* SymbolName
+)
+{
+    SysMon::SymbolTableCodec::Blobs blobs;
+    blobs.SymbolsCount = Packed.SymbolsCount;
+    blobs.BlocksCount = Packed.Blocks.size();
+    blobs.Deltas = Packed.Deltas.data();
+    blobs.DeltasSize = Packed.Deltas.size();
+    blobs.Names = Packed.Names.data();
+    blobs.NamesSize = Packed.Names.size();
+
+    char name[SysMon::SymbolTableCodec::MAX_NAME_LENGTH] = { 0 };
+    size_t nameLength = 0;
+
+    const SysMon::SymbolTableCodec::FindResult result = SysMon::SymbolTableCodec::Find(
+                                                            blobs,
+                                                            [&Packed](size_t Index) -> const SysMon::SymbolTableCodec::Block&
+                                                            {
+                                                                return Packed.Blocks[Index];
+                                                            },
+                                                            Rva,
+                                                            SymbolRva,
+                                                            name,
+                                                            &nameLength);
+    SymbolName->assign(name, nameLength);
+    return result;
+}
+
+/**
+ * @brief   The naive lookup - the last symbol with an rva smaller or equal to the given one.
+ */
+static const FixturePdbSymbol*
+FixtureReferenceFind(
+    const std::vector<FixturePdbSymbol>& Symbols,
+    uint64_t Rva
+)
+{
+    const FixturePdbSymbol* found = nullptr;
+    for (const FixturePdbSymbol& symbol : Symbols)
+    {
+        if (symbol.Rva > Rva)
+        {
+            break;
+        }
+        found = &symbol;
+    }
+    return found;
+}
+
+/**
+ * @brief   Something close to what a pdb gives - methods of the same class are laid out together,
+ *          so neighbouring names share long prefixes. Not a multiple of BLOCK_SIZE on purpose.
+ */
+static std::vector<FixturePdbSymbol>
+FixtureModuleSymbols(
+    void
+)
+{
+    std::vector<FixturePdbSymbol> symbols;
+    uint64_t rva = 0x1000;
+    uint32_t seed = 0x2545F491;
+
+    for (uint32_t cls = 0; cls < 37; ++cls)
+    {
+        for (uint32_t method = 0; method < 23; ++method)
+        {
+            char name[128] = { 0 };
+            snprintf(name, sizeof(name), "SysMon::Component%02u::HandleRequest%03u", cls, method);
+            symbols.push_back({ rva, name });
+
+            seed = seed * 1103515245 + 12345;
+            rva += 0x10 + ((seed >> 16) % 0x400);
+        }
+    }
+    return symbols;
+}
+
+ALPC_TEST(SymbolTableCodec, LookupMatchesTheNaiveSearch)
+{
+    const std::vector<FixturePdbSymbol> symbols = FixtureModuleSymbols();
+    FixturePackedSymbols packed;
+    ALPC_EXPECT_TRUE(FixturePack(symbols, &packed));
+
+    /* Every symbol, right before it, right after it and past the last one. */
+    std::vector<uint64_t> probes;
+    for (const FixturePdbSymbol& symbol : symbols)
+    {
+        probes.push_back(symbol.Rva - 1);
+        probes.push_back(symbol.Rva);
+        probes.push_back(symbol.Rva + 1);
+    }
+    probes.push_back(0);
+    probes.push_back(symbols.back().Rva + 0x100000);
+    probes.push_back(UINT64_MAX);
+
+    size_t mismatches = 0;
+    for (uint64_t probe : probes)
+    {
+        uint32_t symbolRva = 0;
+        std::string symbolName;
+        const SysMon::SymbolTableCodec::FindResult result = FixtureFind(packed, probe, &symbolRva, &symbolName);
+        const FixturePdbSymbol* expected = FixtureReferenceFind(symbols, probe);
+
+        if (nullptr == expected)
+        {
+            mismatches += (result != SysMon::SymbolTableCodec::FindResult::kNotFound) ? 1 : 0;
+        }
+        else
+        {
+            mismatches += (result != SysMon::SymbolTableCodec::FindResult::kFound ||
+                           symbolRva != expected->Rva ||
+                           symbolName != expected->Name) ? 1 : 0;
+        }
+    }
+    ALPC_EXPECT_EQ(mismatches, size_t{ 0 });
+}
+
+ALPC_TEST(SymbolTableCodec, PackedTableIsSmallerThanFlatNames)
+{
+    const std::vector<FixturePdbSymbol> symbols = FixtureModuleSymbols();
+    FixturePackedSymbols packed;
+    ALPC_EXPECT_TRUE(FixturePack(symbols, &packed));
+
+    /* The flat layout - an rva and a null terminated name per symbol, without any allocator overhead. */
+    size_t flatSize = 0;
+    for (const FixturePdbSymbol& symbol : symbols)
+    {
+        flatSize += sizeof(uint32_t) + symbol.Name.size() + 1;
+    }
+
+    printf("    %zu symbols: packed %zu bytes, flat %zu bytes\n", symbols.size(), packed.Size(), flatSize);
+    ALPC_EXPECT_TRUE(packed.Size() * 2 < flatSize);
+}
+
+ALPC_TEST(SymbolTableCodec, DuplicateRvasResolveToTheLastOne)
+{
+    std::vector<FixturePdbSymbol> symbols;
+    for (uint32_t i = 0; i < 40; ++i)
+    {
+        /* Aliases which straddle the block boundaries. */
+        symbols.push_back({ 0x2000 + (i / 3) * 0x10, "Alias" + std::to_string(i) });
+    }
+    FixturePackedSymbols packed;
+    ALPC_EXPECT_TRUE(FixturePack(symbols, &packed));
+
+    for (const FixturePdbSymbol& symbol : symbols)
+    {
+        uint32_t symbolRva = 0;
+        std::string symbolName;
+
+        ALPC_EXPECT_TRUE(SysMon::SymbolTableCodec::FindResult::kFound == FixtureFind(packed, symbol.Rva, &symbolRva, &symbolName));
+        ALPC_EXPECT_EQ(uint64_t{ symbolRva }, symbol.Rva);
+        ALPC_EXPECT_TRUE(symbolName == FixtureReferenceFind(symbols, symbol.Rva)->Name);
+    }
+}
+
+ALPC_TEST(SymbolTableCodec, LongNamesAreTruncated)
+{
+    const std::string longName(SysMon::SymbolTableCodec::MAX_NAME_LENGTH + 100, 'x');
+    const std::vector<FixturePdbSymbol> symbols = { { 0x100, longName }, { 0x200, longName + "y" }, { 0x300, "" } };
+    FixturePackedSymbols packed;
+    ALPC_EXPECT_TRUE(FixturePack(symbols, &packed));
+
+    uint32_t symbolRva = 0;
+    std::string symbolName;
+
+    ALPC_EXPECT_TRUE(SysMon::SymbolTableCodec::FindResult::kFound == FixtureFind(packed, 0x250, &symbolRva, &symbolName));
+    ALPC_EXPECT_EQ(symbolRva, uint32_t{ 0x200 });
+    ALPC_EXPECT_TRUE(symbolName == longName.substr(0, SysMon::SymbolTableCodec::MAX_NAME_LENGTH));
+
+    ALPC_EXPECT_TRUE(SysMon::SymbolTableCodec::FindResult::kFound == FixtureFind(packed, 0x300, &symbolRva, &symbolName));
+    ALPC_EXPECT_TRUE(symbolName.empty());
+}
+
+ALPC_TEST(SymbolTableCodec, InvalidInputIsRejected)
+{
+    FixturePackedSymbols packed;
+
+    /* Not sorted by rva. */
+    ALPC_EXPECT_FALSE(FixturePack({ { 0x200, "b" }, { 0x100, "a" } }, &packed));
+
+    /* The rvas are kept on 32 bits. */
+    ALPC_EXPECT_FALSE(FixturePack({ { uint64_t{ UINT32_MAX } + 1, "a" } }, &packed));
+
+    /* An empty table finds nothing. */
+    FixturePackedSymbols empty;
+    ALPC_EXPECT_TRUE(FixturePack({}, &empty));
+
+    uint32_t symbolRva = 0;
+    std::string symbolName;
+    ALPC_EXPECT_TRUE(SysMon::SymbolTableCodec::FindResult::kNotFound == FixtureFind(empty, 0x1000, &symbolRva, &symbolName));
+}
+
+ALPC_TEST(SymbolTableCodec, CorruptBlobsAreReported)
+{
+    const std::vector<FixturePdbSymbol> symbols = FixtureModuleSymbols();
+    FixturePackedSymbols packed;
+    ALPC_EXPECT_TRUE(FixturePack(symbols, &packed));
+
+    uint32_t symbolRva = 0;
+    std::string symbolName;
+
+    /* Truncated names - the lookups in the last block run out of data. */
+    FixturePackedSymbols truncated = packed;
+    truncated.Names.resize(truncated.Names.size() / 2);
+    ALPC_EXPECT_TRUE(SysMon::SymbolTableCodec::FindResult::kCorrupt == FixtureFind(truncated,
+                                                                                   symbols.back().Rva,
+                                                                                   &symbolRva,
+                                                                                   &symbolName));
+
+    /* A prefix longer than the previous name. */
+    FixturePackedSymbols badPrefix = packed;
+    badPrefix.Names[badPrefix.Blocks[0].NamesOffset] = 0x05;
+    ALPC_EXPECT_TRUE(SysMon::SymbolTableCodec::FindResult::kCorrupt == FixtureFind(badPrefix,
+                                                                                   symbols[0].Rva,
+                                                                                   &symbolRva,
+                                                                                   &symbolName));
+
+    /* More blocks than symbols. */
+    FixturePackedSymbols badCount = packed;
+    badCount.SymbolsCount = SysMon::SymbolTableCodec::BLOCK_SIZE;
+    ALPC_EXPECT_TRUE(SysMon::SymbolTableCodec::FindResult::kCorrupt == FixtureFind(badCount,
+                                                                                   symbols.back().Rva,
+                                                                                   &symbolRva,
+                                                                                   &symbolName));
+
+    /* Any garbage in the blobs is either decoded or reported, never read past them. */
+    uint32_t seed = 0x1234567;
+    for (size_t i = 0; i < packed.Names.size(); i += 7)
+    {
+        FixturePackedSymbols garbage = packed;
+        seed = seed * 1103515245 + 12345;
+        garbage.Names[i] = static_cast<uint8_t>(seed >> 16);
+        garbage.Deltas[i % garbage.Deltas.size()] = static_cast<uint8_t>(seed >> 24) | 0x80;
+
+        (void) FixtureFind(garbage, symbols[(i * 13) % symbols.size()].Rva, &symbolRva, &symbolName);
+    }
+}
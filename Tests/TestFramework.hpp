@@ -0,0 +1,91 @@
+/**
+ * @file        ALPC-Tools/Tests/TestFramework.hpp
+ *
+ * @brief       A minimal test framework for the portable unit tests.
+ *              Tests register themselves and are run from Main.cpp.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <vector>
+
+
+namespace AlpcTests
+{
+/**
+ * @brief   A registered test.
+ */
+struct TestCase
+{
+    const char* Name;
+    void (*Routine)(void);
+};
+
+/**
+ * @brief   All the registered tests.
+ */
+inline std::vector<AlpcTests::TestCase>&
+Tests(
+    void
+)
+{
+    static std::vector<AlpcTests::TestCase> tests;
+    return tests;
+}
+
+/**
+ * @brief   How many checks failed in the current run.
+ */
+inline int&
+FailedChecks(
+    void
+)
+{
+    static int failedChecks = 0;
+    return failedChecks;
+}
+
+/**
+ * @brief   Registers a test when constructed - used by ALPC_TEST.
+ */
+struct TestRegistrar
+{
+    TestRegistrar(const char* Name, void (*Routine)(void))
+    {
+        AlpcTests::Tests().push_back(AlpcTests::TestCase{ Name, Routine });
+    }
+};
+};  // namespace AlpcTests
+
+/**
+ * @brief   Defines and registers a test.
+ */
+#define ALPC_TEST(Suite, Name)                                                              \
+    static void Suite##_##Name(void);                                                       \
+    static AlpcTests::TestRegistrar gRegistrar_##Suite##_##Name{ #Suite "." #Name,          \
+                                                                 Suite##_##Name };          \
+    static void Suite##_##Name(void)
+
+/**
+ * @brief   Checks a condition. The test goes on if it fails, so all failures are reported.
+ */
+#define ALPC_EXPECT_TRUE(Condition)                                                         \
+    do                                                                                      \
+    {                                                                                       \
+        if (!(Condition))                                                                   \
+        {                                                                                   \
+            printf("    %s:%d: check failed: %s\n", __FILE__, __LINE__, #Condition);        \
+            AlpcTests::FailedChecks()++;                                                    \
+        }                                                                                   \
+    } while (false)
+
+#define ALPC_EXPECT_FALSE(Condition)    ALPC_EXPECT_TRUE(!(Condition))
+#define ALPC_EXPECT_EQ(Left, Right)     ALPC_EXPECT_TRUE((Left) == (Right))
@@ -0,0 +1,138 @@
+/**
+ * @file        ALPC-Tools/Tests/WorkQueueStatsTests.cpp
+ *
+ * @brief       Tests for KmHelper::WorkQueueStats - how the work queue metrics
+ *              are bucketed and accumulated.
+ *
+ * @author      Andrei-Marius MUNTEA (munteaandrei17@gmail.com)
+ *
+ * @copyright   Copyright  Andrei-Marius MUNTEA 2020-2024.
+ *              All rights reserved.
+ *
+ * @license     See top-level directory LICENSE file.
+ */
+
+#include "TestFramework.hpp"
+#include "WorkQueueStats.hpp"
+
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+#if defined(_MSC_VER)
+    #include <intrin.h>
+#endif
+
+
+/**
+ * @brief   One millisecond, in 100ns units.
+ */
+static constexpr uint64_t FIXTURE_MILLISECOND = 10000;
+
+/**
+ * @brief   The same contract as xpf::ApiAtomicCompareExchange - returns the previous value.
+ */
+static uint64_t
+FixtureCompareExchange(
+    volatile uint64_t* Destination,
+    uint64_t Exchange,
+    uint64_t Comparand
+)
+{
+#if defined(_MSC_VER)
+    return static_cast<uint64_t>(_InterlockedCompareExchange64(reinterpret_cast<volatile long long*>(Destination),
+                                                               static_cast<long long>(Exchange),
+                                                               static_cast<long long>(Comparand)));
+#else
+    /* On failure, the comparand receives the current value. */
+    __atomic_compare_exchange_n(Destination, &Comparand, Exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+#endif
+}
+
+ALPC_TEST(WorkQueueStats, BucketsAreDecades)
+{
+    /* Bucket 0 is everything below 100us. */
+    ALPC_EXPECT_EQ(KmHelper::WorkQueueStats::HistogramBucket(0), 0u);
+    ALPC_EXPECT_EQ(KmHelper::WorkQueueStats::HistogramBucket(999), 0u);
+
+    /* The limits are inclusive on the lower side. */
+    ALPC_EXPECT_EQ(KmHelper::WorkQueueStats::HistogramBucket(1000), 1u);
+    ALPC_EXPECT_EQ(KmHelper::WorkQueueStats::HistogramBucket(FIXTURE_MILLISECOND - 1), 1u);
+    ALPC_EXPECT_EQ(KmHelper::WorkQueueStats::HistogramBucket(FIXTURE_MILLISECOND), 2u);
+    ALPC_EXPECT_EQ(KmHelper::WorkQueueStats::HistogramBucket(10 * FIXTURE_MILLISECOND), 3u);
+    ALPC_EXPECT_EQ(KmHelper::WorkQueueStats::HistogramBucket(100 * FIXTURE_MILLISECOND), 4u);
+    ALPC_EXPECT_EQ(KmHelper::WorkQueueStats::HistogramBucket(1000 * FIXTURE_MILLISECOND), 5u);
+    ALPC_EXPECT_EQ(KmHelper::WorkQueueStats::HistogramBucket(10000 * FIXTURE_MILLISECOND), 6u);
+
+    /* The last bucket counts everything above 100 seconds. */
+    ALPC_EXPECT_EQ(KmHelper::WorkQueueStats::HistogramBucket(100000 * FIXTURE_MILLISECOND - 1), 6u);
+    ALPC_EXPECT_EQ(KmHelper::WorkQueueStats::HistogramBucket(100000 * FIXTURE_MILLISECOND),
+                   KmHelper::WorkQueueStats::HISTOGRAM_BUCKETS - 1);
+    ALPC_EXPECT_EQ(KmHelper::WorkQueueStats::HistogramBucket(UINT64_MAX),
+                   KmHelper::WorkQueueStats::HISTOGRAM_BUCKETS - 1);
+}
+
+ALPC_TEST(WorkQueueStats, BucketsNeverDecrease)
+{
+    size_t previous = 0;
+    for (uint64_t duration = 1; duration < (uint64_t{ 1 } << 40); duration = duration * 3 + 1)
+    {
+        const size_t bucket = KmHelper::WorkQueueStats::HistogramBucket(duration);
+        ALPC_EXPECT_TRUE(bucket >= previous);
+        ALPC_EXPECT_TRUE(bucket < KmHelper::WorkQueueStats::HISTOGRAM_BUCKETS);
+        previous = bucket;
+    }
+}
+
+ALPC_TEST(WorkQueueStats, ElapsedIgnoresClockGoingBack)
+{
+    ALPC_EXPECT_EQ(KmHelper::WorkQueueStats::Elapsed(100, 350), 250u);
+    ALPC_EXPECT_EQ(KmHelper::WorkQueueStats::Elapsed(350, 350), 0u);
+    ALPC_EXPECT_EQ(KmHelper::WorkQueueStats::Elapsed(350, 100), 0u);
+}
+
+ALPC_TEST(WorkQueueStats, TotalsAndMaximaAreAccumulated)
+{
+    volatile uint64_t total = 0;
+    volatile uint64_t maximum = 0;
+    const uint64_t durations[] = { 5, 42, 7, 42, 0, 13 };
+
+    for (const uint64_t duration : durations)
+    {
+        KmHelper::WorkQueueStats::AtomicAdd(&total, duration, FixtureCompareExchange);
+        KmHelper::WorkQueueStats::AtomicMax(&maximum, duration, FixtureCompareExchange);
+    }
+    ALPC_EXPECT_EQ(total, 109u);
+    ALPC_EXPECT_EQ(maximum, 42u);
+}
+
+ALPC_TEST(WorkQueueStats, ConcurrentUpdatesAreNotLost)
+{
+    static constexpr size_t THREADS = 8;
+    static constexpr uint64_t UPDATES = 20000;
+
+    volatile uint64_t total = 0;
+    volatile uint64_t maximum = 0;
+    std::vector<std::thread> threads;
+
+    /* Each thread adds 1..UPDATES and reports its own maximum, so the values interleave. */
+    for (size_t i = 0; i < THREADS; ++i)
+    {
+        threads.emplace_back([&total, &maximum, i]()
+                             {
+                                 for (uint64_t value = 1; value <= UPDATES; ++value)
+                                 {
+                                     KmHelper::WorkQueueStats::AtomicAdd(&total, value, FixtureCompareExchange);
+                                     KmHelper::WorkQueueStats::AtomicMax(&maximum, value * THREADS + i, FixtureCompareExchange);
+                                 }
+                             });
+    }
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    ALPC_EXPECT_EQ(total, THREADS * (UPDATES * (UPDATES + 1) / 2));
+    ALPC_EXPECT_EQ(maximum, UPDATES * THREADS + (THREADS - 1));
+}